@@ -22,38 +22,285 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "instrumentation.h"
 
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 // The data structure
 //
-// An image is stored in a structure containing 3 fields:
+// An image is stored in a structure containing 6 fields:
 // Two integers store the image width and height.
-// The other field is a pointer to an array that stores the 8-bit gray
+// Another stores the maximum gray level, maxval, and determines the depth:
+// images with maxval <= 255 use one byte (uint8) per pixel, and images
+// with larger maxval use two bytes (uint16) per pixel, as in PGM files.
+// The last field is a pointer to an array that stores the gray
 // level of each pixel in the image.  The pixel array is one-dimensional
 // and corresponds to a "raster scan" of the image from left to right,
 // top to bottom.
 // For example, in a 100-pixel wide image (img->width == 100),
 //   pixel position (x,y) = (33,0) is stored in img->pixel[33];
 //   pixel position (x,y) = (22,1) is stored in img->pixel[122].
+// That is the default, raster layout.  The last field selects it or the
+// tiled layout (see pixelOffset), where 2D neighbourhoods stay within one
+// or a few memory pages.
 //
 // Clients should use images only through variables of type Image,
 // which are pointers to the image structure, and should not access the
 // structure fields directly.
 
-// Maximum value you can store in a pixel (maximum maxval accepted)
+// Maximum value you can store in an 8-bit pixel
 const uint8 PixMax = 255;
 
-// Internal structure for storing 8-bit graymap images
+// Maximum value you can store in a 16-bit pixel (maximum maxval accepted)
+const uint16 PixMax16 = 65535;
+
+// Internal structure for storing 8-bit and 16-bit graymap images
 struct image
 {
   int width;
   int height;
   int maxval;   // maximum gray value (pixels with maxval are pure WHITE)
-  uint8 *pixel; // pixel data (a raster scan)
+  int depth;    // bytes per pixel: 1 (uint8) or 2 (uint16)
+  void *pixel;  // pixel data (a raster scan of uint8 or uint16)
+  int layout;   // IMAGE_LAYOUT_RASTER or IMAGE_LAYOUT_TILED
 };
 
+// Typed views of the pixel array
+#define PIX8(img) ((uint8 *)(img)->pixel)
+#define PIX16(img) ((uint16 *)(img)->pixel)
+
+// Pseudo-random 64-bit value number index of the sequence seed:
+// the SplitMix64 generator, jumped directly to position index.
+// Being counter-based, it lets generators fill any part of an image
+// independently and reproducibly.
+static inline uint64_t random64(uint64_t seed, uint64_t index)
+{
+  uint64_t z = seed + (index + 1) * 0x9E3779B97F4A7C15ull;
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+  return z ^ (z >> 31);
+}
+
+// Index of the sample read for position i of a row (or column) of n
+// samples, extended beyond its ends according to border mode:
+// IMAGE_BORDER_CLAMP repeats the end samples, IMAGE_BORDER_MIRROR reflects
+// about them (without repeating them), IMAGE_BORDER_ZERO gives -1, which
+// stands for a black sample.
+static inline int borderIndex(int i, int n, int border)
+{
+  if (i >= 0 && i < n)
+    return i;
+  switch (border)
+  {
+  case IMAGE_BORDER_CLAMP:
+    return i < 0 ? 0 : n - 1;
+  case IMAGE_BORDER_MIRROR:
+  {
+    if (n == 1)
+      return 0;
+    int period = 2 * (n - 1);
+    i %= period;
+    i = i < 0 ? i + period : i;
+    return i < n ? i : period - i;
+  }
+  default:
+    return -1;
+  }
+}
+
+// Elementwise maximum (if max is nonzero) or minimum of a and b:
+//   d[x] = max(a[x], b[x])  or  d[x] = min(a[x], b[x]),  for x in [0, n).
+// d may be a or b.  Uses SSE2 or NEON for 16 (8-bit) or 8 (16-bit) samples
+// per instruction, when available.  SSE2 lacks 16-bit unsigned min/max, so
+// both widths use saturating arithmetic: max(a,b) = a + sat(b-a) and
+// min(a,b) = a - sat(a-b).
+static void minmax8(uint8 *d, const uint8 *a, const uint8 *b, int n, int max)
+{
+  int x = 0;
+#if defined(__SSE2__)
+  for (; x + 16 <= n; x += 16)
+  {
+    __m128i va = _mm_loadu_si128((const __m128i *)(a + x));
+    __m128i vb = _mm_loadu_si128((const __m128i *)(b + x));
+    __m128i r = max ? _mm_adds_epu8(va, _mm_subs_epu8(vb, va)) : _mm_subs_epu8(va, _mm_subs_epu8(va, vb));
+    _mm_storeu_si128((__m128i *)(d + x), r);
+  }
+#elif defined(__ARM_NEON)
+  for (; x + 16 <= n; x += 16)
+  {
+    uint8x16_t va = vld1q_u8(a + x), vb = vld1q_u8(b + x);
+    vst1q_u8(d + x, max ? vmaxq_u8(va, vb) : vminq_u8(va, vb));
+  }
+#endif
+  for (; x < n; x++)
+    d[x] = (a[x] > b[x]) == (max != 0) ? a[x] : b[x];
+}
+
+static void minmax16(uint16 *d, const uint16 *a, const uint16 *b, int n, int max)
+{
+  int x = 0;
+#if defined(__SSE2__)
+  for (; x + 8 <= n; x += 8)
+  {
+    __m128i va = _mm_loadu_si128((const __m128i *)(a + x));
+    __m128i vb = _mm_loadu_si128((const __m128i *)(b + x));
+    __m128i r = max ? _mm_adds_epu16(va, _mm_subs_epu16(vb, va)) : _mm_subs_epu16(va, _mm_subs_epu16(va, vb));
+    _mm_storeu_si128((__m128i *)(d + x), r);
+  }
+#elif defined(__ARM_NEON)
+  for (; x + 8 <= n; x += 8)
+  {
+    uint16x8_t va = vld1q_u16(a + x), vb = vld1q_u16(b + x);
+    vst1q_u16(d + x, max ? vmaxq_u16(va, vb) : vminq_u16(va, vb));
+  }
+#endif
+  for (; x < n; x++)
+    d[x] = (a[x] > b[x]) == (max != 0) ? a[x] : b[x];
+}
+
+// Union-find forest over labels: parent[l] is l for a root.  Each tree
+// is rooted at its smallest label, so that final labels can be numbered
+// in a single ascending pass (see ImageLabel).
+
+// Root of label l, halving the path on the way.
+static inline uint32_t ufFind(uint32_t *parent, uint32_t l)
+{
+  while (parent[l] != l)
+  {
+    parent[l] = parent[parent[l]];
+    l = parent[l];
+  }
+  return l;
+}
+
+// Join the trees of labels a and b.  Returns the root of the result.
+static inline uint32_t ufUnion(uint32_t *parent, uint32_t a, uint32_t b)
+{
+  a = ufFind(parent, a);
+  b = ufFind(parent, b);
+  if (a < b)
+    return parent[b] = a;
+  return parent[a] = b;
+}
+
+// Type-specialized kernels.
+// imageKernels.h is instantiated once per pixel type, producing, e.g.,
+// negative8 and negative16.  Public functions then call
+//   DISPATCH(img, kernel, args...)
+// to select the variant that matches the depth of img, once per call.
+#define PIXEL uint8
+#define K(name) name##8
+#include "imageKernels.h"
+#undef PIXEL
+#undef K
+
+#define PIXEL uint16
+#define K(name) name##16
+#include "imageKernels.h"
+#undef PIXEL
+#undef K
+
+#define DISPATCH(img, kernel, ...) \
+  ((img)->depth == 1 ? kernel##8(__VA_ARGS__) : kernel##16(__VA_ARGS__))
+
+// Number of pixels in image
+static inline size_t npixels(Image img)
+{
+  return (size_t)img->width * (size_t)img->height;
+}
+
+// Number of bytes in pixel array of image
+static inline unsigned long nbytes(Image img)
+{
+  return (unsigned long)(npixels(img) * (size_t)img->depth);
+}
+
+// Tile size of the tiled layout
+#define TILE 64
+
+// Offset of pixel (x, y) in the pixel array of img.
+// In tiled layout, the image is cut into TILE x TILE tiles (narrower in the
+// last column, shorter in the last row), stored one after the other in
+// raster order, each one as a raster scan of its own width.  So the tile
+// row of (x, y) starts at y0*width, and its tile x0*th samples further,
+// th being the height of the tile row.  There is no padding: the array has
+// width*height samples in both layouts.
+static inline size_t pixelOffset(Image img, int x, int y)
+{
+  if (img->layout == IMAGE_LAYOUT_RASTER)
+    return (size_t)y * img->width + x;
+  int x0 = x - x % TILE, y0 = y - y % TILE;
+  int tw = img->width - x0 < TILE ? img->width - x0 : TILE;
+  int th = img->height - y0 < TILE ? img->height - y0 : TILE;
+  return (size_t)y0 * img->width + (size_t)x0 * th + (size_t)(y - y0) * tw + (x - x0);
+}
+
+// Address of pixel (x, y) of img.  Sets *run to the number of pixels of
+// that row stored contiguously from there: up to the end of the row in
+// raster layout, or of the tile in tiled layout.
+static inline void *pixelRun(Image img, int x, int y, int *run)
+{
+  int end = img->width;
+  if (img->layout == IMAGE_LAYOUT_TILED && x - x % TILE + TILE < end)
+    end = x - x % TILE + TILE;
+  *run = end - x;
+  return (char *)img->pixel + pixelOffset(img, x, y) * (size_t)img->depth;
+}
+
+// Header of a w x h raster image with the maxval of img, for buffer p.
+// Lets copyPixels and friends work with plain buffers.
+static inline struct image rasterHeader(Image img, int w, int h, void *p)
+{
+  struct image b = {w, h, img->maxval, img->depth, p, IMAGE_LAYOUT_RASTER};
+  return b;
+}
+
+// Copy a w x h rectangle of pixels, row by row, between images of the same
+// depth, from (sx, sy) in src to (dx, dy) in dst, in any layouts.
+// Each row is copied in runs contiguous in both images.
+// Safe to call from parallel tasks (it does not count accesses).
+static void copyPixels(Image dst, int dx, int dy, Image src, int sx, int sy, int w, int h)
+{
+  assert(dst->depth == src->depth);
+  size_t d = (size_t)src->depth;
+  for (int i = 0; i < h; i++)
+  {
+    for (int j = 0; j < w;)
+    {
+      int rs, rd;
+      const void *s = pixelRun(src, sx + j, sy + i, &rs);
+      void *t = pixelRun(dst, dx + j, dy + i, &rd);
+      int n = w - j < rs ? w - j : rs;
+      n = n < rd ? n : rd;
+      memcpy(t, s, (size_t)n * d);
+      j += n;
+    }
+  }
+}
+
 // This module follows "design-by-contract" principles.
 // Read `Design-by-Contract.md` for more details.
 
@@ -65,6 +312,8 @@ struct image
 // When one of these functions fails, it signals this by returning an error
 // value such as NULL or 0 (see function documentation), and sets an internal
 // variable (errCause) to a string indicating the failure cause.
+// Like errno, errCause is kept per thread, so that threads calling this
+// module at once get their own error causes.
 // The errno global variable thoroughly used in the standard library is
 // carefully preserved and propagated, and clients can use it together with
 // the ImageErrMsg() function to produce informative error messages.
@@ -73,17 +322,15 @@ struct image
 //
 // Additional information:  man 3 errno;  man 3 error;
 
-// Variable to preserve errno temporarily
-static int errsave = 0;
-
-// Error cause
-static char *errCause;
+// Error cause, per thread
+static _Thread_local char *errCause;
 
 /// Error cause.
 /// After some other module function fails (and returns an error code),
 /// calling this function retrieves an appropriate message describing the
 /// failure cause.  This may be used together with global variable errno
 /// to produce informative error messages (using error(), for instance).
+/// The cause is that of the last failure in the calling thread.
 ///
 /// After a successful operation, the result is not garanteed (it might be
 /// the previous error cause).  It is not meant to be used in that situation!
@@ -140,36 +387,143 @@ static int check(int condition, const char *failmsg)
   return condition;
 }
 
+/// Diagnostics
+
+// Diagnostics handler of each thread, and its argument
+static _Thread_local ImageDiagFn diagFn = NULL;
+static _Thread_local void *diagArg = NULL;
+
+/// Set the diagnostics handler of the calling thread (see image8bit.h).
+void ImageSetDiagnostics(ImageDiagFn fn, void *arg)
+{ ///
+  diagFn = fn;
+  diagArg = arg;
+}
+
+// Format a diagnostic message, as printf does, and pass it to the
+// handler of the calling thread.  Without a handler, it costs a test.
+static void diag(const char *format, ...)
+{
+  if (diagFn == NULL)
+    return;
+  char msg[256];
+  va_list ap;
+  va_start(ap, format);
+  vsnprintf(msg, sizeof(msg), format, ap);
+  va_end(ap);
+  diagFn(msg, diagArg);
+}
+
 /// Init Image library.  (Call once!)
 /// Currently, simply calibrate instrumentation and set names of counters.
 void ImageInit(void)
 { ///
   InstrCalibrate();
-  InstrName[0] = "pixmem"; // InstrCount[0] will count pixel array acesses
+  InstrName[PIXMEM_COUNTER] = "pixmem"; // counts pixel array acesses
   // Name other counters here...
 }
 
-// Macros to simplify accessing instrumentation counters:
-#define PIXMEM InstrCount[0]
-// Add more macros here...
+// Counter indices (see image8bit.h) are used with InstrAdd(index, n).
+// Add more counters there...
+
+// TIP: Search for InstrAdd(PIXMEM_COUNTER to see where it is incremented!
+
+// Each public operation runs inside an instrumentation scope with its name
+// (InstrBegin/InstrEnd), so that calls, times and bytes are reported per
+// operation by InstrReport.  Bytes are those of the pixel arrays read and
+// written.
+
+/// Parallel execution
+
+// Number of threads used by parallel operations (0 = one per cpu).
+// A setting for the whole process, read and written atomically.
+static int numThreads = 0;
+
+// Upper limit on the threads of one parallel operation (including the
+// caller), whatever the setting or the number of cpus.
+#define MAXTHREADS 256
+
+/// Set the number of threads used by parallel operations.
+/// n == 0 selects one thread per online cpu.
+/// At most MAXTHREADS threads are used, whatever n.
+/// Requires: n >= 0.
+void ImageSetThreads(int n)
+{ ///
+  assert(n >= 0);
+  __atomic_store_n(&numThreads, n, __ATOMIC_RELAXED);
+}
+
+// Number of threads to use in parallel operations.
+static int threadCount(void)
+{
+  long n = __atomic_load_n(&numThreads, __ATOMIC_RELAXED);
+  if (n == 0)
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+  if (n < 1)
+    n = 1;
+  return n < MAXTHREADS ? (int)n : MAXTHREADS;
+}
+
+// A task function, called as fn(arg, task) for each task index.
+typedef void (*TaskFn)(void *arg, int task);
+
+// Shared state of a parallelFor.
+struct taskQueue
+{
+  TaskFn fn;
+  void *arg;
+  int ntasks;
+  int next; // next task to run (updated atomically)
+};
+
+static void *taskWorker(void *q)
+{
+  struct taskQueue *tq = (struct taskQueue *)q;
+  int task;
+  while ((task = __atomic_fetch_add(&tq->next, 1, __ATOMIC_RELAXED)) < tq->ntasks)
+    tq->fn(tq->arg, task);
+  return NULL;
+}
 
-// TIP: Search for PIXMEM or InstrCount to see where it is incremented!
+// Run fn(arg, task) for task = 0 .. ntasks-1, spreading tasks over up to
+// threadCount() (<= MAXTHREADS) threads (including the calling thread).
+// Tasks are handed out dynamically, one at a time, so their cost need not
+// be uniform.  Returns when all tasks are done.
+// If threads cannot be created, the remaining work is done by the caller.
+static void parallelFor(int ntasks, TaskFn fn, void *arg)
+{
+  struct taskQueue tq = {fn, arg, ntasks, 0};
+  int nthreads = threadCount();
+  if (nthreads > ntasks)
+    nthreads = ntasks;
+  pthread_t threads[MAXTHREADS - 1];
+  int started = 0;
+  for (; started < nthreads - 1; started++)
+  {
+    if (pthread_create(&threads[started], NULL, taskWorker, &tq) != 0)
+      break;
+  }
+  taskWorker(&tq);
+  for (int i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+}
 
 /// Image management functions
 
 /// Create a new black image.
 ///   width, height : the dimensions of the new image.
 ///   maxval: the maximum gray level (corresponding to white).
-/// Requires: width and height must be non-negative, maxval > 0.
+/// Requires: width and height must be non-negative, 0 < maxval <= PixMax16.
+/// Images with maxval <= PixMax have 8-bit pixels, others have 16-bit pixels.
 ///
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
 /// On failure, returns NULL and errno/errCause are set accordingly.
-Image ImageCreate(int width, int height, uint8 maxval)
+Image ImageCreate(int width, int height, uint16 maxval)
 { ///
   assert(width >= 0);
   assert(height >= 0);
-  assert(0 < maxval && maxval <= PixMax);
+  assert(0 < maxval && maxval <= PixMax16);
 
   // Allocate memory for the image structure
   Image img = (Image)malloc(sizeof(struct image));
@@ -184,9 +538,11 @@ Image ImageCreate(int width, int height, uint8 maxval)
   img->width = width;
   img->height = height;
   img->maxval = maxval;
+  img->depth = maxval <= PixMax ? 1 : 2;
+  img->layout = IMAGE_LAYOUT_RASTER;
 
-  // Allocate memory for the pixel array
-  img->pixel = (uint8 *)malloc(width * height * sizeof(uint8));
+  // Allocate memory for the pixel array (initialized to black)
+  img->pixel = calloc(npixels(img), (size_t)img->depth);
 
   if (img->pixel == NULL)
   {
@@ -219,10 +575,200 @@ void ImageDestroy(Image *imgp)
   }
 }
 
+// copyPixels, counting pixel memory accesses.
+static void copyRect(Image dst, int dx, int dy, Image src, int sx, int sy, int w, int h)
+{
+  copyPixels(dst, dx, dy, src, sx, sy, w, h);
+  InstrAdd(PIXMEM_COUNTER, 2ul * (unsigned long)w * (unsigned long)h); // count pixel memory accesses
+}
+
+// Raster copy of img, for operations that only work in raster layout.
+// (The caller is responsible for destroying the returned image!)
+// Returns NULL if out of memory.
+static Image rasterCopy(Image img)
+{
+  Image r = ImageCreate(img->width, img->height, (uint16)img->maxval);
+  if (r != NULL)
+    copyRect(r, 0, 0, img, 0, 0, img->width, img->height);
+  return r;
+}
+
+/// Synthetic images
+
+// Generators draw all their random numbers from random64, by index, so
+// results never depend on the number of threads or on the host.
+
+// Rows of noise generated by each parallel task
+#define NOISEROWS 64
+
+// Parameters of a parallel noise fill
+struct noiseJob
+{
+  Image img;
+  uint64_t seed;
+  uint32_t levels;
+};
+
+static void noiseTask(void *arg, int task)
+{
+  struct noiseJob *job = (struct noiseJob *)arg;
+  Image img = job->img;
+  int y0 = task * NOISEROWS;
+  int y1 = y0 + NOISEROWS < img->height ? y0 + NOISEROWS : img->height;
+  size_t first = (size_t)y0 * img->width;
+  size_t n = (size_t)(y1 - y0) * img->width;
+  void *p = (char *)img->pixel + first * (size_t)img->depth;
+  DISPATCH(img, noise, p, n, first, job->seed, job->levels);
+}
+
+// Fill img with noise levels in [0, levels-1] from sequence seed.
+static void fillNoise(Image img, uint64_t seed, uint32_t levels)
+{
+  struct noiseJob job = {img, seed, levels};
+  parallelFor((img->height + NOISEROWS - 1) / NOISEROWS, noiseTask, &job);
+  InstrAdd(PIXMEM_COUNTER, (unsigned long)npixels(img)); // count pixel memory accesses (store)
+}
+
+/// Create an image of uniform noise in [0, maxval], from seed.
+Image ImageCreateNoise(int width, int height, uint16 maxval, unsigned int seed)
+{ ///
+  assert(width >= 0);
+  assert(height >= 0);
+  assert(0 < maxval && maxval <= PixMax16);
+
+  InstrBegin("ImageCreateNoise");
+  Image img = ImageCreate(width, height, maxval);
+  if (img != NULL)
+  {
+    fillNoise(img, seed, (uint32_t)maxval + 1);
+    InstrEnd(nbytes(img));
+  }
+  else
+    InstrEnd(0);
+  return img;
+}
+
+/// Create a linear gradient from black to maxval, along x (direction 0),
+/// y (1) or x+y (2).
+Image ImageCreateGradient(int width, int height, uint16 maxval, int direction)
+{ ///
+  assert(width >= 0);
+  assert(height >= 0);
+  assert(0 < maxval && maxval <= PixMax16);
+  assert(0 <= direction && direction <= 2);
+
+  InstrBegin("ImageCreateGradient");
+  Image img = ImageCreate(width, height, maxval);
+  if (img != NULL)
+  {
+    DISPATCH(img, gradient, img->pixel, width, height, img->maxval, direction);
+    InstrAdd(PIXMEM_COUNTER, (unsigned long)npixels(img)); // count pixel memory accesses (store)
+    InstrEnd(nbytes(img));
+  }
+  else
+    InstrEnd(0);
+  return img;
+}
+
+/// Create a checkerboard of cell x cell squares, black at the top left.
+Image ImageCreateChecker(int width, int height, uint16 maxval, int cell)
+{ ///
+  assert(width >= 0);
+  assert(height >= 0);
+  assert(0 < maxval && maxval <= PixMax16);
+  assert(cell > 0);
+
+  InstrBegin("ImageCreateChecker");
+  Image img = ImageCreate(width, height, maxval);
+  if (img != NULL)
+  {
+    DISPATCH(img, checker, img->pixel, width, height, cell, maxval);
+    InstrAdd(PIXMEM_COUNTER, (unsigned long)npixels(img)); // count pixel memory accesses (store)
+    InstrEnd(nbytes(img));
+  }
+  else
+    InstrEnd(0);
+  return img;
+}
+
+/// Create a black image with count random rectangles, from seed.
+Image ImageCreateRects(int width, int height, uint16 maxval, int count, unsigned int seed)
+{ ///
+  assert(width >= 0);
+  assert(height >= 0);
+  assert(0 < maxval && maxval <= PixMax16);
+  assert(count >= 0);
+
+  InstrBegin("ImageCreateRects");
+  Image img = ImageCreate(width, height, maxval);
+  if (img == NULL || width == 0 || height == 0)
+  {
+    InstrEnd(0);
+    return img;
+  }
+  unsigned long area = 0;
+  uint64_t maxw = width > 1 ? (uint64_t)width / 2 : 1;
+  uint64_t maxh = height > 1 ? (uint64_t)height / 2 : 1;
+  for (int i = 0; i < count; i++)
+  {
+    uint64_t k = 5 * (uint64_t)i; // five random numbers per rectangle
+    int w = 1 + (int)(random64(seed, k) % maxw);
+    int h = 1 + (int)(random64(seed, k + 1) % maxh);
+    int x = (int)(random64(seed, k + 2) % (uint64_t)(width - w + 1));
+    int y = (int)(random64(seed, k + 3) % (uint64_t)(height - h + 1));
+    int v = (int)(random64(seed, k + 4) % ((uint64_t)maxval + 1));
+    void *p = (char *)img->pixel + ((size_t)y * width + x) * (size_t)img->depth;
+    DISPATCH(img, fillRect, p, width, w, h, v);
+    area += (unsigned long)w * (unsigned long)h;
+  }
+  InstrAdd(PIXMEM_COUNTER, area); // count pixel memory accesses (store)
+  InstrEnd(area * (unsigned long)img->depth);
+  return img;
+}
+
+/// Create a (haystack, needle) pair for ImageLocateSubImage, with the
+/// needle planted at (x, y) and nowhere else.
+int ImageCreateHaystack(int width, int height, uint16 maxval,
+                        int nwidth, int nheight, int x, int y, int levels,
+                        unsigned int seed, Image *phaystack, Image *pneedle)
+{ ///
+  assert(width >= 0);
+  assert(height >= 0);
+  assert(0 < maxval && maxval <= PixMax16);
+  assert(0 < levels && levels <= maxval);
+  assert(nwidth > 0 && nheight > 0);
+  assert(0 <= x && x <= width - nwidth);
+  assert(0 <= y && y <= height - nheight);
+  assert(phaystack != NULL && pneedle != NULL);
+
+  InstrBegin("ImageCreateHaystack");
+  Image haystack = ImageCreate(width, height, maxval);
+  Image needle = ImageCreate(nwidth, nheight, maxval);
+  if (haystack == NULL || needle == NULL)
+  {
+    ImageDestroy(&haystack);
+    ImageDestroy(&needle);
+    InstrEnd(0);
+    return 0;
+  }
+  // Distinct streams for haystack and needle
+  fillNoise(haystack, seed, (uint32_t)levels);
+  fillNoise(needle, random64(seed, UINT64_MAX), (uint32_t)levels);
+  ImageSetPixel(needle, nwidth - 1, nheight - 1, maxval);
+  copyRect(haystack, x, y, needle, 0, 0, nwidth, nheight);
+  *phaystack = haystack;
+  *pneedle = needle;
+  InstrEnd(nbytes(haystack) + 3ul * nbytes(needle));
+  return 1;
+}
+
 /// PGM file operations
 
 // See also:
 // PGM format specification: http://netpbm.sourceforge.net/doc/pgm.html
+//
+// In PGM files with maxval > 255, each sample takes 2 bytes, most
+// significant byte first (big-endian).
 
 // Match and skip 0 or more comment lines in file f.
 // Comments start with a # and continue until the end-of-line, inclusive.
@@ -238,21 +784,88 @@ static int skipComments(FILE *f)
   return i;
 }
 
-/// Load a raw PGM file.
-/// Only 8 bit PGM files are accepted.
-/// On success, a new image is returned.
-/// (The caller is responsible for destroying the returned image!)
-/// On failure, returns NULL and errno/errCause are set accordingly.
-Image ImageLoad(const char *filename)
-{ ///
+// Swap the bytes of n 16-bit samples from src into dst (may be the same).
+// Used to convert between big-endian PGM samples and host order.
+// Uses SSE2 or NEON to swap 8 samples per instruction, when available.
+static void swapBytes16(uint16 *dst, const uint16 *src, size_t n)
+{
+  size_t i = 0;
+#if defined(__SSE2__)
+  for (; i + 8 <= n; i += 8)
+  {
+    __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+    v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+    _mm_storeu_si128((__m128i *)(dst + i), v);
+  }
+#elif defined(__ARM_NEON)
+  for (; i + 8 <= n; i += 8)
+  {
+    uint8x16_t v = vld1q_u8((const uint8_t *)(src + i));
+    vst1q_u8((uint8_t *)(dst + i), vrev16q_u8(v));
+  }
+#endif
+  for (; i < n; i++)
+    dst[i] = (uint16)((src[i] << 8) | (src[i] >> 8));
+}
+
+// Is the host little-endian?  (PGM samples are big-endian.)
+static inline int hostIsLittleEndian(void)
+{
+  const uint16 one = 1;
+  return *(const uint8 *)&one == 1;
+}
+
+// Write n 16-bit samples to f in big-endian order.
+// Samples are converted in chunks through a small buffer, so that img is
+// not modified and no full-size copy is needed.
+static int writeSamples16(const uint16 *p, size_t n, FILE *f)
+{
+  if (!hostIsLittleEndian())
+    return fwrite(p, sizeof(uint16), n, f) == n;
+  uint16 buf[8192];
+  for (size_t i = 0; i < n; i += 8192)
+  {
+    size_t m = n - i < 8192 ? n - i : 8192;
+    swapBytes16(buf, p + i, m);
+    if (fwrite(buf, sizeof(uint16), m, f) != m)
+      return 0;
+  }
+  return 1;
+}
+
+// Write the pixels of img to f, in raster order, as PGM samples.
+// Tiled images are written through a buffer of TILE rows.
+static int writePixels(Image img, FILE *f)
+{
+  if (img->layout == IMAGE_LAYOUT_RASTER)
+    return img->depth == 1 ? fwrite(img->pixel, sizeof(uint8), npixels(img), f) == npixels(img)
+                           : writeSamples16(PIX16(img), npixels(img), f);
+  size_t n = (size_t)img->width * TILE;
+  void *buf = malloc(n * (size_t)img->depth);
+  if (buf == NULL)
+    return 0;
+  int ok = 1;
+  for (int y = 0; ok && y < img->height; y += TILE)
+  {
+    int h = img->height - y < TILE ? img->height - y : TILE;
+    struct image band = rasterHeader(img, img->width, h, buf);
+    copyRect(&band, 0, 0, img, 0, y, img->width, h);
+    n = npixels(&band);
+    ok = img->depth == 1 ? fwrite(buf, sizeof(uint8), n, f) == n : writeSamples16(buf, n, f);
+  }
+  free(buf);
+  return ok;
+}
+
+// Read a raw PGM image from f (see ImageLoad).
+static Image readPGM(FILE *f)
+{
   int w, h;
   int maxval;
   char c;
-  FILE *f = NULL;
   Image img = NULL;
 
   int success =
-      check((f = fopen(filename, "rb")) != NULL, "Open failed") &&
       // Parse PGM header
       check(fscanf(f, "P%c ", &c) == 1 && c == '5', "Invalid file format") &&
       skipComments(f) >= 0 &&
@@ -260,23 +873,61 @@ Image ImageLoad(const char *filename)
       skipComments(f) >= 0 &&
       check(fscanf(f, "%d ", &h) == 1 && h >= 0, "Invalid height") &&
       skipComments(f) >= 0 &&
-      check(fscanf(f, "%d", &maxval) == 1 && 0 < maxval && maxval <= (int)PixMax, "Invalid maxval") &&
+      check(fscanf(f, "%d", &maxval) == 1 && 0 < maxval && maxval <= (int)PixMax16, "Invalid maxval") &&
       check(fscanf(f, "%c", &c) == 1 && isspace(c), "Whitespace expected") &&
       // Allocate image
-      (img = ImageCreate(w, h, (uint8)maxval)) != NULL &&
+      (img = ImageCreate(w, h, (uint16)maxval)) != NULL &&
       // Read pixels
-      check(fread(img->pixel, sizeof(uint8), w * h, f) == w * h, "Reading pixels");
-  PIXMEM += (unsigned long)(w * h); // count pixel memory accesses
+      check(fread(img->pixel, (size_t)img->depth, npixels(img), f) == npixels(img), "Reading pixels");
+  // Convert big-endian samples to host order
+  if (success && img->depth == 2 && hostIsLittleEndian())
+  {
+    InstrBegin("byteswap");
+    swapBytes16(PIX16(img), PIX16(img), npixels(img));
+    InstrEnd(2ul * nbytes(img));
+  }
+  if (img != NULL)
+    InstrAdd(PIXMEM_COUNTER, (unsigned long)npixels(img)); // count pixel memory accesses
 
   // Cleanup
   if (!success)
   {
-    errsave = errno;
+    int errsave = errno;
     ImageDestroy(&img);
     errno = errsave;
   }
+  return img;
+}
+
+// Write img to f as a raw PGM image (see ImageSave).
+static int writePGM(Image img, FILE *f)
+{
+  int success =
+      check(fprintf(f, "P5\n%d %d\n%d\n", img->width, img->height, img->maxval) > 0, "Writing header failed") &&
+      check(writePixels(img, f), "Writing pixels failed");
+  InstrAdd(PIXMEM_COUNTER, (unsigned long)npixels(img)); // count pixel memory accesses
+  return success;
+}
+
+/// Load a raw PGM file.
+/// Files with maxval <= 255 produce 8-bit images,
+/// files with 255 < maxval <= 65535 produce 16-bit images.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageLoad(const char *filename)
+{ ///
+  FILE *f = NULL;
+  Image img = NULL;
+  InstrBegin("ImageLoad");
+
+  if (check((f = fopen(filename, "rb")) != NULL, "Open failed"))
+    img = readPGM(f);
+
+  // Cleanup
   if (f != NULL)
     fclose(f);
+  InstrEnd(img != NULL ? nbytes(img) : 0);
   return img;
 }
 
@@ -287,79 +938,395 @@ Image ImageLoad(const char *filename)
 int ImageSave(Image img, const char *filename)
 { ///
   assert(img != NULL);
-  int w = img->width;
-  int h = img->height;
-  uint8 maxval = img->maxval;
   FILE *f = NULL;
+  InstrBegin("ImageSave");
 
   int success =
       check((f = fopen(filename, "wb")) != NULL, "Open failed") &&
-      check(fprintf(f, "P5\n%d %d\n%u\n", w, h, maxval) > 0, "Writing header failed") &&
-      check(fwrite(img->pixel, sizeof(uint8), w * h, f) == w * h, "Writing pixels failed");
-  PIXMEM += (unsigned long)(w * h); // count pixel memory accesses
+      writePGM(img, f);
 
   // Cleanup
   if (f != NULL)
     fclose(f);
+  InstrEnd(nbytes(img));
   return success;
 }
 
-/// Information queries
+/// Asynchronous file I/O
 
-/// These functions do not modify the image and never fail.
+// An asynchronous load reads the whole file into memory in the background,
+// and ImageLoadWait parses it from there.  An asynchronous save encodes
+// the image into memory at once (so the image is free to change), and
+// writes it in the background.  Transfers go through a private io_uring,
+// where the kernel supports it, or else through a thread doing pread or
+// pwrite.
 
-/// Get image width
-int ImageWidth(Image img)
-{ ///
-  assert(img != NULL);
-  return img->width;
-}
+struct imageio
+{
+  int fd;          // file being read or written
+  int writing;     // nonzero for a save
+  char *data;      // file contents
+  size_t size;     // bytes of data
+  size_t done;     // bytes transferred so far
+  int err;         // errno of a failed transfer, or 0
+  int uring;       // transfer runs in ring (else in thread)
+  int threaded;    // transfer runs in thread
+  pthread_t thread;
+#ifdef HAVE_IO_URING
+  struct ring
+  {
+    int fd;
+    void *sq, *cq;           // mapped rings
+    size_t sqLen, cqLen;
+    struct io_uring_sqe *sqes;
+    size_t sqesLen;
+    unsigned *sqTail, *sqMask, *sqArray;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_cqe *cqes;
+  } ring;
+#endif
+};
 
-/// Get image height
-int ImageHeight(Image img)
-{ ///
-  assert(img != NULL);
-  return img->height;
-}
+// Largest single read or write request
+#define IOCHUNK (1u << 30)
 
-/// Get image maximum gray level
-int ImageMaxval(Image img)
-{ ///
-  assert(img != NULL);
-  return img->maxval;
+// Transfer the rest of io synchronously.
+static void ioTransfer(struct imageio *io)
+{
+  while (io->err == 0 && io->done < io->size)
+  {
+    size_t n = io->size - io->done < IOCHUNK ? io->size - io->done : IOCHUNK;
+    ssize_t r = io->writing ? pwrite(io->fd, io->data + io->done, n, (off_t)io->done)
+                            : pread(io->fd, io->data + io->done, n, (off_t)io->done);
+    if (r < 0 && errno != EINTR)
+      io->err = errno;
+    else if (r == 0)
+      io->err = EIO; // the file shrank
+    else if (r > 0)
+      io->done += (size_t)r;
+  }
 }
 
-/// Pixel stats
-/// Find the minimum and maximum gray levels in image.
-/// On return,
-/// *min is set to the minimum gray level in the image,
-/// *max is set to the maximum.
-void ImageStats(Image img, uint8 *min, uint8 *max)
-{ ///
-  assert(img != NULL);
-  // minimum gray -> black (0)
-  // maximum gray -> white (255)
+static void *ioThread(void *arg)
+{
+  ioTransfer((struct imageio *)arg);
+  return NULL;
+}
 
-  // atribuir o maior valor ao min para cada vez que quando encontrar um valor menor substituir
-  *min = PixMax;
-  // atribuir o menor valor ao max para cada vez que quando encontrar um valor maior substituir
-  *max = 0;
+#ifdef HAVE_IO_URING
 
-  for (int i = 0; i < img->width * img->height; i++)
+// Set up a ring of one entry for io.  Returns 0 if io_uring is unavailable.
+static int ringSetup(struct imageio *io)
+{
+  struct ring *r = &io->ring;
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  r->fd = (int)syscall(__NR_io_uring_setup, 1, &p);
+  if (r->fd < 0)
+    return 0;
+  r->sqLen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cqLen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  r->sqesLen = p.sq_entries * sizeof(struct io_uring_sqe);
+  r->sq = mmap(NULL, r->sqLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+               IORING_OFF_SQ_RING);
+  r->cq = mmap(NULL, r->cqLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+               IORING_OFF_CQ_RING);
+  r->sqes = mmap(NULL, r->sqesLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+                 IORING_OFF_SQES);
+  if (r->sq == MAP_FAILED || r->cq == MAP_FAILED || r->sqes == MAP_FAILED)
   {
-    // buscar o valor de gray levels do array de pixeis da imagem
-    uint8 pixelValue = img->pixel[i];
+    if (r->sq != MAP_FAILED)
+      munmap(r->sq, r->sqLen);
+    if (r->cq != MAP_FAILED)
+      munmap(r->cq, r->cqLen);
+    if (r->sqes != MAP_FAILED)
+      munmap(r->sqes, r->sqesLen);
+    close(r->fd);
+    return 0;
+  }
+  r->sqTail = (unsigned *)((char *)r->sq + p.sq_off.tail);
+  r->sqMask = (unsigned *)((char *)r->sq + p.sq_off.ring_mask);
+  r->sqArray = (unsigned *)((char *)r->sq + p.sq_off.array);
+  r->cqHead = (unsigned *)((char *)r->cq + p.cq_off.head);
+  r->cqTail = (unsigned *)((char *)r->cq + p.cq_off.tail);
+  r->cqMask = (unsigned *)((char *)r->cq + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *)((char *)r->cq + p.cq_off.cqes);
+  return 1;
+}
 
-    //encontrar o pixel com menor e maior valor
-    if (pixelValue < *min)
+static void ringDestroy(struct ring *r)
+{
+  munmap(r->sq, r->sqLen);
+  munmap(r->cq, r->cqLen);
+  munmap(r->sqes, r->sqesLen);
+  close(r->fd);
+}
+
+// Submit a request for the next chunk of io.  Returns 0 on failure.
+static int ringSubmit(struct imageio *io)
+{
+  struct ring *r = &io->ring;
+  unsigned tail = *r->sqTail, i = tail & *r->sqMask;
+  struct io_uring_sqe *sqe = &r->sqes[i];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = io->writing ? IORING_OP_WRITE : IORING_OP_READ;
+  sqe->fd = io->fd;
+  sqe->addr = (uint64_t)(uintptr_t)(io->data + io->done);
+  sqe->len = io->size - io->done < IOCHUNK ? (unsigned)(io->size - io->done) : IOCHUNK;
+  sqe->off = io->done;
+  r->sqArray[i] = i;
+  __atomic_store_n(r->sqTail, tail + 1, __ATOMIC_RELEASE);
+  return syscall(__NR_io_uring_enter, r->fd, 1, 0, 0, NULL, 0) == 1;
+}
+
+// Wait for the completion of the request in the ring.  Returns its result.
+static int ringComplete(struct ring *r)
+{
+  unsigned head = *r->cqHead;
+  while (head == __atomic_load_n(r->cqTail, __ATOMIC_ACQUIRE))
+    if (syscall(__NR_io_uring_enter, r->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+        errno != EINTR)
+      return -errno;
+  int res = r->cqes[head & *r->cqMask].res;
+  __atomic_store_n(r->cqHead, head + 1, __ATOMIC_RELEASE);
+  return res;
+}
+
+// Finish the transfer of io through its ring, one chunk after the other.
+// Kernels older than IORING_OP_READ fail the first request with EINVAL:
+// the transfer then goes on synchronously.
+static void ringTransfer(struct imageio *io)
+{
+  while (io->err == 0 && io->done < io->size)
+  {
+    int res = ringComplete(&io->ring);
+    if (res == -EINVAL && io->done == 0)
     {
-      *min = pixelValue;
+      ioTransfer(io);
+      break;
     }
-    if (pixelValue > *max)
+    if (res < 0 && res != -EINTR && res != -EAGAIN)
+      io->err = -res;
+    else if (res == 0)
+      io->err = EIO; // the file shrank
+    else if (res > 0)
+      io->done += (size_t)res;
+    if (io->err == 0 && io->done < io->size && !ringSubmit(io))
+      io->err = errno;
+  }
+  ringDestroy(&io->ring);
+}
+
+#endif
+
+// Start the transfer of io: in a ring, a thread, or, failing both, now.
+static void ioStart(struct imageio *io)
+{
+  io->uring = io->threaded = 0;
+  if (io->size == 0)
+    return;
+#ifdef HAVE_IO_URING
+  if (ringSetup(io))
+  {
+    if (ringSubmit(io))
     {
-      *max = pixelValue;
+      io->uring = 1;
+      return;
     }
+    ringDestroy(&io->ring);
+  }
+#endif
+  if (pthread_create(&io->thread, NULL, ioThread, io) == 0)
+    io->threaded = 1;
+  else
+    ioTransfer(io);
+}
+
+// Wait for the transfer of io to end, and close its file.
+// Returns 0, with errno set, if the transfer failed.
+static int ioFinish(struct imageio *io)
+{
+#ifdef HAVE_IO_URING
+  if (io->uring)
+    ringTransfer(io);
+#endif
+  if (io->threaded)
+    pthread_join(io->thread, NULL);
+  if (close(io->fd) != 0 && io->err == 0)
+    io->err = errno;
+  errno = io->err;
+  return io->err == 0;
+}
+
+/// Start loading a raw PGM file in the background (see image8bit.h).
+ImageIO ImageLoadAsync(const char *filename)
+{ ///
+  assert(filename != NULL);
+  struct stat st;
+  ImageIO io = malloc(sizeof(struct imageio));
+  if (!check(io != NULL, "Memory allocation failed"))
+    return NULL;
+  io->writing = 0;
+  io->done = 0;
+  io->err = 0;
+  io->data = NULL;
+  int success =
+      check((io->fd = open(filename, O_RDONLY)) >= 0, "Open failed") &&
+      check(fstat(io->fd, &st) == 0 && S_ISREG(st.st_mode), "Open failed") &&
+      check((io->data = malloc((size_t)st.st_size + 1)) != NULL, "Memory allocation failed");
+  if (!success)
+  {
+    int errsave = errno;
+    if (io->fd >= 0)
+      close(io->fd);
+    free(io);
+    errno = errsave;
+    return NULL;
+  }
+  io->size = (size_t)st.st_size;
+  ioStart(io);
+  return io;
+}
+
+/// Wait for a load started by ImageLoadAsync (see image8bit.h).
+Image ImageLoadWait(ImageIO *iop)
+{ ///
+  assert(iop != NULL && *iop != NULL);
+  ImageIO io = *iop;
+  assert(!io->writing);
+  Image img = NULL;
+  InstrBegin("ImageLoadWait");
+  FILE *f = NULL;
+  if (check(ioFinish(io), "Reading pixels") &&
+      check(io->size > 0, "Invalid file format") &&
+      check((f = fmemopen(io->data, io->size, "rb")) != NULL, "Memory allocation failed"))
+    img = readPGM(f);
+  int errsave = errno;
+  if (f != NULL)
+    fclose(f);
+  free(io->data);
+  free(io);
+  *iop = NULL;
+  errno = errsave;
+  InstrEnd(img != NULL ? nbytes(img) : 0);
+  return img;
+}
+
+/// Start saving an image to a PGM file in the background (see image8bit.h).
+ImageIO ImageSaveAsync(Image img, const char *filename)
+{ ///
+  assert(img != NULL);
+  assert(filename != NULL);
+  InstrBegin("ImageSaveAsync");
+  ImageIO io = malloc(sizeof(struct imageio));
+  if (!check(io != NULL, "Memory allocation failed"))
+  {
+    InstrEnd(0);
+    return NULL;
+  }
+  io->writing = 1;
+  io->done = 0;
+  io->err = 0;
+  io->data = NULL;
+  io->fd = -1;
+  FILE *f = NULL;
+  int success =
+      check((f = open_memstream(&io->data, &io->size)) != NULL, "Memory allocation failed") &&
+      writePGM(img, f);
+  if (f != NULL)
+    success = check(fclose(f) == 0, "Memory allocation failed") && success;
+  success = success &&
+            check((io->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666)) >= 0, "Open failed");
+  if (!success)
+  {
+    int errsave = errno;
+    free(io->data);
+    free(io);
+    errno = errsave;
+    InstrEnd(0);
+    return NULL;
+  }
+  ioStart(io);
+  InstrEnd(nbytes(img));
+  return io;
+}
+
+/// Wait for a save started by ImageSaveAsync (see image8bit.h).
+int ImageSaveWait(ImageIO *iop)
+{ ///
+  assert(iop != NULL && *iop != NULL);
+  ImageIO io = *iop;
+  assert(io->writing);
+  int success = check(ioFinish(io), "Writing pixels failed");
+  int errsave = errno;
+  free(io->data);
+  free(io);
+  *iop = NULL;
+  errno = errsave;
+  return success;
+}
+
+/// Information queries
+
+/// These functions do not modify the image and never fail.
+
+/// Get image width
+int ImageWidth(Image img)
+{ ///
+  assert(img != NULL);
+  return img->width;
+}
+
+/// Get image height
+int ImageHeight(Image img)
+{ ///
+  assert(img != NULL);
+  return img->height;
+}
+
+/// Get image maximum gray level
+int ImageMaxval(Image img)
+{ ///
+  assert(img != NULL);
+  return img->maxval;
+}
+
+/// Get image depth: number of bytes per pixel (1 or 2)
+int ImageDepth(Image img)
+{ ///
+  assert(img != NULL);
+  return img->depth;
+}
+
+/// Get image pixel layout (see ImageSetLayout)
+int ImageLayout(Image img)
+{ ///
+  assert(img != NULL);
+  return img->layout;
+}
+
+/// Pixel stats
+/// Find the minimum and maximum gray levels in image.
+/// On return,
+/// *min is set to the minimum gray level in the image,
+/// *max is set to the maximum.
+void ImageStats(Image img, uint16 *min, uint16 *max)
+{ ///
+  assert(img != NULL);
+  InstrBegin("ImageStats");
+  if (img->depth == 1)
+  {
+    uint8 min8, max8;
+    stats8(PIX8(img), npixels(img), &min8, &max8);
+    *min = min8;
+    *max = max8;
+  }
+  else
+  {
+    stats16(PIX16(img), npixels(img), min, max);
   }
+  InstrAdd(PIXMEM_COUNTER, (unsigned long)npixels(img)); // count pixel memory accesses
+  InstrEnd(nbytes(img));
 }
 
 /// Check if pixel position (x,y) is inside img.
@@ -408,27 +1375,64 @@ static inline int G(Image img, int x, int y)
   // fórmula:
   //'y * img->width' calcula a posição vertical
   //'+ x' ajusta essa posição horizontalmente para a coluna
-  index = y * img->width + x;
+  // (no formato em mosaico, ver pixelOffset)
+  index = img->layout == IMAGE_LAYOUT_RASTER ? y * img->width + x : (int)pixelOffset(img, x, y);
   assert(0 <= index && index < img->width * img->height);
   return index;
 }
 
 /// Get the pixel (level) at position (x,y).
-uint8 ImageGetPixel(Image img, int x, int y)
+uint16 ImageGetPixel(Image img, int x, int y)
 { ///
   assert(img != NULL);
   assert(ImageValidPos(img, x, y));
-  PIXMEM += 1; // count one pixel access (read)
-  return img->pixel[G(img, x, y)];
+  InstrAdd(PIXMEM_COUNTER, 1); // count one pixel access (read)
+  return img->depth == 1 ? PIX8(img)[G(img, x, y)] : PIX16(img)[G(img, x, y)];
 }
 
 /// Set the pixel at position (x,y) to new level.
-void ImageSetPixel(Image img, int x, int y, uint8 level)
+void ImageSetPixel(Image img, int x, int y, uint16 level)
 { ///
   assert(img != NULL);
   assert(ImageValidPos(img, x, y));
-  PIXMEM += 1; // count one pixel access (store)
-  img->pixel[G(img, x, y)] = level;
+  assert(level <= img->maxval);
+  InstrAdd(PIXMEM_COUNTER, 1); // count one pixel access (store)
+  if (img->depth == 1)
+    PIX8(img)[G(img, x, y)] = (uint8)level;
+  else
+    PIX16(img)[G(img, x, y)] = level;
+}
+
+/// Pixel layout
+
+/// Change the layout of the pixels of img (see image8bit.h).
+int ImageSetLayout(Image img, int layout)
+{ ///
+  assert(img != NULL);
+  assert(layout == IMAGE_LAYOUT_RASTER || layout == IMAGE_LAYOUT_TILED);
+  if (img->layout == layout || npixels(img) == 0)
+  {
+    img->layout = layout;
+    return 1;
+  }
+
+  InstrBegin("ImageSetLayout");
+  void *pixel = malloc(nbytes(img));
+  if (pixel == NULL)
+  {
+    errCause = "Memory allocation failed";
+    InstrEnd(0);
+    return 0;
+  }
+  struct image out = *img;
+  out.pixel = pixel;
+  out.layout = layout;
+  copyRect(&out, 0, 0, img, 0, 0, img->width, img->height);
+  free(img->pixel);
+  img->pixel = pixel;
+  img->layout = layout;
+  InstrEnd(2ul * nbytes(img));
+  return 1;
 }
 
 /// Pixel transformations
@@ -444,55 +1448,22 @@ void ImageSetPixel(Image img, int x, int y, uint8 level)
 void ImageNegative(Image img)
 { ///
   assert(img != NULL);
-
-  // Obtém o valor máximo do pixel (branco)
-  uint8 maxPixelValue = ImageMaxval(img);
-
-  // Percorre todos os pixels da imagem
-  for (int y = 0; y < ImageHeight(img); y++)
-  {
-    for (int x = 0; x < ImageWidth(img); x++)
-    {
-      // Obtém o valor do pixel atual
-      uint8 pixelValue = ImageGetPixel(img, x, y);
-
-      // Calcula o valor negativo (inverte o valor do pixel)
-      uint8 negativeValue = maxPixelValue - pixelValue;
-
-      // Define o novo valor do pixel
-      ImageSetPixel(img, x, y, negativeValue);
-    }
-  }
+  InstrBegin("ImageNegative");
+  DISPATCH(img, negative, img->pixel, npixels(img), img->maxval);
+  InstrAdd(PIXMEM_COUNTER, 2ul * npixels(img)); // count pixel memory accesses (read+store)
+  InstrEnd(2ul * nbytes(img));
 }
 
 /// Apply threshold to image.
 /// Transform all pixels with level<thr to black (0) and
 /// all pixels with level>=thr to white (maxval).
-void ImageThreshold(Image img, uint8 thr)
+void ImageThreshold(Image img, uint16 thr)
 { ///
   assert(img != NULL);
-
-  // Percorre todos os pixels da imagem
-  for (int y = 0; y < ImageHeight(img); y++)
-  {
-    for (int x = 0; x < ImageWidth(img); x++)
-    {
-      // Obtém o valor do pixel atual
-      uint8 pixelValue = ImageGetPixel(img, x, y);
-
-      // verifica se o pixel é inferior a thr
-      if (pixelValue < thr)
-      {
-        // transforma de branco para preto
-        ImageSetPixel(img, x, y, 0);
-      }
-      else
-      {
-        // inverso (preto para branco)
-        ImageSetPixel(img, x, y, 255);
-      }
-    }
-  }
+  InstrBegin("ImageThreshold");
+  DISPATCH(img, threshold, img->pixel, npixels(img), thr, img->maxval);
+  InstrAdd(PIXMEM_COUNTER, 2ul * npixels(img)); // count pixel memory accesses (read+store)
+  InstrEnd(2ul * nbytes(img));
 }
 
 /// Brighten image by a factor.
@@ -503,33 +1474,66 @@ void ImageBrighten(Image img, double factor)
 { ///
   assert(img != NULL);
   assert(factor >= 0.0);
+  InstrBegin("ImageBrighten");
 
-  // Percorre todos os pixels da imagem
-  for (int y = 0; y < ImageHeight(img); y++)
+  // Precompute the result for every possible level into a look-up table,
+  // so that the per-pixel work is a single table access.
+  size_t lutSize = (size_t)1 << (8 * img->depth);
+  void *lut = malloc(lutSize * (size_t)img->depth);
+  if (lut == NULL)
   {
-    for (int x = 0; x < ImageWidth(img); x++)
-    {
-      // Obtém o valor do pixel atual
-      uint8 pixelValue = ImageGetPixel(img, x, y);
-
-      // Calcula o novo valor do pixel multiplicando pelo fator
-      int NewpixelValue = (int)(pixelValue * factor + 0.5);
-      // verifica se vai ultrpassar o maxVal (se for adquire o valor de maxVal)
-      if (NewpixelValue > 255)
+    // Not enough memory for the table: compute each pixel directly.
+    for (int y = 0; y < img->height; y++)
+      for (int x = 0; x < img->width; x++)
       {
-        // satura para o maior valor possivel (maxVal = 255)
-        NewpixelValue = 255;
-      }
-      if (NewpixelValue < 0)
-      {
-        // satura para o menor valor possivel (0)
-        NewpixelValue = 0;
+        int v = (int)(ImageGetPixel(img, x, y) * factor + 0.5);
+        ImageSetPixel(img, x, y, (uint16)(v > img->maxval ? img->maxval : v));
       }
+    InstrEnd(2ul * nbytes(img));
+    return;
+  }
+  InstrBegin("build LUT");
+  for (size_t v = 0; v < lutSize; v++)
+  {
+    double nv = v * factor + 0.5;
+    int level = nv >= img->maxval ? img->maxval : (int)nv;
+    if (img->depth == 1)
+      ((uint8 *)lut)[v] = (uint8)level;
+    else
+      ((uint16 *)lut)[v] = (uint16)level;
+  }
+  InstrEnd(lutSize * (size_t)img->depth);
+  DISPATCH(img, applyLUT, img->pixel, npixels(img), lut);
+  InstrAdd(PIXMEM_COUNTER, 2ul * npixels(img)); // count pixel memory accesses (read+store)
+  free(lut);
+  InstrEnd(2ul * nbytes(img));
+}
 
-      // define o novo valor do pixel
-      ImageSetPixel(img, x, y, (uint8)NewpixelValue);
+/// Apply a look-up table to image.
+/// Each pixel level v is replaced by lut[v].
+/// Requires: lut has maxval+1 entries, all of them <= maxval.
+void ImageApplyLUT(Image img, const uint16 *lut)
+{ ///
+  assert(img != NULL);
+  assert(lut != NULL);
+  InstrBegin("ImageApplyLUT");
+  if (img->depth == 1)
+  {
+    // Narrow the table and extend it to cover every 8-bit level
+    uint8 lut8[256];
+    for (int v = 0; v < 256; v++)
+    {
+      lut8[v] = (uint8)lut[v <= img->maxval ? v : img->maxval];
+      assert(lut8[v] <= img->maxval);
     }
+    applyLUT8(PIX8(img), npixels(img), lut8);
+  }
+  else
+  {
+    applyLUT16(PIX16(img), npixels(img), lut);
   }
+  InstrAdd(PIXMEM_COUNTER, 2ul * npixels(img)); // count pixel memory accesses (read+store)
+  InstrEnd(2ul * nbytes(img));
 }
 
 /// Geometric transformations
@@ -545,51 +1549,76 @@ void ImageBrighten(Image img, double factor)
 // Implementation hint:
 // Call ImageCreate whenever you need a new image!
 
+// Rotate and mirror of tiled images work tile by tile: the source
+// rectangle that maps to a tile of the result is gathered into a raster
+// buffer (from up to 4 tiles), and the raster kernel writes it straight
+// into the tile, which is itself a small raster scan.
+
+// ImageRotate of tiled img into tiled out (see above).
+static void rotateTiled(Image img, Image out)
+{
+  uint16 buf[TILE * TILE];
+  for (int v0 = 0; v0 < out->height; v0 += TILE)
+    for (int u0 = 0; u0 < out->width; u0 += TILE)
+    {
+      int tw = out->width - u0 < TILE ? out->width - u0 : TILE;
+      int th = out->height - v0 < TILE ? out->height - v0 : TILE;
+      // out(u, v) = img(width-1-v, u)
+      struct image b = rasterHeader(img, th, tw, buf);
+      copyRect(&b, 0, 0, img, img->width - v0 - th, u0, th, tw);
+      int run;
+      DISPATCH(img, rotate, (const void *)buf, th, tw, pixelRun(out, u0, v0, &run));
+    }
+  InstrAdd(PIXMEM_COUNTER, 2ul * npixels(img)); // count pixel memory accesses (read+store)
+}
+
+// ImageMirror of tiled img into tiled out (see above).
+static void mirrorTiled(Image img, Image out)
+{
+  uint16 buf[TILE * TILE];
+  for (int v0 = 0; v0 < out->height; v0 += TILE)
+    for (int u0 = 0; u0 < out->width; u0 += TILE)
+    {
+      int tw = out->width - u0 < TILE ? out->width - u0 : TILE;
+      int th = out->height - v0 < TILE ? out->height - v0 : TILE;
+      // out(u, v) = img(width-1-u, v)
+      struct image b = rasterHeader(img, tw, th, buf);
+      copyRect(&b, 0, 0, img, img->width - u0 - tw, v0, tw, th);
+      int run;
+      DISPATCH(img, mirror, (const void *)buf, tw, th, pixelRun(out, u0, v0, &run));
+    }
+  InstrAdd(PIXMEM_COUNTER, 2ul * npixels(img)); // count pixel memory accesses (read+store)
+}
+
 /// Rotate an image.
 /// Returns a rotated version of the image.
-/// The rotation is 90 degrees clockwise.
+/// The rotation is 90 degrees anti-clockwise:
+/// pixel (x, y) of img goes to (y, width-1-x) of the result.
 /// Ensures: The original img is not modified.
 ///
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageRotate(Image img)
-{ /// rotação de 90º, a coordenada x mantem-se, o que muda é a y
-  // 1 2 3           7 4 1
-  // 4 5 6    =>     8 5 2
-  // 7 8 9           9 6 3
-
+{ ///
+  // 1 2 3           3 6 9
+  // 4 5 6    =>     2 5 8
+  // 7 8 9           1 4 7
   assert(img != NULL);
 
-  // Cria uma nova imagem
+  InstrBegin("ImageRotate");
   Image rotatedImg = ImageCreate(img->height, img->width, img->maxval);
-
-  // Verifica se a criação da nova imagem foi bem-sucedida
-  if (rotatedImg == NULL)
+  if (rotatedImg != NULL && img->layout == IMAGE_LAYOUT_TILED)
   {
-    errCause = "Memory allocation failed";
-    return NULL;
+    rotatedImg->layout = IMAGE_LAYOUT_TILED; // (still all black)
+    rotateTiled(img, rotatedImg);
   }
-
-  for (int y = 0; y < ImageHeight(img); y++)
+  else if (rotatedImg != NULL)
   {
-    for (int x = 0; x < ImageWidth(img); x++)
-    {
-      // calcular as coordenadas após a rotação
-      // examples: (2,1)->(3,2) ; (1,2)->(2,1) nota que o x é igual ao rotatedY
-
-      // Get the pixel value from the original image
-      uint8 pixelValue = ImageGetPixel(img, x, y);
-
-      // Calculate the new coordinates after rotation
-      int newX = y;
-      int newY = img->width - 1 - x;
-
-      // Set the pixel value in the rotated image
-      ImageSetPixel(rotatedImg, newX, newY, pixelValue);
-    }
+    DISPATCH(img, rotate, img->pixel, img->width, img->height, rotatedImg->pixel);
+    InstrAdd(PIXMEM_COUNTER, 2ul * npixels(img)); // count pixel memory accesses (read+store)
   }
-
+  InstrEnd(2ul * nbytes(img));
   return rotatedImg;
 }
 
@@ -601,39 +1630,25 @@ Image ImageRotate(Image img)
 /// (The caller is responsible for destroying the returned image!)
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageMirror(Image img)
-{ /// no flip left-right, o y mantém-se
+{ ///
   // 1 2 3           3 2 1
   // 4 5 6    =>     6 5 4
   // 7 8 9           9 8 7
   assert(img != NULL);
 
-  // Cria uma nova imagem
-  Image mirrorImg = ImageCreate(img->height, img->width, img->maxval);
-
-  // Verifica se a criação da nova imagem foi bem-sucedida
-  if (mirrorImg == NULL)
+  InstrBegin("ImageMirror");
+  Image mirrorImg = ImageCreate(img->width, img->height, img->maxval);
+  if (mirrorImg != NULL && img->layout == IMAGE_LAYOUT_TILED)
   {
-    errCause = "Memory allocation failed";
-    return NULL;
+    mirrorImg->layout = IMAGE_LAYOUT_TILED; // (still all black)
+    mirrorTiled(img, mirrorImg);
   }
-
-  for (int y = 0; y < ImageHeight(img); y++)
+  else if (mirrorImg != NULL)
   {
-    for (int x = 0; x < ImageWidth(img); x++)
-    {
-      // calcular as coordenadas após o flip left-right
-      // examples: (1,1)->(3,1) ; (1,2)->(3,2) nota que o y mantém-se
-      // Get the pixel value from the original image
-      uint8 pixelValue = ImageGetPixel(img, x, y);
-
-      // Calculate the new x-coordinate after mirroring
-      int newX = img->width - 1 - x;
-
-      // Set the pixel value in the mirrored image
-      ImageSetPixel(mirrorImg, newX, y, pixelValue);
-    }
+    DISPATCH(img, mirror, img->pixel, img->width, img->height, mirrorImg->pixel);
+    InstrAdd(PIXMEM_COUNTER, 2ul * npixels(img)); // count pixel memory accesses (read+store)
   }
-
+  InstrEnd(2ul * nbytes(img));
   return mirrorImg;
 }
 
@@ -649,36 +1664,88 @@ Image ImageMirror(Image img)
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
 /// On failure, returns NULL and errno/errCause are set accordingly.
-
 Image ImageCrop(Image img, int x, int y, int w, int h)
 { ///
   assert(img != NULL);
-  // verifica se a imagem vai ter um formato de um retângulo (validação)
-  if (!ImageValidRect(img, x, y, w, h))
+  assert(ImageValidRect(img, x, y, w, h));
+
+  InstrBegin("ImageCrop");
+  Image croppedImg = ImageCreate(w, h, img->maxval);
+  if (croppedImg != NULL)
   {
-    errCause = "Invalid img";
-    return NULL;
+    croppedImg->layout = img->layout; // (still all black)
+    copyRect(croppedImg, 0, 0, img, x, y, w, h);
+  }
+  InstrEnd(2ul * (unsigned long)w * (unsigned long)h * (unsigned long)img->depth);
+  return croppedImg;
+}
+
+/// Crop, mirror and rotate an image in a single pass.
+/// Returns the same image as
+///   ImageCrop(img, x, y, w, h), then
+///   ImageMirror of that, if mirror is nonzero, then
+///   ImageRotate of that, repeated turns times,
+/// but without creating the intermediate images.
+/// Requires:
+///   The rectangle must be inside the original image.
+/// Ensures:
+///   The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageRemap(Image img, int x, int y, int w, int h, int mirror, int turns)
+{ ///
+  assert(img != NULL);
+  assert(ImageValidRect(img, x, y, w, h));
+  turns = ((turns % 4) + 4) % 4;
+
+  if (img->layout == IMAGE_LAYOUT_TILED) // works on a raster copy of the rectangle
+  {
+    Image r = ImageCreate(w, h, img->maxval);
+    if (r != NULL)
+      copyRect(r, 0, 0, img, x, y, w, h);
+    Image out = r != NULL ? ImageRemap(r, 0, 0, w, h, mirror, turns) : NULL;
+    ImageDestroy(&r);
+    return out;
   }
 
-  // Create a new image for the cropped area
-  Image croppedImg = ImageCreate(w, h, img->maxval);
-  if (croppedImg == NULL)
+  int ow = turns % 2 == 0 ? w : h;
+  int oh = turns % 2 == 0 ? h : w;
+  InstrBegin("ImageRemap");
+  Image remapImg = ImageCreate(ow, oh, img->maxval);
+  if (remapImg == NULL)
   {
-    errCause = "Memory allocation failed";
+    InstrEnd(0);
     return NULL;
   }
 
-  // Copy the pixels from the original image to the cropped image
-  for (int i = 0; i < h; i++)
+  // Map output coords (u, v) back to crop coords (cx, cy) for u, v in
+  // {0, 1}, undoing each rotation and then the mirror.
+  // The map is affine, so these three points define it.
+  ptrdiff_t idx[3];
+  const int us[3] = {0, 1, 0}, vs[3] = {0, 0, 1};
+  for (int p = 0; p < 3; p++)
   {
-    for (int j = 0; j < w; j++)
+    int cx = us[p], cy = vs[p];
+    for (int t = turns; t > 0; t--)
     {
-      // buscar o pixel e substituir na posição certa
-      ImageSetPixel(croppedImg, j, i, ImageGetPixel(img, x + j, y + i));
+      // Undo one ImageRotate: (x, y) -> (y, wb-1-x), wb = width before it
+      int wb = t % 2 == 1 ? w : h;
+      int px = wb - 1 - cy;
+      cy = cx;
+      cx = px;
     }
+    if (mirror)
+      cx = w - 1 - cx;
+    idx[p] = (ptrdiff_t)(y + cy) * img->width + (x + cx);
   }
 
-  return croppedImg;
+  DISPATCH(img, remap, img->pixel, idx[0], idx[1] - idx[0], idx[2] - idx[0],
+           remapImg->pixel, ow, oh);
+  InstrAdd(PIXMEM_COUNTER, 2ul * npixels(remapImg)); // count pixel memory accesses (read+store)
+  InstrEnd(2ul * nbytes(remapImg));
+  return remapImg;
 }
 
 /// Operations on two images
@@ -686,30 +1753,25 @@ Image ImageCrop(Image img, int x, int y, int w, int h)
 /// Paste an image into a larger image.
 /// Paste img2 into position (x, y) of img1.
 /// This modifies img1 in-place: no allocation involved.
-/// Requires: img2 must fit inside img1 at position (x, y).
-
+/// Requires: img2 must fit inside img1 at position (x, y),
+/// and both images must have the same depth.
 void ImagePaste(Image img1, int x, int y, Image img2)
 { ///
   assert(img1 != NULL);
   assert(img2 != NULL);
-  // make sure img 2 fits in img 1
   assert(ImageValidRect(img1, x, y, img2->width, img2->height));
+  assert(img1->depth == img2->depth);
 
-  //percorre a imagem toda e encontra a posição onde quer colar a imagem
-  //quando encontrada começa a substituir os pixeis da img1 pelos da img2
-  for (int i = 0; i < img2->height; i++)
-  {
-    for (int j = 0; j < img2->width; j++)
-    {
-      ImageSetPixel(img1, x + j, y + i, ImageGetPixel(img2, j, i));
-    }
-  }
+  InstrBegin("ImagePaste");
+  copyRect(img1, x, y, img2, 0, 0, img2->width, img2->height);
+  InstrEnd(2ul * nbytes(img2));
 }
 
 /// Blend an image into a larger image.
 /// Blend img2 into position (x, y) of img1.
 /// This modifies img1 in-place: no allocation involved.
-/// Requires: img2 must fit inside img1 at position (x, y).
+/// Requires: img2 must fit inside img1 at position (x, y),
+/// and both images must have the same depth.
 /// alpha usually is in [0.0, 1.0], but values outside that interval
 /// may provide interesting effects.  Over/underflows should saturate.
 void ImageBlend(Image img1, int x, int y, Image img2, double alpha)
@@ -717,63 +1779,123 @@ void ImageBlend(Image img1, int x, int y, Image img2, double alpha)
   assert(img1 != NULL);
   assert(img2 != NULL);
   assert(ImageValidRect(img1, x, y, img2->width, img2->height));
+  assert(img1->depth == img2->depth);
 
-  for (int i = 0; i < img2->height; i++)
+  InstrBegin("ImageBlend");
+  size_t offset = (size_t)y * img1->width + x;
+  if (img1->layout == IMAGE_LAYOUT_TILED || img2->layout == IMAGE_LAYOUT_TILED)
   {
-    for (int j = 0; j < img2->width; j++)
-    {
-      // Obtenha os valores dos pixels das duas imagens
-      // encontrar as posições dos pixeis da img 1 onde vai ficar os pixeis da img 2 e obte-los
-      uint8 pixelImg1 = ImageGetPixel(img1, x + j, y + i);
-      uint8 pixelImg2 = ImageGetPixel(img2, j, i);
-
-      // defenir o valor do novo pixel (using a formula)
-      // formula: blendedValue = α    * pixelImg2 + (1.0 − α    ) * pixelImg1
-      int blendedValue = (int)(alpha * pixelImg2 + (1.0 - alpha) * pixelImg1 + 0.5);
-
-      // caso o blendedValue não esteja nos limites dos valores posiveis de um pixel (0 a 255)
-      // ajustar a saturação
-      if (blendedValue > 255)
-      { // ou blendedValue = (blendedValue > 255) ? 255 : blendedValue;
-        blendedValue = 255;
-      }
-
-      if (blendedValue < 0)
-      { // ou blendedValue = (blendedValue < 0) ? 0 : blendedValue;
-        blendedValue = 0;
+    // Blend row by row, in runs contiguous in both images
+    for (int i = 0; i < img2->height; i++)
+      for (int j = 0; j < img2->width;)
+      {
+        int r1, r2;
+        void *d = pixelRun(img1, x + j, y + i, &r1);
+        const void *s = pixelRun(img2, j, i, &r2);
+        int n = img2->width - j < r1 ? img2->width - j : r1;
+        n = n < r2 ? n : r2;
+        DISPATCH(img1, blend, d, n, s, n, 1, alpha, img1->maxval);
+        j += n;
       }
+  }
+  else if (img1->depth == 1)
+    blend8(PIX8(img1) + offset, img1->width, PIX8(img2), img2->width, img2->height, alpha, img1->maxval);
+  else
+    blend16(PIX16(img1) + offset, img1->width, PIX16(img2), img2->width, img2->height, alpha, img1->maxval);
+  InstrAdd(PIXMEM_COUNTER, 3ul * npixels(img2)); // count pixel memory accesses (2 reads+store)
+  InstrEnd(3ul * nbytes(img2));
+}
 
-      // defenir o pixel
-      ImageSetPixel(img1, x + j, y + i, (uint8)blendedValue);
+// Compare img2 with the subimage of img1 at (x, y), row by row, in runs
+// contiguous in both images, stopping at the first row that differs.
+// Returns 1 if they match, else 0, and adds the number of pixel accesses
+// to *accesses.
+static int matchRows(Image img1, int x, int y, Image img2, unsigned long *accesses)
+{
+  size_t d = (size_t)img1->depth;
+  for (int i = 0; i < img2->height; i++)
+  {
+    *accesses += 2ul * (unsigned long)img2->width;
+    for (int j = 0; j < img2->width;)
+    {
+      int r1, r2;
+      const void *a = pixelRun(img1, x + j, y + i, &r1);
+      const void *b = pixelRun(img2, j, i, &r2);
+      int n = img2->width - j < r1 ? img2->width - j : r1;
+      n = n < r2 ? n : r2;
+      if (memcmp(a, b, (size_t)n * d) != 0)
+        return 0;
+      j += n;
     }
   }
+  return 1;
 }
 
 /// Compare an image to a subimage of a larger image.
 /// Returns 1 (true) if img2 matches subimage of img1 at pos (x, y).
 /// Returns 0, otherwise.
-
-int count = 0;
-
 int ImageMatchSubImage(Image img1, int x, int y, Image img2)
 { ///
   assert(img1 != NULL);
   assert(img2 != NULL);
-  assert(ImageValidPos(img1, x, y));
+  assert(ImageValidRect(img1, x, y, img2->width, img2->height));
+  assert(img1->depth == img2->depth);
 
-  for (int i = 0; i < img2->height; i++)
+  unsigned long accesses = 0;
+  int match = matchRows(img1, x, y, img2, &accesses);
+  InstrAdd(PIXMEM_COUNTER, accesses); // count pixel memory accesses
+  return match;
+}
+
+// ImageLocateSubImage when either image is tiled.
+// Candidate positions are scanned tile by tile, in bands of TILE rows,
+// so that the scan stays within a tile of img1 (one or two pages).  The
+// first match in raster order is the first one found in the band of the
+// topmost match, in the tile of leftmost x for the lowest y: so after a
+// match, the remaining tiles of the band are only scanned above it.
+static int locateTiled(Image img1, int *px, int *py, Image img2, unsigned long *accesses)
+{
+  int run;
+  const void *p2 = pixelRun(img2, 0, 0, &run);
+  uint16 first = img2->depth == 1 ? *(const uint8 *)p2 : *(const uint16 *)p2;
+  int maxx = img1->width - img2->width, maxy = img1->height - img2->height;
+  unsigned long acc = 1;
+  for (int y0 = 0; y0 <= maxy; y0 += TILE)
   {
-    for (int j = 0; j < img2->width; j++)
+    int bx = -1, by = y0 + TILE; // best match in the band
+    for (int x0 = 0; x0 <= maxx; x0 += TILE)
     {
-      count += 1;
-      if (ImageGetPixel(img1, x + j, y + i) != ImageGetPixel(img2, j, i))
+      int n = maxx + 1 - x0 < TILE ? maxx + 1 - x0 : TILE;
+      int found = 0;
+      for (int y = y0; !found && y <= maxy && y < by; y++)
       {
-        // Os pixels não são idênticos => não há correspondência
-        return 0;
+        const char *row = pixelRun(img1, x0, y, &run);
+        for (int i = 0; i < n; i++)
+        {
+          int j = DISPATCH(img1, findLevel, (const void *)(row + (size_t)i * img1->depth), n - i,
+                           first);
+          acc += (unsigned long)(j < n - i ? j + 1 : j);
+          i += j;
+          if (i < n && matchRows(img1, x0 + i, y, img2, &acc))
+          {
+            bx = x0 + i;
+            by = y;
+            found = 1;
+            break;
+          }
+        }
       }
     }
+    if (bx >= 0)
+    {
+      *px = bx;
+      *py = by;
+      *accesses += acc;
+      return 1;
+    }
   }
-  return 1;
+  *accesses += acc;
+  return 0;
 }
 
 /// Locate a subimage inside another image.
@@ -785,26 +1907,277 @@ int ImageLocateSubImage(Image img1, int *px, int *py, Image img2)
   assert(img1 != NULL);
   assert(img2 != NULL);
 
-  for (int i = 0; i <= img1->height - img2->height + 1; i++)
-  {
-    for (int j = 0; j <= img1->width - img2->width + 1; j++)
-    {
-      if (ImageMatchSubImage(img1, j, i, img2))
-      {
-        // Correspondência encontrada, atualiza as posições e retorna 1
-        *px = j;
-        *py = i;
-        printf("Total de comparações feitas: %d\n", count);
-        return 1;
-      }
-    }
-  }
-  printf("Total de comparações feitas: %d\n", count);
-  return 0;
+  if (img1->depth != img2->depth || img2->width > img1->width ||
+      img2->height > img1->height || npixels(img2) == 0)
+    return 0;
+
+  InstrBegin("ImageLocateSubImage");
+  unsigned long accesses = 0;
+  int found;
+  if (img1->layout == IMAGE_LAYOUT_TILED || img2->layout == IMAGE_LAYOUT_TILED)
+    found = locateTiled(img1, px, py, img2, &accesses);
+  else
+    found = DISPATCH(img1, locate, img1->pixel, img1->width, img1->height,
+                     img2->pixel, img2->width, img2->height, px, py, &accesses);
+  InstrAdd(PIXMEM_COUNTER, accesses); // count pixel memory accesses
+  InstrEnd(accesses * (unsigned long)img1->depth);
+  diag("ImageLocateSubImage: %lu pixel comparisons", accesses);
+  return found;
+}
+
+/// Image comparison
+
+// Running totals of a comparison
+struct diffAcc
+{
+  uint64_t sad;
+  uint64_t ssd;
+  unsigned max;
+};
+
+// Add the differences of a[0..n-1] and b[0..n-1] to acc.
+// SSE2 takes |a-b| as the OR of both saturated differences, sums 16 of
+// them with psadbw, and squares and pairs them with pmaddwd into 32-bit
+// lanes, flushed to 64 bits before they can overflow.  NEON does the same
+// with vabd and widening multiply-accumulates.
+static void diffRow8(const uint8 *a, const uint8 *b, int n, struct diffAcc *acc)
+{
+  int i = 0;
+#if defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+  __m128i sad = zero, max = zero;
+  while (i + 16 <= n)
+  {
+    __m128i ssd = zero; // at most 4 * 255^2 per lane per step
+    for (int k = 0; k < 4096 && i + 16 <= n; k++, i += 16)
+    {
+      __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+      __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+      __m128i d = _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va));
+      sad = _mm_add_epi64(sad, _mm_sad_epu8(d, zero));
+      max = _mm_max_epu8(max, d);
+      __m128i lo = _mm_unpacklo_epi8(d, zero), hi = _mm_unpackhi_epi8(d, zero);
+      ssd = _mm_add_epi32(ssd, _mm_add_epi32(_mm_madd_epi16(lo, lo), _mm_madd_epi16(hi, hi)));
+    }
+    uint32_t lanes[4];
+    _mm_storeu_si128((__m128i *)lanes, ssd);
+    acc->ssd += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+  }
+  uint64_t sums[2];
+  uint8 maxs[16];
+  _mm_storeu_si128((__m128i *)sums, sad);
+  _mm_storeu_si128((__m128i *)maxs, max);
+  acc->sad += sums[0] + sums[1];
+  for (int k = 0; k < 16; k++)
+    acc->max = maxs[k] > acc->max ? maxs[k] : acc->max;
+#elif defined(__ARM_NEON)
+  uint8x16_t max = vdupq_n_u8(0);
+  while (i + 16 <= n)
+  {
+    uint32x4_t ssd = vdupq_n_u32(0), sad = vdupq_n_u32(0);
+    for (int k = 0; k < 4096 && i + 16 <= n; k++, i += 16)
+    {
+      uint8x16_t d = vabdq_u8(vld1q_u8(a + i), vld1q_u8(b + i));
+      max = vmaxq_u8(max, d);
+      sad = vpadalq_u16(sad, vpaddlq_u8(d));
+      ssd = vpadalq_u16(ssd, vmull_u8(vget_low_u8(d), vget_low_u8(d)));
+      ssd = vpadalq_u16(ssd, vmull_u8(vget_high_u8(d), vget_high_u8(d)));
+    }
+    acc->sad += vaddvq_u32(sad);
+    acc->ssd += vaddvq_u32(ssd);
+  }
+  acc->max = vmaxvq_u8(max) > acc->max ? vmaxvq_u8(max) : acc->max;
+#endif
+  for (; i < n; i++)
+  {
+    unsigned d = a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+    acc->sad += d;
+    acc->ssd += (uint64_t)d * d;
+    acc->max = d > acc->max ? d : acc->max;
+  }
+}
+
+static void diffRow16(const uint16 *a, const uint16 *b, int n, struct diffAcc *acc)
+{
+  for (int i = 0; i < n; i++)
+  {
+    unsigned d = a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+    acc->sad += d;
+    acc->ssd += (uint64_t)d * d;
+    acc->max = d > acc->max ? d : acc->max;
+  }
+}
+
+/// Check if two images are identical (see image8bit.h).
+int ImageEqual(Image img1, Image img2)
+{ ///
+  assert(img1 != NULL);
+  assert(img2 != NULL);
+  if (img1->width != img2->width || img1->height != img2->height || img1->maxval != img2->maxval)
+    return 0;
+
+  InstrBegin("ImageEqual");
+  unsigned long accesses = 0;
+  int equal;
+  if (img1->layout == img2->layout)
+  {
+    // Same layout: one memcmp of the arrays, which glibc does with SIMD
+    // and stops at the first difference
+    equal = memcmp(img1->pixel, img2->pixel, nbytes(img1)) == 0;
+    accesses = 2ul * npixels(img1);
+  }
+  else
+    equal = matchRows(img1, 0, 0, img2, &accesses);
+  InstrAdd(PIXMEM_COUNTER, accesses); // count pixel memory accesses
+  InstrEnd(accesses * (unsigned long)img1->depth);
+  return equal;
+}
+
+/// Compare img2 with the subimage of img1 at (x, y) (see image8bit.h).
+void ImageCompareSubImage(Image img1, int x, int y, Image img2, ImageDiff *d)
+{ ///
+  assert(img1 != NULL);
+  assert(img2 != NULL);
+  assert(d != NULL);
+  assert(ImageValidRect(img1, x, y, img2->width, img2->height));
+  assert(img1->depth == img2->depth);
+
+  InstrBegin("ImageCompare");
+  struct diffAcc acc = {0, 0, 0};
+  for (int i = 0; i < img2->height; i++)
+    for (int j = 0; j < img2->width;)
+    {
+      int r1, r2;
+      const void *a = pixelRun(img1, x + j, y + i, &r1);
+      const void *b = pixelRun(img2, j, i, &r2);
+      int n = img2->width - j < r1 ? img2->width - j : r1;
+      n = n < r2 ? n : r2;
+      if (img1->depth == 1)
+        diffRow8(a, b, n, &acc);
+      else
+        diffRow16(a, b, n, &acc);
+      j += n;
+    }
+  d->sad = acc.sad;
+  d->ssd = acc.ssd;
+  d->maxAbsDiff = (int)acc.max;
+  double mse = npixels(img2) > 0 ? (double)acc.ssd / (double)npixels(img2) : 0.0;
+  d->psnr = mse > 0.0 ? 10.0 * log10((double)img1->maxval * img1->maxval / mse) : INFINITY;
+  InstrAdd(PIXMEM_COUNTER, 2ul * npixels(img2)); // count pixel memory accesses
+  InstrEnd(2ul * nbytes(img2));
+}
+
+/// Compare two images of the same size (see image8bit.h).
+void ImageCompare(Image img1, Image img2, ImageDiff *d)
+{ ///
+  assert(img1 != NULL);
+  assert(img2 != NULL);
+  assert(img1->width == img2->width && img1->height == img2->height);
+  ImageCompareSubImage(img1, 0, 0, img2, d);
+}
+
+/// Sum of absolute differences of two images of the same size.
+uint64_t ImageSAD(Image img1, Image img2)
+{ ///
+  ImageDiff d;
+  ImageCompare(img1, img2, &d);
+  return d.sad;
+}
+
+/// Sum of squared differences of two images of the same size.
+uint64_t ImageSSD(Image img1, Image img2)
+{ ///
+  ImageDiff d;
+  ImageCompare(img1, img2, &d);
+  return d.ssd;
+}
+
+/// Peak signal-to-noise ratio of img2 relative to img1, in dB.
+double ImagePSNR(Image img1, Image img2)
+{ ///
+  ImageDiff d;
+  ImageCompare(img1, img2, &d);
+  return d.psnr;
+}
+
+/// Largest absolute difference of levels of two images of the same size.
+int ImageMaxAbsDiff(Image img1, Image img2)
+{ ///
+  ImageDiff d;
+  ImageCompare(img1, img2, &d);
+  return d.maxAbsDiff;
 }
 
 /// Filtering
 
+// ImageBlur of a tiled image works in bands of TILE rows, in parallel
+// (see ImageSetThreads).  Each band gathers its rows, and the dy rows
+// above and below it (clipped), into a raster buffer; blur filters the
+// rows of the band, and they are scattered to the tiles of a new pixel
+// array.  Halo rows are read by two bands, so this suits dy up to about
+// TILE/2; beyond that, converting to raster layout is cheaper.
+
+// Parameters of a parallel tiled blur
+struct blurJob
+{
+  Image img;
+  void *out;              // new pixel array, in tiled layout
+  int dx, dy;
+  unsigned long accesses; // pixel accesses (updated atomically)
+  int failed;             // memory allocation failed (set atomically)
+};
+
+static void blurBandTask(void *arg, int task)
+{
+  struct blurJob *job = (struct blurJob *)arg;
+  Image img = job->img;
+  int w = img->width, h = img->height;
+  int y0 = task * TILE, y1 = y0 + TILE < h ? y0 + TILE : h;
+  int h0 = y0 - job->dy < 0 ? 0 : y0 - job->dy;
+  int h1 = y1 + job->dy < h ? y1 + job->dy : h;
+  void *buf = malloc((size_t)w * (size_t)(h1 - h0) * (size_t)img->depth);
+  void *band = malloc((size_t)w * (size_t)(y1 - y0) * (size_t)img->depth);
+  uint64_t *colSum = malloc((size_t)w * sizeof(uint64_t));
+  uint64_t *rowSum = malloc(((size_t)w + 1) * sizeof(uint64_t));
+  if (buf != NULL && band != NULL && colSum != NULL && rowSum != NULL)
+  {
+    struct image in = rasterHeader(img, w, h1 - h0, buf);
+    copyPixels(&in, 0, 0, img, 0, h0, w, h1 - h0);
+    DISPATCH(img, blur, buf, w, h1 - h0, job->dx, job->dy, y0 - h0, y1 - h0, band, colSum,
+             rowSum);
+    struct image out = *img;
+    out.pixel = job->out;
+    struct image res = rasterHeader(img, w, y1 - y0, band);
+    copyPixels(&out, 0, y0, &res, 0, 0, w, y1 - y0);
+    unsigned long gathered = (unsigned long)w * (unsigned long)(h1 - h0);
+    unsigned long stored = (unsigned long)w * (unsigned long)(y1 - y0);
+    __atomic_fetch_add(&job->accesses, 4ul * gathered + 3ul * stored, __ATOMIC_RELAXED);
+  }
+  else
+    __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+  free(buf);
+  free(band);
+  free(colSum);
+  free(rowSum);
+}
+
+// ImageBlur of a tiled image (see above).
+static void blurTiled(Image img, int dx, int dy)
+{
+  struct blurJob job = {img, malloc(npixels(img) * (size_t)img->depth), dx, dy, 0, 0};
+  if (job.out != NULL)
+    parallelFor((img->height + TILE - 1) / TILE, blurBandTask, &job);
+  if (job.out == NULL || job.failed)
+  {
+    errCause = "Memory allocation failed";
+    free(job.out);
+    return;
+  }
+  free(img->pixel);
+  img->pixel = job.out;
+  InstrAdd(PIXMEM_COUNTER, job.accesses); // count pixel memory accesses
+}
+
 /// Blur an image by a applying a (2dx+1)x(2dy+1) mean filter.
 /// Each pixel is substituted by the mean of the pixels in the rectangle
 /// [x-dx, x+dx]x[y-dy, y+dy].
@@ -814,46 +2187,2972 @@ void ImageBlur(Image img, int dx, int dy)
   assert(img != NULL);
   assert(dx >= 0 && dy >= 0);
 
-  Image tempImg = ImageCreate(img->width, img->height, img->maxval);
+  if (npixels(img) == 0)
+    return;
+
+  InstrBegin("ImageBlur");
+  int tiled = img->layout == IMAGE_LAYOUT_TILED;
+  if (tiled && 2 * dy <= TILE)
+  {
+    blurTiled(img, dx, dy);
+    InstrEnd(5ul * nbytes(img));
+    diag("ImageBlur: %lu pixel accesses", 5ul * (unsigned long)npixels(img));
+    return;
+  }
+  if (tiled && !ImageSetLayout(img, IMAGE_LAYOUT_RASTER))
+  {
+    InstrEnd(0);
+    return;
+  }
+  void *out = malloc(npixels(img) * (size_t)img->depth);
+  uint64_t *colSum = malloc((size_t)img->width * sizeof(uint64_t));
+  uint64_t *rowSum = malloc(((size_t)img->width + 1) * sizeof(uint64_t));
 
-  // Verificar se a criação da imagem temporária foi bem-sucedida
-  if (tempImg == NULL)
+  if (out == NULL || colSum == NULL || rowSum == NULL)
   {
     errCause = "Memory allocation failed";
+  }
+  else
+  {
+    InstrBegin("window sums");
+    DISPATCH(img, blur, img->pixel, img->width, img->height, dx, dy, 0, img->height, out, colSum,
+             rowSum);
+    InstrEnd(3ul * nbytes(img));
+    InstrBegin("copy back");
+    memcpy(img->pixel, out, npixels(img) * (size_t)img->depth);
+    InstrEnd(2ul * nbytes(img));
+    // each pixel is read twice (added and removed from colSum), stored
+    // once, and copied back once.
+    InstrAdd(PIXMEM_COUNTER, 5ul * npixels(img)); // count pixel memory accesses
+  }
+  free(out);
+  free(colSum);
+  free(rowSum);
+  if (tiled)
+    ImageSetLayout(img, IMAGE_LAYOUT_TILED);
+  InstrEnd(5ul * nbytes(img));
+  diag("ImageBlur: %lu pixel accesses", 5ul * (unsigned long)npixels(img));
+}
+
+/// Convolution
+
+// ImageConvolve works in bands of CONVROWS output rows, in parallel.
+// Each band first widens the source rows it needs (with a halo of kh/2 rows
+// and kw/2 columns given by the border mode) to int32, so the inner loops
+// are plain multiply-accumulates of one weight by a contiguous row:
+//   acc[x] += weight * row[x + i]
+// which is what mac32 does with SIMD.
+// For a rank-1 kernel, kernel[j][i] * pivot == v[j] * h[i], so rows are
+// first filtered with h (horizontal pass), then combined with v (vertical
+// pass), and the sums, pivot times those of the 2D kernel, are divided by
+// divisor * pivot, which rounds identically.
+// Sums are 32-bit when maxval times the sum of absolute weights fits;
+// otherwise a scalar 64-bit path is used.
+#ifndef CONVROWS
+#define CONVROWS 64
+#endif
+
+// Multiply-accumulate: acc[x] += k * src[x], for x in [0, n).
+// Uses SSE2 or NEON for 4 sums per instruction, when available.
+static void mac32(int32_t *restrict acc, const int32_t *restrict src, int32_t k, int n)
+{
+  int x = 0;
+#if defined(__SSE2__)
+  // SSE2 has no 32-bit multiply-low: combine two 32x32->64 products.
+  __m128i vk = _mm_set1_epi32(k);
+  __m128i vk1 = _mm_srli_epi64(vk, 32);
+  for (; x + 4 <= n; x += 4)
+  {
+    __m128i v = _mm_loadu_si128((const __m128i *)(src + x));
+    __m128i even = _mm_mul_epu32(v, vk);
+    __m128i odd = _mm_mul_epu32(_mm_srli_epi64(v, 32), vk1);
+    __m128i prod = _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                                      _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+    __m128i a = _mm_loadu_si128((const __m128i *)(acc + x));
+    _mm_storeu_si128((__m128i *)(acc + x), _mm_add_epi32(a, prod));
+  }
+#elif defined(__ARM_NEON)
+  for (; x + 4 <= n; x += 4)
+    vst1q_s32(acc + x, vmlaq_n_s32(vld1q_s32(acc + x), vld1q_s32(src + x), k));
+#endif
+  for (; x < n; x++)
+    acc[x] += k * src[x];
+}
+
+// Multiply-accumulate with 64-bit sums: acc[x] += k * src[x].
+static void mac64(int64_t *restrict acc, const int32_t *restrict src, int64_t k, int n)
+{
+  for (int x = 0; x < n; x++)
+    acc[x] += k * src[x];
+}
+
+// If kernel (kh rows of kw weights) has rank 1, store h and v such that
+// kernel[j*kw + i] * pivot == v[j] * h[i], and return pivot (> 0).
+// Otherwise, return 0.
+static int64_t separable(const int *kernel, int kw, int kh, int32_t *h, int32_t *v)
+{
+  int p = 0;
+  while (p < kw * kh && kernel[p] == 0)
+    p++;
+  if (p == kw * kh)
+    return 0;
+  int r0 = p / kw;
+  int c0 = p % kw;
+  int64_t pivot = kernel[p];
+  for (int j = 0; j < kh; j++)
+    for (int i = 0; i < kw; i++)
+      if ((int64_t)kernel[j * kw + i] * pivot != (int64_t)kernel[j * kw + c0] * kernel[r0 * kw + i])
+        return 0;
+  int sign = pivot < 0 ? -1 : 1;
+  for (int i = 0; i < kw; i++)
+    h[i] = kernel[r0 * kw + i];
+  for (int j = 0; j < kh; j++)
+    v[j] = sign * kernel[j * kw + c0];
+  return sign * pivot;
+}
+
+// Parameters of a parallel convolution
+struct convJob
+{
+  Image img;
+  void *out;              // new pixel array
+  const int *kernel;
+  int kw, kh, border;
+  const int32_t *h, *v;   // separable factors, or NULL
+  int64_t divisor;        // times the pivot, if separable
+  int shift;              // log2(divisor) if a power of 2, else -1
+  int wide;               // 64-bit sums needed
+  unsigned long accesses; // pixel accesses (updated atomically)
+  int failed;             // memory allocation failed (set atomically)
+};
+
+static void convTask(void *arg, int task)
+{
+  struct convJob *job = (struct convJob *)arg;
+  Image img = job->img;
+  int w = img->width;
+  int rx = job->kw / 2;
+  int ry = job->kh / 2;
+  int y0 = task * CONVROWS;
+  int y1 = y0 + CONVROWS < img->height ? y0 + CONVROWS : img->height;
+  int nrows = y1 - y0 + 2 * ry;
+  size_t pw = (size_t)w + 2 * (size_t)rx;
+  size_t d = (size_t)img->depth;
+
+  int32_t *pad = malloc((size_t)nrows * pw * sizeof(int32_t));
+  int32_t *hrows = job->h != NULL ? malloc((size_t)nrows * w * sizeof(int32_t)) : NULL;
+  int32_t *acc32 = malloc((size_t)w * sizeof(int32_t));
+  int64_t *acc64 = malloc((size_t)w * sizeof(int64_t));
+  if (pad == NULL || (job->h != NULL && hrows == NULL) || acc32 == NULL || acc64 == NULL)
+  {
+    __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+    free(pad);
+    free(hrows);
+    free(acc32);
+    free(acc64);
     return;
   }
 
-  for (int y = 0; y < ImageHeight(img); y++)
+  // Widen source rows [y0-ry, y1+ry), extended by the border mode
+  unsigned long accesses = 0;
+  for (int r = 0; r < nrows; r++)
+  {
+    int j = borderIndex(y0 - ry + r, img->height, job->border);
+    const void *row = j < 0 ? NULL : (const char *)img->pixel + (size_t)j * w * d;
+    DISPATCH(img, padRow, row, w, rx, job->border, pad + r * pw);
+    accesses += j < 0 ? 0 : (unsigned long)w;
+  }
+
+  // Horizontal pass of a separable kernel
+  if (hrows != NULL)
+  {
+    memset(hrows, 0, (size_t)nrows * w * sizeof(int32_t));
+    for (int r = 0; r < nrows; r++)
+      for (int i = 0; i < job->kw; i++)
+        if (job->h[i] != 0)
+          mac32(hrows + (size_t)r * w, pad + r * pw + i, job->h[i], w);
+  }
+
+  for (int y = y0; y < y1; y++)
+  {
+    int r = y - y0;
+    if (job->wide)
+    {
+      memset(acc64, 0, (size_t)w * sizeof(int64_t));
+      for (int j = 0; j < job->kh; j++)
+        for (int i = 0; i < job->kw; i++)
+          if (job->kernel[j * job->kw + i] != 0)
+            mac64(acc64, pad + (r + j) * pw + i, job->kernel[j * job->kw + i], w);
+    }
+    else
+    {
+      memset(acc32, 0, (size_t)w * sizeof(int32_t));
+      if (hrows != NULL) // vertical pass
+      {
+        for (int j = 0; j < job->kh; j++)
+          if (job->v[j] != 0)
+            mac32(acc32, hrows + (size_t)(r + j) * w, job->v[j], w);
+      }
+      else
+      {
+        for (int j = 0; j < job->kh; j++)
+          for (int i = 0; i < job->kw; i++)
+            if (job->kernel[j * job->kw + i] != 0)
+              mac32(acc32, pad + (r + j) * pw + i, job->kernel[j * job->kw + i], w);
+      }
+      for (int x = 0; x < w; x++)
+        acc64[x] = acc32[x];
+    }
+    void *dst = (char *)job->out + (size_t)y * w * d;
+    DISPATCH(img, storeRow, acc64, w, job->divisor, job->shift, img->maxval, dst);
+  }
+  accesses += (unsigned long)(y1 - y0) * (unsigned long)w;
+  __atomic_fetch_add(&job->accesses, accesses, __ATOMIC_RELAXED);
+  free(pad);
+  free(hrows);
+  free(acc32);
+  free(acc64);
+}
+
+/// Convolve an image with an integer kernel (see image8bit.h).
+int ImageConvolve(Image img, const int *kernel, int kw, int kh, int divisor, int border)
+{ ///
+  assert(img != NULL);
+  assert(kernel != NULL);
+  assert(kw > 0 && kw % 2 == 1);
+  assert(kh > 0 && kh % 2 == 1);
+  assert(divisor > 0);
+  assert(border == IMAGE_BORDER_CLAMP || border == IMAGE_BORDER_MIRROR ||
+         border == IMAGE_BORDER_ZERO);
+
+  if (npixels(img) == 0)
+    return 1;
+
+  if (img->layout == IMAGE_LAYOUT_TILED) // works in raster layout
+  {
+    int ok = ImageSetLayout(img, IMAGE_LAYOUT_RASTER) && ImageConvolve(img, kernel, kw, kh, divisor, border);
+    return ImageSetLayout(img, IMAGE_LAYOUT_TILED) && ok;
+  }
+
+  InstrBegin("ImageConvolve");
+  int32_t *h = malloc((size_t)kw * sizeof(int32_t));
+  int32_t *v = malloc((size_t)kh * sizeof(int32_t));
+  void *out = malloc(nbytes(img));
+  if (h == NULL || v == NULL || out == NULL)
+  {
+    free(h);
+    free(v);
+    free(out);
+    errCause = "Memory allocation failed";
+    InstrEnd(0);
+    return 0;
+  }
+
+  struct convJob job = {img, out, kernel, kw, kh, border, NULL, NULL, divisor, -1, 0, 0, 0};
+  // Bounds of the sums, to choose their width
+  double sumK = 0.0, sumH = 0.0, sumV = 0.0;
+  for (int i = 0; i < kw * kh; i++)
+    sumK += (double)llabs(kernel[i]);
+  int64_t pivot = kw > 1 && kh > 1 ? separable(kernel, kw, kh, h, v) : 0;
+  if (pivot > 0)
   {
-    for (int x = 0; x < ImageWidth(img); x++)
+    for (int i = 0; i < kw; i++)
+      sumH += (double)llabs(h[i]);
+    for (int j = 0; j < kh; j++)
+      sumV += (double)llabs(v[j]);
+    if ((double)img->maxval * sumH * sumV <= INT32_MAX)
     {
-      int sum = 0;
-      int count = 0;
+      job.h = h;
+      job.v = v;
+      job.divisor = (int64_t)divisor * pivot;
+    }
+  }
+  job.wide = job.h == NULL && (double)img->maxval * sumK > INT32_MAX;
+  if ((job.divisor & (job.divisor - 1)) == 0)
+    for (job.shift = 0; ((int64_t)1 << job.shift) < job.divisor; job.shift++)
+      ;
+
+  InstrBegin(job.h != NULL ? "separable" : "direct");
+  parallelFor((img->height + CONVROWS - 1) / CONVROWS, convTask, &job);
+  InstrEnd(2ul * nbytes(img));
+  free(h);
+  free(v);
+  if (job.failed)
+  {
+    free(out);
+    errCause = "Memory allocation failed";
+    InstrEnd(0);
+    return 0;
+  }
+  free(img->pixel);
+  img->pixel = out;
+  InstrAdd(PIXMEM_COUNTER, job.accesses); // count pixel memory accesses
+  InstrEnd(2ul * nbytes(img));
+  return 1;
+}
+
+/// Resizing
+
+// ImageResize is separable: each source row is resampled along x into a
+// row of fixed-point sums (horizontal pass), then each output row is a
+// weighted sum of those rows (vertical pass).
+// The weights of each axis are computed once, into a table giving, for
+// each output sample, the first source sample and the weights of taps
+// consecutive samples.  Weights are fixed point, adding up to exactly 1.0
+// for each output sample.
+// For 8-bit images, weights have 14 fractional bits and horizontal sums
+// keep 9, the most for which vertical sums fit in 31 bits, so the vertical
+// pass is mac32 (SIMD).  16-bit images need more precision: weights have 20
+// fractional bits, horizontal sums keep 14, and the vertical pass is
+// mac64.  With power-of-2 factors, all sums are exact, so the result is
+// the average rounded half up, as in the direct path for 2x and 4x
+// reductions (see shrinkRow), which skips the tables.
+// Output rows are computed in parallel bands of RESIZEROWS, each resampling
+// the source rows it needs.
+#ifndef RESIZEROWS
+#define RESIZEROWS 64
+#endif
+
+// Resampling along one axis (see above)
+struct resizeAxis
+{
+  int taps;
+  int *first;       // first source sample of each output sample
+  int32_t *weight;  // taps weights for each output sample
+};
+
+static void freeAxis(struct resizeAxis *ax)
+{
+  free(ax->first);
+  free(ax->weight);
+}
 
-      // Percorre a vizinhança definida por dx e dy
-      //começa em negativo para que percorra para cima e para a esquerda
-      for (int newY = y - dy; newY <= y + dy; newY++)
+// Build the table to resample n source samples to m, in mode, with
+// weights of bits fractional bits.
+// Returns 1 on success, 0 if memory allocation failed.
+static int buildAxis(struct resizeAxis *ax, int n, int m, int mode, int bits)
+{
+  double scale = (double)n / m;
+  int taps = mode == IMAGE_RESIZE_AREA ? (int)scale + 2 : 2;
+  if (taps > n)
+    taps = n;
+  ax->taps = taps;
+  ax->first = malloc((size_t)m * sizeof(int));
+  ax->weight = calloc((size_t)m * taps, sizeof(int32_t));
+  double *wd = malloc((size_t)taps * sizeof(double));
+  if (ax->first == NULL || ax->weight == NULL || wd == NULL)
+  {
+    freeAxis(ax);
+    free(wd);
+    return 0;
+  }
+  for (int o = 0; o < m; o++)
+  {
+    // Source interval [a, b) (area) or point c (bilinear), and the first
+    // source sample it touches
+    double a = o * scale, b = (o + 1) * scale;
+    double c = (o + 0.5) * scale - 0.5;
+    c = c < 0.0 ? 0.0 : c > n - 1 ? n - 1 : c;
+    int start = mode == IMAGE_RESIZE_AREA ? (int)a : (int)c;
+    int first = start + taps > n ? n - taps : start;
+    for (int t = 0; t < taps; t++)
+    {
+      int i = first + t;
+      if (mode == IMAGE_RESIZE_AREA)
       {
-        for (int newX = x - dx; newX <= x + dx; newX++)
-        {
-          // Verifica se as coordenadas estão dentro dos limites da imagem
-          if (ImageValidPos(img, newX, newY))
-          {
-            //acumular o valor dos pixeis da vizinhança
-            sum += ImageGetPixel(img, newX, newY);
-            //numero de pixeis contados
-            count++;
-          }
-        }
+        double lo = i > a ? i : a, hi = i + 1 < b ? i + 1 : b;
+        wd[t] = hi > lo ? (hi - lo) / scale : 0.0;
+      }
+      else
+      {
+        double d = c > i ? c - i : i - c;
+        wd[t] = d < 1.0 ? 1.0 - d : 0.0;
       }
-      
-      // Calcula a média e define o novo valor do pixel na imagem original
-      int avgValue = count > 0 ? (sum + count/2)/ count : 0;
-      ImageSetPixel(tempImg, x, y, avgValue);
     }
+    // Round to fixed point, giving the rounding error to the largest weight
+    int32_t *wt = ax->weight + (size_t)o * taps;
+    int32_t sum = 0;
+    int big = 0;
+    for (int t = 0; t < taps; t++)
+    {
+      wt[t] = (int32_t)(wd[t] * (1 << bits) + 0.5);
+      sum += wt[t];
+      big = wt[t] > wt[big] ? t : big;
+    }
+    wt[big] += (1 << bits) - sum;
+    ax->first[o] = first;
+  }
+  free(wd);
+  return 1;
+}
+
+// Parameters of a parallel resize
+struct resizeJob
+{
+  Image img, out;
+  struct resizeAxis ax, ay;
+  int bits;               // fractional bits of the weights
+  int frac;               // fractional bits of the horizontal sums
+  int factor;             // 2 or 4 for the direct path, else 0
+  unsigned long accesses; // pixel accesses (updated atomically)
+  int failed;             // memory allocation failed (set atomically)
+};
+
+// Average 2x2 blocks of rows r0 and r1 into ow samples of dst, as
+// shrinkRow8 with f == 2, 16 source samples at a time with SSE2.
+static void halveRow8(const uint8 *r0, const uint8 *r1, int ow, uint8 *dst)
+{
+  int o = 0;
+#if defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i ones = _mm_set1_epi16(1);
+  const __m128i two = _mm_set1_epi32(2);
+  for (; o + 8 <= ow; o += 8)
+  {
+    __m128i a = _mm_loadu_si128((const __m128i *)(r0 + 2 * o));
+    __m128i b = _mm_loadu_si128((const __m128i *)(r1 + 2 * o));
+    __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+    __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+    // Add horizontal pairs into 32-bit lanes, round and divide by 4
+    __m128i slo = _mm_srli_epi32(_mm_add_epi32(_mm_madd_epi16(lo, ones), two), 2);
+    __m128i shi = _mm_srli_epi32(_mm_add_epi32(_mm_madd_epi16(hi, ones), two), 2);
+    __m128i r = _mm_packus_epi16(_mm_packs_epi32(slo, shi), zero);
+    _mm_storel_epi64((__m128i *)(dst + o), r);
+  }
+#endif
+  if (o < ow)
+    shrinkRow8(r0 + 2 * o, (size_t)(r1 - r0), 2, ow - o, dst + o);
+}
+
+static void resizeTask(void *arg, int task)
+{
+  struct resizeJob *job = (struct resizeJob *)arg;
+  Image img = job->img, out = job->out;
+  int w = img->width, ow = out->width;
+  size_t d = (size_t)img->depth;
+  int oy0 = task * RESIZEROWS;
+  int oy1 = oy0 + RESIZEROWS < out->height ? oy0 + RESIZEROWS : out->height;
+
+  if (job->factor != 0) // direct path
+  {
+    int f = job->factor;
+    for (int oy = oy0; oy < oy1; oy++)
+    {
+      const char *src = (const char *)img->pixel + (size_t)oy * f * w * d;
+      void *dst = (char *)out->pixel + (size_t)oy * ow * d;
+      if (d == 1 && f == 2)
+        halveRow8((const uint8 *)src, (const uint8 *)src + w, ow, dst);
+      else
+        DISPATCH(img, shrinkRow, (const void *)src, (size_t)w, f, ow, dst);
+    }
+    unsigned long n = (unsigned long)(oy1 - oy0) * (unsigned long)ow;
+    __atomic_fetch_add(&job->accesses, n * (unsigned long)(f * f + 1), __ATOMIC_RELAXED);
+    return;
+  }
+
+  // Source rows [y0, y1) are needed
+  int taps = job->ay.taps;
+  int y0 = job->ay.first[oy0];
+  int y1 = job->ay.first[oy1 - 1] + taps;
+  int32_t *hrows = malloc((size_t)(y1 - y0) * ow * sizeof(int32_t));
+  int32_t *acc32 = malloc((size_t)ow * sizeof(int32_t));
+  int64_t *acc64 = malloc((size_t)ow * sizeof(int64_t));
+  if (hrows == NULL || acc32 == NULL || acc64 == NULL)
+  {
+    __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+    free(hrows);
+    free(acc32);
+    free(acc64);
+    return;
+  }
+  for (int y = y0; y < y1; y++)
+  {
+    const void *src = (const char *)img->pixel + (size_t)y * w * d;
+    DISPATCH(img, resizeRow, src, job->ax.first, job->ax.weight, job->ax.taps, ow,
+             job->bits - job->frac, hrows + (size_t)(y - y0) * ow);
+  }
+  for (int oy = oy0; oy < oy1; oy++)
+  {
+    const int32_t *wt = job->ay.weight + (size_t)oy * taps;
+    if (d == 1)
+    {
+      memset(acc32, 0, (size_t)ow * sizeof(int32_t));
+      for (int t = 0; t < taps; t++)
+        if (wt[t] != 0)
+          mac32(acc32, hrows + (size_t)(job->ay.first[oy] + t - y0) * ow, wt[t], ow);
+      for (int x = 0; x < ow; x++)
+        acc64[x] = acc32[x];
+    }
+    else
+    {
+      memset(acc64, 0, (size_t)ow * sizeof(int64_t));
+      for (int t = 0; t < taps; t++)
+        if (wt[t] != 0)
+          mac64(acc64, hrows + (size_t)(job->ay.first[oy] + t - y0) * ow, wt[t], ow);
+    }
+    int shift = job->bits + job->frac;
+    void *dst = (char *)out->pixel + (size_t)oy * ow * d;
+    DISPATCH(img, storeRow, acc64, ow, (int64_t)1 << shift, shift, out->maxval, dst);
+  }
+  unsigned long reads = (unsigned long)(y1 - y0) * (unsigned long)job->ax.taps * (unsigned long)ow;
+  __atomic_fetch_add(&job->accesses, reads + (unsigned long)(oy1 - oy0) * (unsigned long)ow,
+                     __ATOMIC_RELAXED);
+  free(hrows);
+  free(acc32);
+  free(acc64);
+}
+
+/// Resize an image (see image8bit.h).
+Image ImageResize(Image img, int w, int h, int mode)
+{ ///
+  assert(img != NULL);
+  assert(w >= 0 && h >= 0);
+  assert(mode == IMAGE_RESIZE_AREA || mode == IMAGE_RESIZE_BILINEAR);
+  assert(npixels(img) > 0 || w == 0 || h == 0);
+
+  if (img->layout == IMAGE_LAYOUT_TILED) // works on a raster copy
+  {
+    Image r = rasterCopy(img);
+    Image out = r != NULL ? ImageResize(r, w, h, mode) : NULL;
+    ImageDestroy(&r);
+    return out;
+  }
+
+  InstrBegin("ImageResize");
+  Image out = ImageCreate(w, h, img->maxval);
+  if (out == NULL)
+  {
+    InstrEnd(0);
+    return NULL;
+  }
+  if (npixels(out) == 0)
+  {
+    InstrEnd(0);
+    return out;
+  }
+
+  struct resizeJob job = {img, out, {0, NULL, NULL}, {0, NULL, NULL}, 0, 0, 0, 0, 0};
+  job.bits = img->depth == 1 ? 14 : 20;
+  job.frac = img->depth == 1 ? 9 : 14;
+  for (int f = 2; f <= 4; f *= 2)
+    if (mode == IMAGE_RESIZE_AREA && img->width == f * w && img->height == f * h)
+      job.factor = f;
+  if (job.factor == 0 &&
+      (!buildAxis(&job.ax, img->width, w, mode, job.bits) ||
+       !buildAxis(&job.ay, img->height, h, mode, job.bits)))
+    job.failed = 1;
+  else
+  {
+    InstrBegin(job.factor != 0 ? "direct" : "separable");
+    parallelFor((h + RESIZEROWS - 1) / RESIZEROWS, resizeTask, &job);
+    InstrEnd(nbytes(img) + nbytes(out));
+  }
+  freeAxis(&job.ax);
+  freeAxis(&job.ay);
+  if (job.failed)
+  {
+    ImageDestroy(&out);
+    errCause = "Memory allocation failed";
+    InstrEnd(0);
+    return NULL;
+  }
+  InstrAdd(PIXMEM_COUNTER, job.accesses); // count pixel memory accesses
+  InstrEnd(nbytes(img) + nbytes(out));
+  return out;
+}
+
+/// Affine warp
+
+// ImageWarpAffine maps each output pixel (x, y) to the source point
+// (m[0]*x + m[1]*y + m[2], m[3]*x + m[4]*y + m[5]).  Along a row, that
+// point moves by the constant step (m[0], m[3]), so it is computed in fixed
+// point (24 fractional bits) by adding the step, with no multiplications
+// (see warpRow).  The fixed-point step is rounded, so the error grows along
+// the row: the output is computed in WARPTILE x WARPTILE tiles, and the
+// starting point of each tile row is computed exactly from the matrix,
+// which bounds the error to WARPTILE * 2^-25 pixels.
+// Tiles also keep the source reads local: in a rotation, the rows of a
+// tile read a small patch of the source instead of long diagonal lines.
+// Tiles are computed in parallel (see ImageSetThreads).
+#ifndef WARPTILE
+#define WARPTILE 64
+#endif
+
+// Parameters of a parallel warp
+struct warpJob
+{
+  Image img, out;
+  double m[6];            // output-to-source matrix (see image8bit.h)
+  int bilinear;           // interpolation
+  int tilesx;             // number of tiles per row of tiles
+  unsigned long accesses; // pixel accesses (updated atomically)
+};
+
+// Convert coordinate or step c to fixed point (24 fractional bits).
+// Values are clamped to +-2^31, which keeps a tile row of steps (up to
+// WARPTILE 128) from overflowing: beyond that, points are outside any
+// image anyway (and so is the next point, after such a step).  NaN is
+// taken as outside too.
+static int64_t warpFixed(double c)
+{
+  const double lim = 2147483648.0; // 2^31
+  c = c != c ? lim : c < -lim ? -lim : c > lim ? lim : c;
+  c *= 16777216.0;
+  return (int64_t)(c < 0 ? c - 0.5 : c + 0.5);
+}
+
+static void warpTask(void *arg, int task)
+{
+  struct warpJob *job = (struct warpJob *)arg;
+  Image img = job->img, out = job->out;
+  const double *m = job->m;
+  size_t d = (size_t)img->depth;
+  int x0 = (task % job->tilesx) * WARPTILE;
+  int y0 = (task / job->tilesx) * WARPTILE;
+  int x1 = x0 + WARPTILE < out->width ? x0 + WARPTILE : out->width;
+  int y1 = y0 + WARPTILE < out->height ? y0 + WARPTILE : out->height;
+  int64_t dx = warpFixed(m[0]), dy = warpFixed(m[3]);
+  unsigned long reads = 0;
+  for (int y = y0; y < y1; y++)
+  {
+    int64_t sx = warpFixed(m[0] * x0 + m[1] * y + m[2]);
+    int64_t sy = warpFixed(m[3] * x0 + m[4] * y + m[5]);
+    void *dst = (char *)out->pixel + ((size_t)y * out->width + x0) * d;
+    reads += DISPATCH(img, warpRow, (const void *)img->pixel, img->width, img->height, sx, sy,
+                      dx, dy, x1 - x0, job->bilinear, dst);
+  }
+  unsigned long writes = (unsigned long)(y1 - y0) * (unsigned long)(x1 - x0);
+  __atomic_fetch_add(&job->accesses, reads + writes, __ATOMIC_RELAXED);
+}
+
+/// Warp an image by an affine transform (see image8bit.h).
+Image ImageWarpAffine(Image img, const double matrix[6], int w, int h, int interp)
+{ ///
+  assert(img != NULL);
+  assert(matrix != NULL);
+  assert(w >= 0 && h >= 0);
+  assert(interp == IMAGE_WARP_NEAREST || interp == IMAGE_WARP_BILINEAR);
+
+  if (img->layout == IMAGE_LAYOUT_TILED) // works on a raster copy
+  {
+    Image r = rasterCopy(img);
+    Image out = r != NULL ? ImageWarpAffine(r, matrix, w, h, interp) : NULL;
+    ImageDestroy(&r);
+    return out;
+  }
+
+  InstrBegin("ImageWarpAffine");
+  Image out = ImageCreate(w, h, img->maxval);
+  if (out == NULL)
+  {
+    InstrEnd(0);
+    return NULL;
+  }
+  if (npixels(out) == 0)
+  {
+    InstrEnd(0);
+    return out;
   }
-  ImagePaste(img, 0, 0, tempImg);
-  // Libera a imagem temporária
-  ImageDestroy(&tempImg);
-  InstrPrint();
-}
\ No newline at end of file
+  if (npixels(img) == 0) // nothing to sample: all black
+  {
+    memset(out->pixel, 0, nbytes(out));
+    InstrAdd(PIXMEM_COUNTER, npixels(out)); // count pixel memory accesses
+    InstrEnd(nbytes(out));
+    return out;
+  }
+
+  struct warpJob job;
+  job.img = img;
+  job.out = out;
+  memcpy(job.m, matrix, sizeof(job.m));
+  job.bilinear = interp == IMAGE_WARP_BILINEAR;
+  job.tilesx = (w + WARPTILE - 1) / WARPTILE;
+  job.accesses = 0;
+  parallelFor(job.tilesx * ((h + WARPTILE - 1) / WARPTILE), warpTask, &job);
+  InstrAdd(PIXMEM_COUNTER, job.accesses); // count pixel memory accesses
+  InstrEnd(nbytes(img) + nbytes(out));
+  return out;
+}
+
+/// Gaussian blur
+
+// ImageGaussianBlur approximates the Gaussian by three successive box
+// filters (their convolution tends to a Gaussian, by the central limit
+// theorem).  Each box pass is a running sum: one add and one subtract per
+// sample, whatever the width, so the cost is independent of sigma.
+// Box widths follow Kovesi, "Fast almost-Gaussian filtering" (2010): m
+// boxes of odd width wl and 3-m of width wl+2, with m chosen so that the
+// variance of the cascade, sum((w*w - 1) / 12), is the closest to sigma^2.
+// Rows are filtered first, in bands of GAUSSROWS, into a float image; then
+// columns, in strips of GAUSSCOLS, going down the rows so that each step
+// reads and writes contiguous runs of the strip.  Samples outside the image
+// repeat the edge (IMAGE_BORDER_CLAMP), so each pass is an exact box.
+#ifndef GAUSSROWS
+#define GAUSSROWS 64
+#endif
+#ifndef GAUSSCOLS
+#define GAUSSCOLS 64
+#endif
+// Widest box: larger sigmas use boxes of this width, which already span
+// any image many times over, and keep radii and indices far from INT_MAX.
+#define GAUSSMAXW ((1 << 30) - 1)
+
+// Store in r[0..2] the radii of the three boxes approximating a Gaussian
+// of standard deviation sigma.
+static void gaussRadii(double sigma, int *r)
+{
+  double var = 12.0 * sigma * sigma; // sum(w*w - 1) of the three boxes
+  // Largest odd wl with wl*wl <= var/3 + 1 (at most GAUSSMAXW)
+  double ideal = sqrt(var / 3.0 + 1.0);
+  int wl = ideal < GAUSSMAXW ? (int)ideal : GAUSSMAXW;
+  if (wl % 2 == 0)
+    wl--;
+  // Number of boxes of width wl (the others are wl+2) that best fits var
+  double mi = (var - 3.0 * ((double)wl * wl + 4.0 * wl + 3.0)) / (-4.0 * wl - 4.0);
+  int m = !(mi > 0.0) ? 0 : mi >= 3.0 ? 3 : (int)(mi + 0.5);
+  for (int i = 0; i < 3; i++)
+    r[i] = (i < m ? wl : wl + 2) / 2;
+}
+
+// Box filter of radius r along a row of n samples.
+static void boxRow(const float *restrict src, float *restrict dst, int n, int r)
+{
+  float inv = 1.0f / (float)(2 * r + 1);
+  double sum = (double)(r + 1) * src[0];
+  for (int k = 1; k <= r && k < n; k++)
+    sum += src[k];
+  if (r > n - 1) // taps past the end repeat the last sample
+    sum += (double)(r - (n - 1)) * src[n - 1];
+  // The window leaves the row on the left for i < r, and on the right for
+  // i >= n-r-1: split the loop so the middle part has no clamping.
+  int i = 0;
+  int head = r < n ? r : n;
+  int tail = n - r - 1 > head ? n - r - 1 : head;
+  for (; i < head; i++)
+  {
+    dst[i] = (float)sum * inv;
+    sum += (double)src[i + r + 1 < n ? i + r + 1 : n - 1] - src[0];
+  }
+  for (; i < tail; i++)
+  {
+    dst[i] = (float)sum * inv;
+    sum += (double)src[i + r + 1] - src[i - r];
+  }
+  for (; i < n; i++)
+  {
+    dst[i] = (float)sum * inv;
+    sum += (double)src[n - 1] - src[i - r > 0 ? i - r : 0];
+  }
+}
+
+// One step of the box filter of cw adjacent columns:
+//   dst[c] = sum[c] * inv;  sum[c] += add[c] - sub[c]
+// Uses SSE2 for 4 columns per iteration, when available.
+static void boxStep(float *restrict dst, const float *add, const float *sub,
+                    double *restrict sum, float inv, int cw)
+{
+  int c = 0;
+#if defined(__SSE2__)
+  __m128 vinv = _mm_set1_ps(inv);
+  for (; c + 4 <= cw; c += 4)
+  {
+    __m128d lo = _mm_loadu_pd(sum + c);
+    __m128d hi = _mm_loadu_pd(sum + c + 2);
+    __m128 s = _mm_movelh_ps(_mm_cvtpd_ps(lo), _mm_cvtpd_ps(hi));
+    _mm_storeu_ps(dst + c, _mm_mul_ps(s, vinv));
+    __m128 a = _mm_loadu_ps(add + c);
+    __m128 b = _mm_loadu_ps(sub + c);
+    __m128d dlo = _mm_sub_pd(_mm_cvtps_pd(a), _mm_cvtps_pd(b));
+    __m128d dhi = _mm_sub_pd(_mm_cvtps_pd(_mm_movehl_ps(a, a)), _mm_cvtps_pd(_mm_movehl_ps(b, b)));
+    _mm_storeu_pd(sum + c, _mm_add_pd(lo, dlo));
+    _mm_storeu_pd(sum + c + 2, _mm_add_pd(hi, dhi));
+  }
+#endif
+  for (; c < cw; c++)
+  {
+    dst[c] = (float)sum[c] * inv;
+    sum[c] += (double)add[c] - sub[c];
+  }
+}
+
+// Box filter of radius r along the n rows of a strip of cw columns: row i
+// is read from src + i*sstride and written to dst + i*dstride.
+// sum[] holds cw running sums.
+static void boxCols(const float *src, size_t sstride, float *dst, size_t dstride,
+                    int n, int cw, int r, double *sum)
+{
+  float inv = 1.0f / (float)(2 * r + 1);
+  for (int c = 0; c < cw; c++)
+    sum[c] = (double)(r + 1) * src[c];
+  for (int k = 1; k <= r && k < n; k++)
+  {
+    const float *s = src + (size_t)k * sstride;
+    for (int c = 0; c < cw; c++)
+      sum[c] += s[c];
+  }
+  if (r > n - 1) // taps past the end repeat the last row
+  {
+    const float *s = src + (size_t)(n - 1) * sstride;
+    for (int c = 0; c < cw; c++)
+      sum[c] += (double)(r - (n - 1)) * s[c];
+  }
+  for (int i = 0; i < n; i++)
+  {
+    const float *add = src + (size_t)(i + r + 1 < n ? i + r + 1 : n - 1) * sstride;
+    const float *sub = src + (size_t)(i - r > 0 ? i - r : 0) * sstride;
+    boxStep(dst + (size_t)i * dstride, add, sub, sum, inv, cw);
+  }
+}
+
+// Parameters of a parallel Gaussian blur
+struct gaussJob
+{
+  Image img;
+  float *tmp;   // image filtered along rows
+  void *out;    // new pixel array
+  int r[3];     // box radii
+  int failed;   // memory allocation failed (set atomically)
+};
+
+// Filter a band of GAUSSROWS rows of img into tmp.
+static void gaussRowTask(void *arg, int task)
+{
+  struct gaussJob *job = (struct gaussJob *)arg;
+  Image img = job->img;
+  int w = img->width;
+  int y0 = task * GAUSSROWS;
+  int y1 = y0 + GAUSSROWS < img->height ? y0 + GAUSSROWS : img->height;
+  float *buf = malloc((size_t)w * sizeof(float));
+  if (buf == NULL)
+  {
+    __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  for (int y = y0; y < y1; y++)
+  {
+    const void *src = (const char *)img->pixel + (size_t)y * w * img->depth;
+    float *row = job->tmp + (size_t)y * w;
+    DISPATCH(img, loadRowF, src, w, buf);
+    boxRow(buf, row, w, job->r[0]);
+    boxRow(row, buf, w, job->r[1]);
+    boxRow(buf, row, w, job->r[2]);
+  }
+  free(buf);
+}
+
+// Filter a strip of GAUSSCOLS columns of tmp, storing the result in out.
+// The strip of tmp is reused as the buffer of the middle pass.
+static void gaussColTask(void *arg, int task)
+{
+  struct gaussJob *job = (struct gaussJob *)arg;
+  Image img = job->img;
+  int w = img->width;
+  int h = img->height;
+  int x0 = task * GAUSSCOLS;
+  int cw = x0 + GAUSSCOLS < w ? GAUSSCOLS : w - x0;
+  float *a = malloc((size_t)h * cw * sizeof(float));
+  double *sum = malloc((size_t)cw * sizeof(double));
+  if (a == NULL || sum == NULL)
+  {
+    __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+    free(a);
+    free(sum);
+    return;
+  }
+  float *strip = job->tmp + x0;
+  boxCols(strip, (size_t)w, a, (size_t)cw, h, cw, job->r[0], sum);
+  boxCols(a, (size_t)cw, strip, (size_t)w, h, cw, job->r[1], sum);
+  boxCols(strip, (size_t)w, a, (size_t)cw, h, cw, job->r[2], sum);
+  for (int y = 0; y < h; y++)
+  {
+    void *dst = (char *)job->out + ((size_t)y * w + x0) * img->depth;
+    DISPATCH(img, storeRowF, a + (size_t)y * cw, cw, img->maxval, dst);
+  }
+  free(a);
+  free(sum);
+}
+
+/// Blur an image with an approximate Gaussian filter (see image8bit.h).
+int ImageGaussianBlur(Image img, double sigma)
+{ ///
+  assert(img != NULL);
+  assert(sigma >= 0.0);
+
+  if (npixels(img) == 0)
+    return 1;
+
+  if (img->layout == IMAGE_LAYOUT_TILED) // works in raster layout
+  {
+    int ok = ImageSetLayout(img, IMAGE_LAYOUT_RASTER) && ImageGaussianBlur(img, sigma);
+    return ImageSetLayout(img, IMAGE_LAYOUT_TILED) && ok;
+  }
+
+  InstrBegin("ImageGaussianBlur");
+  struct gaussJob job = {img, NULL, NULL, {0, 0, 0}, 0};
+  gaussRadii(sigma, job.r);
+  job.tmp = malloc(npixels(img) * sizeof(float));
+  job.out = malloc(nbytes(img));
+  if (job.tmp == NULL || job.out == NULL)
+  {
+    free(job.tmp);
+    free(job.out);
+    errCause = "Memory allocation failed";
+    InstrEnd(0);
+    return 0;
+  }
+
+  InstrBegin("rows");
+  parallelFor((img->height + GAUSSROWS - 1) / GAUSSROWS, gaussRowTask, &job);
+  InstrEnd(nbytes(img) + npixels(img) * sizeof(float));
+  if (!job.failed)
+  {
+    InstrBegin("columns");
+    parallelFor((img->width + GAUSSCOLS - 1) / GAUSSCOLS, gaussColTask, &job);
+    InstrEnd(nbytes(img) + 3ul * npixels(img) * sizeof(float));
+  }
+  free(job.tmp);
+  if (job.failed)
+  {
+    free(job.out);
+    errCause = "Memory allocation failed";
+    InstrEnd(0);
+    return 0;
+  }
+  free(img->pixel);
+  img->pixel = job.out;
+  InstrAdd(PIXMEM_COUNTER, 2ul * npixels(img)); // count pixel memory accesses
+  InstrEnd(2ul * nbytes(img));
+  return 1;
+}
+
+/// Median filter
+
+// ImageMedian follows Perreault and Hebert, "Median filtering in constant
+// time" (2007), for 8-bit images.  Each column keeps a histogram of its
+// pixels in the rows of the window, moved down one row at a time (one
+// pixel added, one removed).  The window histogram, the sum of the column
+// histograms in the window, moves right one column at a time (one column
+// histogram added, one removed).  Histograms have two levels: 16 coarse
+// bins (the high 4 bits of the level) and 256 fine bins.  The window keeps
+// its coarse bins up to date, but each 16-bin segment of its fine bins is
+// only brought up to date when the median falls in it.
+// 16-bit images would need 65536 fine bins per column, so they use Huang's
+// sliding histogram instead: a window histogram (256 coarse and 65536 fine
+// bins) that moves right by adding and removing a column of pixels, in
+// O(dy) per pixel.
+// The image is processed in parallel tiles of at least MEDIANROWS rows by
+// MEDIANCOLS columns, and at least (2dy+1) x (2dx+1), so that the column
+// histograms of a tile stay in cache, and filling them for its first row
+// (and for its dx columns of halo on each side) costs no more than the
+// tile itself.
+#ifndef MEDIANROWS
+#define MEDIANROWS 64
+#endif
+#ifndef MEDIANCOLS
+#define MEDIANCOLS 128
+#endif
+
+// Add sign (+1 or -1) times pixels [c0, c1) of row to the coarse and fine
+// histograms of columns c0 .. c1-1, stored from colC and colF.
+static void medianRow8(const uint8 *row, int c0, int c1, uint32_t sign,
+                       uint32_t *colC, uint32_t *colF)
+{
+  for (int c = c0; c < c1; c++)
+  {
+    colC[(size_t)(c - c0) * 16 + (row[c] >> 4)] += sign;
+    colF[(size_t)(c - c0) * 256 + row[c]] += sign;
+  }
+}
+
+// Median of the tile [x0, x1) x [y0, y1) of the 8-bit image p (w x h)
+// into out, with windows [x-dx, x+dx]x[y-dy, y+dy] clipped to the image.
+// colC and colF have room for the coarse (16) and fine (256) histograms of
+// x1-x0+2dx columns.
+// Returns the number of pixel accesses.
+static unsigned long medianTile8(const uint8 *p, int w, int h, int dx, int dy,
+                        int x0, int x1, int y0, int y1,
+                        uint8 *out, uint32_t *colC, uint32_t *colF)
+{
+  // Columns [c0, c1) of the image have histograms, column c at c-c0
+  int c0 = x0 - dx > 0 ? x0 - dx : 0;
+  int c1 = x1 + dx < w ? x1 + dx : w;
+  memset(colC, 0, (size_t)(c1 - c0) * 16 * sizeof(uint32_t));
+  memset(colF, 0, (size_t)(c1 - c0) * 256 * sizeof(uint32_t));
+  // Column histograms of rows [y0-dy, y0+dy-1]: the first step adds y0+dy
+  unsigned long rowsRead = 0;
+  for (int j = y0 - dy > 0 ? y0 - dy : 0; j < y0 + dy && j < h; j++, rowsRead++)
+    medianRow8(p + (size_t)j * w, c0, c1, 1, colC, colF);
+
+  uint32_t hc[16], hf[256];
+  int upd[16]; // window position at which each fine segment is up to date
+  for (int y = y0; y < y1; y++)
+  {
+    // Move the column histograms down to rows [y-dy, y+dy]
+    if (y + dy < h)
+      medianRow8(p + (size_t)(y + dy) * w, c0, c1, 1, colC, colF), rowsRead++;
+    if (y > y0 && y - dy - 1 >= 0)
+      medianRow8(p + (size_t)(y - dy - 1) * w, c0, c1, (uint32_t)-1, colC, colF), rowsRead++;
+    uint32_t rows = (uint32_t)((y + dy < h ? y + dy : h - 1) - (y - dy > 0 ? y - dy : 0) + 1);
+
+    // Window histogram of columns [x0-dx, x0+dx-1]: the first step adds x0+dx
+    memset(hc, 0, sizeof(hc));
+    for (int c = x0 - dx > 0 ? x0 - dx : 0; c < x0 + dx && c < w; c++)
+      for (int b = 0; b < 16; b++)
+        hc[b] += colC[(size_t)(c - c0) * 16 + b];
+    for (int b = 0; b < 16; b++)
+      upd[b] = x0 - 2 * dx - 2; // stale
+
+    uint8 *d = out + (size_t)y * w;
+    for (int x = x0; x < x1; x++)
+    {
+      if (x + dx < w)
+        for (int b = 0; b < 16; b++)
+          hc[b] += colC[(size_t)(x + dx - c0) * 16 + b];
+      if (x > x0 && x - dx - 1 >= 0)
+        for (int b = 0; b < 16; b++)
+          hc[b] -= colC[(size_t)(x - dx - 1 - c0) * 16 + b];
+      int wx0 = x - dx > 0 ? x - dx : 0;
+      int wx1 = x + dx < w ? x + dx : w - 1;
+      uint32_t k = ((uint32_t)(wx1 - wx0 + 1) * rows - 1) / 2; // lower median
+
+      int b = 0;
+      while (hc[b] <= k)
+        k -= hc[b++];
+
+      // Bring fine segment b up to date for this window
+      uint32_t *seg = hf + 16 * b;
+      const uint32_t *col = colF + 16 * b - (size_t)c0 * 256;
+      if (2 * (x - upd[b]) > wx1 - wx0 + 1)
+      {
+        memset(seg, 0, 16 * sizeof(uint32_t));
+        for (int c = wx0; c <= wx1; c++)
+          for (int i = 0; i < 16; i++)
+            seg[i] += col[(size_t)c * 256 + i];
+      }
+      else
+      {
+        for (int s = upd[b] + 1; s <= x; s++)
+        {
+          if (s + dx < w)
+            for (int i = 0; i < 16; i++)
+              seg[i] += col[(size_t)(s + dx) * 256 + i];
+          if (s - dx - 1 >= 0)
+            for (int i = 0; i < 16; i++)
+              seg[i] -= col[(size_t)(s - dx - 1) * 256 + i];
+        }
+      }
+      upd[b] = x;
+
+      int i = 0;
+      while (seg[i] <= k)
+        k -= seg[i++];
+      d[x] = (uint8)(16 * b + i);
+    }
+  }
+  return rowsRead * (unsigned long)(c1 - c0) + (unsigned long)(x1 - x0) * (unsigned long)(y1 - y0);
+}
+
+// Add sign (+1 or -1) times the pixels of column x, rows [j0, j1], of the
+// 16-bit image p (width w) to the coarse (256) and fine (65536) histograms.
+static void medianColumn16(const uint16 *p, int w, int x, int j0, int j1, uint32_t sign,
+                           uint32_t *hc, uint32_t *hf)
+{
+  for (int j = j0; j <= j1; j++)
+  {
+    uint16 v = p[(size_t)j * w + x];
+    hc[v >> 8] += sign;
+    hf[v] += sign;
+  }
+}
+
+// Median of the tile [x0, x1) x [y0, y1) of the 16-bit image p (w x h)
+// into out, as in medianTile8.  hc and hf must be zero, and are left so.
+// Returns the number of pixel accesses.
+static unsigned long medianTile16(const uint16 *p, int w, int h, int dx, int dy,
+                                  int x0, int x1, int y0, int y1,
+                                  uint16 *out, uint32_t *hc, uint32_t *hf)
+{
+  unsigned long accesses = 0;
+  for (int y = y0; y < y1; y++)
+  {
+    int j0 = y - dy > 0 ? y - dy : 0;
+    int j1 = y + dy < h ? y + dy : h - 1;
+    uint32_t rows = (uint32_t)(j1 - j0 + 1);
+    int cols = 0; // columns added and removed
+    // Window histogram of columns [x0-dx, x0+dx-1]: the first step adds x0+dx
+    for (int c = x0 - dx > 0 ? x0 - dx : 0; c < x0 + dx && c < w; c++, cols++)
+      medianColumn16(p, w, c, j0, j1, 1, hc, hf);
+
+    uint16 *d = out + (size_t)y * w;
+    for (int x = x0; x < x1; x++)
+    {
+      if (x + dx < w)
+        medianColumn16(p, w, x + dx, j0, j1, 1, hc, hf), cols++;
+      if (x > x0 && x - dx - 1 >= 0)
+        medianColumn16(p, w, x - dx - 1, j0, j1, (uint32_t)-1, hc, hf), cols++;
+      int wx0 = x - dx > 0 ? x - dx : 0;
+      int wx1 = x + dx < w ? x + dx : w - 1;
+      uint32_t k = ((uint32_t)(wx1 - wx0 + 1) * rows - 1) / 2; // lower median
+      int b = 0;
+      while (hc[b] <= k)
+        k -= hc[b++];
+      const uint32_t *seg = hf + 256 * b;
+      int i = 0;
+      while (seg[i] <= k)
+        k -= seg[i++];
+      d[x] = (uint16)(256 * b + i);
+    }
+    // Empty the histograms: remove the columns of the last window
+    for (int c = x1 - 1 - dx > 0 ? x1 - 1 - dx : 0; c <= x1 - 1 + dx && c < w; c++, cols++)
+      medianColumn16(p, w, c, j0, j1, (uint32_t)-1, hc, hf);
+    accesses += (unsigned long)cols * rows + (unsigned long)(x1 - x0);
+  }
+  return accesses;
+}
+
+// Parameters of a parallel median filter
+struct medianJob
+{
+  Image img;
+  void *out;               // new pixel array
+  int dx, dy;
+  int rows, cols;          // tile size
+  int ncols;               // tiles per row of tiles
+  unsigned long accesses;  // pixel accesses (updated atomically)
+  int failed;              // memory allocation failed (set atomically)
+};
+
+static void medianTask(void *arg, int task)
+{
+  struct medianJob *job = (struct medianJob *)arg;
+  Image img = job->img;
+  int w = img->width;
+  int x0 = task % job->ncols * job->cols;
+  int x1 = x0 + job->cols < w ? x0 + job->cols : w;
+  int y0 = task / job->ncols * job->rows;
+  int y1 = y0 + job->rows < img->height ? y0 + job->rows : img->height;
+  // 8-bit: column histograms; 16-bit: window histogram
+  size_t ncols = (size_t)(x1 - x0) + 2 * (size_t)job->dx;
+  size_t nc = img->depth == 1 ? ncols * 16 : 256;
+  size_t nf = img->depth == 1 ? ncols * 256 : 65536;
+  uint32_t *hc = calloc(nc, sizeof(uint32_t));
+  uint32_t *hf = calloc(nf, sizeof(uint32_t));
+  if (hc == NULL || hf == NULL)
+  {
+    __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+    free(hc);
+    free(hf);
+    return;
+  }
+  unsigned long accesses;
+  if (img->depth == 1)
+    accesses = medianTile8(PIX8(img), w, img->height, job->dx, job->dy,
+                           x0, x1, y0, y1, job->out, hc, hf);
+  else
+    accesses = medianTile16(PIX16(img), w, img->height, job->dx, job->dy,
+                            x0, x1, y0, y1, job->out, hc, hf);
+  __atomic_fetch_add(&job->accesses, accesses, __ATOMIC_RELAXED);
+  free(hc);
+  free(hf);
+}
+
+/// Apply a median filter to an image (see image8bit.h).
+int ImageMedian(Image img, int dx, int dy)
+{ ///
+  assert(img != NULL);
+  assert(dx >= 0 && dy >= 0);
+
+  if (npixels(img) == 0)
+    return 1;
+
+  if (img->layout == IMAGE_LAYOUT_TILED) // works in raster layout
+  {
+    int ok = ImageSetLayout(img, IMAGE_LAYOUT_RASTER) && ImageMedian(img, dx, dy);
+    return ImageSetLayout(img, IMAGE_LAYOUT_TILED) && ok;
+  }
+
+  InstrBegin("ImageMedian");
+  // Larger windows cover the whole image, as these do
+  if (dx >= img->width)
+    dx = img->width - 1;
+  if (dy >= img->height)
+    dy = img->height - 1;
+  struct medianJob job = {img, NULL, dx, dy, MEDIANROWS, MEDIANCOLS, 0, 0, 0};
+  if (job.rows < 2 * dy + 1)
+    job.rows = 2 * dy + 1;
+  if (job.cols < 2 * dx + 1)
+    job.cols = 2 * dx + 1;
+  job.ncols = (img->width + job.cols - 1) / job.cols;
+  job.out = malloc(nbytes(img));
+  if (job.out == NULL)
+  {
+    errCause = "Memory allocation failed";
+    InstrEnd(0);
+    return 0;
+  }
+  int nrows = (img->height + job.rows - 1) / job.rows;
+  parallelFor(nrows * job.ncols, medianTask, &job);
+  if (job.failed)
+  {
+    free(job.out);
+    errCause = "Memory allocation failed";
+    InstrEnd(0);
+    return 0;
+  }
+  free(img->pixel);
+  img->pixel = job.out;
+  InstrAdd(PIXMEM_COUNTER, job.accesses); // count pixel memory accesses
+  InstrEnd(2ul * nbytes(img));
+  return 1;
+}
+
+/// Morphology
+
+// Erosion and dilation by a (2dx+1)x(2dy+1) rectangle are separable: a
+// running minimum (or maximum) along rows, then along columns, each by
+// van Herk / Gil-Werman (see morphRow), in 3 comparisons per pixel
+// whatever the size.  Rows are filtered in parallel bands of MORPHROWS,
+// then columns in parallel strips of MORPHCOLS, whole rows of the strip at
+// a time, with SIMD min/max (see minmax8).
+#ifndef MORPHROWS
+#define MORPHROWS 64
+#endif
+#ifndef MORPHCOLS
+#define MORPHCOLS 256
+#endif
+
+// Parameters of a parallel erosion or dilation
+struct morphJob
+{
+  Image img;         // dimensions and depth
+  const void *src;   // pixel array to filter
+  void *dst;         // result (may be src)
+  int dx, dy;
+  int dilate;        // dilate if nonzero, else erode
+  int failed;        // memory allocation failed (set atomically)
+};
+
+// Filter a band of MORPHROWS rows of src into dst.
+static void morphRowTask(void *arg, int task)
+{
+  struct morphJob *job = (struct morphJob *)arg;
+  Image img = job->img;
+  int w = img->width;
+  size_t d = (size_t)img->depth;
+  int y0 = task * MORPHROWS;
+  int y1 = y0 + MORPHROWS < img->height ? y0 + MORPHROWS : img->height;
+  void *g = malloc(((size_t)w + 2 * (size_t)job->dx) * d);
+  void *h = malloc(((size_t)w + 2 * (size_t)job->dx) * d);
+  if (g == NULL || h == NULL)
+  {
+    __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+    free(g);
+    free(h);
+    return;
+  }
+  for (int y = y0; y < y1; y++)
+  {
+    const void *src = (const char *)job->src + (size_t)y * w * d;
+    void *dst = (char *)job->dst + (size_t)y * w * d;
+    DISPATCH(img, morphRow, src, dst, w, job->dx, job->dilate, g, h);
+  }
+  free(g);
+  free(h);
+}
+
+// Filter a strip of MORPHCOLS columns of dst, in place.
+static void morphColTask(void *arg, int task)
+{
+  struct morphJob *job = (struct morphJob *)arg;
+  Image img = job->img;
+  int w = img->width;
+  size_t d = (size_t)img->depth;
+  int x0 = task * MORPHCOLS;
+  int cw = x0 + MORPHCOLS < w ? MORPHCOLS : w - x0;
+  size_t size = ((size_t)img->height + 2 * (size_t)job->dy) * (size_t)cw * d;
+  void *g = malloc(size);
+  void *h = malloc(size);
+  if (g == NULL || h == NULL)
+  {
+    __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+    free(g);
+    free(h);
+    return;
+  }
+  void *strip = (char *)job->dst + (size_t)x0 * d;
+  DISPATCH(img, morphCols, strip, strip, (size_t)w, img->height, cw, job->dy, job->dilate, g, h);
+  free(g);
+  free(h);
+}
+
+// Erode (dilate == 0) or dilate the pixel array src of img into dst, which
+// may be src.  Returns 1 on success, 0 if memory allocation failed.
+static int morph(Image img, const void *src, void *dst, int dx, int dy, int dilate)
+{
+  // Larger windows cover the whole image, as these do
+  if (dx >= img->width)
+    dx = img->width - 1;
+  if (dy >= img->height)
+    dy = img->height - 1;
+  struct morphJob job = {img, src, dst, dx, dy, dilate, 0};
+  InstrBegin("rows");
+  parallelFor((img->height + MORPHROWS - 1) / MORPHROWS, morphRowTask, &job);
+  InstrEnd(2ul * nbytes(img));
+  if (job.failed)
+    return 0;
+  InstrBegin("columns");
+  parallelFor((img->width + MORPHCOLS - 1) / MORPHCOLS, morphColTask, &job);
+  InstrEnd(2ul * nbytes(img));
+  InstrAdd(PIXMEM_COUNTER, 4ul * npixels(img)); // count pixel memory accesses
+  return !job.failed;
+}
+
+// Morphological operations
+enum morphOp
+{
+  MORPH_ERODE,
+  MORPH_DILATE,
+  MORPH_OPEN,     // erode, then dilate
+  MORPH_CLOSE,    // dilate, then erode
+  MORPH_GRADIENT, // dilate minus erode
+};
+
+// Apply operation op with a (2dx+1)x(2dy+1) rectangle to img, in-place.
+// On failure, returns 0, sets errCause, and leaves img unchanged.
+static int morphology(Image img, int dx, int dy, enum morphOp op)
+{
+  static const char *const names[] = {"ImageErode", "ImageDilate", "ImageOpen", "ImageClose",
+                                      "ImageGradient"};
+  (void)names; // only used by InstrBegin, which NINSTR removes
+  assert(img != NULL);
+  assert(dx >= 0 && dy >= 0);
+
+  if (npixels(img) == 0)
+    return 1;
+
+  if (img->layout == IMAGE_LAYOUT_TILED) // works in raster layout
+  {
+    int ok = ImageSetLayout(img, IMAGE_LAYOUT_RASTER) && morphology(img, dx, dy, op);
+    return ImageSetLayout(img, IMAGE_LAYOUT_TILED) && ok;
+  }
+
+  InstrBegin(names[op]);
+  void *out = malloc(nbytes(img));
+  void *out2 = op == MORPH_GRADIENT ? malloc(nbytes(img)) : NULL;
+  int ok = out != NULL && (op != MORPH_GRADIENT || out2 != NULL);
+  switch (op)
+  {
+  case MORPH_ERODE:
+  case MORPH_DILATE:
+    ok = ok && morph(img, img->pixel, out, dx, dy, op == MORPH_DILATE);
+    break;
+  case MORPH_OPEN:
+  case MORPH_CLOSE:
+    ok = ok && morph(img, img->pixel, out, dx, dy, op == MORPH_CLOSE) &&
+         morph(img, out, out, dx, dy, op == MORPH_OPEN);
+    break;
+  case MORPH_GRADIENT:
+    ok = ok && morph(img, img->pixel, out, dx, dy, 1) && morph(img, img->pixel, out2, dx, dy, 0);
+    if (ok)
+    {
+      DISPATCH(img, difference, out, out2, npixels(img));
+      InstrAdd(PIXMEM_COUNTER, 3ul * npixels(img)); // count pixel memory accesses
+    }
+    break;
+  }
+  free(out2);
+  if (!ok)
+  {
+    free(out);
+    errCause = "Memory allocation failed";
+    InstrEnd(0);
+    return 0;
+  }
+  free(img->pixel);
+  img->pixel = out;
+  InstrEnd(2ul * nbytes(img));
+  return 1;
+}
+
+/// Erode an image with a (2dx+1)x(2dy+1) rectangle (see image8bit.h).
+int ImageErode(Image img, int dx, int dy)
+{ ///
+  return morphology(img, dx, dy, MORPH_ERODE);
+}
+
+/// Dilate an image with a (2dx+1)x(2dy+1) rectangle (see image8bit.h).
+int ImageDilate(Image img, int dx, int dy)
+{ ///
+  return morphology(img, dx, dy, MORPH_DILATE);
+}
+
+/// Open an image: erode, then dilate (see image8bit.h).
+int ImageOpen(Image img, int dx, int dy)
+{ ///
+  return morphology(img, dx, dy, MORPH_OPEN);
+}
+
+/// Close an image: dilate, then erode (see image8bit.h).
+int ImageClose(Image img, int dx, int dy)
+{ ///
+  return morphology(img, dx, dy, MORPH_CLOSE);
+}
+
+/// Morphological gradient: dilation minus erosion (see image8bit.h).
+int ImageGradient(Image img, int dx, int dy)
+{ ///
+  return morphology(img, dx, dy, MORPH_GRADIENT);
+}
+
+/// Binary masks
+
+// A mask stores each row in stride 64-bit words: pixel (x, y) is bit x%64
+// of bits[y*stride + x/64].  Bits beyond the width, in the last word of
+// each row, are always 0, so that whole words can be counted and compared.
+struct mask
+{
+  int width;
+  int height;
+  int stride;     // words per row
+  uint64_t *bits; // rows of packed pixels
+};
+
+// Number of words in mask m
+static inline size_t nwords(Mask m)
+{
+  return (size_t)m->stride * (size_t)m->height;
+}
+
+// Bits of the last word of each row of m that are inside the mask
+static inline uint64_t lastBits(Mask m)
+{
+  int r = m->width % 64;
+  return r == 0 ? ~(uint64_t)0 : ((uint64_t)1 << r) - 1;
+}
+
+/// Create a new empty mask (see image8bit.h).
+Mask MaskCreate(int width, int height)
+{ ///
+  assert(width >= 0);
+  assert(height >= 0);
+  Mask m = malloc(sizeof(struct mask));
+  if (m == NULL)
+  {
+    errCause = "Memory allocation failed";
+    return NULL;
+  }
+  m->width = width;
+  m->height = height;
+  m->stride = (width + 63) / 64;
+  m->bits = calloc(nwords(m) > 0 ? nwords(m) : 1, sizeof(uint64_t));
+  if (m->bits == NULL)
+  {
+    free(m);
+    errCause = "Memory allocation failed";
+    return NULL;
+  }
+  return m;
+}
+
+/// Destroy the mask pointed to by (*maskp).
+void MaskDestroy(Mask *maskp)
+{ ///
+  assert(maskp != NULL);
+  if (*maskp != NULL)
+  {
+    free((*maskp)->bits);
+    free(*maskp);
+    *maskp = NULL;
+  }
+}
+
+/// Get mask width
+int MaskWidth(Mask m)
+{ ///
+  assert(m != NULL);
+  return m->width;
+}
+
+/// Get mask height
+int MaskHeight(Mask m)
+{ ///
+  assert(m != NULL);
+  return m->height;
+}
+
+/// Get the pixel (0 or 1) at position (x,y).
+int MaskGetPixel(Mask m, int x, int y)
+{ ///
+  assert(m != NULL);
+  assert(0 <= x && x < m->width && 0 <= y && y < m->height);
+  return (int)(m->bits[(size_t)y * m->stride + x / 64] >> (x % 64)) & 1;
+}
+
+/// Set the pixel at position (x,y) to bit (0 or 1).
+void MaskSetPixel(Mask m, int x, int y, int bit)
+{ ///
+  assert(m != NULL);
+  assert(0 <= x && x < m->width && 0 <= y && y < m->height);
+  assert(bit == 0 || bit == 1);
+  uint64_t *w = &m->bits[(size_t)y * m->stride + x / 64];
+  *w = (*w & ~((uint64_t)1 << (x % 64))) | ((uint64_t)bit << (x % 64));
+}
+
+// Threshold n samples of p into bits of dst: bit i of the words of dst is
+// set if p[i] >= thr.
+// SSE2 has no unsigned comparison, but max(v, thr) == v is v >= thr, and
+// movemask packs the 16 comparisons into 16 bits.  NEON adds up the
+// comparisons weighted by their bit.
+static void thresholdBits8(const uint8 *p, int n, uint8 thr, uint64_t *dst)
+{
+  int i = 0;
+  for (; i + 64 <= n; i += 64)
+  {
+    uint64_t w = 0;
+#if defined(__SSE2__)
+    const __m128i t = _mm_set1_epi8((char)thr);
+    for (int j = 0; j < 64; j += 16)
+    {
+      __m128i v = _mm_loadu_si128((const __m128i *)(p + i + j));
+      __m128i ge = _mm_cmpeq_epi8(_mm_max_epu8(v, t), v);
+      w |= (uint64_t)(uint16_t)_mm_movemask_epi8(ge) << j;
+    }
+#elif defined(__ARM_NEON)
+    static const uint8_t weights[16] = {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+    const uint8x16_t t = vdupq_n_u8(thr), wt = vld1q_u8(weights);
+    for (int j = 0; j < 64; j += 16)
+    {
+      uint8x16_t ge = vandq_u8(vcgeq_u8(vld1q_u8(p + i + j), t), wt);
+      uint8x8_t s = vpadd_u8(vget_low_u8(ge), vget_high_u8(ge));
+      s = vpadd_u8(s, s);
+      s = vpadd_u8(s, s);
+      w |= (uint64_t)(vget_lane_u8(s, 0) | vget_lane_u8(s, 1) << 8) << j;
+    }
+#else
+    for (int j = 0; j < 64; j++)
+      w |= (uint64_t)(p[i + j] >= thr) << j;
+#endif
+    dst[i / 64] = w;
+  }
+  if (i < n)
+  {
+    uint64_t w = 0;
+    for (int j = 0; i + j < n; j++)
+      w |= (uint64_t)(p[i + j] >= thr) << j;
+    dst[i / 64] = w;
+  }
+}
+
+// As thresholdBits8, for 16-bit samples.  SSE2 compares them as signed,
+// after flipping their top bit, and narrows the comparisons to bytes
+// for movemask.
+static void thresholdBits16(const uint16 *p, int n, uint16 thr, uint64_t *dst)
+{
+  int i = 0;
+#if defined(__SSE2__)
+  const __m128i flip = _mm_set1_epi16((short)0x8000);
+  const __m128i t = _mm_set1_epi16((short)(thr ^ 0x8000));
+  for (; i + 64 <= n; i += 64)
+  {
+    uint64_t w = 0;
+    for (int j = 0; j < 64; j += 16)
+    {
+      __m128i a = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(p + i + j)), flip);
+      __m128i b = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(p + i + j + 8)), flip);
+      __m128i lt = _mm_packs_epi16(_mm_cmplt_epi16(a, t), _mm_cmplt_epi16(b, t));
+      w |= (uint64_t)(uint16_t)~_mm_movemask_epi8(lt) << j;
+    }
+    dst[i / 64] = w;
+  }
+#endif
+  for (; i < n; i += 64)
+  {
+    uint64_t w = 0;
+    for (int j = 0; j < 64 && i + j < n; j++)
+      w |= (uint64_t)(p[i + j] >= thr) << j;
+    dst[i / 64] = w;
+  }
+}
+
+/// Threshold an image into a new mask (see image8bit.h).
+Mask ImageThresholdMask(Image img, uint16 thr)
+{ ///
+  assert(img != NULL);
+  InstrBegin("ImageThresholdMask");
+  Mask m = MaskCreate(img->width, img->height);
+  if (m == NULL)
+  {
+    InstrEnd(0);
+    return NULL;
+  }
+  // Runs start at multiples of TILE (in tiled layout), so at word bounds.
+  // 8-bit levels never reach a threshold above PixMax: the mask stays 0.
+  int empty = img->depth == 1 && thr > PixMax;
+  for (int y = 0; y < img->height && !empty; y++)
+    for (int x = 0; x < img->width;)
+    {
+      int run;
+      const void *p = pixelRun(img, x, y, &run);
+      uint64_t *dst = m->bits + (size_t)y * m->stride + x / 64;
+      if (img->depth == 1)
+        thresholdBits8(p, run, (uint8)thr, dst);
+      else
+        thresholdBits16(p, run, thr, dst);
+      x += run;
+    }
+  InstrAdd(PIXMEM_COUNTER, (unsigned long)npixels(img)); // count pixel memory accesses
+  InstrEnd(nbytes(img) + nwords(m) * sizeof(uint64_t));
+  return m;
+}
+
+/// Expand a mask into a new image (see image8bit.h).
+Image MaskToImage(Mask m, uint16 maxval)
+{ ///
+  assert(m != NULL);
+  assert(0 < maxval && maxval <= PixMax16);
+  InstrBegin("MaskToImage");
+  Image img = ImageCreate(m->width, m->height, maxval);
+  if (img == NULL)
+  {
+    InstrEnd(0);
+    return NULL;
+  }
+  for (int y = 0; y < m->height; y++)
+  {
+    const uint64_t *row = m->bits + (size_t)y * m->stride;
+    if (img->depth == 1)
+    {
+      uint8 *d = PIX8(img) + (size_t)y * m->width;
+      for (int x = 0; x < m->width; x++)
+        d[x] = (uint8)(-(int)((row[x / 64] >> (x % 64)) & 1) & maxval);
+    }
+    else
+    {
+      uint16 *d = PIX16(img) + (size_t)y * m->width;
+      for (int x = 0; x < m->width; x++)
+        d[x] = (uint16)(-(int)((row[x / 64] >> (x % 64)) & 1) & maxval);
+    }
+  }
+  InstrAdd(PIXMEM_COUNTER, (unsigned long)npixels(img)); // count pixel memory accesses
+  InstrEnd(nwords(m) * sizeof(uint64_t) + nbytes(img));
+  return img;
+}
+
+/// Mask a with b: a = a AND b.
+void MaskAnd(Mask a, Mask b)
+{ ///
+  assert(a != NULL && b != NULL);
+  assert(a->width == b->width && a->height == b->height);
+  for (size_t i = 0; i < nwords(a); i++)
+    a->bits[i] &= b->bits[i];
+}
+
+/// Merge b into a: a = a OR b.
+void MaskOr(Mask a, Mask b)
+{ ///
+  assert(a != NULL && b != NULL);
+  assert(a->width == b->width && a->height == b->height);
+  for (size_t i = 0; i < nwords(a); i++)
+    a->bits[i] |= b->bits[i];
+}
+
+/// Difference of a and b: a = a XOR b.
+void MaskXor(Mask a, Mask b)
+{ ///
+  assert(a != NULL && b != NULL);
+  assert(a->width == b->width && a->height == b->height);
+  for (size_t i = 0; i < nwords(a); i++)
+    a->bits[i] ^= b->bits[i];
+}
+
+/// Invert mask m.
+void MaskNot(Mask m)
+{ ///
+  assert(m != NULL);
+  uint64_t last = lastBits(m);
+  for (size_t i = 0; i < nwords(m); i++)
+    m->bits[i] = ~m->bits[i] & ((int)(i % (size_t)m->stride) == m->stride - 1 ? last : ~(uint64_t)0);
+}
+
+/// Number of pixels set in m.
+unsigned long MaskArea(Mask m)
+{ ///
+  assert(m != NULL);
+  unsigned long area = 0;
+  for (size_t i = 0; i < nwords(m); i++)
+    area += (unsigned long)__builtin_popcountll(m->bits[i]);
+  return area;
+}
+
+// Packed erosion and dilation are separable, like ImageErode: rows, then
+// columns.  The rectangle is split at its center into two one-sided
+// windows of length r+1, going forward (towards higher x or y) and
+// backward, and each one is computed by doubling: a window of length 2k is
+// the window of length k combined with itself shifted by k.  Shifts that
+// read beyond the mask read the identity (1 for AND, 0 for OR), which
+// clips windows to the mask.  So a radius r takes O(log r) passes of word
+// operations.
+
+// Shift row s (nw words, width w bits) by k bits: d[x] = s[x + k], reading
+// fill (all ones or all zeros) beyond the row.  The bits of s beyond w
+// must already be fill.  d must not alias s.
+static void shiftBits(uint64_t *d, const uint64_t *s, int nw, int k, uint64_t fill)
+{
+  int q = k >= 0 ? k / 64 : -((-k + 63) / 64); // floor(k / 64)
+  int off = k - 64 * q;
+  for (int i = 0; i < nw; i++)
+  {
+    int j = i + q;
+    uint64_t lo = j >= 0 && j < nw ? s[j] : fill;
+    if (off == 0)
+      d[i] = lo;
+    else
+    {
+      uint64_t hi = j + 1 >= 0 && j + 1 < nw ? s[j + 1] : fill;
+      d[i] = (lo >> off) | (hi << (64 - off));
+    }
+  }
+}
+
+// One-sided window along the row: d[x] = s[x] op s[x+dir] op ... op
+// s[x+(n-1)*dir], with op AND (fill all ones) or OR (fill zero).
+// p and t are scratch rows.  Rows have the fill beyond the width.
+static void runRow(uint64_t *d, const uint64_t *s, int nw, int n, int dir, uint64_t fill,
+                   uint64_t *p, uint64_t *t)
+{
+  memcpy(p, s, (size_t)nw * sizeof(uint64_t));
+  for (int i = 0; i < nw; i++)
+    d[i] = fill;
+  int off = 0;
+  for (int k = 1; n > 0; k *= 2)
+  {
+    if (n & 1)
+    {
+      shiftBits(t, p, nw, dir * off, fill);
+      for (int i = 0; i < nw; i++)
+        d[i] = fill ? d[i] & t[i] : d[i] | t[i];
+      off += k;
+    }
+    n >>= 1;
+    if (n > 0)
+    {
+      shiftBits(t, p, nw, dir * k, fill);
+      for (int i = 0; i < nw; i++)
+        p[i] = fill ? p[i] & t[i] : p[i] | t[i];
+    }
+  }
+}
+
+// One-sided window along the columns of h rows of stride words:
+// d[y] = s[y] op s[y+dir] op ... op s[y+(n-1)*dir], rows beyond the mask
+// being the identity.  p is a scratch array as large as s.
+static void runCols(uint64_t *d, const uint64_t *s, int h, int stride, int n, int dir, int and,
+                    uint64_t *p)
+{
+  size_t size = (size_t)h * stride;
+  memcpy(d, s, size * sizeof(uint64_t));
+  memcpy(p, s, size * sizeof(uint64_t));
+  int off = 1; // d covers offsets [0, off)
+  n--;
+  for (int k = 1; n > 0; k *= 2)
+  {
+    if (n & 1)
+    {
+      // d[y] op= p[y + dir*off]
+      for (int y = 0; y < h; y++)
+      {
+        int z = y + dir * off;
+        if (z < 0 || z >= h)
+          continue;
+        uint64_t *dr = d + (size_t)y * stride;
+        const uint64_t *pr = p + (size_t)z * stride;
+        for (int i = 0; i < stride; i++)
+          dr[i] = and ? dr[i] & pr[i] : dr[i] | pr[i];
+      }
+      off += k;
+    }
+    n >>= 1;
+    if (n > 0)
+    {
+      // p[y] op= p[y + dir*k], in the order that reads rows not yet updated
+      for (int j = 0; j < h; j++)
+      {
+        int y = dir > 0 ? j : h - 1 - j;
+        int z = y + dir * k;
+        if (z < 0 || z >= h)
+          continue;
+        uint64_t *pr = p + (size_t)y * stride;
+        const uint64_t *zr = p + (size_t)z * stride;
+        for (int i = 0; i < stride; i++)
+          pr[i] = and ? pr[i] & zr[i] : pr[i] | zr[i];
+      }
+    }
+  }
+}
+
+// Erode (and nonzero) or dilate m with a (2dx+1)x(2dy+1) rectangle.
+static int maskMorph(Mask m, int dx, int dy, int and)
+{
+  assert(m != NULL);
+  assert(dx >= 0 && dy >= 0);
+  if (nwords(m) == 0)
+    return 1;
+
+  InstrBegin(and ? "MaskErode" : "MaskDilate");
+  size_t size = nwords(m);
+  int nw = m->stride;
+  uint64_t *a = malloc(size * sizeof(uint64_t));
+  uint64_t *b = malloc(size * sizeof(uint64_t));
+  uint64_t *c = malloc(size * sizeof(uint64_t));
+  uint64_t *rows = malloc(4 * (size_t)nw * sizeof(uint64_t));
+  if (a == NULL || b == NULL || c == NULL || rows == NULL)
+  {
+    free(a);
+    free(b);
+    free(c);
+    free(rows);
+    errCause = "Memory allocation failed";
+    InstrEnd(0);
+    return 0;
+  }
+  uint64_t fill = and ? ~(uint64_t)0 : 0;
+  uint64_t last = lastBits(m);
+  // Rows into a
+  uint64_t *src = rows, *back = rows + nw, *p = rows + 2 * nw, *t = rows + 3 * nw;
+  for (int y = 0; y < m->height; y++)
+  {
+    uint64_t *r = m->bits + (size_t)y * nw, *d = a + (size_t)y * nw;
+    if (dx == 0)
+    {
+      memcpy(d, r, (size_t)nw * sizeof(uint64_t));
+      continue;
+    }
+    memcpy(src, r, (size_t)nw * sizeof(uint64_t));
+    src[nw - 1] |= fill & ~last;
+    runRow(d, src, nw, dx + 1, 1, fill, p, t);
+    runRow(back, src, nw, dx + 1, -1, fill, p, t);
+    for (int i = 0; i < nw; i++)
+      d[i] = and ? d[i] & back[i] : d[i] | back[i];
+    d[nw - 1] &= last;
+  }
+  // Columns into m
+  if (dy == 0)
+    memcpy(m->bits, a, size * sizeof(uint64_t));
+  else
+  {
+    runCols(b, a, m->height, nw, dy + 1, 1, and, c);
+    runCols(m->bits, a, m->height, nw, dy + 1, -1, and, c);
+    for (size_t i = 0; i < size; i++)
+      m->bits[i] = and ? m->bits[i] & b[i] : m->bits[i] | b[i];
+  }
+  free(a);
+  free(b);
+  free(c);
+  free(rows);
+  InstrEnd(2ul * size * sizeof(uint64_t));
+  return 1;
+}
+
+/// Erode mask m with a (2dx+1)x(2dy+1) rectangle (see image8bit.h).
+int MaskErode(Mask m, int dx, int dy)
+{ ///
+  return maskMorph(m, dx, dy, 1);
+}
+
+/// Dilate mask m with a (2dx+1)x(2dy+1) rectangle (see image8bit.h).
+int MaskDilate(Mask m, int dx, int dy)
+{ ///
+  return maskMorph(m, dx, dy, 0);
+}
+
+/// Run-length encoded images
+
+// An RLE image stores each row as a list of runs of equal levels.  Runs
+// never cross rows, and adjacent runs of a row always have different
+// levels (the canonical form): operations that could make two neighbours
+// equal merge them.  Run k of row y covers x from run[k].x up to the start
+// of run k+1, or the end of the row.
+struct run
+{
+  int x;        // first column of the run
+  uint16 level; // level of all its pixels
+};
+
+struct rleimage
+{
+  int width;
+  int height;
+  uint16 maxval;
+  size_t nruns;    // runs in use
+  size_t capacity; // runs allocated
+  struct run *run; // all runs, row after row
+  size_t *row;     // height+1 entries: row y has runs row[y] .. row[y+1]-1
+};
+
+// Create an RLE image with no runs, and room for capacity runs.
+static RLEImage rleAlloc(int width, int height, uint16 maxval, size_t capacity)
+{
+  RLEImage r = malloc(sizeof(struct rleimage));
+  if (r == NULL)
+  {
+    errCause = "Memory allocation failed";
+    return NULL;
+  }
+  r->width = width;
+  r->height = height;
+  r->maxval = maxval;
+  r->nruns = 0;
+  r->capacity = capacity > 0 ? capacity : 1;
+  r->run = malloc(r->capacity * sizeof(struct run));
+  r->row = calloc((size_t)height + 1, sizeof(size_t));
+  if (r->run == NULL || r->row == NULL)
+  {
+    RLEDestroy(&r);
+    errCause = "Memory allocation failed";
+    return NULL;
+  }
+  return r;
+}
+
+// Append a run at column x to the row started at run index start.
+// A run of the same level as the previous one in the row extends it.
+// Returns 0 (and sets errCause) if memory runs out.
+static int rlePush(RLEImage r, size_t start, int x, uint16 level)
+{
+  if (r->nruns > start && r->run[r->nruns - 1].level == level)
+    return 1;
+  if (r->nruns == r->capacity)
+  {
+    struct run *p = realloc(r->run, 2 * r->capacity * sizeof(struct run));
+    if (p == NULL)
+    {
+      errCause = "Memory allocation failed";
+      return 0;
+    }
+    r->run = p;
+    r->capacity *= 2;
+  }
+  r->run[r->nruns].x = x;
+  r->run[r->nruns].level = level;
+  r->nruns++;
+  return 1;
+}
+
+// Column just after run k of row y
+static inline int runEnd(RLEImage r, int y, size_t k)
+{
+  return k + 1 < r->row[y + 1] ? r->run[k + 1].x : r->width;
+}
+
+// Index of the run of row y that covers column x (binary search).
+static size_t findRun(RLEImage r, int y, int x)
+{
+  size_t lo = r->row[y], hi = r->row[y + 1] - 1;
+  while (lo < hi)
+  {
+    size_t mid = lo + (hi - lo + 1) / 2;
+    if (r->run[mid].x <= x)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return lo;
+}
+
+// Merge adjacent runs of equal levels, restoring the canonical form.
+static void rleCompact(RLEImage r)
+{
+  size_t out = 0;
+  for (int y = 0; y < r->height; y++)
+  {
+    size_t begin = r->row[y], end = r->row[y + 1];
+    r->row[y] = out;
+    for (size_t k = begin; k < end; k++)
+      if (out == r->row[y] || r->run[out - 1].level != r->run[k].level)
+        r->run[out++] = r->run[k];
+  }
+  r->row[r->height] = out;
+  r->nruns = out;
+}
+
+// Bytes of the runs of r, for instrumentation
+static inline unsigned long rleBytes(RLEImage r)
+{
+  return (unsigned long)(r->nruns * sizeof(struct run));
+}
+
+/// Encode an image into runs (see image8bit.h).
+RLEImage RLEFromImage(Image img)
+{ ///
+  assert(img != NULL);
+  InstrBegin("RLEFromImage");
+  RLEImage r = rleAlloc(img->width, img->height, img->maxval, 2 * (size_t)img->height);
+  for (int y = 0; r != NULL && y < img->height; y++)
+  {
+    size_t start = r->row[y] = r->nruns;
+    for (int x = 0; x < img->width;)
+    {
+      int n;
+      const char *p = pixelRun(img, x, y, &n);
+      for (int i = 0; i < n;)
+      {
+        const void *q = p + (size_t)i * img->depth;
+        uint16 v = img->depth == 1 ? *(const uint8 *)q : *(const uint16 *)q;
+        int len = DISPATCH(img, runLength, q, n - i, v);
+        if (!rlePush(r, start, x + i, v))
+        {
+          RLEDestroy(&r);
+          break;
+        }
+        i += len;
+      }
+      if (r == NULL)
+        break;
+      x += n;
+    }
+  }
+  if (r != NULL)
+    r->row[r->height] = r->nruns;
+  InstrAdd(PIXMEM_COUNTER, (unsigned long)npixels(img)); // count pixel memory accesses
+  InstrEnd(r != NULL ? nbytes(img) + rleBytes(r) : 0);
+  return r;
+}
+
+/// Decode an RLE image into a new image (see image8bit.h).
+Image RLEToImage(RLEImage r)
+{ ///
+  assert(r != NULL);
+  InstrBegin("RLEToImage");
+  Image img = ImageCreate(r->width, r->height, r->maxval);
+  if (img == NULL)
+  {
+    InstrEnd(0);
+    return NULL;
+  }
+  for (int y = 0; y < r->height; y++)
+    for (size_t k = r->row[y]; k < r->row[y + 1]; k++)
+    {
+      size_t i = (size_t)y * r->width + r->run[k].x;
+      int n = runEnd(r, y, k) - r->run[k].x;
+      if (img->depth == 1)
+        memset(PIX8(img) + i, r->run[k].level, (size_t)n);
+      else
+        for (int j = 0; j < n; j++)
+          PIX16(img)[i + j] = r->run[k].level;
+    }
+  InstrAdd(PIXMEM_COUNTER, (unsigned long)npixels(img)); // count pixel memory accesses
+  InstrEnd(rleBytes(r) + nbytes(img));
+  return img;
+}
+
+/// Destroy the RLE image pointed to by (*rp).
+void RLEDestroy(RLEImage *rp)
+{ ///
+  assert(rp != NULL);
+  if (*rp != NULL)
+  {
+    free((*rp)->run);
+    free((*rp)->row);
+    free(*rp);
+    *rp = NULL;
+  }
+}
+
+/// Get RLE image width
+int RLEWidth(RLEImage r)
+{ ///
+  assert(r != NULL);
+  return r->width;
+}
+
+/// Get RLE image height
+int RLEHeight(RLEImage r)
+{ ///
+  assert(r != NULL);
+  return r->height;
+}
+
+/// Get RLE image maximum gray level
+int RLEMaxval(RLEImage r)
+{ ///
+  assert(r != NULL);
+  return r->maxval;
+}
+
+/// Get the number of runs of r
+unsigned long RLERuns(RLEImage r)
+{ ///
+  assert(r != NULL);
+  return (unsigned long)r->nruns;
+}
+
+/// Negate every run of r (see ImageNegative).
+void RLENegative(RLEImage r)
+{ ///
+  assert(r != NULL);
+  InstrBegin("RLENegative");
+  // A bijection: neighbours stay different
+  for (size_t k = 0; k < r->nruns; k++)
+    r->run[k].level = (uint16)(r->maxval - r->run[k].level);
+  InstrEnd(2ul * rleBytes(r));
+}
+
+/// Threshold every run of r (see ImageThreshold).
+void RLEThreshold(RLEImage r, uint16 thr)
+{ ///
+  assert(r != NULL);
+  InstrBegin("RLEThreshold");
+  unsigned long bytes = 2ul * rleBytes(r); // before compaction
+  (void)bytes; // only used by InstrEnd, which NINSTR removes
+  for (size_t k = 0; k < r->nruns; k++)
+    r->run[k].level = r->run[k].level < thr ? 0 : r->maxval;
+  rleCompact(r);
+  InstrEnd(bytes);
+}
+
+/// Apply a look-up table to every run of r (see ImageApplyLUT).
+void RLEApplyLUT(RLEImage r, const uint16 *lut)
+{ ///
+  assert(r != NULL);
+  assert(lut != NULL);
+  InstrBegin("RLEApplyLUT");
+  unsigned long bytes = 2ul * rleBytes(r); // before compaction
+  (void)bytes; // only used by InstrEnd, which NINSTR removes
+  for (size_t k = 0; k < r->nruns; k++)
+  {
+    assert(lut[r->run[k].level] <= r->maxval);
+    r->run[k].level = lut[r->run[k].level];
+  }
+  rleCompact(r);
+  InstrEnd(bytes);
+}
+
+/// Mirror an RLE image (see ImageMirror).
+RLEImage RLEMirror(RLEImage r)
+{ ///
+  assert(r != NULL);
+  InstrBegin("RLEMirror");
+  RLEImage m = rleAlloc(r->width, r->height, r->maxval, r->nruns);
+  if (m == NULL)
+  {
+    InstrEnd(0);
+    return NULL;
+  }
+  // Runs of each row in reverse order, each starting where it ended
+  for (int y = 0; y < r->height; y++)
+  {
+    m->row[y] = m->nruns;
+    for (size_t k = r->row[y + 1]; k-- > r->row[y];)
+    {
+      m->run[m->nruns].x = r->width - runEnd(r, y, k);
+      m->run[m->nruns].level = r->run[k].level;
+      m->nruns++;
+    }
+  }
+  m->row[m->height] = m->nruns;
+  InstrEnd(2ul * rleBytes(r));
+  return m;
+}
+
+/// Crop a rectangle of an RLE image (see ImageCrop).
+RLEImage RLECrop(RLEImage r, int x, int y, int w, int h)
+{ ///
+  assert(r != NULL);
+  assert(0 <= x && 0 <= w && x + w <= r->width);
+  assert(0 <= y && 0 <= h && y + h <= r->height);
+  InstrBegin("RLECrop");
+  RLEImage c = rleAlloc(w, h, r->maxval, 2 * (size_t)h);
+  for (int j = 0; c != NULL && j < h; j++)
+  {
+    size_t start = c->row[j] = c->nruns;
+    if (w == 0)
+      continue;
+    for (size_t k = findRun(r, y + j, x); k < r->row[y + j + 1] && r->run[k].x < x + w; k++)
+      if (!rlePush(c, start, r->run[k].x > x ? r->run[k].x - x : 0, r->run[k].level))
+      {
+        RLEDestroy(&c);
+        break;
+      }
+  }
+  if (c != NULL)
+    c->row[h] = c->nruns;
+  InstrEnd(c != NULL ? 2ul * rleBytes(c) : 0);
+  return c;
+}
+
+// Does r2 match r1 at position (x, y)?  Compares rows run by run: in the
+// canonical form, every run of r2 but the first and last of a row must
+// coincide with a run of r1, and those two must lie inside one.
+// Adds the number of runs compared to *compared.
+static int rleMatch(RLEImage r1, int x, int y, RLEImage r2, unsigned long *compared)
+{
+  for (int j = 0; j < r2->height; j++)
+  {
+    size_t k = findRun(r1, y + j, x);
+    size_t last = r2->row[j + 1] - 1;
+    for (size_t i = r2->row[j]; i <= last; i++, k++)
+    {
+      int end = x + runEnd(r2, j, i), end1 = runEnd(r1, y + j, k);
+      (*compared)++;
+      if (r1->run[k].level != r2->run[i].level || end1 < end || (i < last && end1 != end))
+        return 0;
+    }
+  }
+  return 1;
+}
+
+/// Locate an RLE subimage inside another RLE image (see image8bit.h).
+int RLELocateSubImage(RLEImage r1, int *px, int *py, RLEImage r2)
+{ ///
+  assert(r1 != NULL);
+  assert(r2 != NULL);
+  int w2 = r2->width, h2 = r2->height;
+  if (w2 > r1->width || h2 > r1->height || w2 == 0 || h2 == 0)
+    return 0;
+
+  InstrBegin("RLELocateSubImage");
+  // Candidates come from the first run of r2, of level a and length n:
+  // its left end may be anywhere inside an r1 run of level a if it spans
+  // the whole row of r2; otherwise r1 must change level right after it,
+  // at the end of a run.  So each run of r1 gives at most one candidate,
+  // and they come in raster order.
+  uint16 a = r2->run[0].level;
+  int n = runEnd(r2, 0, 0);
+  unsigned long compared = 0;
+  int found = 0;
+  for (int y = 0; !found && y <= r1->height - h2; y++)
+    for (size_t k = r1->row[y]; !found && k < r1->row[y + 1]; k++)
+    {
+      compared++;
+      int s = r1->run[k].x, e = runEnd(r1, y, k);
+      if (r1->run[k].level != a || e - s < n)
+        continue;
+      int first = n == w2 ? s : e - n;
+      int last = n == w2 ? e - w2 : e - n;
+      if (last > r1->width - w2)
+        last = r1->width - w2;
+      for (int x = first; x <= last; x++)
+        if (rleMatch(r1, x, y, r2, &compared))
+        {
+          *px = x;
+          *py = y;
+          found = 1;
+          break;
+        }
+    }
+  InstrEnd(compared * sizeof(struct run));
+  return found;
+}
+
+// RLE files have a PGM-like header, with magic number R5:
+//   R5 width height maxval
+// followed by the runs, in raster order, each one as its length in base
+// 128 (7 bits per byte, least significant first, with the top bit set on
+// all bytes but the last), then its level as in a PGM sample (1 byte, or
+// 2 big-endian bytes if maxval > 255).  Runs do not cross rows.
+
+// Write the runs of r to f.
+static int writeRuns(RLEImage r, FILE *f)
+{
+  for (int y = 0; y < r->height; y++)
+    for (size_t k = r->row[y]; k < r->row[y + 1]; k++)
+    {
+      unsigned int n = (unsigned int)(runEnd(r, y, k) - r->run[k].x);
+      for (; n >= 0x80; n >>= 7)
+        putc((int)(n & 0x7F) | 0x80, f);
+      putc((int)n, f);
+      if (r->maxval > PixMax)
+        putc(r->run[k].level >> 8, f);
+      putc(r->run[k].level & 0xFF, f);
+    }
+  return !ferror(f);
+}
+
+// Read the runs of r from f.
+static int readRuns(RLEImage r, FILE *f)
+{
+  for (int y = 0; y < r->height; y++)
+  {
+    size_t start = r->row[y] = r->nruns;
+    for (int x = 0; x < r->width;)
+    {
+      unsigned int n = 0;
+      int c, shift = 0;
+      do
+      {
+        c = getc(f);
+        if (!check(c != EOF && shift < 32, "Reading runs"))
+          return 0;
+        n |= (unsigned int)(c & 0x7F) << shift;
+        shift += 7;
+      } while (c & 0x80);
+      int level = getc(f);
+      if (r->maxval > PixMax && level != EOF)
+      {
+        c = getc(f);
+        level = c != EOF ? level << 8 | c : EOF;
+      }
+      if (!check(level != EOF, "Reading runs") ||
+          !check(0 < n && n <= (unsigned int)(r->width - x) && level <= r->maxval, "Invalid run") ||
+          !rlePush(r, start, x, (uint16)level))
+        return 0;
+      x += (int)n;
+    }
+  }
+  r->row[r->height] = r->nruns;
+  return 1;
+}
+
+/// Load an RLE file (see image8bit.h).
+RLEImage RLELoad(const char *filename)
+{ ///
+  int w, h;
+  int maxval;
+  char c;
+  FILE *f = NULL;
+  RLEImage r = NULL;
+  InstrBegin("RLELoad");
+
+  int success =
+      check((f = fopen(filename, "rb")) != NULL, "Open failed") &&
+      // Parse header
+      check(fscanf(f, "R%c ", &c) == 1 && c == '5', "Invalid file format") &&
+      check(fscanf(f, "%d ", &w) == 1 && w >= 0, "Invalid width") &&
+      check(fscanf(f, "%d ", &h) == 1 && h >= 0, "Invalid height") &&
+      check(fscanf(f, "%d", &maxval) == 1 && 0 < maxval && maxval <= (int)PixMax16, "Invalid maxval") &&
+      check(fscanf(f, "%c", &c) == 1 && isspace(c), "Whitespace expected") &&
+      // Allocate and read runs
+      (r = rleAlloc(w, h, (uint16)maxval, 2 * (size_t)h)) != NULL &&
+      readRuns(r, f);
+
+  // Cleanup
+  if (!success)
+  {
+    int errsave = errno;
+    RLEDestroy(&r);
+    errno = errsave;
+  }
+  if (f != NULL)
+    fclose(f);
+  InstrEnd(r != NULL ? rleBytes(r) : 0);
+  return r;
+}
+
+/// Save an RLE image to a file (see image8bit.h).
+int RLESave(RLEImage r, const char *filename)
+{ ///
+  assert(r != NULL);
+  FILE *f = NULL;
+  InstrBegin("RLESave");
+
+  int success =
+      check((f = fopen(filename, "wb")) != NULL, "Open failed") &&
+      check(fprintf(f, "R5\n%d %d\n%d\n", r->width, r->height, r->maxval) > 0, "Writing header failed") &&
+      check(writeRuns(r, f), "Writing runs failed");
+
+  // Cleanup
+  if (f != NULL)
+    fclose(f);
+  InstrEnd(rleBytes(r));
+  return success;
+}
+
+/// Connected components
+
+struct labels
+{
+  int width;
+  int height;
+  int count;           // number of components
+  uint32_t *label;     // width x height labels, in raster order
+  LabelStats *stats;   // stats[k-1] describes component k
+};
+
+// Rows of the image labeled by each parallel task
+#define LABELROWS 64
+
+// Parameters of a parallel labeling.
+// Band t labels its rows with provisional labels from t*LABELROWS*width+1
+// on, which cannot run into those of the next band.
+struct labelJob
+{
+  Image img;      // raster image
+  int conn8;
+  uint32_t *label;
+  uint32_t *parent;
+  uint32_t *next; // next provisional label of each band
+};
+
+static void labelBandTask(void *arg, int task)
+{
+  struct labelJob *job = (struct labelJob *)arg;
+  Image img = job->img;
+  int y0 = task * LABELROWS;
+  int y1 = y0 + LABELROWS < img->height ? y0 + LABELROWS : img->height;
+  job->next[task] = (uint32_t)((size_t)y0 * img->width + 1);
+  DISPATCH(img, labelRows, img->pixel, img->width, y0, y1, job->conn8, job->label, job->parent,
+           &job->next[task]);
+}
+
+static void relabelBandTask(void *arg, int task)
+{
+  struct labelJob *job = (struct labelJob *)arg;
+  Image img = job->img;
+  int y0 = task * LABELROWS;
+  int y1 = y0 + LABELROWS < img->height ? y0 + LABELROWS : img->height;
+  uint32_t *l = job->label + (size_t)y0 * img->width;
+  for (size_t i = 0; i < (size_t)(y1 - y0) * img->width; i++)
+    l[i] = job->parent[l[i]];
+}
+
+// Link the first row y of a band to the row above, from the other band.
+static void labelMerge(uint32_t *label, uint32_t *parent, int w, int y, int conn8)
+{
+  const uint32_t *up = label + (size_t)(y - 1) * w, *lab = label + (size_t)y * w;
+  for (int x = 0; x < w; x++)
+  {
+    if (lab[x] == 0)
+      continue;
+    for (int i = conn8 ? -1 : 0; i <= (conn8 ? 1 : 0); i++)
+      if (x + i >= 0 && x + i < w && up[x + i] != 0)
+        ufUnion(parent, lab[x], up[x + i]);
+  }
+}
+
+// Fill the stats of the count components of l, in one pass over the
+// labels, a run of equal labels at a time.  Sums of coordinates are exact
+// in doubles up to 2^53.
+static void labelStats(Labels l)
+{
+  for (int k = 0; k < l->count; k++)
+  {
+    LabelStats *s = &l->stats[k];
+    s->area = 0;
+    s->x = l->width;
+    s->y = l->height;
+    s->w = s->h = 0;
+    s->cx = s->cy = 0.0;
+  }
+  for (int y = 0; y < l->height; y++)
+  {
+    const uint32_t *row = l->label + (size_t)y * l->width;
+    for (int x = 0; x < l->width;)
+    {
+      // A run of equal labels, [x0, x)
+      int x0 = x;
+      uint32_t k = row[x];
+      while (x < l->width && row[x] == k)
+        x++;
+      if (k == 0)
+        continue;
+      LabelStats *s = &l->stats[k - 1];
+      unsigned long n = (unsigned long)(x - x0);
+      s->area += n;
+      if (x0 < s->x)
+        s->x = x0;
+      if (s->y > y)
+        s->y = y;
+      if (x > s->w) // w holds the largest x + 1 until the end
+        s->w = x;
+      s->h = y + 1; // rows come in order
+      s->cx += (double)(n * (unsigned long)(x0 + x - 1) / 2);
+      s->cy += (double)(n * (unsigned long)y);
+    }
+  }
+  for (int k = 0; k < l->count; k++)
+  {
+    LabelStats *s = &l->stats[k];
+    s->w -= s->x;
+    s->h -= s->y;
+    s->cx /= (double)s->area;
+    s->cy /= (double)s->area;
+  }
+}
+/// Label the connected components of an image (see image8bit.h).
+Labels ImageLabel(Image img, int connectivity)
+{ ///
+  assert(img != NULL);
+  assert(connectivity == 4 || connectivity == 8);
+  assert(npixels(img) < UINT32_MAX);
+  InstrBegin("ImageLabel");
+  int w = img->width, h = img->height;
+  size_t n = npixels(img);
+  int nbands = (h + LABELROWS - 1) / LABELROWS;
+  Image src = img->layout == IMAGE_LAYOUT_RASTER ? img : rasterCopy(img);
+  Labels l = malloc(sizeof(struct labels));
+  uint32_t *parent = malloc((n + 1) * sizeof(uint32_t));
+  uint32_t *next = malloc((size_t)(nbands > 0 ? nbands : 1) * sizeof(uint32_t));
+  if (l != NULL)
+  {
+    l->label = malloc((n > 0 ? n : 1) * sizeof(uint32_t));
+    l->stats = NULL;
+  }
+  if (src == NULL || l == NULL || l->label == NULL || parent == NULL || next == NULL)
+  {
+    if (l != NULL)
+      LabelsDestroy(&l);
+    free(parent);
+    free(next);
+    if (src != img)
+      ImageDestroy(&src);
+    errCause = "Memory allocation failed";
+    InstrEnd(0);
+    return NULL;
+  }
+  l->width = w;
+  l->height = h;
+  l->count = 0;
+
+  // Label bands in parallel, then link each band to the one above
+  struct labelJob job = {src, connectivity == 8, l->label, parent, next};
+  parent[0] = 0; // background
+  parallelFor(nbands, labelBandTask, &job);
+  for (int t = 1; t < nbands; t++)
+    labelMerge(l->label, parent, w, t * LABELROWS, job.conn8);
+
+  // Number the roots in ascending order: a root is the first label of its
+  // component in raster order, so components are numbered in the order of
+  // their first pixel.  Other labels take the number of their parent,
+  // which is smaller and so already numbered.
+  uint32_t count = 0;
+  for (int t = 0; t < nbands; t++)
+    for (uint32_t i = (uint32_t)((size_t)t * LABELROWS * w + 1); i < next[t]; i++)
+      parent[i] = parent[i] == i ? ++count : parent[parent[i]];
+  l->count = (int)count;
+  parallelFor(nbands, relabelBandTask, &job);
+  InstrAdd(PIXMEM_COUNTER, (unsigned long)n); // count pixel memory accesses
+
+  free(parent);
+  free(next);
+  if (src != img)
+    ImageDestroy(&src);
+  l->stats = malloc((count > 0 ? count : 1) * sizeof(LabelStats));
+  if (l->stats == NULL)
+  {
+    LabelsDestroy(&l);
+    errCause = "Memory allocation failed";
+    InstrEnd(0);
+    return NULL;
+  }
+  labelStats(l);
+  InstrEnd(nbytes(img) + 3 * n * sizeof(uint32_t));
+  return l;
+}
+
+/// Destroy the labels pointed to by (*lp).
+void LabelsDestroy(Labels *lp)
+{ ///
+  assert(lp != NULL);
+  if (*lp != NULL)
+  {
+    free((*lp)->label);
+    free((*lp)->stats);
+    free(*lp);
+    *lp = NULL;
+  }
+}
+
+/// Number of components
+int LabelsCount(Labels l)
+{ ///
+  assert(l != NULL);
+  return l->count;
+}
+
+/// Label of pixel (x,y)
+uint32_t LabelsGet(Labels l, int x, int y)
+{ ///
+  assert(l != NULL);
+  assert(0 <= x && x < l->width && 0 <= y && y < l->height);
+  return l->label[(size_t)y * l->width + x];
+}
+
+/// All labels, row by row
+const uint32_t *LabelsData(Labels l)
+{ ///
+  assert(l != NULL);
+  return l->label;
+}
+
+/// Stats of component k
+const LabelStats *LabelsStats(Labels l, int k)
+{ ///
+  assert(l != NULL);
+  assert(1 <= k && k <= l->count);
+  return &l->stats[k - 1];
+}
+
+/// Deferred evaluation
+
+// A lazy image is a node in a graph of operations whose leaves are
+// ordinary images.  Nothing is computed until LazyEvaluate is called.
+// Then, the result is computed tile by tile: each output tile is pulled
+// through the whole graph (asking each node only for the rectangle it
+// needs) before the next tile starts, so the working set is a few tiles
+// instead of a few full images.  Tiles are evaluated in parallel.
+//
+// Nodes are reference counted: operations take a reference to their
+// inputs, so a node may be destroyed by its creator as soon as it has been
+// used as input of another operation.
+
+// Tile side, chosen so that a few tile buffers fit in a typical L2 cache.
+#ifndef LAZYTILE
+#define LAZYTILE 256
+#endif
+
+enum lazyKind
+{
+  LAZY_SOURCE,
+  LAZY_NEGATIVE,
+  LAZY_THRESHOLD,
+  LAZY_LUT,
+  LAZY_BLUR,
+  LAZY_BLEND
+};
+
+// Internal structure for lazy image nodes
+struct lazyimage
+{
+  enum lazyKind kind;
+  int refs;           // number of references to this node
+  int width;          // all nodes have the dimensions,
+  int height;         // maxval and depth of their first input
+  int maxval;
+  int depth;
+  Image img;          // LAZY_SOURCE: the image (not owned)
+  LazyImage a;        // first input
+  LazyImage b;        // LAZY_BLEND: image blended into a
+  int x, y;           // LAZY_BLEND: position; LAZY_BLUR: dx, dy
+  double alpha;       // LAZY_BLEND: alpha
+  uint16 thr;         // LAZY_THRESHOLD: threshold
+  void *lut;          // LAZY_LUT: table covering all levels
+};
+
+// Rectangle of pixels
+typedef struct
+{
+  int x, y, w, h;
+} Rect;
+
+// Allocate a node of the given kind, with the attributes of input a
+// (or of img, for sources).
+static LazyImage lazyNode(enum lazyKind kind, LazyImage a)
+{
+  LazyImage node = (LazyImage)calloc(1, sizeof(struct lazyimage));
+  if (node == NULL)
+  {
+    errCause = "Memory allocation failed";
+    return NULL;
+  }
+  node->kind = kind;
+  node->refs = 1;
+  if (a != NULL)
+  {
+    node->width = a->width;
+    node->height = a->height;
+    node->maxval = a->maxval;
+    node->depth = a->depth;
+    node->a = a;
+    a->refs++;
+  }
+  return node;
+}
+
+/// Create a lazy image that reads pixels from img.
+/// img is not copied: it must not be modified or destroyed while the
+/// lazy image is in use.
+/// On success, a new lazy image is returned.
+/// (The caller is responsible for destroying the returned lazy image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+LazyImage LazySource(Image img)
+{ ///
+  assert(img != NULL);
+  LazyImage node = lazyNode(LAZY_SOURCE, NULL);
+  if (node == NULL)
+    return NULL;
+  node->img = img;
+  node->width = img->width;
+  node->height = img->height;
+  node->maxval = img->maxval;
+  node->depth = img->depth;
+  return node;
+}
+
+/// Lazy version of ImageNegative.
+/// Returns a new lazy image, or NULL on failure (as in LazySource).
+LazyImage LazyNegative(LazyImage a)
+{ ///
+  assert(a != NULL);
+  return lazyNode(LAZY_NEGATIVE, a);
+}
+
+/// Lazy version of ImageThreshold.
+/// Returns a new lazy image, or NULL on failure (as in LazySource).
+LazyImage LazyThreshold(LazyImage a, uint16 thr)
+{ ///
+  assert(a != NULL);
+  LazyImage node = lazyNode(LAZY_THRESHOLD, a);
+  if (node != NULL)
+    node->thr = thr;
+  return node;
+}
+
+/// Lazy version of ImageBrighten.
+/// Returns a new lazy image, or NULL on failure (as in LazySource).
+LazyImage LazyBrighten(LazyImage a, double factor)
+{ ///
+  assert(a != NULL);
+  assert(factor >= 0.0);
+  LazyImage node = lazyNode(LAZY_LUT, a);
+  if (node == NULL)
+    return NULL;
+  // Precompute the level map once, as ImageBrighten does
+  size_t lutSize = (size_t)1 << (8 * a->depth);
+  node->lut = malloc(lutSize * (size_t)a->depth);
+  if (node->lut == NULL)
+  {
+    errCause = "Memory allocation failed";
+    LazyDestroy(&node);
+    return NULL;
+  }
+  for (size_t v = 0; v < lutSize; v++)
+  {
+    double nv = v * factor + 0.5;
+    int level = nv >= a->maxval ? a->maxval : (int)nv;
+    if (a->depth == 1)
+      ((uint8 *)node->lut)[v] = (uint8)level;
+    else
+      ((uint16 *)node->lut)[v] = (uint16)level;
+  }
+  return node;
+}
+
+/// Lazy version of ImageBlur.
+/// Each tile is computed from a tile of a extended by a (dx, dy) halo.
+/// Returns a new lazy image, or NULL on failure (as in LazySource).
+LazyImage LazyBlur(LazyImage a, int dx, int dy)
+{ ///
+  assert(a != NULL);
+  assert(dx >= 0 && dy >= 0);
+  LazyImage node = lazyNode(LAZY_BLUR, a);
+  if (node != NULL)
+  {
+    node->x = dx;
+    node->y = dy;
+  }
+  return node;
+}
+
+/// Lazy version of ImageBlend: blend b into position (x, y) of a.
+/// Requires: b must fit inside a at position (x, y),
+/// and both must have the same depth.
+/// Returns a new lazy image, or NULL on failure (as in LazySource).
+LazyImage LazyBlend(LazyImage a, int x, int y, LazyImage b, double alpha)
+{ ///
+  assert(a != NULL);
+  assert(b != NULL);
+  assert(0 <= x && 0 <= y && x + b->width <= a->width && y + b->height <= a->height);
+  assert(a->depth == b->depth);
+  LazyImage node = lazyNode(LAZY_BLEND, a);
+  if (node != NULL)
+  {
+    node->b = b;
+    b->refs++;
+    node->x = x;
+    node->y = y;
+    node->alpha = alpha;
+  }
+  return node;
+}
+
+/// Destroy the lazy image pointed to by (*lazyp).
+/// Nodes still used as inputs of other lazy images are kept until those
+/// are destroyed too.
+/// If (*lazyp)==NULL, no operation is performed.
+/// Ensures: (*lazyp)==NULL.
+void LazyDestroy(LazyImage *lazyp)
+{ ///
+  assert(lazyp != NULL);
+  LazyImage node = *lazyp;
+  *lazyp = NULL;
+  if (node == NULL || --node->refs > 0)
+    return;
+  LazyDestroy(&node->a);
+  LazyDestroy(&node->b);
+  free(node->lut);
+  free(node);
+}
+
+// Compute rectangle r of lazy image node into a new buffer of r.w*r.h
+// pixels, and add the number of pixel accesses to *accesses.
+// Requires: r inside node.
+// Returns NULL if out of memory.
+static void *lazyRect(LazyImage node, Rect r, unsigned long *accesses)
+{
+  size_t d = (size_t)node->depth;
+  size_t n = (size_t)r.w * (size_t)r.h;
+  void *buf = NULL;
+  switch (node->kind)
+  {
+  case LAZY_SOURCE:
+  {
+    buf = malloc(n * d);
+    if (buf == NULL)
+      return NULL;
+    struct image b = rasterHeader(node->img, r.w, r.h, buf);
+    copyPixels(&b, 0, 0, node->img, r.x, r.y, r.w, r.h);
+    *accesses += 2ul * n;
+    break;
+  }
+  case LAZY_NEGATIVE:
+    buf = lazyRect(node->a, r, accesses);
+    if (buf != NULL)
+      DISPATCH(node, negative, buf, n, node->maxval);
+    *accesses += 2ul * n;
+    break;
+  case LAZY_THRESHOLD:
+    buf = lazyRect(node->a, r, accesses);
+    if (buf != NULL)
+      DISPATCH(node, threshold, buf, n, node->thr, node->maxval);
+    *accesses += 2ul * n;
+    break;
+  case LAZY_LUT:
+    buf = lazyRect(node->a, r, accesses);
+    if (buf != NULL)
+      DISPATCH(node, applyLUT, buf, n, node->lut);
+    *accesses += 2ul * n;
+    break;
+  case LAZY_BLUR:
+  {
+    // Extend r by the halo (clipped to the image), blur it, and keep r.
+    int dx = node->x, dy = node->y;
+    Rect e;
+    e.x = r.x - dx < 0 ? 0 : r.x - dx;
+    e.y = r.y - dy < 0 ? 0 : r.y - dy;
+    e.w = (r.x + r.w + dx > node->width ? node->width : r.x + r.w + dx) - e.x;
+    e.h = (r.y + r.h + dy > node->height ? node->height : r.y + r.h + dy) - e.y;
+    void *in = lazyRect(node->a, e, accesses);
+    void *out = malloc((size_t)e.w * (size_t)e.h * d);
+    uint64_t *colSum = malloc((size_t)e.w * sizeof(uint64_t));
+    uint64_t *rowSum = malloc(((size_t)e.w + 1) * sizeof(uint64_t));
+    buf = malloc(n * d);
+    if (in != NULL && out != NULL && colSum != NULL && rowSum != NULL && buf != NULL)
+    {
+      // Pixels of r have their whole (clipped) window inside e,
+      // so they are not affected by the borders of e.
+      DISPATCH(node, blur, in, e.w, e.h, dx, dy, 0, e.h, out, colSum, rowSum);
+      for (int i = 0; i < r.h; i++)
+        memcpy((char *)buf + (size_t)i * r.w * d,
+               (const char *)out + ((size_t)(r.y - e.y + i) * e.w + (r.x - e.x)) * d,
+               (size_t)r.w * d);
+      *accesses += 3ul * (unsigned long)e.w * (unsigned long)e.h + 2ul * n;
+    }
+    else
+    {
+      free(buf);
+      buf = NULL;
+    }
+    free(in);
+    free(out);
+    free(colSum);
+    free(rowSum);
+    break;
+  }
+  case LAZY_BLEND:
+  {
+    buf = lazyRect(node->a, r, accesses);
+    if (buf == NULL)
+      break;
+    // Part of r covered by b, in coordinates of b
+    int x0 = r.x > node->x ? r.x : node->x;
+    int y0 = r.y > node->y ? r.y : node->y;
+    int x1 = r.x + r.w < node->x + node->b->width ? r.x + r.w : node->x + node->b->width;
+    int y1 = r.y + r.h < node->y + node->b->height ? r.y + r.h : node->y + node->b->height;
+    if (x0 >= x1 || y0 >= y1)
+      break;
+    Rect rb = {x0 - node->x, y0 - node->y, x1 - x0, y1 - y0};
+    void *bbuf = lazyRect(node->b, rb, accesses);
+    if (bbuf == NULL)
+    {
+      free(buf);
+      return NULL;
+    }
+    size_t offset = (size_t)(y0 - r.y) * r.w + (x0 - r.x);
+    if (node->depth == 1)
+      blend8((uint8 *)buf + offset, r.w, bbuf, rb.w, rb.h, node->alpha, node->maxval);
+    else
+      blend16((uint16 *)buf + offset, r.w, bbuf, rb.w, rb.h, node->alpha, node->maxval);
+    *accesses += 3ul * (unsigned long)rb.w * (unsigned long)rb.h;
+    free(bbuf);
+    break;
+  }
+  }
+  return buf;
+}
+
+// Shared state of a LazyEvaluate
+struct lazyEval
+{
+  LazyImage node;
+  Image result;
+  int tilesX;              // number of tile columns
+  unsigned long accesses;  // pixel accesses (updated atomically)
+  int failed;              // set if some tile failed
+};
+
+// Compute one tile of the result.
+static void lazyTile(void *arg, int task)
+{
+  struct lazyEval *ev = (struct lazyEval *)arg;
+  Image res = ev->result;
+  Rect r;
+  r.x = (task % ev->tilesX) * LAZYTILE;
+  r.y = (task / ev->tilesX) * LAZYTILE;
+  r.w = r.x + LAZYTILE <= res->width ? LAZYTILE : res->width - r.x;
+  r.h = r.y + LAZYTILE <= res->height ? LAZYTILE : res->height - r.y;
+  unsigned long accesses = 0;
+  void *buf = lazyRect(ev->node, r, &accesses);
+  if (buf == NULL)
+  {
+    __atomic_store_n(&ev->failed, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  size_t d = (size_t)res->depth;
+  for (int i = 0; i < r.h; i++)
+    memcpy((char *)res->pixel + ((size_t)(r.y + i) * res->width + r.x) * d,
+           (const char *)buf + (size_t)i * r.w * d, (size_t)r.w * d);
+  free(buf);
+  __atomic_fetch_add(&ev->accesses, accesses + 2ul * (unsigned long)r.w * r.h, __ATOMIC_RELAXED);
+}
+
+/// Evaluate a lazy image.
+/// The result is computed in tiles of LAZYTILE x LAZYTILE pixels, in
+/// parallel (see ImageSetThreads), each tile going through all the
+/// operations before the next one starts.
+/// The source images are not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image LazyEvaluate(LazyImage node)
+{ ///
+  assert(node != NULL);
+  InstrBegin("LazyEvaluate");
+  Image result = ImageCreate(node->width, node->height, (uint16)node->maxval);
+  if (result == NULL)
+  {
+    InstrEnd(0);
+    return NULL;
+  }
+  struct lazyEval ev = {node, result, (node->width + LAZYTILE - 1) / LAZYTILE, 0, 0};
+  int tilesY = (node->height + LAZYTILE - 1) / LAZYTILE;
+  parallelFor(ev.tilesX * tilesY, lazyTile, &ev);
+  InstrAdd(PIXMEM_COUNTER, ev.accesses); // count pixel memory accesses
+  InstrEnd(ev.accesses * (unsigned long)node->depth);
+  if (ev.failed)
+  {
+    errCause = "Memory allocation failed";
+    ImageDestroy(&result);
+  }
+  return result;
+}
@@ -14,15 +14,34 @@
 
 #include <inttypes.h>
 
-// Type for pixel levels
+// Types for pixel levels
 typedef uint8_t uint8;
+typedef uint16_t uint16;
 
-// Maximum value you can store in a pixel (maximum maxval accepted)
+// Maximum value you can store in an 8-bit pixel
 extern const uint8 PixMax;
 
+// Maximum value you can store in a 16-bit pixel (maximum maxval accepted)
+extern const uint16 PixMax16;
+
 // Type Image is a pointer to image objects
 typedef struct image *Image;
 
+// Type LazyImage is a pointer to lazy image objects (see LazyEvaluate)
+typedef struct lazyimage *LazyImage;
+
+// Type Mask is a pointer to binary image objects (see ImageThresholdMask)
+typedef struct mask *Mask;
+
+// Type RLEImage is a pointer to run-length encoded images (see RLEFromImage)
+typedef struct rleimage *RLEImage;
+
+// Type Labels is a pointer to connected component labelings (see ImageLabel)
+typedef struct labels *Labels;
+
+// Type ImageIO is a pointer to pending file transfers (see ImageLoadAsync)
+typedef struct imageio *ImageIO;
+
 /// Error handling functions
 
 /// Error cause.
@@ -30,26 +49,51 @@ typedef struct image *Image;
 /// calling this function retrieves an appropriate message describing the
 /// failure cause.  This may be used together with global variable errno
 /// to produce informative error messages (using error(), for instance).
+/// The cause is that of the last failure in the calling thread.
 ///
 /// After a successful operation, the result is not garanteed (it might be
 /// the previous error cause).  It is not meant to be used in that situation!
 char* ImageErrMsg() ;
 
+/// Diagnostics
+
+/// A diagnostics handler: it gets each message msg, which is only valid
+/// during the call, and the arg given to ImageSetDiagnostics.
+typedef void (*ImageDiagFn)(const char* msg, void* arg);
+
+/// Set the diagnostics handler of the calling thread, or none if fn is NULL.
+/// Some operations describe their work in a message (e.g., the number of
+/// pixel comparisons of ImageLocateSubImage).  This module never prints
+/// them: it passes them to the handler of the thread that called the
+/// operation, if there is one, and drops them otherwise.
+void ImageSetDiagnostics(ImageDiagFn fn, void* arg) ;
+
 /// Init Image library.  (Call once!)
 /// Currently, simply calibrate instrumentation and set names of counters.
 void ImageInit(void) ;
 
+/// Index of the instrumentation counter of pixel array accesses
+/// (named "pixmem"), e.g., for InstrTotal(PIXMEM_COUNTER).
+#define PIXMEM_COUNTER 0
+
+/// Set the number of threads used by parallel operations.
+/// n == 0 selects one thread per online cpu.
+/// At most 256 threads are used, whatever n.
+/// Requires: n >= 0.
+void ImageSetThreads(int n) ;
+
 /// Image management functions
 
 /// Create a new black image.
 ///   width, height : the dimensions of the new image.
 ///   maxval: the maximum gray level (corresponding to white).
-/// Requires: width and height must be non-negative, maxval > 0.
+/// Requires: width and height must be non-negative, 0 < maxval <= PixMax16.
+/// Images with maxval <= PixMax have 8-bit pixels, others have 16-bit pixels.
 /// 
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
 /// On failure, returns NULL and errno/errCause are set accordingly.
-Image ImageCreate(int width, int height, uint8 maxval) ;
+Image ImageCreate(int width, int height, uint16 maxval) ;
 
 /// Destroy the image pointed to by (*imgp).
 ///   imgp : address of an Image variable.
@@ -58,10 +102,58 @@ Image ImageCreate(int width, int height, uint8 maxval) ;
 /// Should never fail, and should preserve global errno/errCause.
 void ImageDestroy(Image* imgp) ;
 
+/// Synthetic images
+
+/// These generators are deterministic: the same arguments always produce
+/// the same image, on any host and with any number of threads.
+/// They are meant for tests and benchmarks at arbitrary sizes.
+/// All require: width and height non-negative, 0 < maxval <= PixMax16.
+/// On success, a new image is returned (to be destroyed by the caller).
+/// On failure, they return NULL and errno/errCause are set accordingly.
+
+/// Create an image of uniform noise: independent levels in [0, maxval],
+/// drawn from a pseudo-random generator started from seed.
+Image ImageCreateNoise(int width, int height, uint16 maxval, unsigned int seed) ;
+
+/// Create a linear gradient from black to maxval:
+/// left to right (direction 0), top to bottom (1), or top-left to
+/// bottom-right (2).
+/// Requires: 0 <= direction <= 2.
+Image ImageCreateGradient(int width, int height, uint16 maxval, int direction) ;
+
+/// Create a checkerboard of cell x cell squares, alternating black and
+/// maxval, with a black square at the top left corner.
+/// Requires: cell > 0.
+Image ImageCreateChecker(int width, int height, uint16 maxval, int cell) ;
+
+/// Create a black image with count rectangles of random positions, sizes
+/// (up to half the image in each dimension) and levels, drawn in order
+/// from a pseudo-random generator started from seed.
+/// Requires: count >= 0.
+Image ImageCreateRects(int width, int height, uint16 maxval, int count, unsigned int seed) ;
+
+/// Create a (haystack, needle) pair for ImageLocateSubImage.
+/// The haystack is width x height noise with levels in [0, levels-1].
+/// The needle is nwidth x nheight noise with the same levels, except for
+/// its bottom-right pixel, which is maxval.  The needle is planted in the
+/// haystack at (x, y), and since maxval appears nowhere else, that is the
+/// only position where it matches.
+/// Fewer levels make more candidate positions look alike: levels == 1
+/// gives a uniform haystack, the worst case for locate.
+/// Requires: 0 < levels <= maxval, nwidth > 0, nheight > 0,
+/// and the needle rectangle (x, y, nwidth, nheight) inside the haystack.
+/// On success, stores the new images in *phaystack and *pneedle and
+/// returns 1 (the caller is responsible for destroying both!).
+/// On failure, returns 0, sets errno/errCause, and creates no images.
+int ImageCreateHaystack(int width, int height, uint16 maxval,
+                        int nwidth, int nheight, int x, int y, int levels,
+                        unsigned int seed, Image* phaystack, Image* pneedle) ;
+
 /// PGM file operations
 
 /// Load a raw PGM file.
-/// Only 8 bit PGM files are accepted.
+/// Files with maxval <= 255 produce 8-bit images,
+/// files with 255 < maxval <= 65535 produce 16-bit images.
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
 /// On failure, returns NULL and errno/errCause are set accordingly.
@@ -73,6 +165,39 @@ Image ImageLoad(const char* filename) ;
 /// a partial and invalid file may be left in the system.
 int ImageSave(Image img, const char* filename) ;
 
+/// Asynchronous file I/O
+
+/// These functions start a load or save and return at once, so that the
+/// disk works while the caller computes.  The file is transferred whole,
+/// through io_uring where the kernel supports it, or else by a thread.
+/// Every started transfer must be finished by the matching Wait function,
+/// which also frees the handle.
+
+/// Start loading a raw PGM file (see ImageLoad).
+/// On success, returns a handle for ImageLoadWait.
+/// On failure to start (e.g., the file cannot be opened), returns NULL
+/// and errno/errCause are set accordingly.
+ImageIO ImageLoadAsync(const char* filename) ;
+
+/// Wait for the load of *iop to end, and parse the file.
+/// Returns the image, or NULL if it fails, as ImageLoad.
+/// Ensures: (*iop)==NULL.
+Image ImageLoadWait(ImageIO* iop) ;
+
+/// Start saving img to a PGM file (see ImageSave).
+/// The image is encoded at once: it may be modified or destroyed as soon
+/// as this returns.
+/// On success, returns a handle for ImageSaveWait.
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageIO ImageSaveAsync(Image img, const char* filename) ;
+
+/// Wait for the save of *iop to end.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// a partial and invalid file may be left in the system.
+/// Ensures: (*iop)==NULL.
+int ImageSaveWait(ImageIO* iop) ;
+
 /// Information queries
 
 /// These functions do not modify the image and never fail.
@@ -86,12 +211,18 @@ int ImageHeight(Image img) ;
 /// Get image maximum gray level
 int ImageMaxval(Image img) ;
 
+/// Get image depth: number of bytes per pixel (1 or 2)
+int ImageDepth(Image img) ;
+
+/// Get image pixel layout (see ImageSetLayout)
+int ImageLayout(Image img) ;
+
 /// Pixel stats
 /// Find the minimum and maximum gray levels in image.
 /// On return,
 /// *min is set to the minimum gray level in the image,
 /// *max is set to the maximum.
-void ImageStats(Image img, uint8* min, uint8* max) ;
+void ImageStats(Image img, uint16* min, uint16* max) ;
 
 /// Check if pixel position (x,y) is inside img.
 int ImageValidPos(Image img, int x, int y) ;
@@ -107,10 +238,38 @@ int ImageValidRect(Image img, int x, int y, int w, int h) ;
 /// implement more complex operations.
 
 /// Get the pixel (level) at position (x,y).
-uint8 ImageGetPixel(Image img, int x, int y) ;
+uint16 ImageGetPixel(Image img, int x, int y) ;
 
 /// Set the pixel at position (x,y) to new level.
-void ImageSetPixel(Image img, int x, int y, uint8 level) ;
+/// Requires: level <= maxval.
+void ImageSetPixel(Image img, int x, int y, uint16 level) ;
+
+/// Pixel layout
+
+/// Pixel layouts, for ImageSetLayout
+enum {
+  IMAGE_LAYOUT_RASTER,  ///< rows from top to bottom (the default)
+  IMAGE_LAYOUT_TILED,   ///< 64x64 tiles in raster order, each a raster scan
+};
+
+/// Change the layout of the pixels of img in memory.
+/// The layout does not change the image, only how fast operations access
+/// it: the raster layout suits operations that go along rows, and the
+/// tiled layout those that go along columns or over 2D windows, which then
+/// stay within a page or two of memory (and of the TLB).
+/// All operations accept both layouts.  These ones work directly in tiled
+/// layout: pixel access, pixel transformations, ImageStats, ImageSave,
+/// ImageRotate, ImageMirror, ImageCrop, ImagePaste, ImageBlend,
+/// ImageMatchSubImage, ImageLocateSubImage, ImageBlur and lazy sources.
+/// The others convert to raster layout and back (if they modify img) or
+/// work on a raster copy.
+/// New images are in raster layout, except those of ImageRotate,
+/// ImageMirror and ImageCrop, which take the layout of img.
+/// On success, returns 1.
+/// On failure (out of memory), returns 0, sets errno/errCause, and leaves
+/// img unchanged.  (An in-place operation on a tiled image that runs out of
+/// memory while converting back may leave it in raster layout.)
+int ImageSetLayout(Image img, int layout) ;
 
 /// Pixel transformations
 
@@ -127,7 +286,7 @@ void ImageNegative(Image img) ;
 /// Apply threshold to image.
 /// Transform all pixels with level<thr to black (0) and
 /// all pixels with level>=thr to white (maxval).
-void ImageThreshold(Image img, uint8 thr) ;
+void ImageThreshold(Image img, uint16 thr) ;
 
 /// Brighten image by a factor.
 /// Multiply each pixel level by a factor, but saturate at maxval.
@@ -135,6 +294,11 @@ void ImageThreshold(Image img, uint8 thr) ;
 /// darken the image if factor<1.0.
 void ImageBrighten(Image img, double factor) ;
 
+/// Apply a look-up table to image.
+/// Each pixel level v is replaced by lut[v].
+/// Requires: lut has maxval+1 entries, all of them <= maxval.
+void ImageApplyLUT(Image img, const uint16* lut) ;
+
 /// Geometric transformations
 
 /// These functions apply geometric transformations to an image,
@@ -147,7 +311,8 @@ void ImageBrighten(Image img, double factor) ;
 
 /// Rotate an image.
 /// Returns a rotated version of the image.
-/// The rotation is 90 degrees clockwise.
+/// The rotation is 90 degrees anti-clockwise:
+/// pixel (x, y) of img goes to (y, width-1-x) of the result.
 /// Ensures: The original img is not modified.
 /// 
 /// On success, a new image is returned.
@@ -178,18 +343,88 @@ Image ImageMirror(Image img) ;
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageCrop(Image img, int x, int y, int w, int h) ;
 
+/// Crop, mirror and rotate an image in a single pass.
+/// Returns the same image as
+///   ImageCrop(img, x, y, w, h), then
+///   ImageMirror of that, if mirror is nonzero, then
+///   ImageRotate of that, repeated turns times,
+/// but without creating the intermediate images.
+/// Requires:
+///   The rectangle must be inside the original image.
+/// Ensures:
+///   The original img is not modified.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageRemap(Image img, int x, int y, int w, int h, int mirror, int turns) ;
+
+/// Resampling modes, for ImageResize
+enum {
+  IMAGE_RESIZE_AREA,      ///< average of the source area under each pixel
+  IMAGE_RESIZE_BILINEAR,  ///< linear interpolation of the 4 nearest pixels
+};
+
+/// Resize an image to w x h pixels.
+/// IMAGE_RESIZE_AREA suits downscaling: each pixel becomes the average of
+/// the source pixels it covers, weighted by the area covered, which avoids
+/// aliasing.  Reducing by exactly 2 or 4 in both directions takes a direct
+/// path that averages 2x2 or 4x4 blocks, rounding half up.
+/// IMAGE_RESIZE_BILINEAR suits upscaling: each pixel interpolates the
+/// source pixels around its center (pixel centers are aligned, and edges
+/// are clamped).
+/// Both are computed as two 1D passes, in fixed point, with results
+/// rounded to the nearest level.
+/// Requires: w >= 0, h >= 0, and img not empty unless the result is.
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageResize(Image img, int w, int h, int mode) ;
+
+/// Interpolation modes, for ImageWarpAffine
+enum {
+  IMAGE_WARP_NEAREST,   ///< level of the nearest pixel
+  IMAGE_WARP_BILINEAR,  ///< linear interpolation of the 4 nearest pixels
+};
+
+/// Warp an image by an affine transform, into a new w x h image.
+/// The matrix maps each output pixel (x, y) to the source point
+///   (matrix[0]*x + matrix[1]*y + matrix[2],
+///    matrix[3]*x + matrix[4]*y + matrix[5])
+/// whose level it takes (so it is the INVERSE of the transform applied to
+/// the image).  Pixel (x, y) is centered at point (x, y).
+/// Points outside img are black; with IMAGE_WARP_BILINEAR, pixels within
+/// one pixel of the edge of img fade to black.
+/// For example, to rotate img by angle a (counter-clockwise) around its
+/// center (cx, cy), keeping its size, use
+///   {cos(a), -sin(a), cx - cos(a)*cx + sin(a)*cy,
+///    sin(a),  cos(a), cy - sin(a)*cx - cos(a)*cy}.
+/// Points are computed incrementally in fixed point, with an error below
+/// 1/100000 pixel.
+/// Requires: w >= 0, h >= 0.
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageWarpAffine(Image img, const double matrix[6], int w, int h, int interp) ;
+
 /// Operations on two images
 
 /// Paste an image into a larger image.
 /// Paste img2 into position (x, y) of img1.
 /// This modifies img1 in-place: no allocation involved.
-/// Requires: img2 must fit inside img1 at position (x, y).
+/// Requires: img2 must fit inside img1 at position (x, y),
+/// and both images must have the same depth.
 void ImagePaste(Image img1, int x, int y, Image img2) ;
 
 /// Blend an image into a larger image.
 /// Blend img2 into position (x, y) of img1.
 /// This modifies img1 in-place: no allocation involved.
-/// Requires: img2 must fit inside img1 at position (x, y).
+/// Requires: img2 must fit inside img1 at position (x, y),
+/// and both images must have the same depth.
 /// alpha usually is in [0.0, 1.0], but values outside that interval
 /// may provide interesting effects.  Over/underflows should saturate.
 void ImageBlend(Image img1, int x, int y, Image img2, double alpha) ;
@@ -205,6 +440,37 @@ int ImageMatchSubImage(Image img1, int x, int y, Image img2) ;
 /// If no match is found, returns 0 and (*px, *py) are left untouched.
 int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) ;
 
+/// Image comparison
+
+/// Differences between two images (see ImageCompare)
+typedef struct {
+  uint64_t sad;         ///< sum of absolute differences of levels
+  uint64_t ssd;         ///< sum of squared differences
+  int maxAbsDiff;       ///< largest absolute difference
+  double psnr;          ///< peak signal-to-noise ratio, in dB, relative to
+                        ///< the maxval of the first image (INFINITY if equal)
+} ImageDiff;
+
+/// Check if img1 and img2 are identical: same size, maxval and levels,
+/// whatever their layouts.  Stops at the first difference.
+int ImageEqual(Image img1, Image img2) ;
+
+/// Compare img2 with the subimage of img1 at (x, y), of the size of img2,
+/// computing all of *d in a single pass.  (With SIMD, 16 8-bit pixels
+/// are compared per step.)
+/// Requires: img2 must fit inside img1 at position (x, y),
+/// and both images must have the same depth.
+void ImageCompareSubImage(Image img1, int x, int y, Image img2, ImageDiff* d) ;
+
+/// Compare images of the same size: as ImageCompareSubImage at (0, 0).
+void ImageCompare(Image img1, Image img2, ImageDiff* d) ;
+
+/// Each field of ImageCompare on its own.
+uint64_t ImageSAD(Image img1, Image img2) ;
+uint64_t ImageSSD(Image img1, Image img2) ;
+double ImagePSNR(Image img1, Image img2) ;
+int ImageMaxAbsDiff(Image img1, Image img2) ;
+
 /// Filtering
 
 /// Blur an image by a applying a (2dx+1)x(2dy+1) mean filter.
@@ -213,4 +479,301 @@ int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) ;
 /// The image is changed in-place.
 void ImageBlur(Image img, int dx, int dy) ;
 
+/// Border modes, for neighbourhood operations that read outside the image
+enum {
+  IMAGE_BORDER_CLAMP,   ///< repeat the edge pixels: aaa|abcd|ddd
+  IMAGE_BORDER_MIRROR,  ///< reflect about the edge pixels: dcb|abcd|cba
+  IMAGE_BORDER_ZERO,    ///< black outside: 000|abcd|000
+};
+
+/// Convolve an image with an integer kernel.
+///   kernel: kh rows of kw weights, in raster order, centered on the pixel
+///           (kernel[0] applies to the pixel at (x-kw/2, y-kh/2)).
+///   divisor: the weighted sum is divided by divisor, with rounding,
+///           e.g. the sum of the weights, or 2^k for a fixed-point kernel.
+///   border: how pixels outside the image are read (IMAGE_BORDER_*).
+/// Each pixel becomes round(sum(weight * neighbour) / divisor), saturated
+/// to [0, maxval] (so a filter like Sobel keeps only positive responses).
+/// Rank-1 kernels (such as Gaussian or box kernels) are detected and
+/// applied as two 1D passes, in O(kw+kh) per pixel instead of O(kw*kh),
+/// with exactly the same results.
+/// Requires: kw and kh odd and positive, divisor > 0, valid border mode.
+/// The image is changed in-place.
+/// On success, returns 1.
+/// On failure, returns 0, sets errno/errCause, and the image is unchanged.
+int ImageConvolve(Image img, const int* kernel, int kw, int kh, int divisor, int border) ;
+
+/// Blur an image with an approximate Gaussian filter of standard deviation
+/// sigma (in pixels), applied as three successive box filters along rows
+/// and then along columns, in O(1) per pixel: the time does not depend on
+/// sigma.  Pixels outside the image repeat the edge (IMAGE_BORDER_CLAMP).
+/// Error bound: box widths are odd integers, so the filter is a Gaussian
+/// of a nearby standard deviation (within 0.22 of sigma, for sigma >= 1.5)
+/// with a piecewise-quadratic profile.  Compared with an exact (sampled)
+/// Gaussian blur of the same sigma, no pixel differs by more than
+/// 0.19*maxval for sigma >= 1.5, 0.10*maxval for sigma >= 3 or
+/// 0.07*maxval for sigma >= 8, plus 0.5 for rounding.  These bounds are
+/// reached only at sharp step edges; smooth images differ far less.
+/// For sigma < 1.5 the boxes are too coarse: use ImageConvolve with a
+/// small Gaussian kernel instead.
+/// Requires: sigma >= 0 and finite (0 leaves the image unchanged).
+/// The image is changed in-place.
+/// On success, returns 1.
+/// On failure, returns 0, sets errno/errCause, and the image is unchanged.
+int ImageGaussianBlur(Image img, double sigma) ;
+
+/// Apply a (2dx+1)x(2dy+1) median filter.
+/// Each pixel is substituted by the median of the pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy], clipped to the image as in ImageBlur.
+/// For an even number n of pixels, the lower median (the (n/2)-th smallest)
+/// is taken, so the result is always one of the pixels in the window.
+/// For 8-bit images, the cost per pixel does not depend on dx or dy; for
+/// 16-bit images, it grows linearly with dy (but not with dx).
+/// Requires: dx >= 0, dy >= 0.
+/// The image is changed in-place.
+/// On success, returns 1.
+/// On failure, returns 0, sets errno/errCause, and the image is unchanged.
+int ImageMedian(Image img, int dx, int dy) ;
+
+/// Morphology
+
+/// These functions apply grayscale morphology with a (2dx+1)x(2dy+1)
+/// rectangle as structuring element.  Windows are clipped to the image as
+/// in ImageBlur.  The cost per pixel does not depend on dx or dy.
+/// All require: dx >= 0, dy >= 0.
+/// The image is changed in-place.
+/// On success, they return 1.
+/// On failure, they return 0, set errno/errCause, and the image is unchanged.
+
+/// Erode: each pixel becomes the minimum of the pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy].
+int ImageErode(Image img, int dx, int dy) ;
+
+/// Dilate: each pixel becomes the maximum of the pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy].
+int ImageDilate(Image img, int dx, int dy) ;
+
+/// Open: erode, then dilate.  Removes bright details smaller than the
+/// rectangle (e.g. specks in a thresholded mask).
+int ImageOpen(Image img, int dx, int dy) ;
+
+/// Close: dilate, then erode.  Fills dark details smaller than the
+/// rectangle (e.g. holes in a thresholded mask).
+int ImageClose(Image img, int dx, int dy) ;
+
+/// Morphological gradient: dilation minus erosion, which outlines edges.
+int ImageGradient(Image img, int dx, int dy) ;
+
+/// Binary masks
+
+/// A mask is a binary image packed at 1 bit per pixel, as produced by a
+/// threshold: 8 (or 16) times less memory and bandwidth than the image.
+/// Operations work on 64 pixels per machine word.
+/// Functions that create masks follow the conventions of ImageCreate:
+/// On success, a new mask is returned.
+/// (The caller is responsible for destroying the returned mask!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+
+/// Create a new empty mask (all pixels 0) of width x height pixels.
+/// Requires: width and height must be non-negative.
+Mask MaskCreate(int width, int height) ;
+
+/// Destroy the mask pointed to by (*maskp).
+/// If (*maskp)==NULL, no operation is performed.
+/// Ensures: (*maskp)==NULL.
+void MaskDestroy(Mask* maskp) ;
+
+/// Get mask width and height
+int MaskWidth(Mask m) ;
+int MaskHeight(Mask m) ;
+
+/// Get and set the pixel (0 or 1) at position (x,y).
+int MaskGetPixel(Mask m, int x, int y) ;
+void MaskSetPixel(Mask m, int x, int y, int bit) ;
+
+/// Threshold img into a new mask: 1 where level>=thr, 0 elsewhere,
+/// as ImageThreshold does with 0 and maxval.  (With SIMD, 16 pixels
+/// are compared per instruction.)
+/// Ensures: The original img is not modified.
+Mask ImageThresholdMask(Image img, uint16 thr) ;
+
+/// Expand mask m into a new image: 0 where m is 0, maxval where it is 1.
+/// Requires: 0 < maxval <= PixMax16.
+Image MaskToImage(Mask m, uint16 maxval) ;
+
+/// Bitwise operations, in place on a: a = a AND b, a OR b, a XOR b.
+/// Requires: a and b of the same size.
+void MaskAnd(Mask a, Mask b) ;
+void MaskOr(Mask a, Mask b) ;
+void MaskXor(Mask a, Mask b) ;
+
+/// Invert mask m in place.
+void MaskNot(Mask m) ;
+
+/// Number of pixels set in m.
+unsigned long MaskArea(Mask m) ;
+
+/// Erode (dilate) mask m in place with a (2dx+1)x(2dy+1) rectangle: each
+/// pixel becomes the AND (OR) of the pixels of the rectangle centered on
+/// it, clipped to the mask.  These match ImageErode and ImageDilate of the
+/// thresholded image.  Opening and closing are compositions of the two.
+/// Cost is O(log dx + log dy) word operations per 64 pixels.
+/// Requires: dx >= 0, dy >= 0.
+/// On success, returns 1.
+/// On failure, returns 0, m is unchanged, and errno/errCause are set.
+int MaskErode(Mask m, int dx, int dy) ;
+int MaskDilate(Mask m, int dx, int dy) ;
+
+/// Run-length encoded images
+
+/// An RLE image stores each row as runs of equal levels, which suits
+/// images made mostly of flat areas (documents, thresholded images,
+/// synthetic overlays).  The operations below work on the runs directly,
+/// so their cost grows with the number of runs, not of pixels.
+/// Functions that create RLE images follow the conventions of ImageCreate:
+/// On success, a new RLE image is returned.
+/// (The caller is responsible for destroying it!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+
+/// Encode img into a new RLE image.
+/// Ensures: The original img is not modified.
+RLEImage RLEFromImage(Image img) ;
+
+/// Decode r into a new image (in raster layout).
+Image RLEToImage(RLEImage r) ;
+
+/// Destroy the RLE image pointed to by (*rp).
+/// If (*rp)==NULL, no operation is performed.
+/// Ensures: (*rp)==NULL.
+void RLEDestroy(RLEImage* rp) ;
+
+/// Get RLE image width, height, maximum gray level and number of runs
+int RLEWidth(RLEImage r) ;
+int RLEHeight(RLEImage r) ;
+int RLEMaxval(RLEImage r) ;
+unsigned long RLERuns(RLEImage r) ;
+
+/// Pixel transformations, in place, as ImageNegative, ImageThreshold and
+/// ImageApplyLUT.  Runs left with equal levels are merged.  They never fail.
+void RLENegative(RLEImage r) ;
+void RLEThreshold(RLEImage r, uint16 thr) ;
+void RLEApplyLUT(RLEImage r, const uint16* lut) ;
+
+/// Mirror r into a new RLE image, as ImageMirror.
+RLEImage RLEMirror(RLEImage r) ;
+
+/// Crop a rectangle of r into a new RLE image, as ImageCrop.
+/// Requires: The rectangle must be inside r.
+RLEImage RLECrop(RLEImage r, int x, int y, int w, int h) ;
+
+/// Locate r2 inside r1, as ImageLocateSubImage: if found, returns 1 and
+/// sets (*px, *py) to the first match in raster order; otherwise returns
+/// 0 and leaves them untouched.  Levels are compared, whatever the
+/// maxvals.  Each run of r1 offers at most one candidate position, unless
+/// r2 starts with a row of a single level.
+int RLELocateSubImage(RLEImage r1, int* px, int* py, RLEImage r2) ;
+
+/// Load an RLE file, as written by RLESave.
+/// On failure, returns NULL and errno/errCause are set accordingly.
+RLEImage RLELoad(const char* filename) ;
+
+/// Save r to an RLE file: a PGM-like header (with magic number R5)
+/// followed by each run's length, in base 128, and level.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// a partial and invalid file may be left in the system.
+int RLESave(RLEImage r, const char* filename) ;
+
+/// Connected components
+
+/// Statistics of a connected component
+typedef struct {
+  unsigned long area;   ///< number of pixels
+  int x, y, w, h;       ///< bounding box: top left corner, width and height
+  double cx, cy;        ///< centroid: mean x and mean y of its pixels
+} LabelStats;
+
+/// Label the connected components of the foreground (nonzero pixels) of
+/// img, as left by ImageThreshold, with 4- or 8-connectivity.
+/// Components are numbered 1, 2, ... in the order of their first pixel in
+/// raster order; background pixels get label 0.  Rows are labeled in
+/// bands, in parallel (see ImageSetThreads), with a union-find forest, and
+/// labels are then merged across band borders; the result does not
+/// depend on the number of threads.
+/// Requires: connectivity is 4 or 8, and img has fewer than 2^32 pixels.
+/// Ensures: The original img is not modified.
+///
+/// On success, returns a new labeling (destroy with LabelsDestroy).
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Labels ImageLabel(Image img, int connectivity) ;
+
+/// Destroy the labeling pointed to by (*lp).
+/// If (*lp)==NULL, no operation is performed.
+/// Ensures: (*lp)==NULL.
+void LabelsDestroy(Labels* lp) ;
+
+/// Number of components (the largest label)
+int LabelsCount(Labels l) ;
+
+/// Label of pixel (x,y)
+uint32_t LabelsGet(Labels l, int x, int y) ;
+
+/// The labels of all pixels, width x height of them, in raster order.
+/// The array belongs to l.
+const uint32_t* LabelsData(Labels l) ;
+
+/// Statistics of component k.
+/// Requires: 1 <= k <= LabelsCount(l).
+const LabelStats* LabelsStats(Labels l, int k) ;
+
+/// Deferred evaluation
+
+/// These functions build a graph of operations on lazy images, without
+/// computing anything.  LazyEvaluate then computes the result tile by tile,
+/// each tile going through all the operations before the next one starts,
+/// which keeps the working set in cache.
+///
+/// Lazy images are reference counted: operations keep a reference to their
+/// inputs, so each lazy image may be destroyed by its creator as soon as it
+/// has been used.
+///
+/// The constructors return a new lazy image on success.
+/// (The caller is responsible for destroying the returned lazy image!)
+/// On failure, they return NULL and errno/errCause are set accordingly.
+
+/// Create a lazy image that reads pixels from img.
+/// img is not copied: it must not be modified or destroyed while the
+/// lazy image is in use.
+LazyImage LazySource(Image img) ;
+
+/// Lazy versions of ImageNegative, ImageThreshold and ImageBrighten.
+LazyImage LazyNegative(LazyImage a) ;
+LazyImage LazyThreshold(LazyImage a, uint16 thr) ;
+LazyImage LazyBrighten(LazyImage a, double factor) ;
+
+/// Lazy version of ImageBlur.
+/// Each tile is computed from a tile of a extended by a (dx, dy) halo.
+LazyImage LazyBlur(LazyImage a, int dx, int dy) ;
+
+/// Lazy version of ImageBlend: blend b into position (x, y) of a.
+/// Requires: b must fit inside a at position (x, y),
+/// and both must have the same depth.
+LazyImage LazyBlend(LazyImage a, int x, int y, LazyImage b, double alpha) ;
+
+/// Destroy the lazy image pointed to by (*lazyp).
+/// Nodes still used as inputs of other lazy images are kept until those
+/// are destroyed too.
+/// If (*lazyp)==NULL, no operation is performed.
+/// Ensures: (*lazyp)==NULL.
+void LazyDestroy(LazyImage* lazyp) ;
+
+/// Evaluate a lazy image.
+/// The result is computed in tiles, in parallel (see ImageSetThreads).
+/// The source images are not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image LazyEvaluate(LazyImage node) ;
+
 #endif
@@ -0,0 +1,602 @@
+// imageBench - Benchmarks for the image8bit module.
+//
+// Runs every image8bit operation on synthetic images of several sizes,
+// with warmup and repeated trials, and reports throughput in megapixels
+// per second, with the median and 95th percentile of the trial times.
+// Results may be written to a JSON file and compared against a baseline
+// produced in the same way, to flag performance regressions.
+//
+// Inputs are generated locally and deterministically, so no downloads
+// are needed and runs on the same host are comparable.
+//
+// This program is part of the image8bit project for the course AED,
+// DETI / UA.PT.
+//
+// You may freely use and modify this code, NO WARRANTY, blah blah,
+// as long as you give proper credit to the original and subsequent authors.
+
+#include <assert.h>
+#include <errno.h>
+#include <error.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "image8bit.h"
+#include "instrumentation.h"
+
+static const char* USAGE =
+    "USAGE:\n"
+    "  imageBench [OPTIONS]\n"
+    "OPTIONS:\n"
+    "  -s N,N,...      Image sizes (NxN) to benchmark (default 256,1024,2048).\n"
+    "  -t N            Timed trials per benchmark (default 7).\n"
+    "  -w N            Untimed warmup runs per benchmark (default 2).\n"
+    "  -j N            Threads for parallel operations (default 0 = one per cpu).\n"
+    "  -f WORD         Only run benchmarks whose name contains WORD.\n"
+    "  -o FILE         Write results to FILE, in JSON.\n"
+    "  -b FILE         Compare results with baseline FILE (written with -o).\n"
+    "  -r PCT          Flag a regression if throughput drops more than PCT%\n"
+    "                  below the baseline (default 10).\n"
+    "Exits with status 1 if any regression is flagged.\n";
+
+// Maximum number of sizes, trials and benchmark results
+#define MAXSIZES 16
+#define MAXTRIALS 1000
+#define MAXRESULTS 1024
+
+// Inputs of a benchmark, for one image size
+typedef struct {
+  Image img;          // N x N synthetic image
+  Image small;        // N/4 x N/4 image, cropped from bottom-right of img
+  Image doc;          // N x N image of flat rectangles, for RLE
+  RLEImage rle;       // doc, encoded
+  RLEImage rleSmall;  // N/4 x N/4 crop of rle, from bottom-right
+  const char* file;   // temporary file holding img, for load
+  const char* out;    // temporary file for save
+} Inputs;
+
+// A benchmark runs an operation on work, a fresh copy of in->img.
+// It must destroy any image it creates.
+typedef void (*BenchFn)(Image work, const Inputs* in);
+
+static void benchStats(Image work, const Inputs* in) {
+  (void)in;
+  uint16 min, max;
+  ImageStats(work, &min, &max);
+}
+
+static void benchNegative(Image work, const Inputs* in) {
+  (void)in;
+  ImageNegative(work);
+}
+
+static void benchThreshold(Image work, const Inputs* in) {
+  (void)in;
+  ImageThreshold(work, 128);
+}
+
+static void benchBrighten(Image work, const Inputs* in) {
+  (void)in;
+  ImageBrighten(work, 1.3);
+}
+
+static void benchRotate(Image work, const Inputs* in) {
+  (void)in;
+  Image r = ImageRotate(work);
+  ImageDestroy(&r);
+}
+
+static void benchMirror(Image work, const Inputs* in) {
+  (void)in;
+  Image r = ImageMirror(work);
+  ImageDestroy(&r);
+}
+
+static void benchCrop(Image work, const Inputs* in) {
+  (void)in;
+  int w = ImageWidth(work);
+  int h = ImageHeight(work);
+  Image r = ImageCrop(work, w/4, h/4, w/2, h/2);
+  ImageDestroy(&r);
+}
+
+static void benchRemap(Image work, const Inputs* in) {
+  (void)in;
+  Image r = ImageRemap(work, 0, 0, ImageWidth(work), ImageHeight(work), 1, 1);
+  ImageDestroy(&r);
+}
+
+// Mipmap chain: successive halvings down to 1x1
+static void benchMipmap(Image work, const Inputs* in) {
+  (void)in;
+  Image prev = work;
+  while (ImageWidth(prev) > 1 || ImageHeight(prev) > 1) {
+    int w = ImageWidth(prev) > 1 ? ImageWidth(prev) / 2 : 1;
+    int h = ImageHeight(prev) > 1 ? ImageHeight(prev) / 2 : 1;
+    Image r = ImageResize(prev, w, h, IMAGE_RESIZE_AREA);
+    if (prev != work) ImageDestroy(&prev);
+    if (r == NULL) return;
+    prev = r;
+  }
+  if (prev != work) ImageDestroy(&prev);
+}
+
+static void benchResizeArea(Image work, const Inputs* in) {
+  (void)in;
+  Image r = ImageResize(work, ImageWidth(work) * 3 / 8, ImageHeight(work) * 3 / 8,
+                        IMAGE_RESIZE_AREA);
+  ImageDestroy(&r);
+}
+
+static void benchResizeBilinear(Image work, const Inputs* in) {
+  (void)in;
+  Image r = ImageResize(work, ImageWidth(work) * 3 / 2, ImageHeight(work) * 3 / 2,
+                        IMAGE_RESIZE_BILINEAR);
+  ImageDestroy(&r);
+}
+
+// Rotation by about 7 degrees around the center (cos and sin of 0.12 rad)
+static void benchWarp(Image work, int interp) {
+  double c = 0.99280864, s = 0.11971221;
+  double cx = (ImageWidth(work) - 1) / 2.0, cy = (ImageHeight(work) - 1) / 2.0;
+  double m[6] = { c, -s, cx - c*cx + s*cy, s, c, cy - s*cx - c*cy };
+  Image r = ImageWarpAffine(work, m, ImageWidth(work), ImageHeight(work), interp);
+  ImageDestroy(&r);
+}
+
+static void benchWarpNearest(Image work, const Inputs* in) {
+  (void)in;
+  benchWarp(work, IMAGE_WARP_NEAREST);
+}
+
+static void benchWarpBilinear(Image work, const Inputs* in) {
+  (void)in;
+  benchWarp(work, IMAGE_WARP_BILINEAR);
+}
+
+static void benchPaste(Image work, const Inputs* in) {
+  ImagePaste(work, 0, 0, in->small);
+}
+
+static void benchBlend(Image work, const Inputs* in) {
+  ImageBlend(work, 0, 0, in->small, 0.33);
+}
+
+static void benchLocate(Image work, const Inputs* in) {
+  int x, y;
+  ImageLocateSubImage(work, &x, &y, in->small);
+}
+
+static void benchEqual(Image work, const Inputs* in) {
+  ImageEqual(work, in->img);  // a full scan: work is a copy of in->img
+}
+
+static void benchCompare(Image work, const Inputs* in) {
+  ImageDiff d;
+  ImageCompare(work, in->img, &d);
+}
+
+static void benchBlur1(Image work, const Inputs* in) {
+  (void)in;
+  ImageBlur(work, 1, 1);
+}
+
+static void benchBlur7(Image work, const Inputs* in) {
+  (void)in;
+  ImageBlur(work, 7, 7);
+}
+
+static void benchGauss5(Image work, const Inputs* in) {
+  (void)in;
+  static const int k[25] = { 1, 4, 6, 4, 1, 4, 16, 24, 16, 4, 6, 24, 36, 24, 6,
+                             4, 16, 24, 16, 4, 1, 4, 6, 4, 1 };
+  ImageConvolve(work, k, 5, 5, 256, IMAGE_BORDER_CLAMP);
+}
+
+static void benchSharpen(Image work, const Inputs* in) {
+  (void)in;
+  static const int k[9] = { 0, -1, 0, -1, 5, -1, 0, -1, 0 };
+  ImageConvolve(work, k, 3, 3, 1, IMAGE_BORDER_CLAMP);
+}
+
+static void benchGaussian2(Image work, const Inputs* in) {
+  (void)in;
+  ImageGaussianBlur(work, 2.0);
+}
+
+static void benchGaussian20(Image work, const Inputs* in) {
+  (void)in;
+  ImageGaussianBlur(work, 20.0);
+}
+
+static void benchMedian1(Image work, const Inputs* in) {
+  (void)in;
+  ImageMedian(work, 1, 1);
+}
+
+static void benchMedian7(Image work, const Inputs* in) {
+  (void)in;
+  ImageMedian(work, 7, 7);
+}
+
+static void benchErode7(Image work, const Inputs* in) {
+  (void)in;
+  ImageErode(work, 7, 7);
+}
+
+static void benchDilate15(Image work, const Inputs* in) {
+  (void)in;
+  ImageDilate(work, 15, 15);
+}
+
+static void benchMaskThreshold(Image work, const Inputs* in) {
+  (void)in;
+  Mask m = ImageThresholdMask(work, ImageMaxval(work) / 2);
+  MaskDestroy(&m);
+}
+
+static void benchMaskErode7(Image work, const Inputs* in) {
+  (void)in;
+  Mask m = ImageThresholdMask(work, ImageMaxval(work) / 2);
+  if (m == NULL) return;
+  MaskErode(m, 7, 7);
+  MaskDestroy(&m);
+}
+
+static void benchMaskDilate15(Image work, const Inputs* in) {
+  (void)in;
+  Mask m = ImageThresholdMask(work, ImageMaxval(work) / 2);
+  if (m == NULL) return;
+  MaskDilate(m, 15, 15);
+  MaskDestroy(&m);
+}
+
+static void benchRLEEncode(Image work, const Inputs* in) {
+  (void)work;
+  RLEImage r = RLEFromImage(in->doc);
+  RLEDestroy(&r);
+}
+
+static void benchRLEDecode(Image work, const Inputs* in) {
+  (void)work;
+  Image r = RLEToImage(in->rle);
+  ImageDestroy(&r);
+}
+
+static void benchRLENegative(Image work, const Inputs* in) {
+  (void)work;
+  RLENegative(in->rle);
+}
+
+static void benchRLEMirror(Image work, const Inputs* in) {
+  (void)work;
+  RLEImage r = RLEMirror(in->rle);
+  RLEDestroy(&r);
+}
+
+static void benchRLELocate(Image work, const Inputs* in) {
+  (void)work;
+  int x, y;
+  RLELocateSubImage(in->rle, &x, &y, in->rleSmall);
+}
+
+static void benchLabel(Image work, const Inputs* in) {
+  (void)work;
+  Labels l = ImageLabel(in->doc, 8);
+  LabelsDestroy(&l);
+}
+
+static void benchLazy(Image work, const Inputs* in) {
+  (void)in;
+  LazyImage a = LazySource(work);
+  LazyImage b = LazyNegative(a);
+  LazyImage c = LazyBlur(b, 2, 2);
+  LazyImage d = LazyThreshold(c, 128);
+  Image r = LazyEvaluate(d);
+  LazyDestroy(&d);
+  LazyDestroy(&c);
+  LazyDestroy(&b);
+  LazyDestroy(&a);
+  ImageDestroy(&r);
+}
+
+static void benchSave(Image work, const Inputs* in) {
+  ImageSave(work, in->out);
+}
+
+static void benchLoad(Image work, const Inputs* in) {
+  (void)work;
+  Image r = ImageLoad(in->file);
+  ImageDestroy(&r);
+}
+
+// Benchmarks run on work in raster layout, or in the given layout (the
+// conversion is not timed).  Those that change in->rle get a fresh copy
+// of it in each run, as they get work (the copy is not timed either).
+static const struct {
+  const char* name;
+  BenchFn fn;
+  int layout;
+  int changesRLE;
+} benchmarks[] = {
+  { "stats", benchStats },
+  { "negative", benchNegative },
+  { "threshold", benchThreshold },
+  { "brighten", benchBrighten },
+  { "rotate", benchRotate },
+  { "rotate-tiled", benchRotate, IMAGE_LAYOUT_TILED },
+  { "mirror", benchMirror },
+  { "crop", benchCrop },
+  { "remap", benchRemap },
+  { "mipmap", benchMipmap },
+  { "resize-area", benchResizeArea },
+  { "resize-bilinear", benchResizeBilinear },
+  { "warp-nearest", benchWarpNearest },
+  { "warp-bilinear", benchWarpBilinear },
+  { "paste", benchPaste },
+  { "blend", benchBlend },
+  { "locate", benchLocate },
+  { "locate-tiled", benchLocate, IMAGE_LAYOUT_TILED },
+  { "equal", benchEqual },
+  { "compare", benchCompare },
+  { "blur1x1", benchBlur1 },
+  { "blur7x7", benchBlur7 },
+  { "blur7x7-tiled", benchBlur7, IMAGE_LAYOUT_TILED },
+  { "conv-gauss5", benchGauss5 },
+  { "conv-sharpen", benchSharpen },
+  { "gaussian2", benchGaussian2 },
+  { "gaussian20", benchGaussian20 },
+  { "median3x3", benchMedian1 },
+  { "median15x15", benchMedian7 },
+  { "erode15x15", benchErode7 },
+  { "dilate31x31", benchDilate15 },
+  { "mask-threshold", benchMaskThreshold },
+  { "mask-erode15x15", benchMaskErode7 },
+  { "mask-dilate31x31", benchMaskDilate15 },
+  { "rle-encode", benchRLEEncode },
+  { "rle-decode", benchRLEDecode },
+  { "rle-negative", benchRLENegative, IMAGE_LAYOUT_RASTER, 1 },
+  { "rle-mirror", benchRLEMirror },
+  { "rle-locate", benchRLELocate },
+  { "label", benchLabel },
+  { "lazy", benchLazy },
+  { "save", benchSave },
+  { "load", benchLoad },
+};
+
+#define NUMBENCH ((int)(sizeof(benchmarks) / sizeof(benchmarks[0])))
+
+// Result of one benchmark, for one size
+typedef struct {
+  char name[64];
+  int size;
+  double mps;         // megapixels per second, at the median time
+  double median;      // median trial time (s)
+  double p95;         // 95th percentile trial time (s)
+} Result;
+
+// Fill img with a deterministic pattern: a smooth gradient plus noise
+// from a xorshift generator, so that operations see realistic data.
+static void fillSynthetic(Image img) {
+  unsigned int s = 2463534242u;
+  int w = ImageWidth(img);
+  int h = ImageHeight(img);
+  for (int y = 0; y < h; y++)
+    for (int x = 0; x < w; x++) {
+      s ^= s << 13;
+      s ^= s >> 17;
+      s ^= s << 5;
+      int v = (x + y) * 255 / (w + h) + (int)(s & 63) - 32;
+      ImageSetPixel(img, x, y, (uint16)(v < 0 ? 0 : v > 255 ? 255 : v));
+    }
+}
+
+static int cmpDouble(const void* a, const void* b) {
+  double x = *(const double*)a;
+  double y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+// Run benchmark b on inputs in: warmup untimed runs, then trials timed
+// runs, each on a fresh copy of in->img.  Stores the statistics in r.
+static void runBench(int b, const Inputs* in, int warmup, int trials, Result* r) {
+  static double times[MAXTRIALS];
+  int w = ImageWidth(in->img);
+  int h = ImageHeight(in->img);
+  for (int t = -warmup; t < trials; t++) {
+    Image work = ImageCrop(in->img, 0, 0, w, h);
+    if (work == NULL || !ImageSetLayout(work, benchmarks[b].layout))
+      error(2, errno, "Copying image: %s", ImageErrMsg());
+    Inputs run = *in;
+    if (benchmarks[b].changesRLE &&
+        (run.rle = RLECrop(in->rle, 0, 0, RLEWidth(in->rle), RLEHeight(in->rle))) == NULL)
+      error(2, errno, "Copying RLE image: %s", ImageErrMsg());
+    double t0 = wall_time();
+    benchmarks[b].fn(work, &run);
+    double t1 = wall_time();
+    if (benchmarks[b].changesRLE)
+      RLEDestroy(&run.rle);
+    ImageDestroy(&work);
+    if (t >= 0) times[t] = t1 - t0;
+  }
+  qsort(times, (size_t)trials, sizeof(double), cmpDouble);
+  snprintf(r->name, sizeof(r->name), "%s", benchmarks[b].name);
+  r->size = w;
+  r->median = times[trials / 2];
+  r->p95 = times[(trials * 95 + 99) / 100 - 1];
+  r->mps = r->median > 0.0 ? (double)w * h / r->median / 1e6 : 0.0;
+}
+
+// Write results to file name, in JSON, one result per line.
+static void writeResults(const char* name, const Result* res, int n) {
+  FILE* f = fopen(name, "w");
+  if (f == NULL)
+    error(2, errno, "Writing %s", name);
+  fputs("{\"benchmarks\": [\n", f);
+  for (int i = 0; i < n; i++)
+    fprintf(f, "  {\"name\": \"%s\", \"size\": %d, \"mps\": %.3f, "
+            "\"median\": %.9f, \"p95\": %.9f}%s\n",
+            res[i].name, res[i].size, res[i].mps, res[i].median, res[i].p95,
+            i + 1 < n ? "," : "");
+  fputs("]}\n", f);
+  if (fclose(f) != 0)
+    error(2, errno, "Writing %s", name);
+}
+
+// Read baseline results from file name (as written by writeResults).
+// Returns the number of results read into res (at most max).
+static int readResults(const char* name, Result* res, int max) {
+  FILE* f = fopen(name, "r");
+  if (f == NULL)
+    error(2, errno, "Reading %s", name);
+  int n = 0;
+  char line[512];
+  while (n < max && fgets(line, sizeof(line), f) != NULL) {
+    Result* r = &res[n];
+    if (sscanf(line, " {\"name\": \"%63[^\"]\", \"size\": %d, \"mps\": %lf, "
+               "\"median\": %lf, \"p95\": %lf",
+               r->name, &r->size, &r->mps, &r->median, &r->p95) == 5)
+      n++;
+  }
+  fclose(f);
+  return n;
+}
+
+// Compare results res with baseline base, printing a line per result.
+// Returns the number of regressions: throughput more than tolerance
+// (a fraction) below the baseline.
+static int compareResults(const Result* res, int n, const Result* base, int nbase,
+                          double tolerance) {
+  int regressions = 0;
+  printf("#%-15s\t%6s\t%12s\t%12s\t%8s\n", "benchmark", "size", "MP/s", "base MP/s", "change");
+  for (int i = 0; i < n; i++) {
+    const Result* b = NULL;
+    for (int j = 0; j < nbase && b == NULL; j++)
+      if (strcmp(base[j].name, res[i].name) == 0 && base[j].size == res[i].size)
+        b = &base[j];
+    if (b == NULL || b->mps <= 0.0) {
+      printf("%-16s\t%6d\t%12.1f\t%12s\t%8s\n", res[i].name, res[i].size, res[i].mps, "-", "new");
+      continue;
+    }
+    double change = res[i].mps / b->mps - 1.0;
+    int regressed = change < -tolerance;
+    regressions += regressed;
+    printf("%-16s\t%6d\t%12.1f\t%12.1f\t%+7.1f%%%s\n", res[i].name, res[i].size,
+           res[i].mps, b->mps, 100.0 * change, regressed ? "\tREGRESSION" : "");
+  }
+  return regressions;
+}
+
+// Create an empty temporary file and return its (allocated) name.
+static char* makeTemp(void) {
+  const char* dir = getenv("TMPDIR");
+  char* name = malloc(FILENAME_MAX);
+  if (name == NULL)
+    error(2, errno, "Out of memory");
+  snprintf(name, FILENAME_MAX, "%s/imageBenchXXXXXX", dir != NULL ? dir : "/tmp");
+  int fd = mkstemp(name);
+  if (fd < 0)
+    error(2, errno, "Creating temporary file %s", name);
+  close(fd);
+  return name;
+}
+
+int main(int ac, char* av[]) {
+  int sizes[MAXSIZES] = { 256, 1024, 2048 };
+  int nsizes = 3;
+  int trials = 7;
+  int warmup = 2;
+  int threads = 0;
+  const char* filter = NULL;
+  const char* output = NULL;
+  const char* baseline = NULL;
+  double tolerance = 10.0;
+
+  int opt;
+  while ((opt = getopt(ac, av, "s:t:w:j:f:o:b:r:h")) != -1) {
+    switch (opt) {
+    case 's': {
+      nsizes = 0;
+      char* p = optarg;
+      while (nsizes < MAXSIZES && *p != '\0') {
+        char* end;
+        long v = strtol(p, &end, 10);
+        if (end == p || v < 4 || v > 65536)
+          error(1, 0, "Invalid size list: %s", optarg);
+        sizes[nsizes++] = (int)v;
+        p = *end == ',' ? end + 1 : end;
+      }
+      break;
+    }
+    case 't': trials = atoi(optarg); break;
+    case 'w': warmup = atoi(optarg); break;
+    case 'j': threads = atoi(optarg); break;
+    case 'f': filter = optarg; break;
+    case 'o': output = optarg; break;
+    case 'b': baseline = optarg; break;
+    case 'r': tolerance = atof(optarg); break;
+    default:
+      error(1, 0, "\n%s", USAGE);
+    }
+  }
+  if (optind < ac || nsizes == 0 || trials < 1 || trials > MAXTRIALS ||
+      warmup < 0 || threads < 0 || tolerance < 0.0)
+    error(1, 0, "\n%s", USAGE);
+
+  ImageInit();
+  ImageSetThreads(threads);
+
+  static Result res[MAXRESULTS];
+  int nres = 0;
+  char* file = makeTemp();
+  char* out = makeTemp();
+  Inputs in = { .file = file, .out = out };
+  printf("#%-15s\t%6s\t%12s\t%12s\t%12s\n", "benchmark", "size", "MP/s", "median", "p95");
+  for (int s = 0; s < nsizes; s++) {
+    int n = sizes[s];
+    in.img = ImageCreate(n, n, PixMax);
+    if (in.img == NULL)
+      error(2, errno, "Creating %dx%d image: %s", n, n, ImageErrMsg());
+    fillSynthetic(in.img);
+    in.small = ImageCrop(in.img, n - n/4, n - n/4, n/4, n/4);
+    in.doc = ImageCreateRects(n, n, PixMax, n / 16, 1);
+    in.rle = in.doc != NULL ? RLEFromImage(in.doc) : NULL;
+    in.rleSmall = in.rle != NULL ? RLECrop(in.rle, n - n/4, n - n/4, n/4, n/4) : NULL;
+    if (in.small == NULL || in.rleSmall == NULL || !ImageSave(in.img, in.file))
+      error(2, errno, "Preparing inputs: %s", ImageErrMsg());
+    for (int b = 0; b < NUMBENCH && nres < MAXRESULTS; b++) {
+      if (filter != NULL && strstr(benchmarks[b].name, filter) == NULL)
+        continue;
+      Result* r = &res[nres++];
+      runBench(b, &in, warmup, trials, r);
+      printf("%-16s\t%6d\t%12.1f\t%12.6f\t%12.6f\n", r->name, r->size, r->mps, r->median, r->p95);
+      fflush(stdout);
+    }
+    RLEDestroy(&in.rleSmall);
+    RLEDestroy(&in.rle);
+    ImageDestroy(&in.doc);
+    ImageDestroy(&in.small);
+    ImageDestroy(&in.img);
+  }
+  remove(file);
+  remove(out);
+  free(file);
+  free(out);
+
+  if (output != NULL)
+    writeResults(output, res, nres);
+
+  int status = 0;
+  if (baseline != NULL) {
+    static Result base[MAXRESULTS];
+    int nbase = readResults(baseline, base, MAXRESULTS);
+    int regressions = compareResults(res, nres, base, nbase, tolerance / 100.0);
+    if (regressions > 0) {
+      fprintf(stderr, "%d regression(s) beyond %.1f%% against %s\n",
+              regressions, tolerance, baseline);
+      status = 1;
+    }
+  }
+  return status;
+}
@@ -0,0 +1,272 @@
+// imageComplexity - Empirical complexity analysis of locate and blur.
+//
+// Sweeps image sizes, needle sizes and blur radii over synthetic images,
+// recording the pixmem count and wall time of each ImageLocateSubImage and
+// ImageBlur call.  Then fits the scaling exponent b of cost ~ a * x^b
+// (least squares on log-log) along each swept variable, keeping the others
+// fixed.  For example, blur cost should grow linearly with the number of
+// pixels (b ~ 1) and be independent of the window size (b ~ 0).
+//
+// Raw measurements go to a CSV file, and the fitted exponents to stdout,
+// as a whitespace-separated table that gnuplot and similar tools read
+// directly.
+//
+// This program is part of the image8bit project for the course AED,
+// DETI / UA.PT.
+//
+// You may freely use and modify this code, NO WARRANTY, blah blah,
+// as long as you give proper credit to the original and subsequent authors.
+
+#include <assert.h>
+#include <errno.h>
+#include <error.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "image8bit.h"
+#include "instrumentation.h"
+
+static const char* USAGE =
+    "USAGE:\n"
+    "  imageComplexity [OPTIONS]\n"
+    "OPTIONS:\n"
+    "  -N N,N,...      Haystack and blur image sizes, NxN (default 128,256,512,1024).\n"
+    "  -n N,N,...      Needle sizes, NxN (default 8,16,32).\n"
+    "  -r R,R,...      Blur radii, for (2R+1)x(2R+1) windows (default 1,2,4,8,16).\n"
+    "  -L L,L,...      Noise levels in the haystack (default 1,255):\n"
+    "                  1 is the worst case for locate, 255 is typical.\n"
+    "  -t N            Trials per measurement; the fastest is kept (default 3).\n"
+    "  -j N            Threads for parallel operations (default 0 = one per cpu).\n"
+    "  -o FILE         Write raw measurements to FILE, in CSV.\n";
+
+// Maximum number of values in each list, and of measurements
+#define MAXLIST 16
+#define MAXSAMPLES 4096
+
+// One measurement
+typedef struct {
+  const char* op;     // "locate" or "blur"
+  int size;           // haystack or image size (NxN)
+  int needle;         // needle size (NxN), for locate
+  int levels;         // haystack noise levels, for locate
+  int radius;         // blur radius
+  unsigned long pixmem;
+  double time;        // wall time (s)
+} Sample;
+
+static Sample samples[MAXSAMPLES];
+static int nsamples = 0;
+
+// Parse comma-separated list of positive integers s into v.
+// Returns the number of values.
+static int parseList(const char* s, int* v) {
+  int n = 0;
+  while (n < MAXLIST && *s != '\0') {
+    char* end;
+    long x = strtol(s, &end, 10);
+    if (end == s || x <= 0 || x > 1000000)
+      error(1, 0, "Invalid list: %s", s);
+    v[n++] = (int)x;
+    s = *end == ',' ? end + 1 : end;
+  }
+  return n;
+}
+
+static Sample* newSample(void) {
+  if (nsamples == MAXSAMPLES)
+    error(2, 0, "Too many measurements");
+  return &samples[nsamples++];
+}
+
+// Measure locate of a needle x needle in a size x size haystack with the
+// given levels, planted at the bottom-right corner (the last position
+// scanned).  Keeps the fastest of trials runs.
+static void measureLocate(int size, int needle, int levels, int trials) {
+  Image haystack, needleImg;
+  int pos = size - needle;
+  if (!ImageCreateHaystack(size, size, PixMax, needle, needle, pos, pos, levels, 1,
+                           &haystack, &needleImg))
+    error(2, errno, "Creating haystack: %s", ImageErrMsg());
+  Sample* s = newSample();
+  *s = (Sample){ "locate", size, needle, levels, 0, 0, INFINITY };
+  for (int t = 0; t < trials; t++) {
+    int x, y;
+    unsigned long p0 = InstrTotal(PIXMEM_COUNTER);
+    double t0 = wall_time();
+    int found = ImageLocateSubImage(haystack, &x, &y, needleImg);
+    double t1 = wall_time();
+    if (!found || x != pos || y != pos)
+      error(3, 0, "Locate failed for %dx%d needle in %dx%d haystack", needle, needle, size, size);
+    s->pixmem = InstrTotal(PIXMEM_COUNTER) - p0;
+    if (t1 - t0 < s->time) s->time = t1 - t0;
+  }
+  ImageDestroy(&needleImg);
+  ImageDestroy(&haystack);
+}
+
+// Measure blur of a size x size noise image with the given radius.
+// Keeps the fastest of trials runs.
+static void measureBlur(int size, int radius, int trials) {
+  Sample* s = newSample();
+  *s = (Sample){ "blur", size, 0, 0, radius, 0, INFINITY };
+  for (int t = 0; t < trials; t++) {
+    Image img = ImageCreateNoise(size, size, PixMax, 1);
+    if (img == NULL)
+      error(2, errno, "Creating image: %s", ImageErrMsg());
+    unsigned long p0 = InstrTotal(PIXMEM_COUNTER);
+    double t0 = wall_time();
+    ImageBlur(img, radius, radius);
+    double t1 = wall_time();
+    s->pixmem = InstrTotal(PIXMEM_COUNTER) - p0;
+    if (t1 - t0 < s->time) s->time = t1 - t0;
+    ImageDestroy(&img);
+  }
+}
+
+// Least-squares fit of log(y) = log(a) + b log(x) to n points.
+// Stores the exponent b in *b and the coefficient of determination in *r2.
+static void fitPower(const double* x, const double* y, int n, double* b, double* r2) {
+  double sx = 0, sy = 0, sxx = 0, sxy = 0, syy = 0;
+  for (int i = 0; i < n; i++) {
+    double lx = log(x[i]);
+    double ly = log(y[i] > 0 ? y[i] : 1e-12);
+    sx += lx; sy += ly; sxx += lx*lx; sxy += lx*ly; syy += ly*ly;
+  }
+  double vx = n*sxx - sx*sx;
+  double vy = n*syy - sy*sy;
+  double cov = n*sxy - sx*sy;
+  *b = vx > 0 ? cov / vx : 0.0;
+  *r2 = vx > 0 && vy > 0 ? cov*cov / (vx*vy) : 1.0;
+}
+
+// Swept variables
+enum { SWEEP_SIZE, SWEEP_NEEDLE, SWEEP_RADIUS };
+
+// Key selecting a series of samples: those of operation op, with the
+// given fields (those not -1), along variable sweep.
+typedef struct {
+  const char* op;
+  int sweep;
+  int size, needle, levels, radius;
+} Key;
+
+// Value of the swept variable of sample s in series k (a count of pixels).
+static double variable(const Key* k, const Sample* s) {
+  switch (k->sweep) {
+  case SWEEP_SIZE: return (double)s->size * s->size;
+  case SWEEP_NEEDLE: return (double)s->needle * s->needle;
+  default: return (double)(2*s->radius + 1) * (2*s->radius + 1);
+  }
+}
+
+// Fit and print one line of summary for the series selected by k.
+static void printFit(const Key* k, const char* name) {
+  static double x[MAXSAMPLES], pm[MAXSAMPLES], tm[MAXSAMPLES];
+  int n = 0;
+  for (int i = 0; i < nsamples; i++) {
+    const Sample* s = &samples[i];
+    if (strcmp(s->op, k->op) != 0) continue;
+    if (k->size >= 0 && s->size != k->size) continue;
+    if (k->needle >= 0 && s->needle != k->needle) continue;
+    if (k->levels >= 0 && s->levels != k->levels) continue;
+    if (k->radius >= 0 && s->radius != k->radius) continue;
+    x[n] = variable(k, s);
+    pm[n] = (double)s->pixmem;
+    tm[n] = s->time;
+    n++;
+  }
+  if (n < 2) return;
+  double bp, rp, bt, rt;
+  fitPower(x, pm, n, &bp, &rp);
+  fitPower(x, tm, n, &bt, &rt);
+  const char* var = k->sweep == SWEEP_SIZE ? "image_px" :
+                    k->sweep == SWEEP_NEEDLE ? "needle_px" : "window_px";
+  printf("%-32s\t%-10s\t%3d\t%8.3f\t%6.3f\t%8.3f\t%6.3f\n", name, var, n, bp, rp, bt, rt);
+}
+
+int main(int ac, char* av[]) {
+  int sizes[MAXLIST] = { 128, 256, 512, 1024 };
+  int nsizes = 4;
+  int needles[MAXLIST] = { 8, 16, 32 };
+  int nneedles = 3;
+  int radii[MAXLIST] = { 1, 2, 4, 8, 16 };
+  int nradii = 5;
+  int levels[MAXLIST] = { 1, 255 };
+  int nlevels = 2;
+  int trials = 3;
+  int threads = 0;
+  const char* output = NULL;
+
+  int opt;
+  while ((opt = getopt(ac, av, "N:n:r:L:t:j:o:h")) != -1) {
+    switch (opt) {
+    case 'N': nsizes = parseList(optarg, sizes); break;
+    case 'n': nneedles = parseList(optarg, needles); break;
+    case 'r': nradii = parseList(optarg, radii); break;
+    case 'L': nlevels = parseList(optarg, levels); break;
+    case 't': trials = atoi(optarg); break;
+    case 'j': threads = atoi(optarg); break;
+    case 'o': output = optarg; break;
+    default:
+      error(1, 0, "\n%s", USAGE);
+    }
+  }
+  if (optind < ac || trials < 1 || threads < 0)
+    error(1, 0, "\n%s", USAGE);
+  for (int l = 0; l < nlevels; l++)
+    if (levels[l] > PixMax)  // maxval marks the needle
+      error(1, 0, "Levels must be at most %d", PixMax);
+
+  ImageInit();
+  ImageSetThreads(threads);
+
+  for (int i = 0; i < nsizes; i++) {
+    for (int j = 0; j < nneedles; j++)
+      for (int l = 0; l < nlevels; l++)
+        if (needles[j] <= sizes[i])
+          measureLocate(sizes[i], needles[j], levels[l], trials);
+    for (int r = 0; r < nradii; r++)
+      measureBlur(sizes[i], radii[r], trials);
+  }
+
+  if (output != NULL) {
+    FILE* f = fopen(output, "w");
+    if (f == NULL)
+      error(2, errno, "Writing %s", output);
+    fputs("op,size,needle,levels,radius,pixmem,time\n", f);
+    for (int i = 0; i < nsamples; i++) {
+      const Sample* s = &samples[i];
+      fprintf(f, "%s,%d,%d,%d,%d,%lu,%.9f\n", s->op, s->size, s->needle, s->levels,
+              s->radius, s->pixmem, s->time);
+    }
+    if (fclose(f) != 0)
+      error(2, errno, "Writing %s", output);
+  }
+
+  // Summary: exponent b of cost ~ x^b along each swept variable
+  printf("#%-31s\t%-10s\t%3s\t%8s\t%6s\t%8s\t%6s\n",
+         "series", "variable", "n", "b_pixmem", "r2", "b_time", "r2");
+  char name[64];
+  for (int l = 0; l < nlevels; l++) {
+    int lv = levels[l];
+    for (int j = 0; j < nneedles; j++) {
+      snprintf(name, sizeof(name), "locate/levels=%d/needle=%d", lv, needles[j]);
+      printFit(&(Key){ "locate", SWEEP_SIZE, -1, needles[j], lv, -1 }, name);
+    }
+    for (int i = 0; i < nsizes; i++) {
+      snprintf(name, sizeof(name), "locate/levels=%d/size=%d", lv, sizes[i]);
+      printFit(&(Key){ "locate", SWEEP_NEEDLE, sizes[i], -1, lv, -1 }, name);
+    }
+  }
+  for (int r = 0; r < nradii; r++) {
+    snprintf(name, sizeof(name), "blur/radius=%d", radii[r]);
+    printFit(&(Key){ "blur", SWEEP_SIZE, -1, -1, -1, radii[r] }, name);
+  }
+  for (int i = 0; i < nsizes; i++) {
+    snprintf(name, sizeof(name), "blur/size=%d", sizes[i]);
+    printFit(&(Key){ "blur", SWEEP_RADIUS, sizes[i], -1, -1, -1 }, name);
+  }
+  return 0;
+}
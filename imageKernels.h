@@ -0,0 +1,603 @@
+/// imageKernels - Pixel kernels for the image8bit module.
+///
+/// This file is NOT a regular header: it has no include guard and is meant
+/// to be included by image8bit.c once for each supported pixel type.
+/// Before each inclusion, the includer must define:
+///
+///   PIXEL    the sample type (uint8 or uint16);
+///   K(name)  a macro that decorates kernel names with a type suffix,
+///            e.g. K(negative) -> negative8 or negative16.
+///
+/// This way, every kernel is written only once but compiled into two
+/// type-specialized versions, and the public functions in image8bit.c
+/// select the right one ONCE per call (see DISPATCH), never per pixel.
+///
+/// Kernels work on raw raster-scan arrays and know nothing about struct
+/// image, errCause or instrumentation: that is the caller's business.
+
+// Find minimum and maximum levels in array p[0..n-1].
+static void K(stats)(const PIXEL *p, size_t n, PIXEL *pmin, PIXEL *pmax)
+{
+  PIXEL min = (PIXEL)~(PIXEL)0;
+  PIXEL max = 0;
+  for (size_t i = 0; i < n; i++)
+  {
+    PIXEL v = p[i];
+    min = v < min ? v : min;
+    max = v > max ? v : max;
+  }
+  *pmin = min;
+  *pmax = max;
+}
+
+// Negate every level: v -> maxval - v.
+static void K(negative)(PIXEL *p, size_t n, PIXEL maxval)
+{
+  for (size_t i = 0; i < n; i++)
+    p[i] = (PIXEL)(maxval - p[i]);
+}
+
+// Threshold every level: v -> (v < thr) ? 0 : maxval.
+// thr is not narrowed to PIXEL: above the range of PIXEL, all go to 0.
+static void K(threshold)(PIXEL *p, size_t n, unsigned thr, PIXEL maxval)
+{
+  for (size_t i = 0; i < n; i++)
+    p[i] = p[i] < thr ? 0 : maxval;
+}
+
+// Map every level through a look-up table: v -> lut[v].
+// lut must cover the whole range of PIXEL.
+static void K(applyLUT)(PIXEL *p, size_t n, const PIXEL *lut)
+{
+  for (size_t i = 0; i < n; i++)
+    p[i] = lut[p[i]];
+}
+
+// Fill p[0..n-1] with noise levels in [0, levels-1]:
+// p[i] = levels * hash(seed, first + i) / 2^32, where hash is random64.
+// Each sample depends only on its index, so any slice of a raster may be
+// filled independently.
+static void K(noise)(PIXEL *p, size_t n, uint64_t first, uint64_t seed, uint32_t levels)
+{
+  for (size_t i = 0; i < n; i++)
+    p[i] = (PIXEL)(((random64(seed, first + i) >> 32) * levels) >> 32);
+}
+
+// Fill w x h raster p with a gradient from 0 to maxval: along x
+// (direction 0), along y (1), or along x+y (2), rounding to nearest.
+static void K(gradient)(PIXEL *p, int w, int h, int maxval, int direction)
+{
+  int span = direction == 0 ? w - 1 : direction == 1 ? h - 1 : w + h - 2;
+  span = span > 0 ? span : 1;
+  for (int y = 0; y < h; y++)
+  {
+    PIXEL *d = p + (size_t)y * w;
+    for (int x = 0; x < w; x++)
+    {
+      int t = direction == 0 ? x : direction == 1 ? y : x + y;
+      d[x] = (PIXEL)(((int64_t)t * maxval + span / 2) / span);
+    }
+  }
+}
+
+// Fill w x h raster p with a checkerboard of cell x cell squares,
+// alternating 0 (at the top left) and maxval.
+static void K(checker)(PIXEL *p, int w, int h, int cell, PIXEL maxval)
+{
+  for (int y = 0; y < h; y++)
+  {
+    PIXEL *d = p + (size_t)y * w;
+    int odd = (y / cell) & 1;
+    for (int x = 0; x < w; x++)
+      d[x] = ((x / cell) & 1) != odd ? maxval : 0;
+  }
+}
+
+// Fill w x h rectangle of raster p (row stride stride) with level v.
+static void K(fillRect)(PIXEL *p, int stride, int w, int h, PIXEL v)
+{
+  for (int y = 0; y < h; y++)
+  {
+    PIXEL *d = p + (size_t)y * stride;
+    for (int x = 0; x < w; x++)
+      d[x] = v;
+  }
+}
+
+// Size of the square blocks used to keep both source and destination
+// accesses cache-friendly in rotate.
+#ifndef ROTBLOCK
+#define ROTBLOCK 32
+#endif
+
+// Rotate w x h raster src into h x w raster dst,
+// such that src(x, y) goes to dst(y, w-1-x).
+static void K(rotate)(const PIXEL *src, int w, int h, PIXEL *dst)
+{
+  for (int y0 = 0; y0 < h; y0 += ROTBLOCK)
+  {
+    int y1 = y0 + ROTBLOCK < h ? y0 + ROTBLOCK : h;
+    for (int x0 = 0; x0 < w; x0 += ROTBLOCK)
+    {
+      int x1 = x0 + ROTBLOCK < w ? x0 + ROTBLOCK : w;
+      for (int x = x0; x < x1; x++)
+      {
+        PIXEL *d = dst + (size_t)(w - 1 - x) * h;
+        for (int y = y0; y < y1; y++)
+          d[y] = src[(size_t)y * w + x];
+      }
+    }
+  }
+}
+
+// Fill ow x oh raster dst with samples of src picked along an integer
+// affine map: dst(u, v) = src[base + u*su + v*sv].
+// This covers any crop combined with mirrors and quarter turns.
+// Works in square blocks, like rotate, so that column-wise source
+// accesses stay in cache.
+static void K(remap)(const PIXEL *src, ptrdiff_t base, ptrdiff_t su, ptrdiff_t sv,
+                     PIXEL *dst, int ow, int oh)
+{
+  for (int v0 = 0; v0 < oh; v0 += ROTBLOCK)
+  {
+    int v1 = v0 + ROTBLOCK < oh ? v0 + ROTBLOCK : oh;
+    for (int u0 = 0; u0 < ow; u0 += ROTBLOCK)
+    {
+      int u1 = u0 + ROTBLOCK < ow ? u0 + ROTBLOCK : ow;
+      for (int v = v0; v < v1; v++)
+      {
+        const PIXEL *s = src + base + (ptrdiff_t)v * sv;
+        PIXEL *d = dst + (size_t)v * ow;
+        for (int u = u0; u < u1; u++)
+          d[u] = s[(ptrdiff_t)u * su];
+      }
+    }
+  }
+}
+
+// Mirror w x h raster src left-right into dst.
+static void K(mirror)(const PIXEL *src, int w, int h, PIXEL *dst)
+{
+  for (int y = 0; y < h; y++)
+  {
+    const PIXEL *s = src + (size_t)y * w;
+    PIXEL *d = dst + (size_t)y * w + (w - 1);
+    for (int x = 0; x < w; x++)
+      d[-x] = s[x];
+  }
+}
+
+// Blend w x h raster src into dst (which has row stride dstride).
+// Saturates results to [0, maxval].
+static void K(blend)(PIXEL *dst, int dstride, const PIXEL *src, int w, int h,
+                     double alpha, int maxval)
+{
+  double beta = 1.0 - alpha;
+  for (int y = 0; y < h; y++)
+  {
+    PIXEL *d = dst + (size_t)y * dstride;
+    const PIXEL *s = src + (size_t)y * w;
+    for (int x = 0; x < w; x++)
+    {
+      int v = (int)(alpha * s[x] + beta * d[x] + 0.5);
+      v = v > maxval ? maxval : v;
+      v = v < 0 ? 0 : v;
+      d[x] = (PIXEL)v;
+    }
+  }
+}
+
+// Search for w2 x h2 raster p2 inside w1 x h1 raster p1, in raster order.
+// Candidate positions are filtered by their first level before comparing
+// whole rows with memcmp.
+// Returns 1 and sets (*px, *py) on success, returns 0 otherwise.
+// *accesses is incremented by the number of pixel accesses performed.
+static int K(locate)(const PIXEL *p1, int w1, int h1,
+                     const PIXEL *p2, int w2, int h2,
+                     int *px, int *py, unsigned long *accesses)
+{
+  size_t rowbytes = (size_t)w2 * sizeof(PIXEL);
+  PIXEL first = p2[0];
+  unsigned long acc = 1;
+  int found = 0;
+  for (int y = 0; !found && y <= h1 - h2; y++)
+  {
+    const PIXEL *row = p1 + (size_t)y * w1;
+    for (int x = 0; x <= w1 - w2; x++)
+    {
+      acc++;
+      if (row[x] != first)
+        continue;
+      int i = 0;
+      while (i < h2 && memcmp(row + (size_t)i * w1 + x, p2 + (size_t)i * w2, rowbytes) == 0)
+        i++;
+      acc += 2ul * (unsigned long)w2 * (unsigned long)(i < h2 ? i + 1 : h2);
+      if (i == h2)
+      {
+        *px = x;
+        *py = y;
+        found = 1;
+        break;
+      }
+    }
+  }
+  *accesses += acc;
+  return found;
+}
+
+// Mean filter of w x h raster p with a (2dx+1)x(2dy+1) window clipped to
+// the image, with rounding (sum + count/2) / count, for rows [y0, y1).
+// The result is written to out, starting with row y0 (out must not alias
+// p).
+// colSum is a scratch array of w accumulators and rowSum one of w+1.
+//
+// Cost is O(1) per pixel, independent of dx and dy:
+// colSum[x] keeps the sum of column x over rows [y-dy, y+dy], updated by
+// adding one row and removing another as y advances, and each output row
+// is obtained from prefix sums of colSum.
+static void K(blur)(const PIXEL *p, int w, int h, int dx, int dy, int y0, int y1, PIXEL *out,
+                    uint64_t *colSum, uint64_t *rowSum)
+{
+  for (int x = 0; x < w; x++)
+    colSum[x] = 0;
+  // Preload rows [y0-dy, y0+dy-1] (clipped)
+  for (int r = y0 - dy < 0 ? 0 : y0 - dy; r < y0 + dy && r < h; r++)
+  {
+    const PIXEL *s = p + (size_t)r * w;
+    for (int x = 0; x < w; x++)
+      colSum[x] += s[x];
+  }
+  for (int y = y0; y < y1; y++)
+  {
+    // Slide vertical window to [y-dy, y+dy]
+    if (y + dy < h)
+    {
+      const PIXEL *s = p + (size_t)(y + dy) * w;
+      for (int x = 0; x < w; x++)
+        colSum[x] += s[x];
+    }
+    if (y > y0 && y - dy - 1 >= 0)
+    {
+      const PIXEL *s = p + (size_t)(y - dy - 1) * w;
+      for (int x = 0; x < w; x++)
+        colSum[x] -= s[x];
+    }
+    int rows = (y + dy >= h ? h - 1 : y + dy) - (y - dy < 0 ? 0 : y - dy) + 1;
+
+    // Horizontal prefix sums: rowSum[x] = colSum[0] + ... + colSum[x-1]
+    rowSum[0] = 0;
+    for (int x = 0; x < w; x++)
+      rowSum[x + 1] = rowSum[x] + colSum[x];
+
+    PIXEL *d = out + (size_t)(y - y0) * w;
+    for (int x = 0; x < w; x++)
+    {
+      int x0 = x - dx < 0 ? 0 : x - dx;
+      int x1 = x + dx >= w ? w - 1 : x + dx;
+      uint64_t count = (uint64_t)(x1 - x0 + 1) * (uint64_t)rows;
+      uint64_t sum = rowSum[x1 + 1] - rowSum[x0];
+      d[x] = (PIXEL)((sum + count / 2) / count);
+    }
+  }
+}
+
+// Widen row (of w samples) to int32 into out[0 .. w+2r-1], adding r samples
+// on each side as given by border mode (see borderIndex).
+// A NULL row stands for a row outside the image, in IMAGE_BORDER_ZERO mode.
+static void K(padRow)(const PIXEL *row, int w, int r, int border, int32_t *out)
+{
+  if (row == NULL)
+  {
+    memset(out, 0, ((size_t)w + 2 * (size_t)r) * sizeof(int32_t));
+    return;
+  }
+  for (int i = 0; i < r; i++)
+  {
+    int j = borderIndex(i - r, w, border);
+    out[i] = j < 0 ? 0 : row[j];
+    j = borderIndex(w + i, w, border);
+    out[r + w + i] = j < 0 ? 0 : row[j];
+  }
+  int32_t *mid = out + r;
+  for (int x = 0; x < w; x++)
+    mid[x] = row[x];
+}
+
+// Divide the w sums in acc by divisor, rounding half up, and store them
+// into dst saturated to [0, maxval].
+// If shift >= 0, divisor is 2^shift and the division is a shift.
+static void K(storeRow)(const int64_t *acc, int w, int64_t divisor, int shift,
+                        int maxval, PIXEL *dst)
+{
+  if (shift >= 0)
+  {
+    int64_t half = shift > 0 ? (int64_t)1 << (shift - 1) : 0;
+    for (int x = 0; x < w; x++)
+    {
+      int64_t q = (acc[x] + half) >> shift; // arithmetic shift: floor
+      dst[x] = (PIXEL)(q < 0 ? 0 : q > maxval ? maxval : q);
+    }
+    return;
+  }
+  for (int x = 0; x < w; x++)
+  {
+    int64_t num = 2 * acc[x] + divisor;
+    int64_t den = 2 * divisor;
+    int64_t q = num >= 0 ? num / den : -((-num + den - 1) / den); // floor
+    dst[x] = (PIXEL)(q < 0 ? 0 : q > maxval ? maxval : q);
+  }
+}
+
+// Convert n samples of row to float.
+static void K(loadRowF)(const PIXEL *row, int n, float *out)
+{
+  for (int x = 0; x < n; x++)
+    out[x] = row[x];
+}
+
+// Round n float samples to the nearest level, saturated to [0, maxval],
+// into dst.
+static void K(storeRowF)(const float *src, int n, int maxval, PIXEL *dst)
+{
+  for (int x = 0; x < n; x++)
+  {
+    float v = src[x] + 0.5f;
+    dst[x] = (PIXEL)(v < 0.0f ? 0 : v > (float)maxval ? maxval : (int)v);
+  }
+}
+
+// Running maximum (if dilate is nonzero) or minimum of each window of
+// 2r+1 samples along a row, by van Herk / Gil-Werman: the padded row
+// p = [id]*r + src + [id]*r is cut in blocks of k = 2r+1 samples, g holds
+// maxima from the start of each block, h maxima to its end, and window
+// [x, x+2r] of p, which spans at most two blocks, is max(h[x], g[x+2r]).
+// That is 3 comparisons per sample, whatever r.  Samples outside the row
+// are the identity id (0 to dilate, all ones to erode), so windows are
+// clipped to the row.
+// g and h have room for n + 2r samples; dst may be src.
+static void K(morphRow)(const PIXEL *src, PIXEL *dst, int n, int r, int dilate,
+                        PIXEL *g, PIXEL *h)
+{
+  int m = n + 2 * r;
+  int k = 2 * r + 1;
+  memset(g, dilate ? 0 : 0xFF, (size_t)r * sizeof(PIXEL));
+  memset(g + r + n, dilate ? 0 : 0xFF, (size_t)r * sizeof(PIXEL));
+  memcpy(g + r, src, (size_t)n * sizeof(PIXEL));
+  for (int b0 = 0; b0 < m; b0 += k)
+  {
+    int b1 = b0 + k < m ? b0 + k : m;
+    h[b1 - 1] = g[b1 - 1];
+    for (int i = b1 - 2; i >= b0; i--)
+      h[i] = (g[i] > h[i + 1]) == (dilate != 0) ? g[i] : h[i + 1];
+    for (int i = b0 + 1; i < b1; i++)
+      g[i] = (g[i] > g[i - 1]) == (dilate != 0) ? g[i] : g[i - 1];
+  }
+  for (int x = 0; x < n; x++)
+    dst[x] = (h[x] > g[x + 2 * r]) == (dilate != 0) ? h[x] : g[x + 2 * r];
+}
+
+// Same as morphRow, along the n rows of a strip of cw columns: row i of the
+// strip starts at src + i*stride, and whole rows are combined at a time,
+// with SIMD (see minmax8).
+// g and h have room for (n + 2r) * cw samples; dst may be src.
+static void K(morphCols)(const PIXEL *src, PIXEL *dst, size_t stride, int n, int cw, int r,
+                         int dilate, PIXEL *g, PIXEL *h)
+{
+  int m = n + 2 * r;
+  int k = 2 * r + 1;
+  size_t rowBytes = (size_t)cw * sizeof(PIXEL);
+  memset(g, dilate ? 0 : 0xFF, (size_t)r * rowBytes);
+  memset(g + (size_t)(r + n) * cw, dilate ? 0 : 0xFF, (size_t)r * rowBytes);
+  for (int i = 0; i < n; i++)
+    memcpy(g + (size_t)(r + i) * cw, src + (size_t)i * stride, rowBytes);
+  for (int b0 = 0; b0 < m; b0 += k)
+  {
+    int b1 = b0 + k < m ? b0 + k : m;
+    memcpy(h + (size_t)(b1 - 1) * cw, g + (size_t)(b1 - 1) * cw, rowBytes);
+    for (int i = b1 - 2; i >= b0; i--)
+      K(minmax)(h + (size_t)i * cw, g + (size_t)i * cw, h + (size_t)(i + 1) * cw, cw, dilate);
+    for (int i = b0 + 1; i < b1; i++)
+      K(minmax)(g + (size_t)i * cw, g + (size_t)i * cw, g + (size_t)(i - 1) * cw, cw, dilate);
+  }
+  for (int y = 0; y < n; y++)
+    K(minmax)(dst + (size_t)y * stride, h + (size_t)y * cw, g + (size_t)(y + 2 * r) * cw, cw,
+              dilate);
+}
+
+// Subtract b from a, sample by sample: a[i] -= b[i].
+// Requires: b[i] <= a[i].
+static void K(difference)(PIXEL *a, const PIXEL *b, size_t n)
+{
+  for (size_t i = 0; i < n; i++)
+    a[i] = (PIXEL)(a[i] - b[i]);
+}
+
+// Resample row src along x: dst[o] is the sum of weight[o*taps + t] *
+// src[first[o] + t], for t < taps, shifted right by shift with rounding.
+static void K(resizeRow)(const PIXEL *src, const int *first, const int32_t *weight, int taps,
+                         int ow, int shift, int32_t *dst)
+{
+  int64_t half = shift > 0 ? (int64_t)1 << (shift - 1) : 0;
+  for (int o = 0; o < ow; o++)
+  {
+    const PIXEL *s = src + first[o];
+    const int32_t *wt = weight + (size_t)o * taps;
+    int64_t sum = half;
+    for (int t = 0; t < taps; t++)
+      sum += (int64_t)wt[t] * s[t];
+    dst[o] = (int32_t)(sum >> shift);
+  }
+}
+
+// Average f x f blocks of src (rows stride samples apart) into ow samples
+// of dst, rounding half up.  Requires: f is a power of 2.
+static void K(shrinkRow)(const PIXEL *src, size_t stride, int f, int ow, PIXEL *dst)
+{
+  int shift = 0;
+  while ((1 << shift) < f * f)
+    shift++;
+  uint32_t half = (uint32_t)(f * f) / 2;
+  for (int o = 0; o < ow; o++)
+  {
+    uint32_t sum = half;
+    for (int j = 0; j < f; j++)
+    {
+      const PIXEL *s = src + (size_t)j * stride + (size_t)o * f;
+      for (int i = 0; i < f; i++)
+        sum += s[i];
+    }
+    dst[o] = (PIXEL)(sum >> shift);
+  }
+}
+
+// Sample src (w x h) at n points along a line, into dst: point i is at
+// (sx + i*dx, sy + i*dy), coordinates in fixed point with 24 fractional
+// bits.  With bilinear, the 4 samples around the point are interpolated,
+// else the nearest one is taken.  Samples outside src count as 0.
+// Returns the number of samples read from src.
+static unsigned long K(warpRow)(const PIXEL *src, int w, int h, int64_t sx, int64_t sy,
+                                int64_t dx, int64_t dy, int n, int bilinear, PIXEL *dst)
+{
+  unsigned long reads = 0;
+  if (!bilinear)
+  {
+    for (int i = 0; i < n; i++, sx += dx, sy += dy)
+    {
+      int64_t x = (sx + 0x800000) >> 24, y = (sy + 0x800000) >> 24;
+      if (x >= 0 && x < w && y >= 0 && y < h)
+      {
+        dst[i] = src[(size_t)y * w + (size_t)x];
+        reads++;
+      }
+      else
+        dst[i] = 0;
+    }
+    return reads;
+  }
+  for (int i = 0; i < n; i++, sx += dx, sy += dy)
+  {
+    // Interpolate with the top 16 bits of the fractions
+    int64_t x = sx >> 24, y = sy >> 24;
+    int64_t fx = (sx >> 8) & 0xffff, fy = (sy >> 8) & 0xffff;
+    int64_t p00, p01, p10, p11;
+    if (x >= 0 && x + 1 < w && y >= 0 && y + 1 < h)
+    {
+      const PIXEL *s = src + (size_t)y * w + (size_t)x;
+      p00 = s[0];
+      p01 = s[1];
+      p10 = s[w];
+      p11 = s[w + 1];
+      reads += 4;
+    }
+    else if (x >= -1 && x < w && y >= -1 && y < h)
+    {
+      // On the border: some of the 4 samples are outside
+      int x0 = x >= 0, x1 = x + 1 < w, y0 = y >= 0, y1 = y + 1 < h;
+      const PIXEL *s = src + (y0 ? y : y + 1) * w + (x0 ? x : x + 1);
+      p00 = x0 && y0 ? *s : 0;
+      p01 = x1 && y0 ? s[x0] : 0;
+      p10 = x0 && y1 ? s[y0 ? w : 0] : 0;
+      p11 = x1 && y1 ? s[(y0 ? w : 0) + x0] : 0;
+      reads += (unsigned long)((x0 + x1) * (y0 + y1));
+    }
+    else
+    {
+      dst[i] = 0;
+      continue;
+    }
+    int64_t top = p00 * (0x10000 - fx) + p01 * fx;
+    int64_t bottom = p10 * (0x10000 - fx) + p11 * fx;
+    dst[i] = (PIXEL)((top * (0x10000 - fy) + bottom * fy + ((int64_t)1 << 31)) >> 32);
+  }
+  return reads;
+}
+
+// Index of the first sample equal to v in p[0..n-1], or n if there is none.
+static int K(findLevel)(const PIXEL *p, int n, PIXEL v)
+{
+  if (sizeof(PIXEL) == 1)
+  {
+    const PIXEL *q = memchr(p, v, (size_t)n);
+    return q != NULL ? (int)(q - p) : n;
+  }
+  int i = 0;
+  while (i < n && p[i] != v)
+    i++;
+  return i;
+}
+
+// Length of the run of samples equal to v at the start of p[0..n-1].
+// Long runs are skipped 8 bytes at a time.
+static int K(runLength)(const PIXEL *p, int n, PIXEL v)
+{
+  const int step = (int)(sizeof(uint64_t) / sizeof(PIXEL));
+  uint64_t pattern = (uint64_t)v * (sizeof(PIXEL) == 1 ? 0x0101010101010101u : 0x0001000100010001u);
+  int i = 0;
+  for (uint64_t word; i + step <= n; i += step)
+  {
+    memcpy(&word, p + i, sizeof(word));
+    if (word != pattern)
+      break;
+  }
+  while (i < n && p[i] == v)
+    i++;
+  return i;
+}
+
+// Label the foreground (nonzero) samples of rows [y0, y1) of the w-wide
+// raster array p: labels gets provisional labels, taken from *next on and
+// linked in the union-find forest parent (see ufUnion).  Neighbours are
+// looked up in rows y0 and later only, so that row bands may be labeled
+// independently.  The neighbours of x are a (up-left), b (up), c
+// (up-right) and d (left); with 8-connectivity, b alone decides when it is
+// foreground, as it touches all the others, which saves most unions.
+static void K(labelRows)(const PIXEL *p, int w, int y0, int y1, int conn8, uint32_t *labels,
+                         uint32_t *parent, uint32_t *next)
+{
+  for (int y = y0; y < y1; y++)
+  {
+    const PIXEL *row = p + (size_t)y * w;
+    uint32_t *lab = labels + (size_t)y * w;
+    const uint32_t *up = y > y0 ? lab - w : lab; // not read if y == y0
+    for (int x = 0; x < w; x++)
+    {
+      if (row[x] == 0)
+      {
+        lab[x] = 0;
+        continue;
+      }
+      uint32_t d = x > 0 ? lab[x - 1] : 0;
+      if (y == y0) // first row: d only
+      {
+        if (d == 0)
+        {
+          d = (*next)++;
+          parent[d] = d;
+        }
+        lab[x] = d;
+        continue;
+      }
+      uint32_t b = up[x];
+      if (b != 0)
+      {
+        lab[x] = d != 0 && d != b && !conn8 ? ufUnion(parent, b, d) : b;
+        continue;
+      }
+      uint32_t a = conn8 && x > 0 ? up[x - 1] : 0;
+      uint32_t c = conn8 && x + 1 < w ? up[x + 1] : 0;
+      uint32_t l;
+      if (c != 0)
+        l = a != 0 ? ufUnion(parent, c, a) : d != 0 ? ufUnion(parent, c, d) : c;
+      else if (a != 0)
+        l = a;
+      else if (d != 0)
+        l = d;
+      else
+      {
+        l = (*next)++;
+        parent[l] = l;
+      }
+      lab[x] = l;
+    }
+  }
+}
@@ -12,9 +12,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <inttypes.h>
 #include <errno.h>
 #include <error.h>
 #include <assert.h>
+#include <math.h>
+#include <glob.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include "image8bit.h"
 #include "instrumentation.h"
@@ -24,6 +33,8 @@ static const char* USAGE =
     "  Apply pipeline of image processing operations to PGM files.\n"
     "  Arguments are processed from left to right and may be\n"
     "  FILES, OPERATIONS, or OPERANDS to operations.\n"
+    "  The whole pipeline is parsed before it runs, and consecutive\n"
+    "  neg/thr/bri or crop/rotate/mirror operations may run as one pass.\n"
     "  Some operations create images, which are appended to an internal buffer:\n"
     "      I0, I1, ..., PRED, CURR\n"
     "  The last image in the buffer is called the current image CURR and its\n"
@@ -31,31 +42,93 @@ static const char* USAGE =
     "  Most operations apply to CURR and some also use PRED.\n"
     "\n"
     "FILES:\n"
-    "  Currently, only image files in 8-bit raw PGM format are accepted.\n"
+    "  Image files in 8-bit or 16-bit raw PGM format are accepted.\n"
     "  Input file names must be distinct from operation names.\n"
+    "  All input files start loading in the background when the pipeline\n"
+    "  starts, and saves finish in the background; they are checked at exit.\n"
     "\n"
     "OPERATIONS:\n"
     "  FILE            Load PGM image file, creating new image\n"
-    "  save FILE       Save CURR to PGM file\n"
+    "  save FILE       Save CURR to PGM file (FILE may be a NAME template)\n"
     "  info            Show information on CURR (size and range)\n"
     "  tic             Reset instrumentation counters and times.\n"
-    "  toc             Print instrumentation counters and times.\n"
+    "  perf            Also count hardware events (cycles, instructions, cache,\n"
+    "                  TLB and branch misses) in toc and report, if the OS\n"
+    "                  allows it (see /proc/sys/kernel/perf_event_paranoid).\n"
+    "  toc             Print instrumentation counters and times, per operation.\n"
+    "  report FILE     Write per-operation instrumentation to FILE, as JSON\n"
+    "                  (*.json), CSV (*.csv) or text; FILE - is stdout.\n"
+    "  layout LAYOUT   Store CURR in raster (rows) or tiled (64x64 tiles) layout,\n"
+    "                  which speeds up rotate, locate and other 2D accesses\n"
     "\n"              
     "  neg             Apply photo-negative effect to CURR\n"
     "  thr LEVEL       Apply thresholding to CURR\n"
     "  bri FACTOR      Scale brightness in CURR by FACTOR\n"
+    "  lazy            Run the neg/thr/bri/blur operations that follow on CURR\n"
+    "                  as one chain of lazy images, evaluated tile by tile\n"
     "\n"              
-    "  create W,H      Create new black image with WxH pixels\n"
+    "  create W,H[,M]  Create new black image with WxH pixels and maxval M\n"
+    "  gen KIND ARGS   Create new synthetic image, reproducibly from SEED:\n"
+    "    gen noise W,H[,SEED[,M]]          uniform noise in [0,M]\n"
+    "    gen gradient W,H[,DIR[,M]]        ramp along x (DIR 0), y (1) or x+y (2)\n"
+    "    gen checker W,H[,CELL[,M]]        checkerboard of CELLxCELL squares\n"
+    "    gen rects W,H[,N[,SEED[,M]]]      N random rectangles on black\n"
+    "    gen haystack W,H,NW,NH,X,Y[,LEVELS[,SEED[,M]]]\n"
+    "                    NWxNH needle (PRED) planted at (X,Y) in WxH haystack\n"
+    "                    (CURR), both noise in [0,LEVELS-1], for locate;\n"
+    "                    LEVELS 1 gives the worst case for locate\n"
     "  rotate          Rotate CURR 90º counter-clockwise, creating new image\n"
     "  mirror          Mirror CURR left-to-right, creating new image\n"
     "  crop X,Y,W,H    Crop a rectangle from CURR, creating new image\n"
+    "  resize MODE W,H Resize CURR to WxH, creating new image; MODE is area\n"
+    "                  (averaging, to shrink) or bilinear (to enlarge)\n"
+    "  warp MODE A,B,C,D,E,F W,H\n"
+    "                  Warp CURR by an affine transform, creating new WxH\n"
+    "                  image: pixel (x,y) takes the level of CURR at point\n"
+    "                  (A*x+B*y+C, D*x+E*y+F), black outside CURR; MODE is\n"
+    "                  nearest or bilinear\n"
+    "  turn DEGREES    Rotate CURR by DEGREES counter-clockwise around its\n"
+    "                  center (bilinear, same size), creating new image\n"
+    "  rle KIND ARGS   Encode CURR with run lengths, apply an operation to the\n"
+    "                  runs, and decode the result:\n"
+    "    rle neg / rle thr LEVEL / rle bri FACTOR     as neg, thr and bri\n"
+    "    rle mirror / rle crop X,Y,W,H                as mirror and crop\n"
+    "    rle locate                                   as locate\n"
+    "    rle file FILE   save to FILE in RLE format and load it back,\n"
+    "                    creating new image\n"
     "\n"              
     "  paste X,Y       Paste PRED into CURR at position (X,Y)\n"
     "  blend X,Y,alpha Blend PRED into CURR at position (X,Y) with given alpha\n"
     "\n"              
     "  locate          Search PRED in CURR, print matching position, or NOTFOUND\n"
+    "  compare X,Y     Compare PRED with CURR at position (X,Y): print the sum of\n"
+    "                  absolute and squared differences, the largest difference\n"
+    "                  and the PSNR\n"
+    "  equal           Fail unless PRED and CURR are identical (size, maxval and\n"
+    "                  pixels); for tests, instead of save and cmp\n"
+    "  label CONN      Label connected components of nonzero pixels of CURR,\n"
+    "                  with CONN (4 or 8) connectivity; print their count and,\n"
+    "                  for each one, its area, bounding box and centroid\n"
     "\n"              
     "  blur DX,DY      blur CURR using (2DX+1)x(2Dy+1) mean filter\n"
+    "  median DX,DY    Median filter CURR over (2DX+1)x(2DY+1) windows\n"
+    "  erode DX,DY     Erode CURR with a (2DX+1)x(2DY+1) rectangle (minimum)\n"
+    "  dilate DX,DY    Dilate CURR with a (2DX+1)x(2DY+1) rectangle (maximum)\n"
+    "  open DX,DY      Erode, then dilate CURR (removes small bright specks)\n"
+    "  close DX,DY     Dilate, then erode CURR (fills small dark holes)\n"
+    "  gradient DX,DY  Dilation minus erosion of CURR (outlines edges)\n"
+    "  mask LEVEL MORPH DX,DY\n"
+    "                  Threshold CURR at LEVEL into a bit mask, apply MORPH\n"
+    "                  (erode, dilate, open or close) with a (2DX+1)x(2DY+1)\n"
+    "                  rectangle to the mask, and expand it back into CURR\n"
+    "  conv BORDER KERNEL\n"
+    "                  Convolve CURR with KERNEL, reading outside CURR as\n"
+    "                  given by BORDER: clamp, mirror or zero.  KERNEL is\n"
+    "                  KW,KH,DIV,K1,K2,...,Kn (n = KWxKH weights, row by row,\n"
+    "                  divided by DIV), or one of sharpen, sobelx, sobely,\n"
+    "                  gauss3, gauss5.\n"
+    "  gauss SIGMA     Blur CURR with an approximate Gaussian of std. dev.\n"
+    "                  SIGMA pixels (three box passes, any SIGMA at the same cost)\n"
     "\n"              
     "OPERANDS:\n"     
     "  X,Y             Pixel coordinates: 0,0 is top left corner\n"
@@ -63,6 +136,42 @@ static const char* USAGE =
     "  W,H             Width and height of image or rectangular region\n"
     "  alpha           Blending factor\n"
     "\n"
+    "BATCH MODE:\n"
+    "  imageTool batch [-j THREADS] [-m MB] [-o NAME] [-r FILE] INPUT... -- [OPERATION...]\n"
+    "  Apply the same pipeline to each INPUT, in parallel.\n"
+    "  Each INPUT is loaded as I0 before the pipeline runs.\n"
+    "  The pipeline may not use tic, toc or report: use -r instead.\n"
+    "  INPUT may be a file, a quoted glob pattern, or @LIST, a file with\n"
+    "  one input name per line.\n"
+    "  -j THREADS      Number of worker threads (default: number of cpus);\n"
+    "                  the cpus are shared among them by parallel operations\n"
+    "  -m MB           Bound on memory for images in flight (default: 1024)\n"
+    "  -o NAME         Save final CURR of each pipeline to NAME template\n"
+    "  -r FILE         Write instrumentation of the whole batch to FILE, as\n"
+    "                  in report\n"
+    "\n"
+    "NAME templates:\n"
+    "  %s              Input file name, without directory and extension\n"
+    "  %d              Input index in batch (0 outside batch mode)\n"
+    "  %%              A literal %\n"
+    "\n"
+    "SERVER MODE:\n"
+    "  imageTool serve [-j THREADS] [-m MB] [-s SOCKET]\n"
+    "  Run pipelines given one per line (files and operations separated by\n"
+    "  spaces, as in the command line) from stdin, or from the clients of Unix\n"
+    "  domain socket SOCKET.  Each pipeline gets its output, then a line OK or\n"
+    "  ERROR N: MESSAGE.  Pipelines run concurrently, but each client (or\n"
+    "  stdin) gets its responses in the order of its requests.  Pipelines may\n"
+    "  not use tic, toc or report.\n"
+    "  Loaded files are kept decoded in a cache, shared by all pipelines, and\n"
+    "  are loaded again only when their modification time or size changes.\n"
+    "  -j THREADS      Number of pipelines run at once (default: number of\n"
+    "                  cpus); with -s, also of clients served at once; the\n"
+    "                  cpus are shared among them by parallel operations\n"
+    "  -m MB           Bound on memory for cached images (default: 1024);\n"
+    "                  the least recently used images are dropped first\n"
+    "  -s SOCKET       Listen on SOCKET instead of reading stdin\n"
+    "\n"
     ;
 
 static char* errors[] = {
@@ -74,6 +183,12 @@ static char* errors[] = {
   "Invalid operand",
   "Invalid rect (overflow)",
   "Invalid alpha",
+  "Images have different depths",
+  "Batch failed for some inputs",
+  "Writing report failed",
+  "Images differ",
+  "Saving failed",
+  "Not allowed in batch or server mode",
 };
 
 
@@ -85,143 +200,1730 @@ static char* errors[] = {
 // Also, the program does not test every module function, but you may easily
 // add new operations for that purpose.
 
-int main(int ac, char* av[]) {
-  if (ac <= 1) {
-    error(5, 0, "\n%s", USAGE);
+// Log progress messages to stderr (not in batch mode).
+static int verbose = 1;
+#define LOG(...) do { if (verbose) fprintf(stderr, __VA_ARGS__); } while (0)
+
+// Diagnostics handler of the library: log its messages.
+static void logDiag(const char* msg, void* arg) {
+  (void)arg;
+  LOG("%s\n", msg);
+}
+
+// Expand NAME template tmpl into out (with capacity size), for the given
+// input file name and index.  Returns 0 if the result does not fit.
+static int expandName(char* out, size_t size, const char* tmpl,
+                      const char* input, int index) {
+  // base name of input, without directory and extension
+  const char* base = "";
+  int baselen = 0;
+  if (input != NULL) {
+    const char* slash = strrchr(input, '/');
+    base = slash != NULL ? slash + 1 : input;
+    const char* dot = strrchr(base, '.');
+    baselen = dot != NULL && dot != base ? (int)(dot - base) : (int)strlen(base);
   }
+  size_t len = 0;
+  for (const char* t = tmpl; *t != '\0'; t++) {
+    int r;
+    if (t[0] == '%' && t[1] == 's') {
+      r = snprintf(out + len, size - len, "%.*s", baselen, base); t++;
+    } else if (t[0] == '%' && t[1] == 'd') {
+      r = snprintf(out + len, size - len, "%d", index); t++;
+    } else if (t[0] == '%' && t[1] == '%') {
+      r = snprintf(out + len, size - len, "%%"); t++;
+    } else {
+      r = snprintf(out + len, size - len, "%c", *t);
+    }
+    if (r < 0 || (size_t)r >= size - len) return 0;
+    len += (size_t)r;
+  }
+  return 1;
+}
 
-  ImageInit();
+/// Pipeline compiler
+//
+// The command line is not interpreted directly.  It is first compiled into
+// a Program: a list of operations whose operands are parsed and whose image
+// arguments (CURR, PRED) are resolved to image numbers I0, I1, ...
+// The Program is then optimized into a plan:
+//  - runs of point operations (neg, thr, bri) are fused into a single
+//    look-up table pass over CURR;
+//  - chains of crop/rotate/mirror whose intermediate images are used by
+//    nothing else are fused into a single ImageRemap, so the intermediate
+//    images are never created;
+//  - each image is destroyed right after its last use.
 
-  int err = 0;
-  int x, y, w, h;
+typedef enum {
+  OP_LOAD, OP_SAVE, OP_INFO, OP_TIC, OP_TOC, OP_REPORT,
+  OP_NEG, OP_THR, OP_BRI,
+  OP_CREATE, OP_GEN, OP_ROTATE, OP_MIRROR, OP_CROP,
+  OP_PASTE, OP_BLEND, OP_LOCATE, OP_COMPARE, OP_EQUAL, OP_LABEL, OP_BLUR, OP_CONV, OP_GAUSS, OP_MEDIAN, OP_MORPH, OP_MASK, OP_RESIZE,
+  OP_WARP, OP_TURN, OP_RLE, OP_LAYOUT,
+  OP_LAZY,            // marks the operations that follow, see isLazyOp
+  OP_LUT, OP_REMAP,   // fused operations
+} OpKind;
+
+// Operations on run-length encoded images, for OP_RLE
+typedef enum {
+  RLE_FILE, RLE_NEG, RLE_THR, RLE_BRI, RLE_MIRROR, RLE_CROP, RLE_LOCATE,
+} RLEKind;
+
+static const char* rleNames[] = { "file", "neg", "thr", "bri", "mirror", "crop", "locate" };
+
+// Synthetic image generators, for OP_GEN
+typedef enum {
+  GEN_NOISE, GEN_GRADIENT, GEN_CHECKER, GEN_RECTS, GEN_HAYSTACK,
+} GenKind;
+
+typedef struct {
+  OpKind kind;
+  const char* file;   // file name or NAME template, for OP_LOAD, OP_SAVE, OP_REPORT;
+                      // file name for OP_RLE file
+  int x, y, w, h;     // X,Y,W,H operands (DX,DY for blur)
+  double value;       // LEVEL, FACTOR, alpha, SIGMA, DEGREES or maxval operand
+  int src;            // image number of CURR used, or -1
+  int src2;           // image number of PRED used, or -1
+  int dst;            // image number created, or -1
+  int dst2;           // second image number created (needle of gen haystack), or -1
+  GenKind gen;        // generator, for OP_GEN
+  int param[4];       // OP_GEN operands after W,H: NW,NH (haystack),
+                      // DIR/CELL/N/LEVELS, and SEED; OP_MORPH, OP_MASK operation;
+                      // OP_RESIZE and OP_WARP mode; OP_LAYOUT layout;
+                      // OP_LABEL connectivity; OP_RLE operation
+  double matrix[6];   // OP_WARP matrix
+  int* kernel;        // OP_CONV weights (w x h, divisor value, border x),
+                      // owned by the Program
+  int first, count;   // fused operations: ops[first..first+count-1]
+} Op;
+
+typedef struct {
+  Op* ops;            // operations, as given in the command line
+  int nops;
+  Op* plan;           // operations, as executed
+  int nplan;
+  int nimages;        // number of image numbers used
+  int* lastUse;       // index in plan of last use of each image number
+  int perf;           // hardware event counters requested
+} Program;
+
+// Append op to array *ops with *n elements.  Returns 0 if out of memory.
+static int appendOp(Op** ops, int* n, Op op) {
+  if ((*n & (*n - 1)) == 0) {  // n is 0 or a power of 2: grow
+    Op* grown = realloc(*ops, (size_t)(*n > 0 ? 2 * *n : 8) * sizeof(Op));
+    if (grown == NULL) return 0;
+    *ops = grown;
+  }
+  (*ops)[(*n)++] = op;
+  return 1;
+}
+
+static int isPointOp(const Op* op) {
+  return op->kind == OP_NEG || op->kind == OP_THR || op->kind == OP_BRI;
+}
+
+static int isLazyOp(const Op* op) {
+  return isPointOp(op) || op->kind == OP_BLUR;
+}
+
+static int isRemapOp(const Op* op) {
+  return op->kind == OP_CROP || op->kind == OP_ROTATE || op->kind == OP_MIRROR;
+}
+
+// Compute prog->lastUse for operations ops[0..nops-1].
+// If keep >= 0, image number keep is considered used at the end.
+static void computeLastUse(Program* prog, const Op* ops, int nops, int keep) {
+  for (int j = 0; j < prog->nimages; j++) prog->lastUse[j] = -1;
+  for (int i = 0; i < nops; i++) {
+    if (ops[i].src >= 0) prog->lastUse[ops[i].src] = i;
+    if (ops[i].src2 >= 0) prog->lastUse[ops[i].src2] = i;
+  }
+  if (keep >= 0) prog->lastUse[keep] = nops;
+}
+
+// Named convolution kernels: KW,KH,DIV,weights
+static const struct {
+  const char* name;
+  const char* spec;
+} namedKernels[] = {
+  { "sharpen", "3,3,1,0,-1,0,-1,5,-1,0,-1,0" },
+  { "sobelx", "3,3,1,-1,0,1,-2,0,2,-1,0,1" },
+  { "sobely", "3,3,1,-1,-2,-1,0,0,0,1,2,1" },
+  { "gauss3", "3,3,16,1,2,1,2,4,2,1,2,1" },
+  { "gauss5", "5,5,256,1,4,6,4,1,4,16,24,16,4,6,24,36,24,6,4,16,24,16,4,1,4,6,4,1" },
+};
+
+// Morphological operations, by name
+static const struct {
+  const char* name;
+  int (*fn)(Image img, int dx, int dy);
+} morphOps[] = {
+  { "erode", ImageErode },
+  { "dilate", ImageDilate },
+  { "open", ImageOpen },
+  { "close", ImageClose },
+  { "gradient", ImageGradient },
+};
+
+// Index of morphological operation name in morphOps, or -1.
+static int findMorphOp(const char* name) {
+  for (int i = 0; i < (int)(sizeof(morphOps) / sizeof(morphOps[0])); i++)
+    if (strcmp(name, morphOps[i].name) == 0) return i;
+  return -1;
+}
 
-  // The image buffer
-  const int N = 10;   // buffer capacity
-  Image img[N];     // the images
-  int n = 0;          // number of images created
+// Threshold img at thr into a mask, apply morphological operation op
+// (erode, dilate, open or close, as in morphOps) to it with a
+// (2dx+1)x(2dy+1) rectangle, and expand it back into img.
+// Returns 0 on failure (img is unchanged).
+static int maskMorph(Image img, uint16 thr, int op, int dx, int dy) {
+  Mask m = ImageThresholdMask(img, thr);
+  if (m == NULL) return 0;
+  int ok;
+  switch (op) {
+  case 0: ok = MaskErode(m, dx, dy); break;
+  case 1: ok = MaskDilate(m, dx, dy); break;
+  case 2: ok = MaskErode(m, dx, dy) && MaskDilate(m, dx, dy); break;
+  default: ok = MaskDilate(m, dx, dy) && MaskErode(m, dx, dy); break;
+  }
+  Image out = ok ? MaskToImage(m, (uint16)ImageMaxval(img)) : NULL;
+  MaskDestroy(&m);
+  if (out == NULL) return 0;
+  ImagePaste(img, 0, 0, out);
+  ImageDestroy(&out);
+  return 1;
+}
+
+// Parse convolution kernel spec (KW,KH,DIV,K1,...,Kn or a name) into op:
+// weights in op->kernel (allocated), KW,KH in op->w, op->h, DIV in op->value.
+// Returns 0 on success, or an index into errors[] on failure.
+static int parseKernel(Op* op, const char* spec) {
+  for (size_t i = 0; i < sizeof(namedKernels) / sizeof(namedKernels[0]); i++)
+    if (strcmp(spec, namedKernels[i].name) == 0) spec = namedKernels[i].spec;
+  int kw, kh, div, len;
+  if (sscanf(spec, "%d,%d,%d%n", &kw, &kh, &div, &len) != 3) return 5;
+  if (kw <= 0 || kh <= 0 || kw % 2 == 0 || kh % 2 == 0 || div <= 0) return 5;
+  if (kw > 1001 || kh > 1001) return 5;
+  op->kernel = malloc((size_t)kw * kh * sizeof(int));
+  if (op->kernel == NULL) return 4;
+  spec += len;
+  for (int i = 0; i < kw * kh; i++) {
+    if (sscanf(spec, ",%d%n", &op->kernel[i], &len) != 1) return 5;
+    spec += len;
+  }
+  if (*spec != '\0') return 5;
+  op->w = kw; op->h = kh; op->value = div;
+  return 0;
+}
 
-  int k = 1;
-  while (k < ac) {
+// Compile operations av[k..ac-1] into prog, assuming n0 images are
+// already in the buffer when it runs.
+// If keepLast, the final CURR is kept alive until the end.
+// If shared, the pipeline runs alongside others (batch and server modes),
+// so tic, toc and report, which act on the whole process, are rejected.
+// Returns 0 on success, or an index into errors[] on failure.
+static int compile(Program* prog, int ac, char* av[], int k, int n0, int keepLast,
+                   int shared) {
+  int err = 0;
+  int n = n0;
+  *prog = (Program){ NULL, 0, NULL, 0, 0, NULL, 0 };
+  for (; k < ac; k++) {
+    Op op = { .src = -1, .src2 = -1, .dst = -1, .dst2 = -1 };
     if (strcmp(av[k], "info") == 0) {
       if (n < 1) { err = 2; break; }
-      fprintf(stderr, "Info on I%d\n", n-1);
-      uint8 min, max;
-      w = ImageWidth(img[n-1]);
-      h = ImageHeight(img[n-1]);
-      uint8 maxval = ImageMaxval(img[n-1]);
-      ImageStats(img[n-1], &min, &max);
-      printf("# Size: %dx%d\n# Maxval: %hhu\n", w, h, maxval);
-      printf("# Gray level range: [%hhu, %hhu]\n", min, max);
+      op.kind = OP_INFO; op.src = n-1;
     } else if (strcmp(av[k], "tic") == 0) {
-      InstrReset();
+      if (shared) { err = 13; break; }
+      op.kind = OP_TIC;
+    } else if (strcmp(av[k], "perf") == 0) {
+      prog->perf = 1;  // not an operation: counters must be opened up front
+      continue;
     } else if (strcmp(av[k], "toc") == 0) {
-      InstrPrint();
+      if (shared) { err = 13; break; }
+      op.kind = OP_TOC;
+    } else if (strcmp(av[k], "report") == 0) {
+      if (shared) { err = 13; break; }
+      if (++k >= ac) { err = 1; break; }
+      op.kind = OP_REPORT; op.file = av[k];
     } else if (strcmp(av[k], "neg") == 0) {
       if (n < 1) { err = 2; break; }
-      fprintf(stderr, "Negating I%d\n", n-1);
-      ImageNegative(img[n-1]);
+      op.kind = OP_NEG; op.src = n-1;
     } else if (strcmp(av[k], "thr") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
-      uint8 thr;
-      if (sscanf(av[k], "%hhu", &thr) != 1) { err = 5; break; }
-      fprintf(stderr, "Thresholding I%d at %d\n", n-1, thr);
-      ImageThreshold(img[n-1], (uint8)thr);
+      uint16 thr;
+      if (sscanf(av[k], "%hu", &thr) != 1) { err = 5; break; }
+      op.kind = OP_THR; op.src = n-1; op.value = thr;
     } else if (strcmp(av[k], "bri") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
-      double factor;
-      if (sscanf(av[k], "%lf", &factor) != 1) { err = 5; break; }
-      fprintf(stderr, "Brightening I%d by %lf\n", n-1, factor);
-      ImageBrighten(img[n-1], factor);
+      if (sscanf(av[k], "%lf", &op.value) != 1) { err = 5; break; }
+      op.kind = OP_BRI; op.src = n-1;
+    } else if (strcmp(av[k], "lazy") == 0) {
+      if (n < 1) { err = 2; break; }
+      op.kind = OP_LAZY; op.src = n-1;
     } else if (strcmp(av[k], "create") == 0) {
       if (++k >= ac) { err = 1; break; }
-      if (n >= N) { err = 3; break; }
-      if (sscanf(av[k], "%d,%d", &w, &h) != 2) { err = 5; break; }
-      if (w < 0 || h < 0) { err = 5; break; }   // precondition check!
-      fprintf(stderr, "Creating black image (%d,%d) -> I%d\n", w, h, n);
-      img[n] = ImageCreate(w, h, PixMax);
-      if (img[n] == NULL) { err = 4; break; }
-      n++;
+      int maxval = PixMax;
+      if (sscanf(av[k], "%d,%d,%d", &op.w, &op.h, &maxval) < 2) { err = 5; break; }
+      if (op.w < 0 || op.h < 0) { err = 5; break; }   // precondition check!
+      if (maxval <= 0 || maxval > PixMax16) { err = 5; break; }
+      op.kind = OP_CREATE; op.value = maxval; op.dst = n++;
+    } else if (strcmp(av[k], "gen") == 0) {
+      if (k + 2 >= ac) { err = 1; break; }
+      const char* kind = av[++k];
+      const char* args = av[++k];
+      int maxval = PixMax;
+      int* p = op.param;
+      p[3] = 1;   // default SEED
+      if (strcmp(kind, "noise") == 0) {
+        op.gen = GEN_NOISE;
+        if (sscanf(args, "%d,%d,%d,%d", &op.w, &op.h, &p[3], &maxval) < 2) { err = 5; break; }
+      } else if (strcmp(kind, "gradient") == 0) {
+        op.gen = GEN_GRADIENT; p[2] = 0;
+        if (sscanf(args, "%d,%d,%d,%d", &op.w, &op.h, &p[2], &maxval) < 2) { err = 5; break; }
+        if (p[2] < 0 || p[2] > 2) { err = 5; break; }
+      } else if (strcmp(kind, "checker") == 0) {
+        op.gen = GEN_CHECKER; p[2] = 8;
+        if (sscanf(args, "%d,%d,%d,%d", &op.w, &op.h, &p[2], &maxval) < 2) { err = 5; break; }
+        if (p[2] <= 0) { err = 5; break; }
+      } else if (strcmp(kind, "rects") == 0) {
+        op.gen = GEN_RECTS; p[2] = 16;
+        if (sscanf(args, "%d,%d,%d,%d,%d", &op.w, &op.h, &p[2], &p[3], &maxval) < 2) { err = 5; break; }
+        if (p[2] < 0) { err = 5; break; }
+      } else if (strcmp(kind, "haystack") == 0) {
+        op.gen = GEN_HAYSTACK; p[2] = -1;
+        if (sscanf(args, "%d,%d,%d,%d,%d,%d,%d,%d,%d", &op.w, &op.h, &p[0], &p[1],
+                   &op.x, &op.y, &p[2], &p[3], &maxval) < 6) { err = 5; break; }
+        if (p[2] < 0) p[2] = maxval;  // default LEVELS
+        if (p[0] <= 0 || p[1] <= 0 || p[2] <= 0 || p[2] > maxval) { err = 5; break; }
+        if (op.x < 0 || op.y < 0 || op.x > op.w - p[0] || op.y > op.h - p[1]) { err = 6; break; }
+      } else { err = 5; break; }
+      if (op.w < 0 || op.h < 0) { err = 5; break; }   // precondition check!
+      if (maxval <= 0 || maxval > PixMax16) { err = 5; break; }
+      op.kind = OP_GEN; op.value = maxval;
+      if (op.gen == GEN_HAYSTACK) op.dst2 = n++;
+      op.dst = n++;
     } else if (strcmp(av[k], "rotate") == 0) {
       if (n < 1) { err = 2; break; }
-      if (n >= N) { err = 3; break; }
-      fprintf(stderr, "Rotating I%d -> I%d\n", n-1, n);
-      img[n] = ImageRotate(img[n-1]);
-      if (img[n] == NULL) { err = 4; break; }
-      n++;
+      op.kind = OP_ROTATE; op.src = n-1; op.dst = n++;
     } else if (strcmp(av[k], "mirror") == 0) {
       if (n < 1) { err = 2; break; }
-      if (n >= N) { err = 3; break; }
-      fprintf(stderr, "Mirroring I%d -> I%d\n", n-1, n);
-      img[n] = ImageMirror(img[n-1]);
-      if (img[n] == NULL) { err = 4; break; }
-      n++;
+      op.kind = OP_MIRROR; op.src = n-1; op.dst = n++;
     } else if (strcmp(av[k], "crop") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
-      if (n >= N) { err = 3; break; }
-      if (sscanf(av[k], "%d,%d,%d,%d", &x, &y, &w, &h) != 4) { err = 5; break; }
-      if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 5; break; }   // precondition check!
-      fprintf(stderr, "Cropping I%d (%d,%d,%d,%d) -> I%d\n", n-1, x, y, w, h, n);
-      img[n] = ImageCrop(img[n-1], x, y, w, h);
-      if (img[n] == NULL) { err = 4; break; }
-      n++;
+      if (sscanf(av[k], "%d,%d,%d,%d", &op.x, &op.y, &op.w, &op.h) != 4) { err = 5; break; }
+      op.kind = OP_CROP; op.src = n-1; op.dst = n++;
+    } else if (strcmp(av[k], "resize") == 0) {
+      if (k + 2 >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      const char* mode = av[++k];
+      if (strcmp(mode, "area") == 0) op.param[0] = IMAGE_RESIZE_AREA;
+      else if (strcmp(mode, "bilinear") == 0) op.param[0] = IMAGE_RESIZE_BILINEAR;
+      else { err = 5; break; }
+      if (sscanf(av[++k], "%d,%d", &op.w, &op.h) != 2 || op.w < 0 || op.h < 0) { err = 5; break; }
+      op.kind = OP_RESIZE; op.src = n-1; op.dst = n++;
+    } else if (strcmp(av[k], "warp") == 0) {
+      if (k + 3 >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      const char* mode = av[++k];
+      if (strcmp(mode, "nearest") == 0) op.param[0] = IMAGE_WARP_NEAREST;
+      else if (strcmp(mode, "bilinear") == 0) op.param[0] = IMAGE_WARP_BILINEAR;
+      else { err = 5; break; }
+      double* m = op.matrix;
+      if (sscanf(av[++k], "%lf,%lf,%lf,%lf,%lf,%lf", &m[0], &m[1], &m[2], &m[3], &m[4], &m[5]) != 6) { err = 5; break; }
+      if (sscanf(av[++k], "%d,%d", &op.w, &op.h) != 2 || op.w < 0 || op.h < 0) { err = 5; break; }
+      op.kind = OP_WARP; op.src = n-1; op.dst = n++;
+    } else if (strcmp(av[k], "turn") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      if (sscanf(av[k], "%lf", &op.value) != 1) { err = 5; break; }
+      op.kind = OP_TURN; op.src = n-1; op.dst = n++;
+    } else if (strcmp(av[k], "rle") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      const char* kind = av[k];
+      op.kind = OP_RLE; op.src = n-1;
+      if (strcmp(kind, "neg") == 0) {
+        op.param[0] = RLE_NEG;
+      } else if (strcmp(kind, "mirror") == 0) {
+        op.param[0] = RLE_MIRROR; op.dst = n++;
+      } else if (strcmp(kind, "locate") == 0) {
+        if (n < 2) { err = 2; break; }
+        op.param[0] = RLE_LOCATE; op.src2 = n-2;
+      } else if (++k >= ac) {
+        err = 1; break;
+      } else if (strcmp(kind, "file") == 0) {
+        op.param[0] = RLE_FILE; op.dst = n++; op.file = av[k];
+      } else if (strcmp(kind, "thr") == 0) {
+        uint16 thr;
+        if (sscanf(av[k], "%hu", &thr) != 1) { err = 5; break; }
+        op.param[0] = RLE_THR; op.value = thr;
+      } else if (strcmp(kind, "bri") == 0) {
+        if (sscanf(av[k], "%lf", &op.value) != 1) { err = 5; break; }
+        op.param[0] = RLE_BRI;
+      } else if (strcmp(kind, "crop") == 0) {
+        if (sscanf(av[k], "%d,%d,%d,%d", &op.x, &op.y, &op.w, &op.h) != 4) { err = 5; break; }
+        op.param[0] = RLE_CROP; op.dst = n++;
+      } else { err = 5; break; }
     } else if (strcmp(av[k], "paste") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 2) { err = 2; break; }
-      if (sscanf(av[k], "%d,%d", &x, &y) != 2) { err = 5; break; }
-      w = ImageWidth(img[n-2]);
-      h = ImageHeight(img[n-2]);
-      if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 6; break; }
-      fprintf(stderr, "Pasting I%d at I%d (%d,%d)\n", n-2, n-1, x, y);
-      ImagePaste(img[n-1], x, y, img[n-2]);
+      if (sscanf(av[k], "%d,%d", &op.x, &op.y) != 2) { err = 5; break; }
+      op.kind = OP_PASTE; op.src = n-1; op.src2 = n-2;
     } else if (strcmp(av[k], "blend") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 2) { err = 2; break; }
-      double alpha;
-      if (sscanf(av[k], "%d,%d,%lf", &x, &y, &alpha) != 3) { err = 5; break; }
-      w = ImageWidth(img[n-2]);
-      h = ImageHeight(img[n-2]);
-      if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 6; break; }
-      fprintf(stderr, "Blending I%d with I%d@(%d,%d) with alpha=%.3f\n", n-2, n-1, x, y, alpha);
-      ImageBlend(img[n-1], x, y, img[n-2], alpha);
+      if (sscanf(av[k], "%d,%d,%lf", &op.x, &op.y, &op.value) != 3) { err = 5; break; }
+      op.kind = OP_BLEND; op.src = n-1; op.src2 = n-2;
     } else if (strcmp(av[k], "locate") == 0) {
       if (n < 2) { err = 2; break; }
-      fprintf(stderr, "Locating I%d in I%d\n", n-2, n-1);
-      if (ImageLocateSubImage(img[n-1], &x, &y, img[n-2])) {
-        printf("# FOUND (%d,%d)\n", x, y);
-      } else {
-        printf("# NOTFOUND\n");
-      }
+      op.kind = OP_LOCATE; op.src = n-1; op.src2 = n-2;
+    } else if (strcmp(av[k], "compare") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 2) { err = 2; break; }
+      if (sscanf(av[k], "%d,%d", &op.x, &op.y) != 2) { err = 5; break; }
+      op.kind = OP_COMPARE; op.src = n-1; op.src2 = n-2;
+    } else if (strcmp(av[k], "equal") == 0) {
+      if (n < 2) { err = 2; break; }
+      op.kind = OP_EQUAL; op.src = n-1; op.src2 = n-2;
+    } else if (strcmp(av[k], "label") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      if (sscanf(av[k], "%d", &op.param[0]) != 1 || (op.param[0] != 4 && op.param[0] != 8)) { err = 5; break; }
+      op.kind = OP_LABEL; op.src = n-1;
     } else if (strcmp(av[k], "blur") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
-      int dx; int dy;
-      if (sscanf(av[k], "%d,%d", &dx, &dy) != 2) { err = 5; break; }
-      fprintf(stderr, "Blur I%d with %dx%d mean filter\n", n-1, 2*dx+1, 2*dy+1);
-      ImageBlur(img[n-1], dx, dy);
+      if (sscanf(av[k], "%d,%d", &op.x, &op.y) != 2) { err = 5; break; }
+      op.kind = OP_BLUR; op.src = n-1;
+    } else if (strcmp(av[k], "median") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      if (sscanf(av[k], "%d,%d", &op.x, &op.y) != 2 || op.x < 0 || op.y < 0) { err = 5; break; }
+      op.kind = OP_MEDIAN; op.src = n-1;
+    } else if (findMorphOp(av[k]) >= 0) {
+      op.param[0] = findMorphOp(av[k]);
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      if (sscanf(av[k], "%d,%d", &op.x, &op.y) != 2 || op.x < 0 || op.y < 0) { err = 5; break; }
+      op.kind = OP_MORPH; op.src = n-1;
+    } else if (strcmp(av[k], "mask") == 0) {
+      if (k + 3 >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      uint16 thr;
+      if (sscanf(av[++k], "%hu", &thr) != 1) { err = 5; break; }
+      op.value = thr;
+      op.param[0] = findMorphOp(av[++k]);
+      if (op.param[0] < 0 || op.param[0] > 3) { err = 5; break; }  // no gradient
+      if (sscanf(av[++k], "%d,%d", &op.x, &op.y) != 2 || op.x < 0 || op.y < 0) { err = 5; break; }
+      op.kind = OP_MASK; op.src = n-1;
+    } else if (strcmp(av[k], "layout") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      if (strcmp(av[k], "raster") == 0) op.param[0] = IMAGE_LAYOUT_RASTER;
+      else if (strcmp(av[k], "tiled") == 0) op.param[0] = IMAGE_LAYOUT_TILED;
+      else { err = 5; break; }
+      op.kind = OP_LAYOUT; op.src = n-1;
+    } else if (strcmp(av[k], "gauss") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      if (sscanf(av[k], "%lf", &op.value) != 1 || !isfinite(op.value) || op.value < 0.0) { err = 5; break; }
+      op.kind = OP_GAUSS; op.src = n-1;
+    } else if (strcmp(av[k], "conv") == 0) {
+      if (k + 2 >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      const char* border = av[++k];
+      if (strcmp(border, "clamp") == 0) op.x = IMAGE_BORDER_CLAMP;
+      else if (strcmp(border, "mirror") == 0) op.x = IMAGE_BORDER_MIRROR;
+      else if (strcmp(border, "zero") == 0) op.x = IMAGE_BORDER_ZERO;
+      else { err = 5; break; }
+      op.kind = OP_CONV; op.src = n-1;
+      err = parseKernel(&op, av[++k]);
+      if (err != 0) { free(op.kernel); break; }
     } else if (strcmp(av[k], "save") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
-      fprintf(stderr, "Saving %s <- I%d\n", av[k], n-1);
-      if (ImageSave(img[n-1], av[k]) == 0) { err = 4; break; }
+      op.kind = OP_SAVE; op.src = n-1; op.file = av[k];
     } else {  // image file
-      if (n >= N) { err = 3; break; }
-      fprintf(stderr, "Loading %s -> I%d\n", av[k], n);
-      img[n] = ImageLoad(av[k]);
-      if (img[n] == NULL) { err = 4; break; }
-      n++;
+      op.kind = OP_LOAD; op.file = av[k]; op.dst = n++;
     }
-    k++;
+    if (!appendOp(&prog->ops, &prog->nops, op)) { free(op.kernel); err = 4; break; }
   }
-  
-  // Destroy remaining images
-  while (n > 0) {
-    ImageDestroy(&img[--n]);
+  prog->nimages = n;
+  prog->lastUse = malloc((size_t)(n > 0 ? n : 1) * sizeof(int));
+  if (prog->lastUse == NULL) err = 4;
+  if (err != 0) return err;
+
+  int keep = keepLast && n > 0 ? n-1 : -1;
+  computeLastUse(prog, prog->ops, prog->nops, keep);
+
+  // Optimize: fuse runs of operations into plan
+  for (int i = 0; i < prog->nops; ) {
+    const Op* op = &prog->ops[i];
+    int j = i + 1;
+    if (op->kind == OP_LAZY) {
+      while (j < prog->nops && isLazyOp(&prog->ops[j])) j++;
+    } else if (isPointOp(op)) {
+      while (j < prog->nops && isPointOp(&prog->ops[j])) j++;
+    } else if (isRemapOp(op)) {
+      while (j < prog->nops && isRemapOp(&prog->ops[j]) &&
+             prog->ops[j].src == prog->ops[j-1].dst &&
+             prog->lastUse[prog->ops[j-1].dst] == j) j++;
+    }
+    Op fused = *op;
+    if (op->kind == OP_LAZY) {
+      fused.first = i + 1;
+      fused.count = j - i - 1;
+    } else if (j - i >= 2) {
+      fused.kind = isPointOp(op) ? OP_LUT : OP_REMAP;
+      fused.first = i;
+      fused.count = j - i;
+      fused.dst = prog->ops[j-1].dst;
+    } else {
+      j = i + 1;
+    }
+    if (!appendOp(&prog->plan, &prog->nplan, fused)) return 4;
+    i = j;
   }
+  computeLastUse(prog, prog->plan, prog->nplan, keep);
+  return 0;
+}
 
-  error(err, errno, errors[err], ImageErrMsg());
+static void freeProgram(Program* prog) {
+  for (int i = 0; i < prog->nops; i++)
+    free(prog->ops[i].kernel);
+  free(prog->ops);
+  free(prog->plan);
+  free(prog->lastUse);
+}
+
+/// Image cache (server mode)
+//
+// Decoded image files, kept for the pipelines to come.  An entry is keyed by
+// the file name and by the modification time and size of the file when it
+// was loaded, so a file that changes is loaded again.  Entries are kept in
+// least recently used order, and the oldest unused ones are dropped when the
+// cache exceeds its budget.  A cached image is never changed: a pipeline
+// that would change it works on a copy.
+
+// A cached image file.
+typedef struct CacheEntry {
+  char* path;
+  struct timespec mtime;    // modification time and size of the file,
+  off_t size;               // when it was loaded
+  Image img;                // NULL while being loaded
+  size_t bytes;             // size of img
+  int refs;                 // pipelines using img
+  int stale;                // not in the cache: destroyed when unused
+  struct CacheEntry* prev;  // more recently used
+  struct CacheEntry* next;  // less recently used
+} CacheEntry;
+
+typedef struct {
+  CacheEntry* head;         // most recently used
+  CacheEntry* tail;         // least recently used
+  size_t bytes;             // bytes of cached images
+  size_t budget;            // bound on bytes
+  unsigned long hits;       // loads found in the cache
+  unsigned long misses;     // loads from file
+  pthread_mutex_t lock;
+  pthread_cond_t loaded;    // an entry finished loading
+} Cache;
+
+static void cacheUnlink(Cache* c, CacheEntry* e) {
+  *(e->prev != NULL ? &e->prev->next : &c->head) = e->next;
+  *(e->next != NULL ? &e->next->prev : &c->tail) = e->prev;
+  e->prev = e->next = NULL;
+}
+
+static void cachePushFront(Cache* c, CacheEntry* e) {
+  e->prev = NULL;
+  e->next = c->head;
+  *(c->head != NULL ? &c->head->prev : &c->tail) = e;
+  c->head = e;
+}
+
+static void cacheFreeEntry(CacheEntry* e) {
+  ImageDestroy(&e->img);
+  free(e->path);
+  free(e);
+}
+
+// Take entry e out of cache c.  It is destroyed once no pipeline uses it.
+static void cacheRemove(Cache* c, CacheEntry* e) {
+  cacheUnlink(c, e);
+  c->bytes -= e->bytes;
+  e->stale = 1;
+  if (e->refs == 0) cacheFreeEntry(e);
+}
+
+// Drop unused entries, least recently used first, until c fits its budget.
+static void cacheEvict(Cache* c) {
+  CacheEntry* e = c->tail;
+  while (e != NULL && c->bytes > c->budget) {
+    CacheEntry* prev = e->prev;
+    if (e->refs == 0) cacheRemove(c, e);
+    e = prev;
+  }
+}
+
+// Get the image of file path, whose status is st, from cache c, loading
+// it if needed.  Pipelines that need the same file while it is loaded
+// wait for it, so each file is loaded once.
+// Returns the entry, to be given back with cacheRelease, or NULL if the
+// load failed (see ImageLoad).
+static CacheEntry* cacheGet(Cache* c, const char* path, const struct stat* st) {
+  pthread_mutex_lock(&c->lock);
+  CacheEntry* e;
+  for (;;) {
+    for (e = c->head; e != NULL && strcmp(e->path, path) != 0; e = e->next) {}
+    if (e != NULL && (e->mtime.tv_sec != st->st_mtim.tv_sec ||
+                      e->mtime.tv_nsec != st->st_mtim.tv_nsec ||
+                      e->size != st->st_size)) {
+      cacheRemove(c, e);  // the file changed
+      e = NULL;
+    }
+    if (e == NULL || e->img != NULL) break;
+    pthread_cond_wait(&c->loaded, &c->lock);
+  }
+  if (e != NULL) {
+    c->hits++;
+    e->refs++;
+    cacheUnlink(c, e);
+    cachePushFront(c, e);
+    pthread_mutex_unlock(&c->lock);
+    return e;
+  }
+  e = calloc(1, sizeof(*e));
+  char* dup = strdup(path);
+  if (e == NULL || dup == NULL) {
+    pthread_mutex_unlock(&c->lock);
+    free(e);
+    free(dup);
+    return NULL;
+  }
+  c->misses++;
+  e->path = dup;
+  e->mtime = st->st_mtim;
+  e->size = st->st_size;
+  e->refs = 1;
+  cachePushFront(c, e);
+  pthread_mutex_unlock(&c->lock);
+
+  Image img = ImageLoad(path);
+  int errsave = errno;
+  pthread_mutex_lock(&c->lock);
+  if (img == NULL) {
+    if (!e->stale) cacheRemove(c, e);
+    cacheFreeEntry(e);
+    e = NULL;
+  } else {
+    e->img = img;
+    e->bytes = (size_t)ImageWidth(img) * (size_t)ImageHeight(img) * (size_t)ImageDepth(img);
+    if (!e->stale) c->bytes += e->bytes;
+    cacheEvict(c);
+  }
+  pthread_cond_broadcast(&c->loaded);
+  pthread_mutex_unlock(&c->lock);
+  errno = errsave;
+  return e;
+}
+
+// Give back entry e, got from cacheGet.
+static void cacheRelease(Cache* c, CacheEntry* e) {
+  pthread_mutex_lock(&c->lock);
+  e->refs--;
+  if (e->stale && e->refs == 0) cacheFreeEntry(e);
+  else cacheEvict(c);
+  pthread_mutex_unlock(&c->lock);
+}
+
+// Destroy all entries of cache c, which no pipeline may be using.
+static void cacheClear(Cache* c) {
+  while (c->head != NULL) cacheRemove(c, c->head);
+}
+
+// The image buffer, created when a Program runs.
+typedef struct {
+  Image* img;         // the images, indexed by image number
+  int n;              // number of image numbers
+  const char* input;  // input file, for NAME templates (batch mode)
+  int index;          // input index, for NAME templates (batch mode)
+  ImageIO* loads;     // loads started ahead, indexed by image number
+  ImageIO* saves;     // saves not yet finished
+  int nsaves;
+  Cache* cache;       // cache to load files from (server mode), or NULL
+  CacheEntry** shared;  // cache entry of each image shared with the cache
+  FILE* out;          // where operations print their results
+} Buffer;
+
+// Build the look-up table of the point operations ops[0..count-1], for
+// levels up to maxval, by applying them to a 1-row image holding every
+// level, so that the table gives exactly the result of applying them in turn.
+// Returns the table (to be freed by the caller), or NULL if out of memory.
+static uint16* pointLUT(const Op* ops, int count, int maxval) {
+  Image levels = ImageCreate(maxval + 1, 1, (uint16)maxval);
+  uint16* lut = malloc(((size_t)maxval + 1) * sizeof(uint16));
+  if (levels == NULL || lut == NULL) {
+    ImageDestroy(&levels);
+    free(lut);
+    return NULL;
+  }
+  for (int v = 0; v <= maxval; v++) ImageSetPixel(levels, v, 0, (uint16)v);
+  for (int i = 0; i < count; i++) {
+    const Op* p = &ops[i];
+    if (p->kind == OP_NEG) ImageNegative(levels);
+    else if (p->kind == OP_THR) ImageThreshold(levels, (uint16)p->value);
+    else ImageBrighten(levels, p->value);
+  }
+  for (int v = 0; v <= maxval; v++) lut[v] = ImageGetPixel(levels, v, 0);
+  ImageDestroy(&levels);
+  return lut;
+}
+
+// Run the point operations fused in op, on image img, with one pass
+// through a look-up table (see pointLUT).
+static int runLUT(const Program* prog, const Op* op, Image img) {
+  uint16* lut = pointLUT(prog->ops + op->first, op->count, ImageMaxval(img));
+  if (lut == NULL) return 4;
+  ImageApplyLUT(img, lut);
+  free(lut);
+  return 0;
+}
+
+// Run the operations marked by op (see isLazyOp), on image img, as one
+// chain of lazy images, which LazyEvaluate computes tile by tile.
+static int runLazy(const Program* prog, const Op* op, Image img) {
+  LazyImage node = LazySource(img);
+  for (int i = op->first; node != NULL && i < op->first + op->count; i++) {
+    const Op* p = &prog->ops[i];
+    LazyImage next;
+    if (p->kind == OP_NEG) next = LazyNegative(node);
+    else if (p->kind == OP_THR) next = LazyThreshold(node, (uint16)p->value);
+    else if (p->kind == OP_BRI) next = LazyBrighten(node, p->value);
+    else next = LazyBlur(node, p->x, p->y);
+    LazyDestroy(&node);  // next keeps it
+    node = next;
+  }
+  Image result = node != NULL ? LazyEvaluate(node) : NULL;
+  LazyDestroy(&node);
+  if (result == NULL) return 4;
+  ImagePaste(img, 0, 0, result);
+  ImageDestroy(&result);
+  return 0;
+}
+
+// Run the RLE operation op (see RLEKind) on img, encoded with run lengths,
+// and decode the result: into img, for the pixel transformations, or into
+// a new image in *result.  For RLE_LOCATE, search pred in img and print the
+// position to out.
+static int runRLE(const Op* op, Image img, Image pred, Image* result, FILE* out) {
+  RLEImage r = RLEFromImage(img);
+  if (r == NULL) return 4;
+  RLEImage t = NULL;
+  int err = 0;
+  switch ((RLEKind)op->param[0]) {
+  case RLE_FILE:
+    if (!RLESave(r, op->file)) { err = 4; break; }
+    t = RLELoad(op->file);
+    if (t == NULL) err = 4;
+    break;
+  case RLE_NEG:
+    RLENegative(r);
+    break;
+  case RLE_THR:
+    RLEThreshold(r, (uint16)op->value);
+    break;
+  case RLE_BRI: {
+    Op bri = { .kind = OP_BRI, .value = op->value };
+    uint16* lut = pointLUT(&bri, 1, RLEMaxval(r));
+    if (lut == NULL) { err = 4; break; }
+    RLEApplyLUT(r, lut);
+    free(lut);
+    break;
+  }
+  case RLE_MIRROR:
+    t = RLEMirror(r);
+    if (t == NULL) err = 4;
+    break;
+  case RLE_CROP:
+    if (!ImageValidRect(img, op->x, op->y, op->w, op->h)) { err = 5; break; }   // precondition check!
+    t = RLECrop(r, op->x, op->y, op->w, op->h);
+    if (t == NULL) err = 4;
+    break;
+  case RLE_LOCATE: {
+    RLEImage needle = RLEFromImage(pred);
+    if (needle == NULL) { err = 4; break; }
+    int x, y;
+    if (RLELocateSubImage(r, &x, &y, needle)) {
+      fprintf(out, "# FOUND (%d,%d)\n", x, y);
+    } else {
+      fprintf(out, "# NOTFOUND\n");
+    }
+    RLEDestroy(&needle);
+    break;
+  }
+  }
+  if (err == 0 && op->dst >= 0) {
+    *result = RLEToImage(t != NULL ? t : r);
+    if (*result == NULL) err = 4;
+  } else if (err == 0 && op->param[0] != RLE_LOCATE) {
+    Image decoded = RLEToImage(r);
+    if (decoded == NULL) {
+      err = 4;
+    } else {
+      ImagePaste(img, 0, 0, decoded);
+      ImageDestroy(&decoded);
+    }
+  }
+  RLEDestroy(&t);
+  RLEDestroy(&r);
+  return err;
+}
+
+// Map point (u, v) of an image obtained by mirroring (if m) and then
+// rotating t times a w x h image, back to point (*px, *py) of the latter.
+static void unmapPoint(int m, int t, int w, int h, int u, int v, int* px, int* py) {
+  for (; t > 0; t--) {
+    int wb = t % 2 == 1 ? w : h;  // width before rotation t
+    int x = wb - 1 - v;
+    v = u;
+    u = x;
+  }
+  *px = m ? w - 1 - u : u;
+  *py = v;
+}
+
+// Run the crop/rotate/mirror operations fused in op, on image img,
+// with a single ImageRemap.
+// Returns the new image in *result.
+static int runRemap(const Program* prog, const Op* op, Image img, Image* result) {
+  // The chain so far is: crop rectangle (x,y,w,h), mirror m, rotate t times
+  int x = 0, y = 0, w = ImageWidth(img), h = ImageHeight(img);
+  int m = 0, t = 0;
+  for (int i = op->first; i < op->first + op->count; i++) {
+    const Op* p = &prog->ops[i];
+    if (p->kind == OP_ROTATE) {
+      t = (t + 1) % 4;
+    } else if (p->kind == OP_MIRROR) {
+      // mirror after t rotations == -t rotations after mirror
+      m = !m;
+      t = (4 - t) % 4;
+    } else {  // OP_CROP: compose with current rectangle
+      int cw = t % 2 == 0 ? w : h;  // size of the image so far
+      int ch = t % 2 == 0 ? h : w;
+      // precondition check, as in ImageValidRect!
+      if (!(0 <= p->x && p->x < cw && 0 <= p->y && p->y < ch &&
+            p->x + p->w <= cw && p->y + p->h <= ch)) return 5;
+      int x0, y0, x1, y1;
+      unmapPoint(m, t, w, h, p->x, p->y, &x0, &y0);
+      unmapPoint(m, t, w, h, p->x + (p->w > 0 ? p->w - 1 : 0),
+                 p->y + (p->h > 0 ? p->h - 1 : 0), &x1, &y1);
+      x += x0 < x1 ? x0 : x1;
+      y += y0 < y1 ? y0 : y1;
+      w = t % 2 == 0 ? p->w : p->h;
+      h = t % 2 == 0 ? p->h : p->w;
+    }
+  }
+  *result = ImageRemap(img, x, y, w, h, m, t);
+  return *result == NULL ? 4 : 0;
+}
+
+// Write instrumentation report to file name, in the format given by its
+// extension (.json, .csv or else text), or to out if name is "-".
+// Returns 0 on success, or an index into errors[] on failure.
+static int writeReport(const char* name, FILE* out) {
+  const char* ext = strrchr(name, '.');
+  int format = ext == NULL ? INSTR_TEXT :
+               strcmp(ext, ".json") == 0 ? INSTR_JSON :
+               strcmp(ext, ".csv") == 0 ? INSTR_CSV : INSTR_TEXT;
+  if (strcmp(name, "-") == 0) {
+    InstrReport(out, format);
+    return 0;
+  }
+  LOG("Writing report %s\n", name);
+  FILE* f = fopen(name, "w");
+  if (f == NULL) return 10;
+  InstrReport(f, format);
+  return fclose(f) == 0 ? 0 : 10;
+}
+
+// Start counting hardware events, if requested by prog.
+// Must be called before any worker threads are created.
+static void startPerf(const Program* prog) {
+  if (prog->perf && InstrPerfOpen() == 0)
+    fprintf(stderr, "Hardware event counters not available\n");
+}
+
+// Share the cpus among nthreads workers (batch and server modes): each
+// parallel operation of a worker uses the worker's share, at least 1, so
+// that workers do not start a thread per cpu each, on every operation.
+static void shareCpus(int nthreads) {
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  ImageSetThreads(ncpu > nthreads ? (int)(ncpu / nthreads) : 1);
+}
+
+// Run generator op, creating its images in img.
+// Returns 0 on success, or an index into errors[] on failure.
+static int runGen(const Op* op, Image* img) {
+  static const char* names[] = { "noise", "gradient", "checker", "rects", "haystack" };
+  const int* p = op->param;
+  uint16 maxval = (uint16)op->value;
+  LOG("Generating %s image (%d,%d) -> I%d\n", names[op->gen], op->w, op->h, op->dst);
+  switch (op->gen) {
+  case GEN_NOISE:
+    img[op->dst] = ImageCreateNoise(op->w, op->h, maxval, (unsigned int)p[3]);
+    break;
+  case GEN_GRADIENT:
+    img[op->dst] = ImageCreateGradient(op->w, op->h, maxval, p[2]);
+    break;
+  case GEN_CHECKER:
+    img[op->dst] = ImageCreateChecker(op->w, op->h, maxval, p[2]);
+    break;
+  case GEN_RECTS:
+    img[op->dst] = ImageCreateRects(op->w, op->h, maxval, p[2], (unsigned int)p[3]);
+    break;
+  case GEN_HAYSTACK:
+    LOG("Planting needle (%d,%d) at (%d,%d) -> I%d\n", p[0], p[1], op->x, op->y, op->dst2);
+    if (!ImageCreateHaystack(op->w, op->h, maxval, p[0], p[1], op->x, op->y, p[2],
+                             (unsigned int)p[3], &img[op->dst], &img[op->dst2]))
+      return 4;
+    break;
+  }
+  return img[op->dst] == NULL ? 4 : 0;
+}
+
+// Wait for the pending saves of b.  Failed saves are reported here, as
+// they complete.  Returns 0 if a save failed.
+static int finishSaves(Buffer* b) {
+  int ok = 1;
+  for (int i = 0; i < b->nsaves; i++) {
+    if (!ImageSaveWait(&b->saves[i])) {
+      error(0, errno, "%s", ImageErrMsg());
+      ok = 0;
+    }
+  }
+  b->nsaves = 0;
+  return ok;
+}
+
+// Whether prog changes image k in place.
+static int changesImage(const Program* prog, int k) {
+  for (int i = 0; i < prog->nplan; i++) {
+    switch (prog->plan[i].kind) {
+    case OP_NEG: case OP_THR: case OP_BRI: case OP_LUT: case OP_LAZY: case OP_PASTE: case OP_BLEND:
+    case OP_BLUR: case OP_CONV: case OP_GAUSS: case OP_MEDIAN: case OP_MORPH: case OP_MASK: case OP_LAYOUT:
+      if (prog->plan[i].src == k) return 1;
+      break;
+    case OP_RLE:  // neg, thr and bri decode into the image
+      if (prog->plan[i].src == k && prog->plan[i].dst < 0 &&
+          prog->plan[i].param[0] != RLE_LOCATE) return 1;
+      break;
+    default:
+      break;
+    }
+  }
   return 0;
 }
 
+// Load the file of op from the cache of b.  The image is shared with the
+// cache, unless prog changes it: then it gets a copy.
+static Image loadCached(const Program* prog, Buffer* b, const Op* op) {
+  struct stat st;
+  if (stat(op->file, &st) != 0 || !S_ISREG(st.st_mode))
+    return ImageLoad(op->file);  // not cached: let it report the error
+  CacheEntry* e = cacheGet(b->cache, op->file, &st);
+  if (e == NULL) return NULL;
+  if (!changesImage(prog, op->dst)) {
+    b->shared[op->dst] = e;
+    return e->img;
+  }
+  Image img = ImageCrop(e->img, 0, 0, ImageWidth(e->img), ImageHeight(e->img));
+  cacheRelease(b->cache, e);
+  return img;
+}
+
+// Destroy image k of b, or give it back to the cache, if shared.
+static void dropImage(Buffer* b, int k) {
+  if (b->shared != NULL && b->shared[k] != NULL) {
+    cacheRelease(b->cache, b->shared[k]);
+    b->shared[k] = NULL;
+    b->img[k] = NULL;
+  } else {
+    ImageDestroy(&b->img[k]);
+  }
+}
+
+// Run program prog on image buffer b.
+// b must have the n0 images given to compile, and room for all images.
+// Returns 0 on success, or an index into errors[] on failure.
+static int runProgram(const Program* prog, Buffer* b) {
+  int err = 0;
+  int x, y, w, h;
+  Image* img = b->img;
+
+  for (int i = 0; i < prog->nplan && err == 0; i++) {
+    const Op* op = &prog->plan[i];
+    Image curr = op->src >= 0 ? img[op->src] : NULL;
+    Image pred = op->src2 >= 0 ? img[op->src2] : NULL;
+    switch (op->kind) {
+    case OP_INFO: {
+      LOG("Info on I%d\n", op->src);
+      uint16 min, max;
+      w = ImageWidth(curr);
+      h = ImageHeight(curr);
+      int maxval = ImageMaxval(curr);
+      ImageStats(curr, &min, &max);
+      fprintf(b->out, "# Size: %dx%d\n# Maxval: %d\n", w, h, maxval);
+      fprintf(b->out, "# Gray level range: [%hu, %hu]\n", min, max);
+      break;
+    }
+    case OP_TIC:
+      InstrReset();
+      break;
+    case OP_TOC:
+      if (b->out == stdout) InstrPrint();
+      InstrReport(b->out, INSTR_TEXT);
+      break;
+    case OP_REPORT: {
+      char name[FILENAME_MAX];
+      if (!expandName(name, sizeof(name), op->file, b->input, b->index)) { err = 5; break; }
+      err = writeReport(name, b->out);
+      break;
+    }
+    case OP_NEG:
+      LOG("Negating I%d\n", op->src);
+      ImageNegative(curr);
+      break;
+    case OP_THR:
+      LOG("Thresholding I%d at %d\n", op->src, (int)op->value);
+      ImageThreshold(curr, (uint16)op->value);
+      break;
+    case OP_BRI:
+      LOG("Brightening I%d by %lf\n", op->src, op->value);
+      ImageBrighten(curr, op->value);
+      break;
+    case OP_LAZY:
+      LOG("Evaluating %d lazy operations on I%d\n", op->count, op->src);
+      err = runLazy(prog, op, curr);
+      break;
+    case OP_LUT:
+      LOG("Applying %d point operations to I%d in one pass\n", op->count, op->src);
+      err = runLUT(prog, op, curr);
+      break;
+    case OP_CREATE:
+      LOG("Creating black image (%d,%d) -> I%d\n", op->w, op->h, op->dst);
+      img[op->dst] = ImageCreate(op->w, op->h, (uint16)op->value);
+      if (img[op->dst] == NULL) err = 4;
+      break;
+    case OP_GEN:
+      err = runGen(op, img);
+      break;
+    case OP_ROTATE:
+      LOG("Rotating I%d -> I%d\n", op->src, op->dst);
+      img[op->dst] = ImageRotate(curr);
+      if (img[op->dst] == NULL) err = 4;
+      break;
+    case OP_MIRROR:
+      LOG("Mirroring I%d -> I%d\n", op->src, op->dst);
+      img[op->dst] = ImageMirror(curr);
+      if (img[op->dst] == NULL) err = 4;
+      break;
+    case OP_CROP:
+      if (!ImageValidRect(curr, op->x, op->y, op->w, op->h)) { err = 5; break; }   // precondition check!
+      LOG("Cropping I%d (%d,%d,%d,%d) -> I%d\n", op->src, op->x, op->y, op->w, op->h, op->dst);
+      img[op->dst] = ImageCrop(curr, op->x, op->y, op->w, op->h);
+      if (img[op->dst] == NULL) err = 4;
+      break;
+    case OP_RESIZE:
+      if (ImageWidth(curr) * ImageHeight(curr) == 0 && op->w * op->h != 0) { err = 5; break; }
+      LOG("Resizing I%d to %dx%d -> I%d\n", op->src, op->w, op->h, op->dst);
+      img[op->dst] = ImageResize(curr, op->w, op->h, op->param[0]);
+      if (img[op->dst] == NULL) err = 4;
+      break;
+    case OP_WARP:
+      LOG("Warping I%d to %dx%d -> I%d\n", op->src, op->w, op->h, op->dst);
+      img[op->dst] = ImageWarpAffine(curr, op->matrix, op->w, op->h, op->param[0]);
+      if (img[op->dst] == NULL) err = 4;
+      break;
+    case OP_TURN: {
+      LOG("Turning I%d by %g degrees -> I%d\n", op->src, op->value, op->dst);
+      double a = op->value * M_PI / 180.0;
+      double c = cos(a), s = sin(a);
+      double cx = (ImageWidth(curr) - 1) / 2.0, cy = (ImageHeight(curr) - 1) / 2.0;
+      double m[6] = { c, -s, cx - c*cx + s*cy, s, c, cy - s*cx - c*cy };
+      img[op->dst] = ImageWarpAffine(curr, m, ImageWidth(curr), ImageHeight(curr),
+                                     IMAGE_WARP_BILINEAR);
+      if (img[op->dst] == NULL) err = 4;
+      break;
+    }
+    case OP_RLE:
+      LOG("RLE %s of I%d\n", rleNames[op->param[0]], op->src);
+      err = runRLE(op, curr, pred, op->dst >= 0 ? &img[op->dst] : NULL, b->out);
+      break;
+    case OP_REMAP:
+      LOG("Remapping I%d with %d crop/rotate/mirror operations -> I%d\n", op->src, op->count, op->dst);
+      err = runRemap(prog, op, curr, &img[op->dst]);
+      break;
+    case OP_PASTE:
+      w = ImageWidth(pred);
+      h = ImageHeight(pred);
+      if (!ImageValidRect(curr, op->x, op->y, w, h)) { err = 6; break; }
+      if (ImageDepth(curr) != ImageDepth(pred)) { err = 8; break; }
+      LOG("Pasting I%d at I%d (%d,%d)\n", op->src2, op->src, op->x, op->y);
+      ImagePaste(curr, op->x, op->y, pred);
+      break;
+    case OP_BLEND:
+      w = ImageWidth(pred);
+      h = ImageHeight(pred);
+      if (!ImageValidRect(curr, op->x, op->y, w, h)) { err = 6; break; }
+      if (ImageDepth(curr) != ImageDepth(pred)) { err = 8; break; }
+      LOG("Blending I%d with I%d@(%d,%d) with alpha=%.3f\n", op->src2, op->src, op->x, op->y, op->value);
+      ImageBlend(curr, op->x, op->y, pred, op->value);
+      break;
+    case OP_LOCATE:
+      LOG("Locating I%d in I%d\n", op->src2, op->src);
+      if (ImageLocateSubImage(curr, &x, &y, pred)) {
+        fprintf(b->out, "# FOUND (%d,%d)\n", x, y);
+      } else {
+        fprintf(b->out, "# NOTFOUND\n");
+      }
+      break;
+    case OP_COMPARE: {
+      w = ImageWidth(pred);
+      h = ImageHeight(pred);
+      if (!ImageValidRect(curr, op->x, op->y, w, h)) { err = 6; break; }
+      if (ImageDepth(curr) != ImageDepth(pred)) { err = 8; break; }
+      LOG("Comparing I%d with I%d@(%d,%d)\n", op->src2, op->src, op->x, op->y);
+      ImageDiff d;
+      ImageCompareSubImage(curr, op->x, op->y, pred, &d);
+      fprintf(b->out, "# SAD %" PRIu64 "\n# SSD %" PRIu64 "\n# Max difference: %d\n# PSNR: %.2f dB\n",
+             d.sad, d.ssd, d.maxAbsDiff, d.psnr);
+      break;
+    }
+    case OP_EQUAL:
+      LOG("Checking I%d equals I%d\n", op->src2, op->src);
+      if (!ImageEqual(pred, curr)) err = 11;
+      break;
+    case OP_LABEL: {
+      LOG("Labeling I%d with %d-connectivity\n", op->src, op->param[0]);
+      Labels l = ImageLabel(curr, op->param[0]);
+      if (l == NULL) { err = 4; break; }
+      fprintf(b->out, "# Components: %d\n", LabelsCount(l));
+      for (int k = 1; k <= LabelsCount(l); k++) {
+        const LabelStats* s = LabelsStats(l, k);
+        fprintf(b->out, "# %d: area %lu, box (%d,%d) %dx%d, centroid (%.2f,%.2f)\n",
+               k, s->area, s->x, s->y, s->w, s->h, s->cx, s->cy);
+      }
+      LabelsDestroy(&l);
+      break;
+    }
+    case OP_BLUR:
+      LOG("Blur I%d with %dx%d mean filter\n", op->src, 2*op->x+1, 2*op->y+1);
+      ImageBlur(curr, op->x, op->y);
+      break;
+    case OP_CONV:
+      LOG("Convolving I%d with %dx%d kernel\n", op->src, op->w, op->h);
+      if (!ImageConvolve(curr, op->kernel, op->w, op->h, (int)op->value, op->x)) err = 4;
+      break;
+    case OP_MEDIAN:
+      LOG("Median filter I%d with %dx%d window\n", op->src, 2*op->x+1, 2*op->y+1);
+      if (!ImageMedian(curr, op->x, op->y)) err = 4;
+      break;
+    case OP_MORPH:
+      LOG("%s I%d with %dx%d rectangle\n", morphOps[op->param[0]].name, op->src,
+          2*op->x+1, 2*op->y+1);
+      if (!morphOps[op->param[0]].fn(curr, op->x, op->y)) err = 4;
+      break;
+    case OP_MASK:
+      LOG("Mask %s I%d at level %d with %dx%d rectangle\n", morphOps[op->param[0]].name,
+          op->src, (int)op->value, 2*op->x+1, 2*op->y+1);
+      if (!maskMorph(curr, (uint16)op->value, op->param[0], op->x, op->y)) err = 4;
+      break;
+    case OP_LAYOUT:
+      LOG("Changing layout of I%d\n", op->src);
+      if (!ImageSetLayout(curr, op->param[0])) err = 4;
+      break;
+    case OP_GAUSS:
+      LOG("Gaussian blur I%d with sigma %g\n", op->src, op->value);
+      if (!ImageGaussianBlur(curr, op->value)) err = 4;
+      break;
+    case OP_SAVE: {
+      char name[FILENAME_MAX];
+      if (!expandName(name, sizeof(name), op->file, b->input, b->index)) { err = 5; break; }
+      LOG("Saving %s <- I%d\n", name, op->src);
+      // The file is written in the background, and checked at the end
+      ImageIO io = ImageSaveAsync(curr, name);
+      if (io == NULL) err = 4;
+      else b->saves[b->nsaves++] = io;
+      break;
+    }
+    case OP_LOAD:
+      LOG("Loading %s -> I%d\n", op->file, op->dst);
+      if (b->loads[op->dst] != NULL) {
+        img[op->dst] = ImageLoadWait(&b->loads[op->dst]);
+      } else {
+        // Not read ahead: the file may be one that the pipeline saves
+        if (!finishSaves(b)) { err = 12; break; }
+        img[op->dst] = b->cache != NULL ? loadCached(prog, b, op) : ImageLoad(op->file);
+      }
+      if (img[op->dst] == NULL) err = 4;
+      break;
+    }
+    // Destroy images that are no longer needed
+    const int used[4] = { op->src, op->src2, op->dst, op->dst2 };
+    for (int j = 0; j < 4; j++) {
+      if (used[j] >= 0 && prog->lastUse[used[j]] <= i) dropImage(b, used[j]);
+    }
+  }
+  return err;
+}
+
+// Create buffer b with room for the images of prog.
+// Returns 0 if out of memory.
+static int initBuffer(Buffer* b, const Program* prog, const char* input, int index) {
+  size_t n = (size_t)(prog->nimages > 0 ? prog->nimages : 1);
+  int nsaves = 0;
+  for (int i = 0; i < prog->nplan; i++) {
+    if (prog->plan[i].kind == OP_SAVE) nsaves++;
+  }
+  b->img = calloc(n, sizeof(Image));
+  b->loads = calloc(n, sizeof(ImageIO));
+  b->shared = calloc(n, sizeof(CacheEntry*));
+  b->saves = calloc((size_t)nsaves + 1, sizeof(ImageIO));  // + batch output
+  b->nsaves = 0;
+  b->n = b->img != NULL ? prog->nimages : 0;
+  b->input = input;
+  b->index = index;
+  b->cache = NULL;
+  b->out = stdout;
+  return b->img != NULL && b->loads != NULL && b->saves != NULL && b->shared != NULL;
+}
+
+// Start reading every file that prog loads, so that the disk works
+// while the pipeline computes.  Files that the pipeline saves before it
+// loads them are not read ahead; nor are those whose load cannot start:
+// OP_LOAD then loads them in order, and reports any error.
+static void prefetchLoads(Buffer* b, const Program* prog) {
+  for (int i = 0; i < prog->nplan; i++) {
+    if (prog->plan[i].kind != OP_LOAD) continue;
+    int saved = 0;
+    for (int j = 0; j < i && !saved; j++) {
+      char name[FILENAME_MAX];
+      saved = prog->plan[j].kind == OP_SAVE &&
+              (!expandName(name, sizeof(name), prog->plan[j].file, b->input, b->index) ||
+               strcmp(name, prog->plan[i].file) == 0);
+    }
+    if (!saved) b->loads[prog->plan[i].dst] = ImageLoadAsync(prog->plan[i].file);
+  }
+}
+
+// Destroy all images in buffer b, after waiting for its pending loads
+// (unused if the pipeline failed) and saves (see finishSaves).
+// Returns 0 if a save failed.
+static int clearBuffer(Buffer* b) {
+  for (int i = 0; b->loads != NULL && i < b->n; i++) {
+    if (b->loads[i] != NULL) {
+      Image img = ImageLoadWait(&b->loads[i]);
+      ImageDestroy(&img);
+    }
+  }
+  int ok = b->saves == NULL || finishSaves(b);
+  while (b->n > 0) {
+    dropImage(b, --b->n);
+  }
+  free(b->img);
+  free(b->loads);
+  free(b->saves);
+  free(b->shared);
+  b->img = NULL;
+  b->shared = NULL;
+  b->loads = b->saves = NULL;
+  b->nsaves = 0;
+  return ok;
+}
+
+/// Batch mode
+
+// Shared state of a batch job.
+typedef struct {
+  char** inputs;          // input files
+  int ninputs;
+  int next;               // index of next input to process
+  const Program* prog;    // pipeline, compiled for I0 = input
+  const char* output;     // NAME template for final image, or NULL
+  int factor;             // images that may be alive at once, per input
+  size_t budget;          // bound on bytes of images in flight
+  size_t inflight;        // estimated bytes of images in flight
+  int failed;             // number of failed inputs
+  ImageIO* prefetch;      // load of each input started ahead, or NULL
+  char* started;          // whether the load of each input was started
+  pthread_mutex_t lock;
+  pthread_cond_t released;
+} Batch;
+
+// Estimated memory needed to process input file: the size of the file
+// (which is about the size of its pixel array) times the number of images
+// the pipeline may create.
+static size_t estimateBytes(Batch* bt, const char* file) {
+  struct stat st;
+  size_t size = stat(file, &st) == 0 ? (size_t)st.st_size : 0;
+  return size * (size_t)bt->factor;
+}
+
+// Worker thread: take inputs from the shared queue until it is empty.
+static void* batchWorker(void* arg) {
+  Batch* bt = (Batch*)arg;
+  for (;;) {
+    pthread_mutex_lock(&bt->lock);
+    int i = bt->next;
+    if (i >= bt->ninputs) {
+      pthread_mutex_unlock(&bt->lock);
+      break;
+    }
+    bt->next++;
+    // Wait until the image fits in the memory budget.
+    // An input bigger than the whole budget runs alone.
+    size_t bytes = estimateBytes(bt, bt->inputs[i]);
+    while (bt->inflight > 0 && bt->inflight + bytes > bt->budget) {
+      pthread_cond_wait(&bt->released, &bt->lock);
+    }
+    bt->inflight += bytes;
+    // Take this input's load, if started, and start reading the next
+    // input, which is read ahead of the memory budget.
+    ImageIO load = bt->prefetch[i];
+    bt->started[i] = 1;
+    if (bt->next < bt->ninputs && !bt->started[bt->next]) {
+      bt->started[bt->next] = 1;
+      bt->prefetch[bt->next] = ImageLoadAsync(bt->inputs[bt->next]);
+    }
+    pthread_mutex_unlock(&bt->lock);
+
+    Buffer b;
+    int err = 0;
+    if (!initBuffer(&b, bt->prog, bt->inputs[i], i)) {
+      err = 4;
+    } else {
+      prefetchLoads(&b, bt->prog);
+      b.img[0] = load != NULL ? ImageLoadWait(&load) : ImageLoad(bt->inputs[i]);
+      err = b.img[0] != NULL ? runProgram(bt->prog, &b) : 4;
+    }
+    if (load != NULL) {  // not used: the buffer could not be created
+      Image img = ImageLoadWait(&load);
+      ImageDestroy(&img);
+    }
+    if (err == 0 && bt->output != NULL) {
+      char name[FILENAME_MAX];
+      ImageIO io;
+      if (!expandName(name, sizeof(name), bt->output, b.input, i)) {
+        err = 5;
+      } else if ((io = ImageSaveAsync(b.img[bt->prog->nimages-1], name)) == NULL) {
+        err = 4;
+      } else {
+        b.saves[b.nsaves++] = io;
+      }
+    }
+    if (err != 0) {
+      char msg[256];
+      snprintf(msg, sizeof(msg), errors[err], ImageErrMsg());
+      error(0, err == 4 ? errno : 0, "%s: %s", bt->inputs[i], msg);
+    }
+    if (!clearBuffer(&b) && err == 0) {
+      error(0, 0, "%s: %s", bt->inputs[i], errors[12]);
+      err = 12;
+    }
+
+    pthread_mutex_lock(&bt->lock);
+    if (err != 0) bt->failed++;
+    bt->inflight -= bytes;
+    pthread_cond_broadcast(&bt->released);
+    pthread_mutex_unlock(&bt->lock);
+  }
+  return NULL;
+}
+
+// Append the files named by INPUT argument arg to list g.
+// arg may be @LIST, a glob pattern or a plain file name.
+static void addInputs(glob_t* g, const char* arg) {
+  int flags = GLOB_NOCHECK | (g->gl_pathc > 0 ? GLOB_APPEND : 0);
+  if (arg[0] == '@') {
+    FILE* f = fopen(arg + 1, "r");
+    if (f == NULL) error(5, errno, "%s", arg + 1);
+    char line[FILENAME_MAX];
+    while (fgets(line, sizeof(line), f) != NULL) {
+      line[strcspn(line, "\r\n")] = '\0';
+      if (line[0] == '\0') continue;
+      glob(line, flags | GLOB_NOESCAPE, NULL, g);
+      flags |= GLOB_APPEND;
+    }
+    fclose(f);
+  } else {
+    glob(arg, flags, NULL, g);
+  }
+}
+
+// Run batch mode: imageTool batch [OPTIONS] INPUT... -- OPERATION...
+static int batchMain(int ac, char* av[]) {
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  int nthreads = ncpu > 0 ? (int)ncpu : 1;
+  size_t budgetMB = 1024;
+  Batch bt = { .output = NULL };
+  const char* report = NULL;
+
+  int k = 2;
+  for (; k < ac && av[k][0] == '-' && strcmp(av[k], "--") != 0; k++) {
+    if (k + 1 >= ac) error(5, 0, "Missing argument for %s", av[k]);
+    if (strcmp(av[k], "-j") == 0) {
+      if (sscanf(av[++k], "%d", &nthreads) != 1 || nthreads < 1)
+        error(5, 0, "Invalid number of threads: %s", av[k]);
+    } else if (strcmp(av[k], "-m") == 0) {
+      if (sscanf(av[++k], "%zu", &budgetMB) != 1 || budgetMB < 1)
+        error(5, 0, "Invalid memory bound: %s", av[k]);
+    } else if (strcmp(av[k], "-o") == 0) {
+      bt.output = av[++k];
+    } else if (strcmp(av[k], "-r") == 0) {
+      report = av[++k];
+    } else {
+      error(5, 0, "Unknown option %s\n%s", av[k], USAGE);
+    }
+  }
+
+  glob_t g = { .gl_pathc = 0 };
+  for (; k < ac && strcmp(av[k], "--") != 0; k++) {
+    addInputs(&g, av[k]);
+  }
+  if (k < ac) k++;  // skip "--"
+
+  bt.inputs = g.gl_pathv;
+  bt.ninputs = (int)g.gl_pathc;
+  bt.budget = budgetMB << 20;
+
+  Program prog;
+  int err = compile(&prog, ac, av, k, 1, bt.output != NULL, 1);
+  if (err != 0) {
+    freeProgram(&prog);
+    return err;
+  }
+  bt.prog = &prog;
+  startPerf(&prog);
+  // Count operations that create images, to estimate memory per input.
+  bt.factor = 1;
+  for (int i = 0; i < prog.nplan; i++) {
+    if (prog.plan[i].dst >= 0 || prog.plan[i].kind == OP_BLUR ||
+        prog.plan[i].kind == OP_GAUSS || prog.plan[i].kind == OP_MEDIAN ||
+        prog.plan[i].kind == OP_MORPH || prog.plan[i].kind == OP_MASK ||
+        prog.plan[i].kind == OP_LAZY || prog.plan[i].kind == OP_RLE ||
+        prog.plan[i].kind == OP_LAYOUT)
+      bt.factor++;
+    if (prog.plan[i].dst2 >= 0)
+      bt.factor++;
+  }
+  bt.prefetch = calloc((size_t)(bt.ninputs > 0 ? bt.ninputs : 1), sizeof(ImageIO));
+  bt.started = calloc((size_t)(bt.ninputs > 0 ? bt.ninputs : 1), 1);
+  if (bt.prefetch == NULL || bt.started == NULL) error(4, errno, "Allocating inputs");
+  pthread_mutex_init(&bt.lock, NULL);
+  pthread_cond_init(&bt.released, NULL);
+
+  if (nthreads > bt.ninputs) nthreads = bt.ninputs > 0 ? bt.ninputs : 1;
+  shareCpus(nthreads);
+  fprintf(stderr, "Batch: %d inputs, %d threads\n", bt.ninputs, nthreads);
+  verbose = 0;
+  if (report != NULL) InstrReset();
+
+  pthread_t* threads = malloc((size_t)nthreads * sizeof(pthread_t));
+  if (threads == NULL) error(4, errno, "Allocating threads");
+  int started = 0;
+  for (; started < nthreads; started++) {
+    if (pthread_create(&threads[started], NULL, batchWorker, &bt) != 0) break;
+  }
+  if (started == 0) batchWorker(&bt);  // no threads: do it ourselves
+  for (int i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+
+  fprintf(stderr, "Batch: %d of %d inputs failed\n", bt.failed, bt.ninputs);
+  // The workers have exited, leaving their scopes to the report
+  int rerr = report != NULL ? writeReport(report, stdout) : 0;
+  pthread_cond_destroy(&bt.released);
+  pthread_mutex_destroy(&bt.lock);
+  free(bt.prefetch);
+  free(bt.started);
+  if (g.gl_pathc > 0) globfree(&g);
+  freeProgram(&prog);
+  errno = 0;
+  return bt.failed > 0 ? 9 : rerr;
+}
+
+/// Server mode
+
+// A stream of requests, one per line, and of their responses, which are
+// written in the order of the requests, even if they finish out of order.
+typedef struct {
+  FILE* in;
+  FILE* out;
+  unsigned long nread;      // requests read
+  unsigned long nwritten;   // responses written
+  unsigned long failed;     // failed requests
+  pthread_mutex_t lock;
+  pthread_cond_t turn;      // a response was written
+} Session;
+
+// Shared state of a server.
+typedef struct {
+  Cache cache;
+  Session input;            // stdin, if not listening
+  int listenfd;             // socket listened on, or -1
+} Server;
+
+// Run the pipeline in line, printing its output and then its status to out.
+// Returns 0 on success, or an index into errors[] on failure.
+static int runRequest(Server* srv, char* line, FILE* out) {
+  int ac = 0;
+  char** av = malloc((strlen(line) / 2 + 1) * sizeof(char*));  // words
+  int err = av == NULL ? 4 : 0;
+  char* save = NULL;
+  for (char* w = strtok_r(line, " \t\r\n", &save); w != NULL && err == 0;
+       w = strtok_r(NULL, " \t\r\n", &save)) {
+    av[ac++] = w;
+  }
+  Program prog;
+  if (err == 0 && (err = compile(&prog, ac, av, 0, 0, 0, 1)) == 0) {
+    Buffer b;
+    if (initBuffer(&b, &prog, NULL, 0)) {
+      b.cache = &srv->cache;
+      b.out = out;
+      err = runProgram(&prog, &b);
+    } else {
+      err = 4;
+    }
+    if (!clearBuffer(&b) && err == 0) err = 12;
+  }
+  if (av != NULL) freeProgram(&prog);
+  free(av);
+
+  if (err == 0) {
+    fprintf(out, "OK\n");
+  } else {
+    int errsave = errno;
+    fprintf(out, "ERROR %d: ", err);
+    fprintf(out, errors[err], ImageErrMsg());
+    if (err == 4 && errsave != 0) fprintf(out, ": %s", strerror(errsave));
+    fprintf(out, "\n");
+  }
+  return err;
+}
+
+// Serve the requests of session s, until its input ends.
+// Several threads may serve the same session.
+static void serveSession(Server* srv, Session* s) {
+  char* line = NULL;
+  size_t cap = 0;
+  for (;;) {
+    // Read the next request that is not a blank line
+    pthread_mutex_lock(&s->lock);
+    ssize_t len;
+    while ((len = getline(&line, &cap, s->in)) >= 0 &&
+           line[strspn(line, " \t\r\n")] == '\0') {}
+    unsigned long seq = s->nread;
+    if (len >= 0) s->nread++;
+    pthread_mutex_unlock(&s->lock);
+    if (len < 0) break;
+
+    char* text = NULL;
+    size_t size = 0;
+    FILE* out = open_memstream(&text, &size);
+    int err = 4;
+    if (out != NULL) {
+      errno = 0;
+      err = runRequest(srv, line, out);
+      fclose(out);
+    }
+
+    // Write the response when all previous ones have been written
+    pthread_mutex_lock(&s->lock);
+    while (s->nwritten != seq) {
+      pthread_cond_wait(&s->turn, &s->lock);
+    }
+    if (out != NULL) fwrite(text, 1, size, s->out);
+    else fprintf(s->out, "ERROR 4: %s\n", strerror(ENOMEM));
+    fflush(s->out);
+    s->nwritten++;
+    if (err != 0) s->failed++;
+    pthread_cond_broadcast(&s->turn);
+    pthread_mutex_unlock(&s->lock);
+    free(text);
+  }
+  free(line);
+}
+
+static void initSession(Session* s, FILE* in, FILE* out) {
+  *s = (Session){ .in = in, .out = out };
+  pthread_mutex_init(&s->lock, NULL);
+  pthread_cond_init(&s->turn, NULL);
+}
+
+static void destroySession(Session* s) {
+  pthread_cond_destroy(&s->turn);
+  pthread_mutex_destroy(&s->lock);
+}
+
+// Worker thread: serve stdin, shared with the other workers, or else
+// serve one client of the socket at a time.
+static void* serveWorker(void* arg) {
+  Server* srv = (Server*)arg;
+  if (srv->listenfd < 0) {
+    serveSession(srv, &srv->input);
+    return NULL;
+  }
+  for (;;) {
+    int fd = accept(srv->listenfd, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      error(0, errno, "Accepting client");
+      break;
+    }
+    int fd2 = dup(fd);
+    FILE* in = fdopen(fd, "r");
+    FILE* out = fd2 >= 0 ? fdopen(fd2, "w") : NULL;
+    if (in != NULL && out != NULL) {
+      Session s;
+      initSession(&s, in, out);
+      serveSession(srv, &s);
+      destroySession(&s);
+    }
+    if (in != NULL) fclose(in); else close(fd);
+    if (out != NULL) fclose(out); else if (fd2 >= 0) close(fd2);
+  }
+  return NULL;
+}
+
+// Listen on Unix domain socket path, replacing a stale socket file.
+// Returns the socket, or -1 on failure.
+static int listenSocket(const char* path) {
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+  struct stat st;
+  if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) return -1;
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 64) != 0) {
+    int errsave = errno;
+    close(fd);
+    errno = errsave;
+    return -1;
+  }
+  return fd;
+}
+
+// Run server mode: imageTool serve [OPTIONS]
+static int serveMain(int ac, char* av[]) {
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  int nthreads = ncpu > 0 ? (int)ncpu : 1;
+  size_t budgetMB = 1024;
+  const char* socketPath = NULL;
+
+  for (int k = 2; k < ac; k++) {
+    if (k + 1 >= ac) error(5, 0, "Missing argument for %s", av[k]);
+    if (strcmp(av[k], "-j") == 0) {
+      if (sscanf(av[++k], "%d", &nthreads) != 1 || nthreads < 1)
+        error(5, 0, "Invalid number of threads: %s", av[k]);
+    } else if (strcmp(av[k], "-m") == 0) {
+      if (sscanf(av[++k], "%zu", &budgetMB) != 1 || budgetMB < 1)
+        error(5, 0, "Invalid memory bound: %s", av[k]);
+    } else if (strcmp(av[k], "-s") == 0) {
+      socketPath = av[++k];
+    } else {
+      error(5, 0, "Unknown option %s\n%s", av[k], USAGE);
+    }
+  }
+
+  shareCpus(nthreads);
+  Server srv = { .listenfd = -1 };
+  srv.cache.budget = budgetMB << 20;
+  pthread_mutex_init(&srv.cache.lock, NULL);
+  pthread_cond_init(&srv.cache.loaded, NULL);
+  signal(SIGPIPE, SIG_IGN);  // clients that go away are not fatal
+  if (socketPath != NULL) {
+    srv.listenfd = listenSocket(socketPath);
+    if (srv.listenfd < 0) error(5, errno, "%s", socketPath);
+    fprintf(stderr, "Serve: listening on %s, %d threads\n", socketPath, nthreads);
+  } else {
+    // Responses go to stdout, which is left to them alone: anything
+    // else printed there goes to stderr.
+    int fd = dup(STDOUT_FILENO);
+    FILE* out = fd >= 0 ? fdopen(fd, "w") : NULL;
+    if (out == NULL || dup2(STDERR_FILENO, STDOUT_FILENO) < 0)
+      error(4, errno, "Redirecting stdout");
+    initSession(&srv.input, stdin, out);
+  }
+  verbose = 0;
+
+  pthread_t* threads = malloc((size_t)nthreads * sizeof(pthread_t));
+  if (threads == NULL) error(4, errno, "Allocating threads");
+  int started = 0;
+  for (; started < nthreads; started++) {
+    if (pthread_create(&threads[started], NULL, serveWorker, &srv) != 0) break;
+  }
+  if (started == 0) serveWorker(&srv);  // no threads: do it ourselves
+  for (int i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+
+  int err = 0;
+  if (srv.listenfd >= 0) {  // accept failed
+    close(srv.listenfd);
+    err = 5;
+  } else {
+    fprintf(stderr, "Serve: %lu requests, %lu failed; cache: %lu hits, %lu misses\n",
+            srv.input.nread, srv.input.failed, srv.cache.hits, srv.cache.misses);
+    fclose(srv.input.out);
+    destroySession(&srv.input);
+  }
+  cacheClear(&srv.cache);
+  pthread_cond_destroy(&srv.cache.loaded);
+  pthread_mutex_destroy(&srv.cache.lock);
+  errno = 0;
+  return err;
+}
+
+int main(int ac, char* av[]) {
+  if (ac <= 1) {
+    error(5, 0, "\n%s", USAGE);
+  }
+
+  ImageInit();
+  ImageSetDiagnostics(logDiag, NULL);
+
+  int err;
+  if (strcmp(av[1], "batch") == 0) {
+    err = batchMain(ac, av);
+  } else if (strcmp(av[1], "serve") == 0) {
+    err = serveMain(ac, av);
+  } else {
+    Program prog;
+    Buffer b;
+    err = compile(&prog, ac, av, 1, 0, 0, 0);
+    if (err == 0) {
+      startPerf(&prog);
+      if (initBuffer(&b, &prog, NULL, 0)) {
+        prefetchLoads(&b, &prog);
+        err = runProgram(&prog, &b);
+      } else {
+        err = 4;
+      }
+      if (!clearBuffer(&b) && err == 0) err = 12;
+    }
+    freeProgram(&prog);
+  }
+
+  error(err, errno, errors[err], ImageErrMsg());
+  return 0;
+}
@@ -9,7 +9,7 @@
 /// // Name the counters you're going to use: 
 /// InstrName[0] = "memops";
 /// InstrName[1] = "adds";
-/// InstrCalibrate();  // Call once, to measure CTU
+/// InstrCalibrate();  // Call once, to measure CTU (when first needed)
 /// ...
 /// InstrReset();  // reset to zero
 /// for (...) {
@@ -19,9 +19,15 @@
 /// }
 /// InstrPrint();  // to show time and counters
 
+#undef NINSTR  // this module is always complete; NINSTR only affects callers
 #include "instrumentation.h"
+#include <assert.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 /// Cpu time in seconds
 double cpu_time(void) ; ///
@@ -42,6 +48,14 @@ double cpu_time(void) {
   return (double)current_time.tv_sec + 1.0e-9 * (double)current_time.tv_nsec;
 }
 
+double wall_time(void) {
+  struct timespec current_time;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &current_time) != 0)
+    return -1.0; // clock_gettime() failed!!!
+  return (double)current_time.tv_sec + 1.0e-9 * (double)current_time.tv_nsec;
+}
+
 #endif
 
 
@@ -66,10 +80,103 @@ double cpu_time(void) {
   return (double)current_time.QuadPart / (double)frequency.QuadPart;
 }
 
+double wall_time(void) {
+  return cpu_time();  // QueryPerformanceCounter is wall-clock already
+}
+
 #endif
 
-/// Array of operation counters:
-unsigned long InstrCount[NUMCOUNTERS];  ///extern
+/// Counters
+//
+// Counter blocks of live threads are kept in a list, so they can be merged.
+// A thread-specific key runs retireBlock when a thread exits, to move its
+// counts into retired and unlink its block.
+
+struct block {
+  unsigned long count[NUMCOUNTERS];
+  struct block* prev;
+  struct block* next;
+};
+
+// Counter block of each thread.  Thread-local storage of different threads
+// never shares cache lines, so threads count without interference.
+static _Thread_local struct block local;
+
+/// Counter block of the current thread (NULL until first use):
+_Thread_local unsigned long* InstrLocal = NULL;  ///extern
+
+// List of registered blocks, and counts of threads that exited.
+// Blocks are only written by their threads: other threads read them with
+// atomic loads, and InstrReset records a baseline instead of zeroing them.
+static struct block* blocks = NULL;
+static unsigned long retired[NUMCOUNTERS];
+static unsigned long baseline[NUMCOUNTERS];  // raw totals on last reset
+static pthread_mutex_t countLock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_key_t blockKey;
+static pthread_once_t blockKeyOnce = PTHREAD_ONCE_INIT;
+
+// Fold the counts of an exiting thread's block b into retired.
+static void retireBlock(void* p) {
+  struct block* b = p;
+  pthread_mutex_lock(&countLock);
+  for (int i = 0; i < NUMCOUNTERS; i++)
+    retired[i] += b->count[i];
+  if (b->prev != NULL) b->prev->next = b->next;
+  else blocks = b->next;
+  if (b->next != NULL) b->next->prev = b->prev;
+  pthread_mutex_unlock(&countLock);
+}
+
+static void makeBlockKey(void) {
+  pthread_key_create(&blockKey, retireBlock);
+}
+
+unsigned long* InstrAttach(void) { ///
+  if (InstrLocal != NULL) return InstrLocal;
+  pthread_once(&blockKeyOnce, makeBlockKey);
+  pthread_mutex_lock(&countLock);
+  local.prev = NULL;
+  local.next = blocks;
+  if (blocks != NULL) blocks->prev = &local;
+  blocks = &local;
+  pthread_mutex_unlock(&countLock);
+  pthread_setspecific(blockKey, &local);
+  InstrLocal = local.count;
+  return InstrLocal;
+}
+
+// Store the totals of all counters, over all threads, in total, counting
+// from the start (not from the last reset).  Requires countLock.
+static void rawCounts(unsigned long total[NUMCOUNTERS]) {
+  for (int i = 0; i < NUMCOUNTERS; i++)
+    total[i] = retired[i];
+  for (struct block* b = blocks; b != NULL; b = b->next)
+    for (int i = 0; i < NUMCOUNTERS; i++)
+      total[i] += __atomic_load_n(&b->count[i], __ATOMIC_RELAXED);
+}
+
+// Store the totals of all counters, over all threads, since last reset,
+// in total.
+static void mergeCounts(unsigned long total[NUMCOUNTERS]) {
+  pthread_mutex_lock(&countLock);
+  rawCounts(total);
+  for (int i = 0; i < NUMCOUNTERS; i++)
+    total[i] -= baseline[i];
+  pthread_mutex_unlock(&countLock);
+}
+
+// Store the counters of the current thread in count.
+static void ownCounts(unsigned long count[NUMCOUNTERS]) {
+  memcpy(count, InstrCount, NUMCOUNTERS * sizeof(unsigned long));
+}
+
+unsigned long InstrTotal(int i) { ///
+  assert(0 <= i && i < NUMCOUNTERS);
+  unsigned long total[NUMCOUNTERS];
+  mergeCounts(total);
+  return total[i];
+}
 
 /// Array of names for the counters:
 char* InstrName[NUMCOUNTERS] = {NULL};  ///extern
@@ -82,10 +189,8 @@ double InstrTime;  ///extern
 /// Calibrated Time Unit (in seconds, initially 1s)
 double InstrCTU = 1.0;  ///extern
 
-/// Find the Calibrated Time Unit (CTU).
-/// Run and time a loop of basic memory and arithmetic operations to set
-/// a reasonably cpu-independent time unit.
-void InstrCalibrate(void) { ///
+// Run and time a loop of basic memory and arithmetic operations.
+static double measureCTU(void) {
   const int size = 4*1024;     // 2^12!
   const int mask = size - 1;
   int array[size];  // alloc array in stack, not initialized on purpose
@@ -98,13 +203,473 @@ void InstrCalibrate(void) { ///
     array[k] ^= array[i] + array[j] + i*j;
     //printf("%d %d %d\n", i, j, k);  // debug
   }
-  InstrCTU = cpu_time() - time;
+  return cpu_time() - time;
 }
 
-/// Reset counters to zero and store cpu_time.
-void InstrReset(void) { ///
+// Calibration requested by InstrCalibrate, but not done yet
+static int ctuPending = 0;
+static pthread_mutex_t ctuLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Store in key (of given size) a description of the CPU model,
+// used to key the CTU cache.  Returns 0 if the model is unknown.
+static int cpuModel(char* key, size_t size) {
+  key[0] = '\0';
+  FILE* f = fopen("/proc/cpuinfo", "r");
+  if (f != NULL) {
+    char line[256];
+    while (fgets(line, sizeof(line), f) != NULL) {
+      // x86 names the model; ARM gives implementer and part numbers
+      if (strncmp(line, "model name", 10) == 0 ||
+          strncmp(line, "CPU implementer", 15) == 0 ||
+          strncmp(line, "CPU part", 8) == 0) {
+        char* v = strchr(line, ':');
+        if (v == NULL) continue;
+        v += strspn(v + 1, " \t") + 1;
+        v[strcspn(v, "\n")] = '\0';
+        size_t len = strlen(key);
+        snprintf(key + len, size - len, "%s%s", len > 0 ? " " : "", v);
+        if (strncmp(line, "model name", 10) == 0 || strncmp(line, "CPU part", 8) == 0)
+          break;  // first cpu is enough
+      }
+    }
+    fclose(f);
+  }
+  // sanitize: the key is one field of a line in the cache file
+  for (char* c = key; *c != '\0'; c++)
+    if (*c == '\t' || *c == '\n') *c = ' ';
+  return key[0] != '\0';
+}
+
+// Store in path (of given size) the name of the CTU cache file.
+// Returns 0 if caching is disabled or no location is known.
+static int ctuCachePath(char* path, size_t size) {
+  const char* env = getenv("INSTR_CTU_CACHE");
+  if (env != NULL)
+    return env[0] != '\0' && snprintf(path, size, "%s", env) < (int)size;
+  const char* dir = getenv("XDG_CACHE_HOME");
+  if (dir != NULL && dir[0] != '\0')
+    return snprintf(path, size, "%s/instrumentation-ctu", dir) < (int)size;
+  dir = getenv("HOME");
+  if (dir != NULL && dir[0] != '\0')
+    return snprintf(path, size, "%s/.cache/instrumentation-ctu", dir) < (int)size;
+  return 0;
+}
+
+// Look up the CTU for cpu model key in cache file path.
+// The file has one line per model: CTU <tab> model.
+// Returns the CTU, or 0.0 if not found.
+static double ctuLookup(const char* path, const char* key) {
+  FILE* f = fopen(path, "r");
+  if (f == NULL) return 0.0;
+  double ctu = 0.0;
+  char line[512];
+  while (fgets(line, sizeof(line), f) != NULL) {
+    char* tab = strchr(line, '\t');
+    if (tab == NULL) continue;
+    tab[1 + strcspn(tab + 1, "\n")] = '\0';
+    if (strcmp(tab + 1, key) == 0) {
+      ctu = strtod(line, NULL);
+      if (ctu > 0.0) break;
+    }
+  }
+  fclose(f);
+  return ctu > 0.0 ? ctu : 0.0;
+}
+
+/// Find the Calibrated Time Unit (CTU), when first needed.
+void InstrCalibrate(void) { ///
+  pthread_mutex_lock(&ctuLock);
+  ctuPending = 1;
+  pthread_mutex_unlock(&ctuLock);
+}
+
+/// Return the Calibrated Time Unit, calibrating first if still pending.
+double InstrGetCTU(void) { ///
+  pthread_mutex_lock(&ctuLock);
+  if (ctuPending) {
+    int errsave = errno;  // a missing cache is not an error for the caller
+    char key[256];
+    char path[FILENAME_MAX];
+    int cached = cpuModel(key, sizeof(key)) && ctuCachePath(path, sizeof(path));
+    double ctu = cached ? ctuLookup(path, key) : 0.0;
+    if (ctu == 0.0) {
+      ctu = measureCTU();
+      FILE* f = cached ? fopen(path, "a") : NULL;
+      if (f == NULL && cached) {  // maybe the directory is missing
+        char* slash = strrchr(path, '/');
+        if (slash != NULL && slash != path) {
+          *slash = '\0';
+          mkdir(path, 0755);
+          *slash = '/';
+          f = fopen(path, "a");
+        }
+      }
+      if (f != NULL) {
+        fprintf(f, "%.9g\t%s\n", ctu, key);
+        fclose(f);
+      }
+    }
+    errno = errsave;
+    InstrCTU = ctu;
+    ctuPending = 0;
+  }
+  double ctu = InstrCTU;
+  pthread_mutex_unlock(&ctuLock);
+  return ctu;
+}
+
+/// Hardware event counters
+//
+// Each event is opened as a separate counter (not as a group), since
+// inherited counters (which follow the threads created by the caller)
+// cannot be read as a group. Counts of threads are added to their creator
+// when they exit, which is when parallel operations finish.
+// Counters may be multiplexed by the kernel when there are not enough
+// hardware registers: values are then scaled by time_enabled/time_running.
+
+const char* const InstrPerfName[NUMPERF] = {
+  "cycles", "instructions", "LLC-misses", "dTLB-misses", "branch-misses"
+};
+
+// File descriptors of the hardware event counters (-1 = not counted)
+static int perfFd[NUMPERF] = {-1, -1, -1, -1, -1};
+
+// Number of events counted, or -1 if InstrPerfOpen was not called
+static int perfCount = -1;
+
+// Hardware event counts on previous reset
+static unsigned long perf0[NUMPERF];
+
+#ifdef __linux__
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Open a counter for event (type, config), or return -1 on failure.
+static int perfOpen(unsigned int type, unsigned long long config) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.inherit = 1;
+  attr.exclude_kernel = 1;  // allowed by default perf_event_paranoid
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+int InstrPerfOpen(void) { ///
+  if (perfCount >= 0) return perfCount;
+  static const unsigned int type[NUMPERF] = {
+    PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE,
+    PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE
+  };
+  static const unsigned long long config[NUMPERF] = {
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES,
+    PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+    PERF_COUNT_HW_BRANCH_MISSES
+  };
+  int errsave = errno;  // failures here are not errors for the caller
+  perfCount = 0;
+  for (int i = 0; i < NUMPERF; i++)
+    if ((perfFd[i] = perfOpen(type[i], config[i])) >= 0)
+      perfCount++;
+  errno = errsave;
+  return perfCount;
+}
+
+// Read current hardware event counts into v (0 for events not counted).
+static void perfRead(unsigned long v[NUMPERF]) {
+  for (int i = 0; i < NUMPERF; i++) {
+    unsigned long long data[3];  // value, time enabled, time running
+    v[i] = 0;
+    if (perfFd[i] < 0 || read(perfFd[i], data, sizeof(data)) != (ssize_t)sizeof(data))
+      continue;
+    if (data[2] > 0 && data[2] < data[1])
+      v[i] = (unsigned long)((double)data[0] * (double)data[1] / (double)data[2]);
+    else
+      v[i] = (unsigned long)data[0];
+  }
+}
+
+void InstrPerfClose(void) { ///
+  for (int i = 0; i < NUMPERF; i++) {
+    if (perfFd[i] >= 0) close(perfFd[i]);
+    perfFd[i] = -1;
+  }
+  perfCount = -1;
+}
+
+#else
+
+int InstrPerfOpen(void) { ///
+  perfCount = 0;  // not supported on this OS
+  return 0;
+}
+
+static void perfRead(unsigned long v[NUMPERF]) {
+  for (int i = 0; i < NUMPERF; i++)
+    v[i] = 0;
+}
+
+void InstrPerfClose(void) { ///
+  perfCount = -1;
+}
+
+#endif
+
+// Whether hardware event i is being counted.
+static int perfOn(int i) {
+  return perfFd[i] >= 0;
+}
+
+/// Scopes
+//
+// Scope statistics are kept in trees: each node accumulates the calls,
+// times, bytes and counter increments of all the (begin, end) pairs with
+// the same name and the same parent node.
+// Each thread keeps its own tree, and its own stack of open scopes,
+// recording where and when each one started, so scopes are opened and
+// closed with no locking.  The trees are only merged to report them.
+// Counter increments of a scope are those of the thread that opened it, so
+// concurrent scopes do not add to each other's counts.  Operations that
+// count in worker threads must add those counts in the opening thread.
+//
+// A thread only writes its own tree, with atomic stores, and publishes new
+// nodes with release stores, so that InstrReport may read it meanwhile.
+// InstrReset does not write into the trees either: it starts a new epoch,
+// and each thread clears its own tree when it sees that its epoch is past.
+// Trees of past epochs are left out of reports.
+
+struct scope {
+  const char* name;
+  struct scope* parent;
+  struct scope* child;    // first child
+  struct scope* next;     // next sibling
+  unsigned long calls;
+  double wall;            // total wall time (s)
+  double cpu;             // total cpu time (s), of the whole process
+  unsigned long bytes;    // total data volume
+  unsigned long count[NUMCOUNTERS];  // total counter increments
+  unsigned long perf[NUMPERF];       // total hardware events
+};
+
+// The scope tree of a thread
+struct tree {
+  struct scope root;      // pseudo scope, never reported
+  unsigned long epoch;    // epoch of the statistics in the tree
+  struct tree* prev;
+  struct tree* next;
+};
+
+// Current epoch: number of calls to InstrReset
+static unsigned long epoch = 0;
+
+// List of trees of running threads, and merged trees of exited threads
+static struct tree* trees = NULL;
+static struct scope retiredRoot;
+static pthread_mutex_t treeLock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_key_t treeKey;
+static pthread_once_t treeKeyOnce = PTHREAD_ONCE_INIT;
+
+// Tree of the current thread (NULL until its first scope)
+static _Thread_local struct tree* localTree = NULL;
+
+// Add the statistics of scope src to those of dst.
+// src may be being updated by another thread.
+static void addScope(struct scope* dst, struct scope* src) {
+  double wall, cpu;
+  __atomic_load(&src->wall, &wall, __ATOMIC_RELAXED);
+  __atomic_load(&src->cpu, &cpu, __ATOMIC_RELAXED);
+  dst->calls += __atomic_load_n(&src->calls, __ATOMIC_RELAXED);
+  dst->wall += wall;
+  dst->cpu += cpu;
+  dst->bytes += __atomic_load_n(&src->bytes, __ATOMIC_RELAXED);
+  for (int i = 0; i < NUMCOUNTERS; i++)
+    dst->count[i] += __atomic_load_n(&src->count[i], __ATOMIC_RELAXED);
+  for (int i = 0; i < NUMPERF; i++)
+    dst->perf[i] += __atomic_load_n(&src->perf[i], __ATOMIC_RELAXED);
+}
+
+// Child of scope parent named name, or NULL.
+static struct scope* findChild(struct scope* parent, const char* name) {
+  struct scope* s = __atomic_load_n(&parent->child, __ATOMIC_ACQUIRE);
+  while (s != NULL && strcmp(s->name, name) != 0)
+    s = __atomic_load_n(&s->next, __ATOMIC_ACQUIRE);
+  return s;
+}
+
+// Add a new child named name to scope parent, last, so that scopes are
+// reported in order of first use.  Returns it, or NULL if out of memory.
+static struct scope* addChild(struct scope* parent, const char* name) {
+  struct scope* s = calloc(1, sizeof(*s));
+  if (s == NULL) return NULL;
+  s->name = name;
+  s->parent = parent;
+  struct scope** last = &parent->child;
+  while (*last != NULL) last = &(*last)->next;
+  __atomic_store_n(last, s, __ATOMIC_RELEASE);
+  return s;
+}
+
+// Add the statistics of the scopes in list src (siblings), and of their
+// descendants, to the children of dst, creating them as needed.
+static void mergeScopes(struct scope* dst, struct scope* src) {
+  for (; src != NULL; src = __atomic_load_n(&src->next, __ATOMIC_ACQUIRE)) {
+    struct scope* d = findChild(dst, src->name);
+    if (d == NULL && (d = addChild(dst, src->name)) == NULL) d = dst;
+    addScope(d, src);
+    mergeScopes(d, __atomic_load_n(&src->child, __ATOMIC_ACQUIRE));
+  }
+}
+
+// Free the scopes in list s and their descendants.
+static void freeScopes(struct scope* s) {
+  while (s != NULL) {
+    struct scope* next = s->next;
+    freeScopes(s->child);
+    free(s);
+    s = next;
+  }
+}
+
+// Reset statistics of scope s and its descendants.
+// Only the thread that owns them may call it.
+static void resetScope(struct scope* s) {
+  static const double zero = 0.0;
+  for (; s != NULL; s = s->next) {
+    __atomic_store_n(&s->calls, 0, __ATOMIC_RELAXED);
+    __atomic_store(&s->wall, &zero, __ATOMIC_RELAXED);
+    __atomic_store(&s->cpu, &zero, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->bytes, 0, __ATOMIC_RELAXED);
+    for (int i = 0; i < NUMCOUNTERS; i++)
+      __atomic_store_n(&s->count[i], 0, __ATOMIC_RELAXED);
+    for (int i = 0; i < NUMPERF; i++)
+      __atomic_store_n(&s->perf[i], 0, __ATOMIC_RELAXED);
+    resetScope(s->child);
+  }
+}
+
+// Fold the tree of an exiting thread into the retired scopes.
+static void retireTree(void* p) {
+  struct tree* t = p;
+  pthread_mutex_lock(&treeLock);
+  if (t->epoch == epoch) mergeScopes(&retiredRoot, t->root.child);
+  if (t->prev != NULL) t->prev->next = t->next;
+  else trees = t->next;
+  if (t->next != NULL) t->next->prev = t->prev;
+  pthread_mutex_unlock(&treeLock);
+  freeScopes(t->root.child);
+  free(t);
+}
+
+static void makeTreeKey(void) {
+  pthread_key_create(&treeKey, retireTree);
+}
+
+// Tree of the current thread, created and registered on first use.
+// Returns NULL if out of memory.
+static struct tree* ownTree(void) {
+  if (localTree != NULL) return localTree;
+  struct tree* t = calloc(1, sizeof(*t));
+  if (t == NULL) return NULL;
+  pthread_once(&treeKeyOnce, makeTreeKey);
+  pthread_mutex_lock(&treeLock);
+  t->epoch = epoch;
+  t->next = trees;
+  if (trees != NULL) trees->prev = t;
+  trees = t;
+  pthread_mutex_unlock(&treeLock);
+  pthread_setspecific(treeKey, t);
+  localTree = t;
+  return t;
+}
+
+// Maximum nesting of open scopes
+#define MAXDEPTH 32
+
+// An open scope
+struct frame {
+  struct scope* scope;
+  double wall0, cpu0;
+  unsigned long count0[NUMCOUNTERS];
+  unsigned long perf0[NUMPERF];
+};
+
+// Stack of open scopes, for each thread
+static _Thread_local struct frame stack[MAXDEPTH];
+static _Thread_local int depth = 0;
+
+// Scope that accounts for anything that cannot be recorded (out of memory)
+static struct scope lost;
+
+void InstrBegin(const char* name) { ///
+  assert(depth < MAXDEPTH);
+  struct scope* s = &lost;
+  struct tree* t = ownTree();
+  if (t != NULL) {
+    struct scope* parent = depth > 0 ? stack[depth-1].scope : &t->root;
+    if (parent == &lost) {
+      s = parent;
+    } else if ((s = findChild(parent, name)) == NULL && (s = addChild(parent, name)) == NULL) {
+      s = parent;  // out of memory: account in parent
+    }
+  }
+  struct frame* f = &stack[depth++];
+  f->scope = s;
+  ownCounts(f->count0);
+  if (perfCount > 0) perfRead(f->perf0);
+  f->cpu0 = cpu_time();
+  f->wall0 = wall_time();
+}
+
+void InstrEnd(unsigned long bytes) { ///
+  double wall = wall_time();
+  double cpu = cpu_time();
+  assert(depth > 0);
+  struct frame* f = &stack[--depth];
+  unsigned long perf[NUMPERF];
+  if (perfCount > 0) perfRead(perf);
+  unsigned long count[NUMCOUNTERS];
+  ownCounts(count);
+  struct scope* s = f->scope;
+  struct tree* t = localTree;
+  if (s == &lost || t == NULL) return;
+  unsigned long e = __atomic_load_n(&epoch, __ATOMIC_ACQUIRE);
+  if (t->epoch != e) {  // InstrReset was called: start again from zero
+    resetScope(t->root.child);
+    __atomic_store_n(&t->epoch, e, __ATOMIC_RELEASE);
+  }
+  wall = s->wall + (wall - f->wall0);
+  cpu = s->cpu + (cpu - f->cpu0);
+  __atomic_store_n(&s->calls, s->calls + 1, __ATOMIC_RELAXED);
+  __atomic_store(&s->wall, &wall, __ATOMIC_RELAXED);
+  __atomic_store(&s->cpu, &cpu, __ATOMIC_RELAXED);
+  __atomic_store_n(&s->bytes, s->bytes + bytes, __ATOMIC_RELAXED);
   for (int i = 0; i < NUMCOUNTERS; i++)
-    InstrCount[i] = 0ul;
+    __atomic_store_n(&s->count[i], s->count[i] + count[i] - f->count0[i], __ATOMIC_RELAXED);
+  if (perfCount > 0)
+    for (int i = 0; i < NUMPERF; i++)
+      __atomic_store_n(&s->perf[i], s->perf[i] + perf[i] - f->perf0[i], __ATOMIC_RELAXED);
+}
+
+/// Reset counters and scope statistics to zero and store cpu_time.
+void InstrReset(void) { ///
+  pthread_mutex_lock(&countLock);
+  rawCounts(baseline);
+  pthread_mutex_unlock(&countLock);
+  pthread_mutex_lock(&treeLock);
+  __atomic_store_n(&epoch, epoch + 1, __ATOMIC_RELEASE);
+  freeScopes(retiredRoot.child);
+  retiredRoot.child = NULL;
+  pthread_mutex_unlock(&treeLock);
+  if (perfCount > 0) perfRead(perf0);
   InstrTime = cpu_time();
 }
 
@@ -113,17 +678,160 @@ void InstrPrint(void) { ///
   // elapsed time since last reset:
   double time = cpu_time() - InstrTime;
   // compute time in calibrated time units:
-  double caltime = time / InstrCTU;
+  double caltime = time / InstrGetCTU();
+  // hardware events since last reset:
+  unsigned long perf[NUMPERF];
+  if (perfCount > 0) perfRead(perf);
+  unsigned long count[NUMCOUNTERS];
+  mergeCounts(count);
 
   printf("#%14.15s\t%15.15s", "time", "caltime");
   for (int i = 0; i < NUMCOUNTERS; i++)
     if (InstrName[i] != NULL)
       printf("\t%15.15s", InstrName[i]);
+  for (int i = 0; i < NUMPERF; i++)
+    if (perfOn(i))
+      printf("\t%15.15s", InstrPerfName[i]);
   puts("");
   printf("%15.6f\t%15.6f", time, caltime);
   for (int i = 0; i < NUMCOUNTERS; i++)
     if (InstrName[i] != NULL)
-      printf("\t%15lu", InstrCount[i]);  
+      printf("\t%15lu", count[i]);
+  for (int i = 0; i < NUMPERF; i++)
+    if (perfOn(i))
+      printf("\t%15lu", perf[i] - perf0[i]);
   puts("");
 }
 
+// Throughput of scope s in MB/s
+static double throughput(const struct scope* s) {
+  return s->wall > 0.0 ? (double)s->bytes / s->wall / 1.0e6 : 0.0;
+}
+
+// Write full path of scope s to f, with names separated by sep.
+static void printPath(FILE* f, const struct scope* s, const char* sep) {
+  if (s->parent->parent != NULL) {
+    printPath(f, s->parent, sep);
+    fputs(sep, f);
+  }
+  fputs(s->name, f);
+}
+
+// Whether scope s or any of its descendants was entered since last reset.
+static int wasCalled(const struct scope* s) {
+  if (s->calls > 0) return 1;
+  for (const struct scope* c = s->child; c != NULL; c = c->next)
+    if (wasCalled(c)) return 1;
+  return 0;
+}
+
+// Write the scopes in list s (siblings) and their descendants to f,
+// in the given format, with the given nesting level.
+static void reportScopes(FILE* f, const struct scope* s, int format, int level) {
+  int first = 1;
+  for (; s != NULL; s = s->next) {
+    if (!wasCalled(s)) continue;
+    switch (format) {
+    case INSTR_TEXT:
+      fprintf(f, "#%*s%-*.*s\t%8lu\t%12.6f\t%12.6f\t%12.1f", 2*level, "",
+              28 - 2*level, 28 - 2*level, s->name, s->calls, s->wall, s->cpu, throughput(s));
+      for (int i = 0; i < NUMCOUNTERS; i++)
+        if (InstrName[i] != NULL)
+          fprintf(f, "\t%15lu", s->count[i]);
+      for (int i = 0; i < NUMPERF; i++)
+        if (perfOn(i))
+          fprintf(f, "\t%15lu", s->perf[i]);
+      fputs("\n", f);
+      reportScopes(f, s->child, format, level + 1);
+      break;
+    case INSTR_JSON:
+      fprintf(f, "%s\n%*s{\"name\": \"%s\", \"calls\": %lu, \"wall\": %.9f, \"cpu\": %.9f, "
+              "\"bytes\": %lu, \"MBps\": %.3f", first ? "" : ",", 2*level + 4, "",
+              s->name, s->calls, s->wall, s->cpu, s->bytes, throughput(s));
+      for (int i = 0; i < NUMCOUNTERS; i++)
+        if (InstrName[i] != NULL)
+          fprintf(f, ", \"%s\": %lu", InstrName[i], s->count[i]);
+      for (int i = 0; i < NUMPERF; i++)
+        if (perfOn(i))
+          fprintf(f, ", \"%s\": %lu", InstrPerfName[i], s->perf[i]);
+      fputs(", \"children\": [", f);
+      reportScopes(f, s->child, format, level + 1);
+      fputs("]}", f);
+      break;
+    case INSTR_CSV:
+      fputc('"', f);
+      printPath(f, s, "/");
+      fprintf(f, "\",%lu,%.9f,%.9f,%lu,%.3f", s->calls, s->wall, s->cpu, s->bytes, throughput(s));
+      for (int i = 0; i < NUMCOUNTERS; i++)
+        if (InstrName[i] != NULL)
+          fprintf(f, ",%lu", s->count[i]);
+      for (int i = 0; i < NUMPERF; i++)
+        if (perfOn(i))
+          fprintf(f, ",%lu", s->perf[i]);
+      fputs("\n", f);
+      reportScopes(f, s->child, format, level + 1);
+      break;
+    }
+    first = 0;
+  }
+}
+
+// Write the statistics of all scopes since last reset to f.
+void InstrReport(FILE* f, int format) { ///
+  double time = cpu_time() - InstrTime;
+  double caltime = time / InstrGetCTU();
+  unsigned long perf[NUMPERF];
+  if (perfCount > 0) perfRead(perf);
+  unsigned long count[NUMCOUNTERS];
+  mergeCounts(count);
+  // Merge the trees of all threads of this epoch
+  struct scope merged = { .name = NULL };
+  pthread_mutex_lock(&treeLock);
+  mergeScopes(&merged, retiredRoot.child);
+  for (struct tree* t = trees; t != NULL; t = t->next)
+    if (__atomic_load_n(&t->epoch, __ATOMIC_ACQUIRE) == epoch)
+      mergeScopes(&merged, __atomic_load_n(&t->root.child, __ATOMIC_ACQUIRE));
+  pthread_mutex_unlock(&treeLock);
+  switch (format) {
+  case INSTR_TEXT:
+    fprintf(f, "#%-28s\t%8s\t%12s\t%12s\t%12s", "scope", "calls", "wall", "cpu", "MB/s");
+    for (int i = 0; i < NUMCOUNTERS; i++)
+      if (InstrName[i] != NULL)
+        fprintf(f, "\t%15.15s", InstrName[i]);
+    for (int i = 0; i < NUMPERF; i++)
+      if (perfOn(i))
+        fprintf(f, "\t%15.15s", InstrPerfName[i]);
+    fputs("\n", f);
+    reportScopes(f, merged.child, format, 0);
+    break;
+  case INSTR_JSON:
+    fprintf(f, "{\"time\": %.9f, \"caltime\": %.9f, \"counters\": {", time, caltime);
+    const char* sep = "";
+    for (int i = 0; i < NUMCOUNTERS; i++)
+      if (InstrName[i] != NULL) {
+        fprintf(f, "%s\"%s\": %lu", sep, InstrName[i], count[i]);
+        sep = ", ";
+      }
+    for (int i = 0; i < NUMPERF; i++)
+      if (perfOn(i)) {
+        fprintf(f, "%s\"%s\": %lu", sep, InstrPerfName[i], perf[i] - perf0[i]);
+        sep = ", ";
+      }
+    fputs("},\n  \"scopes\": [", f);
+    reportScopes(f, merged.child, format, 0);
+    fputs("]}\n", f);
+    break;
+  case INSTR_CSV:
+    fputs("scope,calls,wall,cpu,bytes,MBps", f);
+    for (int i = 0; i < NUMCOUNTERS; i++)
+      if (InstrName[i] != NULL)
+        fprintf(f, ",%s", InstrName[i]);
+    for (int i = 0; i < NUMPERF; i++)
+      if (perfOn(i))
+        fprintf(f, ",%s", InstrPerfName[i]);
+    fputs("\n", f);
+    reportScopes(f, merged.child, format, 0);
+    break;
+  }
+  freeScopes(merged.child);
+}
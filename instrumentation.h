@@ -9,7 +9,7 @@
 /// // Name the counters you're going to use: 
 /// InstrName[0] = "memops";
 /// InstrName[1] = "adds";
-/// InstrCalibrate();  // Call once, to measure CTU
+/// InstrCalibrate();  // Call once, to measure CTU (when first needed)
 /// ...
 /// InstrReset();  // reset to zero
 /// for (...) {
@@ -18,18 +18,69 @@
 ///   a[k] = a[i] + a[j];
 /// }
 /// InstrPrint();  // to show time and counters
+///
+/// Code may also be divided in named scopes, which may nest:
+///
+/// InstrBegin("sort");
+/// ...
+///   InstrBegin("merge");  // appears as sort > merge
+///   ...
+///   InstrEnd(bytes);      // bytes processed in merge
+/// ...
+/// InstrEnd(0);
+/// InstrReport(stdout, INSTR_JSON);  // calls, times, bytes and counters
+///                                   // accumulated in each scope
+///
+/// Hardware event counters (cycles, instructions, cache and TLB misses...)
+/// may be added to InstrPrint and to each scope, where the OS allows it:
+///
+/// if (InstrPerfOpen() == 0) { /* not available: reports are unchanged */ }
 
 #ifndef INSTRUMENTATION_H
 #define INSTRUMENTATION_H
 
+#include <stdio.h>
+
 /// Cpu time in seconds
 double cpu_time(void) ; ///
 
+/// Wall-clock (monotonic) time in seconds
+double wall_time(void) ; ///
+
 /// Ten counters should be more than enough
 #define NUMCOUNTERS 10
 
-/// Array of operation counters:
-extern unsigned long InstrCount[NUMCOUNTERS];  ///extern
+/// Array of operation counters: use as InstrCount[i] += n;
+/// Each thread increments its own block of counters, with no locking and
+/// no cache lines shared with other threads.  Blocks are merged when the
+/// counters are read (InstrTotal, InstrPrint, InstrReport, scopes), and
+/// the blocks of threads that exit are added to a common total.
+/// Merged values are exact when no other thread is counting at the time,
+/// e.g. after joining worker threads.
+/// Code that may count while other threads read the counters should use
+/// InstrAdd instead.
+/// Compiling with -DNINSTR removes counters and scopes from the caller
+/// entirely (see end of file), as NDEBUG does for assert.
+#define InstrCount (InstrLocal != NULL ? InstrLocal : InstrAttach())
+
+/// Add n to counter i of the current thread, as InstrCount[i] += n does,
+/// but as an atomic store, so that other threads may read the counters
+/// at the same time.  Only this thread writes its block, so the store
+/// needs no locked instruction and costs the same as +=.
+#define InstrAdd(i, n) do { \
+    unsigned long* instrC_ = InstrCount + (i); \
+    __atomic_store_n(instrC_, __atomic_load_n(instrC_, __ATOMIC_RELAXED) + (n), \
+                     __ATOMIC_RELAXED); \
+  } while (0)
+
+/// Counter block of the current thread (NULL until first use):
+extern _Thread_local unsigned long* InstrLocal;  ///extern
+
+/// Allocate and register the counter block of the current thread.
+unsigned long* InstrAttach(void) ;
+
+/// Total of counter i, over all threads, since last reset.
+unsigned long InstrTotal(int i) ;
 
 /// Array of names for the counters:
 extern char* InstrName[NUMCOUNTERS];  ///extern
@@ -38,17 +89,85 @@ extern char* InstrName[NUMCOUNTERS];  ///extern
 extern double InstrTime;  ///extern
 
 /// Calibrated Time Unit (in seconds, initially 1s)
+/// If InstrCalibrate was called, it is only valid after InstrGetCTU.
 extern double InstrCTU;  ///extern
 
 /// Find the Calibrated Time Unit (CTU).
 /// Run and time a loop of basic memory and arithmetic operations to set
 /// a reasonably cpu-independent time unit.
+/// Calibration takes about a second, so it is deferred until calibrated
+/// time is first needed (InstrPrint, InstrReport or InstrGetCTU), and its
+/// result is cached in a file, keyed on the CPU model, so that later runs
+/// on the same host skip it.  The cache file is $INSTR_CTU_CACHE if set
+/// (empty to disable caching), or else instrumentation-ctu in
+/// $XDG_CACHE_HOME or ~/.cache.
 void InstrCalibrate(void) ;
 
-/// Reset counters to zero and store cpu_time.
+/// Return the Calibrated Time Unit, calibrating first if still pending.
+double InstrGetCTU(void) ;
+
+/// Reset counters and scope statistics to zero and store cpu_time.
 void InstrReset(void) ;
 
+/// Print time and named counters since last reset.
 void InstrPrint(void) ;
 
+/// Scopes
+
+/// Open a scope named name, nested in the currently open scope (if any).
+/// Scopes with the same name and parent are merged: their calls, times,
+/// bytes and counter increments are accumulated.
+/// name must remain valid (a string literal, typically).
+/// The current scope is tracked separately in each thread.
+/// Each thread records its scopes in its own tree, taking no locks (except
+/// once, on its first scope); the trees are merged by InstrReport.
+/// Counter increments are those of the calling thread.
+void InstrBegin(const char* name) ;
+
+/// Close the innermost open scope, adding bytes to its data volume.
+/// Requires: a scope is open (in this thread).
+void InstrEnd(unsigned long bytes) ;
+
+/// Report formats
+#define INSTR_TEXT 0   ///< indented table
+#define INSTR_JSON 1   ///< one JSON object with a tree of scopes
+#define INSTR_CSV 2    ///< one line per scope, with its full path
+
+/// Write the statistics of all scopes since last reset to f.
+void InstrReport(FILE* f, int format) ;
+
+/// Hardware event counters
+
+/// Number of hardware events tracked
+#define NUMPERF 5
+
+/// Names of the hardware events:
+extern const char* const InstrPerfName[NUMPERF];  ///extern
+
+/// Start counting hardware events (cycles, instructions, last-level cache
+/// misses, data TLB misses and branch mispredictions) in this process,
+/// using perf_event_open on Linux.
+/// Only user-space events are counted, in the calling thread and the
+/// threads it creates afterwards, so call it before starting any threads.
+/// Events that cannot be counted (unsupported hardware or OS, no
+/// permission, virtual machines...) are silently left out of reports.
+/// Returns the number of events being counted (0 if none).
+/// Calling it again has no effect and returns the same number.
+int InstrPerfOpen(void) ;
+
+/// Stop counting hardware events.
+void InstrPerfClose(void) ;
+
+/// Release builds: with NINSTR defined, counter increments go to a
+/// temporary that the compiler discards, and scopes vanish.
+#ifdef NINSTR
+#undef InstrCount
+#define InstrCount ((unsigned long[NUMCOUNTERS]){0})
+#undef InstrAdd
+#define InstrAdd(i, n) ((void)(i), (void)(n))
+#define InstrBegin(name) ((void)0)
+#define InstrEnd(bytes) ((void)0)
+#endif
+
 #endif
 